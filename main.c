@@ -4,40 +4,411 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h> // For bool type
+#include <stddef.h> // For offsetof (object pools)
+#include <stdarg.h> // HTTP response builder
+#include <math.h> // DSP coefficient math
+#ifdef __SSE2__
+#include <emmintrin.h> // SSE2 biquad kernels
+#endif
+#if defined(__SANITIZE_ADDRESS__)
+#define POOL_POISONING 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define POOL_POISONING 1
+#endif
+#endif
+#ifdef POOL_POISONING
+#include <sanitizer/asan_interface.h> // Free pool objects are poisoned under ASan
+#endif
 
 // Required for Windows API directory scanning
+#include <winsock2.h> // HTTP server; must come before windows.h
+#include <ws2tcpip.h>
 #include <windows.h>
+#include <mswsock.h> // AcceptEx
+#include <psapi.h> // GetProcessMemoryInfo
 
 // Define maximum songs that can be displayed for selection and max playlist name length
 #define MAX_SELECTABLE_SONGS 100 // Adjust as needed
 #define MAX_PLAYLIST_NAME_LENGTH 50
 #define MAX_VISIBLE_LIST_ITEMS 10 // How many songs/playlists to show at once in lists
+#define LIST_COLUMN_WIDTH 240 // Song and playlist lists wrap into columns this wide
 #define MAX_PATH_LENGTH 260 // Standard max path length on Windows (MAX_PATH is defined in windows.h)
 #define PLAYLISTS_FILE "playlists.txt" // Name of the file to save/load playlists
 
+// -------------------------- Object Pools --------------------------
+// Fixed-size pools for the library, queue and stack nodes. Every pool threads its free list
+// through the object's own 'next' member, so a whole chain (e.g. a finished playback queue)
+// can be handed back in O(1) instead of being freed node by node.
+#define POOL_BLOCK_OBJECTS 64 // Objects carved out of each heap block
+
+typedef struct PoolBlock {
+    struct PoolBlock* next;
+} PoolBlock;
+
+typedef struct ObjectPool {
+    const char* name;
+    size_t objectSize;
+    size_t linkOffset; // offsetof(type, next): where the free-list link lives in a free object
+    void* freeList;
+    PoolBlock* blocks;
+    // Counters shown in the debug stats view (F3)
+    long heapBlocks; // Number of malloc calls made by this pool
+    long totalAllocs;
+    long totalFrees;
+    long liveObjects;
+    long peakLiveObjects;
+} ObjectPool;
+
+#define POOL_INIT(poolName, type) { poolName, sizeof(type), offsetof(type, next), NULL, NULL, 0, 0, 0, 0, 0 }
+#define POOL_BLOCK_HEADER ((sizeof(PoolBlock) + 15) & ~(size_t)15) // Keep objects 16-byte aligned
+
+void** poolLink(ObjectPool* pool, void* object) {
+    return (void**)((char*)object + pool->linkOffset);
+}
+
+// Under ASan a free object is poisoned except for its free-list link, so use after poolFree()
+// is reported like use after free() and a second poolFree() of the same object is caught
+void poolPoison(ObjectPool* pool, void* object) {
+#ifdef POOL_POISONING
+    char* bytes = (char*)object;
+    size_t linkEnd = pool->linkOffset + sizeof(void*);
+    ASAN_POISON_MEMORY_REGION(bytes, pool->linkOffset);
+    ASAN_POISON_MEMORY_REGION(bytes + linkEnd, pool->objectSize - linkEnd);
+#else
+    (void)pool;
+    (void)object;
+#endif
+}
+
+void poolCheckLive(ObjectPool* pool, void* object) {
+#ifdef POOL_POISONING
+    size_t probe = pool->linkOffset > 0 ? 0 : sizeof(void*);
+    if (__asan_address_is_poisoned((char*)object + probe)) {
+        fprintf(stderr, "%s pool: object %p released twice\n", pool->name, object);
+        abort();
+    }
+#else
+    (void)pool;
+    (void)object;
+#endif
+}
+
+bool poolGrow(ObjectPool* pool) {
+    PoolBlock* block = (PoolBlock*)malloc(POOL_BLOCK_HEADER + pool->objectSize * POOL_BLOCK_OBJECTS);
+    if (!block) {
+        fprintf(stderr, "Memory allocation failed for %s pool block.\n", pool->name);
+        return false;
+    }
+    block->next = pool->blocks;
+    pool->blocks = block;
+    pool->heapBlocks++;
+
+    // Push objects in reverse so they are handed out in address order
+    char* base = (char*)block + POOL_BLOCK_HEADER;
+    for (int i = POOL_BLOCK_OBJECTS - 1; i >= 0; i--) {
+        void* object = base + (size_t)i * pool->objectSize;
+        *poolLink(pool, object) = pool->freeList;
+        pool->freeList = object;
+        poolPoison(pool, object);
+    }
+    return true;
+}
+
+void* poolAlloc(ObjectPool* pool) {
+    if (!pool->freeList && !poolGrow(pool)) return NULL;
+    void* object = pool->freeList;
+    pool->freeList = *poolLink(pool, object);
+#ifdef POOL_POISONING
+    ASAN_UNPOISON_MEMORY_REGION(object, pool->objectSize);
+#endif
+    pool->totalAllocs++;
+    pool->liveObjects++;
+    if (pool->liveObjects > pool->peakLiveObjects) pool->peakLiveObjects = pool->liveObjects;
+    return object;
+}
+
+void poolFree(ObjectPool* pool, void* object) {
+    if (!object) return;
+    poolCheckLive(pool, object);
+    *poolLink(pool, object) = pool->freeList;
+    pool->freeList = object;
+    poolPoison(pool, object);
+    pool->totalFrees++;
+    pool->liveObjects--;
+}
+
+// Returns an already linked chain (first..last, 'count' objects) to the pool in one step
+void poolFreeChain(ObjectPool* pool, void* first, void* last, long count) {
+    if (!first || !last) return;
+#ifdef POOL_POISONING
+    for (void* object = first; object != last; object = *poolLink(pool, object)) {
+        poolCheckLive(pool, object);
+        poolPoison(pool, object);
+    }
+    poolCheckLive(pool, last);
+    poolPoison(pool, last);
+#endif
+    *poolLink(pool, last) = pool->freeList;
+    pool->freeList = first;
+    pool->totalFrees += count;
+    pool->liveObjects -= count;
+}
+
+// Pre-allocates blocks so that at least 'count' objects can be handed out without touching the heap
+void poolReserve(ObjectPool* pool, long count) {
+    long available = 0;
+    for (void* object = pool->freeList; object; object = *poolLink(pool, object)) available++;
+    while (available < count && poolGrow(pool)) available += POOL_BLOCK_OBJECTS;
+}
+
+// Releases every block at once; all objects from this pool become invalid
+void poolDestroy(ObjectPool* pool) {
+    PoolBlock* block = pool->blocks;
+    while (block) {
+        PoolBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    pool->blocks = NULL;
+    pool->freeList = NULL;
+    pool->totalFrees += pool->liveObjects;
+    pool->liveObjects = 0;
+}
+
+int formatPoolStats(ObjectPool* pool, char* buffer, size_t size) {
+    int written = snprintf(buffer, size, "%-13s live %4ld  peak %4ld  allocs %6ld  frees %6ld  heap blocks %3ld\n",
+                           pool->name, pool->liveObjects, pool->peakLiveObjects, pool->totalAllocs, pool->totalFrees, pool->heapBlocks);
+    return (written < 0) ? 0 : ((size_t)written >= size ? (int)size - 1 : written);
+}
+
+// Heap bytes held by a pool's blocks, live or free
+size_t poolBytes(const ObjectPool* pool) {
+    size_t bytes = 0;
+    for (const PoolBlock* block = pool->blocks; block; block = block->next) bytes += POOL_BLOCK_HEADER + pool->objectSize * POOL_BLOCK_OBJECTS;
+    return bytes;
+}
+
+// Variable-length strings (song names and paths) carved out of shared blocks. Sizes are
+// rounded up to STRING_POOL_GRAIN; a released string goes on the free list of its size
+// class, linked through its own first bytes, and is handed to the next string of that size.
+// As with the object pools, blocks are only given back all at once.
+#define STRING_POOL_BLOCK (16 * 1024)
+#define STRING_POOL_GRAIN 8 // Also the smallest slot, so a free slot can hold its link
+#define STRING_POOL_CLASSES (MAX_PATH_LENGTH / STRING_POOL_GRAIN + 1)
+
+typedef struct StringPool {
+    const char* name;
+    char* freeLists[STRING_POOL_CLASSES]; // By slot size / STRING_POOL_GRAIN - 1
+    PoolBlock* blocks;
+    char* cursor; // Unused tail of the newest block
+    size_t cursorLeft;
+    // Counters shown in the debug stats view (F3)
+    long heapBlocks;
+    long liveStrings;
+    size_t liveBytes; // Slot sizes, so rounding is included
+} StringPool;
+
+size_t stringPoolSlotSize(size_t length) {
+    return (length / STRING_POOL_GRAIN + 1) * STRING_POOL_GRAIN; // Room for the terminator
+}
+
+void stringPoolPush(StringPool* pool, char* slot, size_t bytes) {
+    char** head = &pool->freeLists[bytes / STRING_POOL_GRAIN - 1];
+    memcpy(slot, head, sizeof(char*));
+    *head = slot;
+#ifdef POOL_POISONING
+    ASAN_POISON_MEMORY_REGION(slot + sizeof(char*), bytes - sizeof(char*));
+#endif
+}
+
+// Copies 'text', cut to at most limit - 1 characters; NULL if out of memory
+char* stringPoolCopy(StringPool* pool, const char* text, size_t limit) {
+    size_t length = 0;
+    while (length + 1 < limit && text[length]) length++;
+    if (length + 1 > MAX_PATH_LENGTH) length = MAX_PATH_LENGTH - 1;
+    size_t bytes = stringPoolSlotSize(length);
+    char** head = &pool->freeLists[bytes / STRING_POOL_GRAIN - 1];
+    char* slot = *head;
+    if (slot) {
+        memcpy(head, slot, sizeof(char*));
+#ifdef POOL_POISONING
+        ASAN_UNPOISON_MEMORY_REGION(slot, bytes);
+#endif
+    } else {
+        if (pool->cursorLeft < bytes) {
+            PoolBlock* block = (PoolBlock*)malloc(POOL_BLOCK_HEADER + STRING_POOL_BLOCK);
+            if (!block) {
+                fprintf(stderr, "Memory allocation failed for %s string block.\n", pool->name);
+                return NULL;
+            }
+            if (pool->cursorLeft > 0) stringPoolPush(pool, pool->cursor, pool->cursorLeft); // Keep the old tail
+            block->next = pool->blocks;
+            pool->blocks = block;
+            pool->heapBlocks++;
+            pool->cursor = (char*)block + POOL_BLOCK_HEADER;
+            pool->cursorLeft = STRING_POOL_BLOCK;
+        }
+        slot = pool->cursor;
+        pool->cursor += bytes;
+        pool->cursorLeft -= bytes;
+    }
+    memcpy(slot, text, length);
+    slot[length] = '\0';
+    pool->liveStrings++;
+    pool->liveBytes += bytes;
+    return slot;
+}
+
+// The slot size comes from the string itself, so strings must not be edited in place
+void stringPoolFree(StringPool* pool, char* text) {
+    if (!text) return;
+    size_t bytes = stringPoolSlotSize(strlen(text));
+    stringPoolPush(pool, text, bytes);
+    pool->liveStrings--;
+    pool->liveBytes -= bytes;
+}
+
+// Releases every block at once; all strings from this pool become invalid
+void stringPoolDestroy(StringPool* pool) {
+    PoolBlock* block = pool->blocks;
+    while (block) {
+        PoolBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    memset(pool->freeLists, 0, sizeof(pool->freeLists));
+    pool->blocks = NULL;
+    pool->cursor = NULL;
+    pool->cursorLeft = 0;
+    pool->liveStrings = 0;
+    pool->liveBytes = 0;
+}
+
+size_t stringPoolBytes(const StringPool* pool) {
+    size_t bytes = 0;
+    for (const PoolBlock* block = pool->blocks; block; block = block->next) bytes += POOL_BLOCK_HEADER + STRING_POOL_BLOCK;
+    return bytes;
+}
+
+int formatStringPoolStats(const StringPool* pool, char* buffer, size_t size) {
+    int written = snprintf(buffer, size, "%-13s live %4ld  %zu KB used of %zu KB  heap blocks %3ld\n",
+                           pool->name, pool->liveStrings, pool->liveBytes / 1024, stringPoolBytes(pool) / 1024, pool->heapBlocks);
+    return (written < 0) ? 0 : ((size_t)written >= size ? (int)size - 1 : written);
+}
+
 // -------------------------- Song Structure --------------------------
+#define MAX_SONG_NAME_LENGTH 100 // Longer titles are cut to 99 characters
+
 typedef struct Song {
-    char name[100]; // Stores just the song title
-    char path[MAX_PATH_LENGTH]; // Stores the full path to the .ogg file
+    char* name; // Just the song title, from songStrings
+    char* path; // Full path to the .ogg file, from songStrings
+    char* key; // songPathKey(path), from songStrings; what the path / file name indices compare
     struct Song* next;
     struct Song* prev;
+    struct Song* duplicateOf; // Same recording as an earlier library song (audio fingerprint match)
+    int fingerprintSlot; // 1-based fingerprint index entry, 0 = not indexed yet
+    float bpm; // Estimated tempo, 0 = unknown
+    signed char musicalKey; // 0-11 major, 12-23 minor (tonic pitch class, 0 = C), -1 = unknown
+    unsigned int lastPlayedTurn; // Value of playTurn when the song last started, 0 = not yet
+    unsigned int playCount; // Times started this session
+    unsigned int durationMs; // From the analysis pass, 0 = not known yet
+    int libraryRow; // Row in libraryTable, -1 = none
 } Song;
 
+// Position of a key on the Camelot wheel (1-12); neighbours are a fifth apart and a
+// major key shares its number with its relative minor
+int camelotNumber(int key) {
+    int majorTonic = key < 12 ? key : (key + 3) % 12;
+    return (majorTonic * 7 + 7) % 12 + 1;
+}
+
+// Steps between two keys on the wheel, switching major / minor counting as one
+int keyDistance(int a, int b) {
+    if (a < 0 || b < 0) return 6;
+    int distance = abs(camelotNumber(a) - camelotNumber(b));
+    if (distance > 6) distance = 12 - distance;
+    return distance + (a / 12 != b / 12);
+}
+
+void formatMusicalKey(int key, char* out, size_t size) {
+    if (key < 0) snprintf(out, size, "?");
+    else snprintf(out, size, "%d%c", camelotNumber(key), key < 12 ? 'B' : 'A');
+}
+
+ObjectPool songPool = POOL_INIT("Song", Song);
+StringPool songStrings = { "Song strings" }; // Song names and paths
+
+char songKeyBase[MAX_PATH_LENGTH] = ""; // Working directory at first use; relative paths are keyed against it
+
+// Writes the normalized full path of 'path' into 'key': made absolute against songKeyBase,
+// case-folded with '/' treated as '\\' and "." / ".." segments folded away, matching how
+// Windows compares paths. Plain string work, so keys cost no system call and do not change
+// if the working directory does.
+void songPathKey(const char* path, char* key, size_t size) {
+    if (!songKeyBase[0]) {
+        DWORD len = GetCurrentDirectoryA(sizeof(songKeyBase), songKeyBase);
+        if (len == 0 || len >= sizeof(songKeyBase)) strcpy(songKeyBase, "\\");
+    }
+    char joined[MAX_PATH_LENGTH * 2];
+    bool absolute = path[0] == '\\' || path[0] == '/' || (path[0] && path[1] == ':');
+    if (absolute) snprintf(joined, sizeof(joined), "%s", path);
+    else snprintf(joined, sizeof(joined), "%s\\%s", songKeyBase, path);
+
+    size_t out = 0, root = 0; // 'root' is the part ".." cannot climb out of
+    if ((joined[0] == '\\' || joined[0] == '/') && (joined[1] == '\\' || joined[1] == '/')) key[out++] = '\\'; // UNC path
+    for (const char* c = joined; *c;) {
+        while (*c == '\\' || *c == '/') c++;
+        const char* segment = c;
+        while (*c && *c != '\\' && *c != '/') c++;
+        size_t len = (size_t)(c - segment);
+        if (len == 0 || (len == 1 && segment[0] == '.')) continue;
+        if (len == 2 && segment[0] == '.' && segment[1] == '.') {
+            while (out > root && key[out - 1] != '\\') out--;
+            if (out > root) out--;
+            continue;
+        }
+        bool drive = out == 0 && len == 2 && segment[1] == ':';
+        if (!drive && out + 1 < size) key[out++] = '\\';
+        for (size_t i = 0; i < len && out + 1 < size; i++) {
+            char ch = segment[i];
+            key[out++] = (ch >= 'A' && ch <= 'Z') ? (char)(ch + ('a' - 'A')) : ch;
+        }
+        if (drive) root = out;
+    }
+    key[out] = '\0';
+}
+
 // -------------------------- Linked List (for Songs) --------------------------
 void addSong(Song** list, const char* name, const char* path) {
-    Song* temp = (Song*)malloc(sizeof(Song));
+    Song* temp = (Song*)poolAlloc(&songPool);
     if (!temp) {
         fprintf(stderr, "Memory allocation failed for Song.\n");
         return;
     }
-    strncpy(temp->name, name, sizeof(temp->name) - 1);
-    temp->name[sizeof(temp->name) - 1] = '\0'; // Ensure null-termination
-
-    strncpy(temp->path, path, sizeof(temp->path) - 1);
-    temp->path[sizeof(temp->path) - 1] = '\0'; // Ensure null-termination
+    char key[MAX_PATH_LENGTH];
+    songPathKey(path, key, sizeof(key));
+    temp->name = stringPoolCopy(&songStrings, name, MAX_SONG_NAME_LENGTH);
+    temp->path = stringPoolCopy(&songStrings, path, MAX_PATH_LENGTH);
+    temp->key = stringPoolCopy(&songStrings, key, MAX_PATH_LENGTH);
+    if (!temp->name || !temp->path || !temp->key) {
+        stringPoolFree(&songStrings, temp->name);
+        stringPoolFree(&songStrings, temp->path);
+        stringPoolFree(&songStrings, temp->key);
+        poolFree(&songPool, temp);
+        return;
+    }
 
     temp->next = NULL;
     temp->prev = NULL;
+    temp->duplicateOf = NULL;
+    temp->fingerprintSlot = 0;
+    temp->bpm = 0.0f;
+    temp->musicalKey = -1;
+    temp->lastPlayedTurn = 0;
+    temp->playCount = 0;
+    temp->durationMs = 0;
+    temp->libraryRow = -1;
 
     if (*list == NULL) {
         *list = temp;
@@ -51,12 +422,157 @@ void addSong(Song** list, const char* name, const char* path) {
     }
 }
 
+// Gives an unlinked song and its strings back to the pools
+void freeSong(Song* song) {
+    if (!song) return;
+    stringPoolFree(&songStrings, song->name);
+    stringPoolFree(&songStrings, song->path);
+    stringPoolFree(&songStrings, song->key);
+    poolFree(&songPool, song);
+}
+
+// -------------------------- Song Path Index --------------------------
+// Open-addressing hash tables over the library: one keyed by normalized full path (what
+// findSongByPath uses) and one by file name (used to relink files that moved folders).
+// Songs carry their key (Song.key), so only the path being looked up is normalized.
+typedef struct SongIndexSlot {
+    unsigned int hash;
+    Song* song; // NULL marks an empty slot
+} SongIndexSlot;
+
+typedef struct SongIndex {
+    bool byFileName;
+    SongIndexSlot* slots;
+    size_t capacity; // Power of two
+    size_t count;
+} SongIndex;
+
+SongIndex songPathIndex = { false, NULL, 0, 0 };
+SongIndex songNameIndex = { true, NULL, 0, 0 };
+
+// The part of a full key an index compares
+const char* songIndexPart(const SongIndex* index, const char* key) {
+    if (!index->byFileName) return key;
+    const char* name = strrchr(key, '\\');
+    return name ? name + 1 : key;
+}
+
+unsigned int hashKey(const char* key) {
+    unsigned int hash = 2166136261u; // FNV-1a
+    for (; *key; key++) {
+        hash ^= (unsigned char)*key;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void songIndexPlace(SongIndex* index, unsigned int hash, Song* song) {
+    size_t mask = index->capacity - 1;
+    size_t i = hash & mask;
+    while (index->slots[i].song) i = (i + 1) & mask;
+    index->slots[i].hash = hash;
+    index->slots[i].song = song;
+    index->count++;
+}
+
+bool songIndexGrow(SongIndex* index) {
+    size_t newCapacity = index->capacity ? index->capacity * 2 : 256;
+    SongIndexSlot* oldSlots = index->slots;
+    size_t oldCapacity = index->capacity;
+    index->slots = (SongIndexSlot*)calloc(newCapacity, sizeof(SongIndexSlot));
+    if (!index->slots) {
+        fprintf(stderr, "Memory allocation failed for song index.\n");
+        index->slots = oldSlots;
+        return false;
+    }
+    index->capacity = newCapacity;
+    index->count = 0;
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if (oldSlots[i].song) songIndexPlace(index, oldSlots[i].hash, oldSlots[i].song);
+    }
+    free(oldSlots);
+    return true;
+}
+
+// Sizes the table for 'count' songs up front so building it does not rehash along the way
+void songIndexReserve(SongIndex* index, size_t count) {
+    while (count * 10 > index->capacity * 7) {
+        if (!songIndexGrow(index)) return;
+    }
+}
+
+void songIndexInsert(SongIndex* index, Song* song) {
+    if ((index->count + 1) * 10 > index->capacity * 7 && !songIndexGrow(index)) return;
+    songIndexPlace(index, hashKey(songIndexPart(index, song->key)), song);
+}
+
+void songIndexRemove(SongIndex* index, const Song* song) {
+    if (!index->capacity) return;
+    size_t mask = index->capacity - 1;
+    size_t i = hashKey(songIndexPart(index, song->key)) & mask;
+    while (index->slots[i].song && index->slots[i].song != song) i = (i + 1) & mask;
+    if (!index->slots[i].song) return;
+
+    // Backward-shift deletion keeps probe chains intact without tombstones
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; index->slots[j].song; j = (j + 1) & mask) {
+        size_t home = index->slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            index->slots[hole] = index->slots[j];
+            hole = j;
+        }
+    }
+    index->slots[hole].song = NULL;
+    index->count--;
+}
+
+// Looks up a key made by songPathKey()
+Song* songIndexFindKey(const SongIndex* index, const char* key) {
+    if (!index->capacity) return NULL;
+    key = songIndexPart(index, key);
+    unsigned int hash = hashKey(key);
+    size_t mask = index->capacity - 1;
+    for (size_t i = hash & mask; index->slots[i].song; i = (i + 1) & mask) {
+        if (index->slots[i].hash != hash) continue;
+        if (strcmp(songIndexPart(index, index->slots[i].song->key), key) == 0) return index->slots[i].song;
+    }
+    return NULL;
+}
+
+Song* songIndexFind(const SongIndex* index, const char* path) {
+    char key[MAX_PATH_LENGTH];
+    songPathKey(path, key, sizeof(key));
+    return songIndexFindKey(index, key);
+}
+
+void songIndexClear(SongIndex* index) {
+    free(index->slots);
+    index->slots = NULL;
+    index->capacity = index->count = 0;
+}
+
+// Rebuilds both indices from a song list
+void songIndexRebuild(Song* list) {
+    songIndexClear(&songPathIndex);
+    songIndexClear(&songNameIndex);
+    size_t count = 0;
+    for (Song* song = list; song; song = song->next) count++;
+    songIndexReserve(&songPathIndex, count);
+    songIndexReserve(&songNameIndex, count);
+    for (Song* song = list; song; song = song->next) {
+        songIndexInsert(&songPathIndex, song);
+        songIndexInsert(&songNameIndex, song);
+    }
+}
+
 // -------------------------- Recent Played Stack --------------------------
 typedef struct StackNode {
     Song* song;
     struct StackNode* next;
 } StackNode;
 
+ObjectPool stackNodePool = POOL_INIT("StackNode", StackNode);
+
 StackNode* recentStack = NULL;
 sfText* recentText[5];
 
@@ -82,14 +598,14 @@ void pushRecent(Song* song) {
         }
         if (prev) {
             prev->next = NULL;
-            free(current);
+            poolFree(&stackNodePool, current);
         } else { // Stack has only one element
-            free(recentStack);
+            poolFree(&stackNodePool, recentStack);
             recentStack = NULL;
         }
     }
 
-    StackNode* node = (StackNode*)malloc(sizeof(StackNode));
+    StackNode* node = (StackNode*)poolAlloc(&stackNodePool);
     if (!node) {
         fprintf(stderr, "Memory allocation failed for StackNode.\n");
         return;
@@ -104,14 +620,23 @@ Song* popRecent() {
     StackNode* temp = recentStack;
     recentStack = recentStack->next;
     Song* song = temp->song;
-    free(temp);
+    poolFree(&stackNodePool, temp);
     return song;
 }
 
 // -------------------------- Globals (for main player) --------------------------
-sfMusic* music = NULL;
 Song* current = NULL;
 Song* allSongsList = NULL; // Global list of all available songs
+unsigned int playTurn = 0; // Tracks started this session
+bool lowMemoryMode = false; // --low-memory: smaller caches, buffers and textures for small devices
+
+// Auto-DJ (F6): upcoming picks when no playlist is active, see the Auto-DJ section
+#define AUTO_DJ_LOOKAHEAD 5
+bool autoDjEnabled = false;
+Song* autoDjUpcoming[AUTO_DJ_LOOKAHEAD];
+int autoDjUpcomingCount = 0;
+Song* autoDjAnchor = NULL; // Song the upcoming picks follow
+bool autoDjExhausted = false; // The last fill found nothing; retried once the library or anchor changes
 
 // Forward declaration for Playlist structure
 typedef struct Playlist Playlist;
@@ -134,13 +659,19 @@ struct Playlist { // Definition for Playlist
     char name[100];
     PlaylistNode* front;
     PlaylistNode* rear;
+    int length; // Number of queued nodes (lets the queue be released in one step)
+    bool shared; // Attached instances: came with a library snapshot rather than created here
     struct Playlist* next; // For linking multiple playlists (globally)
 };
 
+ObjectPool playlistNodePool = POOL_INIT("PlaylistNode", PlaylistNode);
+ObjectPool playlistPool = POOL_INIT("Playlist", Playlist);
+
 Playlist* playlists = NULL; // Global list of all playlists
+bool playlistsChanged = false; // A playlist was added since the main loop last passed the change on
 
 Playlist* createPlaylist(const char* name) {
-    Playlist* newPlaylist = (Playlist*)malloc(sizeof(Playlist));
+    Playlist* newPlaylist = (Playlist*)poolAlloc(&playlistPool);
     if (!newPlaylist) {
         fprintf(stderr, "Memory allocation failed for Playlist.\n");
         return NULL;
@@ -148,15 +679,18 @@ Playlist* createPlaylist(const char* name) {
     strncpy(newPlaylist->name, name, sizeof(newPlaylist->name) - 1);
     newPlaylist->name[sizeof(newPlaylist->name) - 1] = '\0'; // Ensure null-termination
     newPlaylist->front = newPlaylist->rear = NULL;
+    newPlaylist->length = 0;
+    newPlaylist->shared = false;
     newPlaylist->next = playlists; // Add to the global list of playlists (prepends)
     playlists = newPlaylist;
+    playlistsChanged = true;
     return newPlaylist;
 }
 
 // Function to create a playlist without adding to global 'playlists' list
 // Used when creating a copy to play, to avoid modifying the master playlist
 Playlist* createTemporaryPlaylist(const char* name) {
-    Playlist* newPlaylist = (Playlist*)malloc(sizeof(Playlist));
+    Playlist* newPlaylist = (Playlist*)poolAlloc(&playlistPool);
     if (!newPlaylist) {
         fprintf(stderr, "Memory allocation failed for Playlist.\n");
         return NULL;
@@ -164,6 +698,8 @@ Playlist* createTemporaryPlaylist(const char* name) {
     strncpy(newPlaylist->name, name, sizeof(newPlaylist->name) - 1);
     newPlaylist->name[sizeof(newPlaylist->name) - 1] = '\0';
     newPlaylist->front = newPlaylist->rear = NULL;
+    newPlaylist->length = 0;
+    newPlaylist->shared = false;
     newPlaylist->next = NULL; // IMPORTANT: Does not add to global 'playlists' list
     return newPlaylist;
 }
@@ -171,7 +707,7 @@ Playlist* createTemporaryPlaylist(const char* name) {
 
 void enqueueSong(Playlist* pl, Song* song) {
     if (!pl || !song) return; // Defensive check
-    PlaylistNode* node = (PlaylistNode*)malloc(sizeof(PlaylistNode));
+    PlaylistNode* node = (PlaylistNode*)poolAlloc(&playlistNodePool);
     if (!node) {
         fprintf(stderr, "Memory allocation failed for PlaylistNode.\n");
         return;
@@ -185,6 +721,7 @@ void enqueueSong(Playlist* pl, Song* song) {
         pl->rear->next = node;
         pl->rear = node;
     }
+    pl->length++;
 }
 
 Song* dequeueSong(Playlist* pl) {
@@ -193,13 +730,43 @@ Song* dequeueSong(Playlist* pl) {
     Song* song = temp->song;
     pl->front = pl->front->next;
     if (!pl->front) pl->rear = NULL;
-    free(temp);
+    pl->length--;
+    poolFree(&playlistNodePool, temp);
     return song;
 }
 
+// Hands every queued node back to the node pool at once and leaves the queue empty
+void releasePlaylistNodes(Playlist* pl) {
+    if (!pl || !pl->front) return;
+    poolFreeChain(&playlistNodePool, pl->front, pl->rear, pl->length);
+    pl->front = pl->rear = NULL;
+    pl->length = 0;
+}
+
+// Releases a playlist created with createTemporaryPlaylist() together with its remaining queue
+void destroyTemporaryPlaylist(Playlist* pl) {
+    if (!pl) return;
+    releasePlaylistNodes(pl);
+    poolFree(&playlistPool, pl);
+}
+
 sfText* queueText[5]; // Playlist queue UI (main screen)
 
 void refreshQueueDisplay(sfFont* font, Playlist* pl) {
+    if (!pl && autoDjEnabled) {
+        for (int i = 0; i < 5; i++) {
+            if (!queueText[i]) continue;
+            if (i < autoDjUpcomingCount) {
+                char key[8], line[160];
+                formatMusicalKey(autoDjUpcoming[i]->musicalKey, key, sizeof(key));
+                snprintf(line, sizeof(line), "%s  %.0f BPM %s", autoDjUpcoming[i]->name, autoDjUpcoming[i]->bpm, key);
+                sfText_setString(queueText[i], line);
+            } else {
+                sfText_setString(queueText[i], "");
+            }
+        }
+        return;
+    }
     PlaylistNode* temp = pl ? pl->front : NULL;
     for (int i = 0; i < 5; i++) {
         if (queueText[i]) {
@@ -239,528 +806,10300 @@ sfText* createLabel(sfFont* font, const char* text, float x, float y, int size)
     return label;
 }
 
-// -------------------------- Display Recent --------------------------
-void refreshRecentDisplay(sfFont* font) {
-    StackNode* temp = recentStack;
-    for (int i = 0; i < 5; i++) {
-        if (recentText[i]) {
-            if (temp) {
-                sfText_setString(recentText[i], temp->song->name);
-                temp = temp->next;
-            } else {
-                sfText_setString(recentText[i], "");
-            }
-        }
+// Cuts the label short with "..." so it is at most 'maxWidth' pixels wide; list rows would
+// otherwise run into the next column and take its clicks
+void ellipsizeLabel(sfText* label, float maxWidth) {
+    if (!label || sfText_getLocalBounds(label).width <= maxWidth) return;
+    char text[256];
+    snprintf(text, sizeof(text), "%s", sfText_getString(label));
+    // Longest prefix that still fits with the ellipsis
+    size_t lo = 0, hi = strlen(text);
+    char shortened[sizeof(text) + 3];
+    while (lo < hi) {
+        size_t mid = (lo + hi + 1) / 2;
+        snprintf(shortened, sizeof(shortened), "%.*s...", (int)mid, text);
+        sfText_setString(label, shortened);
+        if (sfText_getLocalBounds(label).width <= maxWidth) lo = mid; else hi = mid - 1;
     }
+    while (lo > 0 && ((unsigned char)text[lo] & 0xC0) == 0x80) lo--; // Not inside a UTF-8 sequence
+    snprintf(shortened, sizeof(shortened), "%.*s...", (int)lo, text);
+    sfText_setString(label, shortened);
 }
 
-// -------------------------- Music Control --------------------------
-// Function to play a new song, uses global sprites/textures for consistency
-void playNewSong(sfText* songLabel, sfFont* font, sfSprite* playSprite, sfTexture* pauseTex, sfTexture* playTex) {
-    if (!current) {
-        if (songLabel) sfText_setString(songLabel, "No Song Selected");
-        if (playSprite && playTex) sfSprite_setTexture(playSprite, playTex, sfTrue);
-        return;
-    }
+// -------------------------- Layout --------------------------
+// Widgets are placed relative to the window or to another widget. Their geometry is cached
+// and only recomputed after a resize or when a screen rebuilds its widgets, and clicks are
+// resolved through a coarse grid whose cells list the clickable widgets over them.
+#define LAYOUT_MAX_WIDGETS 256 // The song list takes up to two widgets per row (art and name)
+#define LAYOUT_CELL_SIZE 32
+
+typedef enum WidgetKind { WIDGET_TEXT, WIDGET_SPRITE, WIDGET_RECT } WidgetKind;
+
+typedef enum WidgetPlacement {
+    PLACE_ANCHORED, // Offset from a point given as a fraction of the window size
+    PLACE_FLOW,     // Next row of the layout's row flow
+    PLACE_BELOW,    // Centred under the target, 'y' pixels below it
+    PLACE_LEFT_OF,  // Beside the target, tops aligned, 'x' pixels apart
+    PLACE_RIGHT_OF,
+    PLACE_AROUND    // Rectangle covering the target plus 'x' / 'y' pixels of padding
+} WidgetPlacement;
+
+// Actions returned by hit tests; row i of a list reports ACTION_ROW + i
+typedef enum UiAction {
+    ACTION_NONE = -1,
+    ACTION_PLAY,
+    ACTION_NEXT,
+    ACTION_PREV,
+    ACTION_OPEN_CREATE,
+    ACTION_OPEN_SELECT,
+    ACTION_CREATE,
+    ACTION_CANCEL,
+    ACTION_PLAY_SELECTED,
+    ACTION_ROW
+} UiAction;
+
+typedef struct Widget {
+    WidgetKind kind;
+    void* drawable;          // sfText*, sfSprite* or sfRectangleShape*; NULL widgets are skipped
+    WidgetPlacement placement;
+    float anchorX, anchorY;  // Fractions of the window width / height (PLACE_ANCHORED)
+    float x, y;              // Offset, gap or padding in pixels depending on the placement
+    float alignX;            // Which part of the widget sits on the point: 0 left, 0.5 centre, 1 right
+    int target;              // Widget a relative placement refers to
+    int action;              // UiAction reported by layoutHitTest, ACTION_NONE if not clickable
+    bool hidden;
+    sfFloatRect bounds;      // Cached by layoutUpdate
+} Widget;
+
+typedef struct Layout {
+    Widget widgets[LAYOUT_MAX_WIDGETS];
+    int count;
+    // Flow rows stack down from (flowX, flowY) and start a new column before reaching
+    // flowBottom pixels above the bottom of the window
+    float flowX, flowY, flowRowHeight, flowColumnWidth, flowBottom;
+    bool dirty;
+    unsigned int generation; // layoutGeneration the cached geometry belongs to
+    // Hit grid: cell c lists cellItems[cellStart[c] .. cellStart[c + 1]) in widget order
+    int gridColumns, gridRows;
+    int* cellStart;
+    short* cellItems;
+    int cellStartCapacity, cellItemCapacity;
+} Layout;
+
+float layoutWidth = 800, layoutHeight = 500; // Current window size in pixels
+unsigned int layoutGeneration = 1; // Bumped on every resize so each layout recomputes once
+
+void layoutResize(float width, float height) {
+    layoutWidth = width > 1 ? width : 1;
+    layoutHeight = height > 1 ? height : 1;
+    layoutGeneration++;
+}
 
-    if (music) {
-        sfMusic_stop(music);
-        sfMusic_destroy(music);
-        music = NULL;
-    }
+void layoutReset(Layout* layout) {
+    layout->count = 0;
+    layout->dirty = true;
+}
 
-    music = sfMusic_createFromFile(current->path);
-    if (!music) {
-        printf("Failed to load: %s\n", current->path);
-        if (songLabel) sfText_setString(songLabel, "Error loading song!");
-        if (playSprite && playTex) sfSprite_setTexture(playSprite, playTex, sfTrue);
-        return;
+void layoutSetFlow(Layout* layout, float x, float y, float rowHeight, float columnWidth, float bottom) {
+    layout->flowX = x;
+    layout->flowY = y;
+    layout->flowRowHeight = rowHeight;
+    layout->flowColumnWidth = columnWidth;
+    layout->flowBottom = bottom;
+    layout->dirty = true;
+}
+
+int layoutAddWidget(Layout* layout, WidgetKind kind, void* drawable, WidgetPlacement placement) {
+    if (layout->count >= LAYOUT_MAX_WIDGETS) {
+        fprintf(stderr, "Layout is full, widget not shown.\n");
+        return -1;
     }
+    Widget* w = &layout->widgets[layout->count];
+    memset(w, 0, sizeof(*w));
+    w->kind = kind;
+    w->drawable = drawable;
+    w->placement = placement;
+    w->target = -1;
+    w->action = ACTION_NONE;
+    layout->dirty = true;
+    return layout->count++;
+}
 
-    sfMusic_play(music);
-    if (songLabel) sfText_setString(songLabel, current->name);
-    if (playSprite && pauseTex) sfSprite_setTexture(playSprite, pauseTex, sfTrue); // Set to pause icon when playing
-    pushRecent(current);
-    if (font) refreshRecentDisplay(font);
+int layoutAnchor(Layout* layout, WidgetKind kind, void* drawable, float anchorX, float x, float anchorY, float y, float alignX) {
+    int index = layoutAddWidget(layout, kind, drawable, PLACE_ANCHORED);
+    if (index < 0) return -1;
+    Widget* w = &layout->widgets[index];
+    w->anchorX = anchorX;
+    w->anchorY = anchorY;
+    w->x = x;
+    w->y = y;
+    w->alignX = alignX;
+    return index;
 }
 
-// -------------------------- Create Playlist Screen Variables & Functions --------------------------
+int layoutFlow(Layout* layout, WidgetKind kind, void* drawable) {
+    return layoutAddWidget(layout, kind, drawable, PLACE_FLOW);
+}
 
-// Input for playlist name
-char createPlNameInput[MAX_PLAYLIST_NAME_LENGTH + 1] = "";
-sfText* createPlNameLabel = NULL;
-sfText* createPlNameTextInput = NULL;
-sfRectangleShape* createPlNameInputRect = NULL; // New: Rectangle for input field
+// The target must be anchored or flowed, or be a relative widget added before this one
+int layoutAttach(Layout* layout, WidgetKind kind, void* drawable, WidgetPlacement placement, int target, float x, float y) {
+    int index = layoutAddWidget(layout, kind, drawable, placement);
+    if (index < 0) return -1;
+    layout->widgets[index].target = target;
+    layout->widgets[index].x = x;
+    layout->widgets[index].y = y;
+    return index;
+}
 
-// UI elements for the Create Playlist Screen (static to persist across calls)
-static sfText* createPlTitle_s = NULL;
-static sfText* createPlSongsHeading_s = NULL;
-static sfText* createPlCreateBtn_s = NULL;
-static sfText* createPlCancelBtn_s = NULL;
+void layoutSetAction(Layout* layout, int index, int action) {
+    if (index >= 0 && index < layout->count) layout->widgets[index].action = action;
+}
 
-int songSelected[MAX_SELECTABLE_SONGS]; // 0 for unselected, 1 for selected
-sfText* selectableSongTexts[MAX_SELECTABLE_SONGS]; // Text objects for each song name
+// Visibility does not move anything, so it does not invalidate the cached geometry
+void layoutSetHidden(Layout* layout, int index, bool hidden) {
+    if (index >= 0 && index < layout->count) layout->widgets[index].hidden = hidden;
+}
 
-// New: Mouse click debounce flag
-static bool mouseWasPressed = false; // For debouncing clicks in general for UI screens
+// For content changes that alter a widget's size (the cached bounds would go stale)
+void layoutInvalidate(Layout* layout) {
+    layout->dirty = true;
+}
 
-// Function to handle the Create Playlist screen
-// Returns true when the screen is finished (create or cancel)
-bool handleCreatePlaylistScreen(sfRenderWindow* window, sfEvent* event, sfFont* font, Song* allSongs, Playlist** allPlaylists) {
-    static bool uiInitialized = false;
-    static sfClock* inputClock = NULL; // For input de-bouncing
+sfFloatRect widgetGetBounds(const Widget* w) {
+    switch (w->kind) {
+        case WIDGET_TEXT: return sfText_getGlobalBounds((sfText*)w->drawable);
+        case WIDGET_SPRITE: return sfSprite_getGlobalBounds((sfSprite*)w->drawable);
+        default: return sfRectangleShape_getGlobalBounds((sfRectangleShape*)w->drawable);
+    }
+}
 
-    // Initialize/Reset UI elements when entering the screen
-    if (!uiInitialized) {
-        // Clear previous selections and input
-        for (int i = 0; i < MAX_SELECTABLE_SONGS; i++) {
-            songSelected[i] = 0;
-            if (selectableSongTexts[i]) {
-                sfText_destroy(selectableSongTexts[i]);
-                selectableSongTexts[i] = NULL;
-            }
-        }
-        strcpy(createPlNameInput, ""); // Clear name input
+sfVector2f widgetGetPosition(const Widget* w) {
+    switch (w->kind) {
+        case WIDGET_TEXT: return sfText_getPosition((sfText*)w->drawable);
+        case WIDGET_SPRITE: return sfSprite_getPosition((sfSprite*)w->drawable);
+        default: return sfRectangleShape_getPosition((sfRectangleShape*)w->drawable);
+    }
+}
 
-        // Destroy previous UI elements if re-initializing to prevent memory leaks
-        if (createPlTitle_s) sfText_destroy(createPlTitle_s);
-        if (createPlNameLabel) sfText_destroy(createPlNameLabel);
-        if (createPlNameTextInput) sfText_destroy(createPlNameTextInput);
-        if (createPlNameInputRect) sfRectangleShape_destroy(createPlNameInputRect); // Destroy the rectangle
-        if (createPlSongsHeading_s) sfText_destroy(createPlSongsHeading_s);
-        if (createPlCreateBtn_s) sfText_destroy(createPlCreateBtn_s);
-        if (createPlCancelBtn_s) sfText_destroy(createPlCancelBtn_s);
+void widgetSetPosition(Widget* w, sfVector2f position) {
+    switch (w->kind) {
+        case WIDGET_TEXT: sfText_setPosition((sfText*)w->drawable, position); break;
+        case WIDGET_SPRITE: sfSprite_setPosition((sfSprite*)w->drawable, position); break;
+        default: sfRectangleShape_setPosition((sfRectangleShape*)w->drawable, position); break;
+    }
+}
 
-        createPlTitle_s = createLabel(font, "Create New Playlist", 250, 20, 30);
-        if (createPlTitle_s) sfText_setFillColor(createPlTitle_s, sfGreen);
+// Moves the widget so its visible bounds start at (left, top); text bounds are offset from
+// the text position by the glyph bearings, so the offset is measured rather than assumed
+void widgetPlace(Widget* w, float left, float top, bool byBounds) {
+    sfVector2f position = {left, top};
+    if (byBounds) {
+        sfFloatRect bounds = widgetGetBounds(w);
+        sfVector2f current = widgetGetPosition(w);
+        position.x -= bounds.left - current.x;
+        position.y -= bounds.top - current.y;
+    }
+    widgetSetPosition(w, position);
+    w->bounds = widgetGetBounds(w);
+}
 
-        createPlNameLabel = createLabel(font, "Playlist Name:", 50, 80, 20);
-        createPlNameTextInput = createLabel(font, "", 200, 80, 20);
-        if (createPlNameTextInput) sfText_setFillColor(createPlNameTextInput, sfYellow);
+void layoutPlaceWidget(Layout* layout, Widget* w, int flowSlot) {
+    sfFloatRect size = widgetGetBounds(w);
+    if (w->placement == PLACE_ANCHORED) {
+        float x = w->anchorX * layoutWidth + w->x - w->alignX * size.width;
+        widgetPlace(w, x, w->anchorY * layoutHeight + w->y, false);
+        return;
+    }
+    if (w->placement == PLACE_FLOW) {
+        int rowsPerColumn = (int)((layoutHeight - layout->flowBottom - layout->flowY) / layout->flowRowHeight);
+        if (rowsPerColumn < 1) rowsPerColumn = 1;
+        float x = layout->flowX + (flowSlot / rowsPerColumn) * layout->flowColumnWidth;
+        widgetPlace(w, x, layout->flowY + (flowSlot % rowsPerColumn) * layout->flowRowHeight, false);
+        return;
+    }
 
-        // New: Create rectangle for input field
-        createPlNameInputRect = sfRectangleShape_create();
-        if (createPlNameInputRect) {
-            sfRectangleShape_setSize(createPlNameInputRect, (sfVector2f){300, 30}); // Adjust size as needed
-            sfRectangleShape_setPosition(createPlNameInputRect, (sfVector2f){195, 75}); // Position slightly behind text
-            sfRectangleShape_setFillColor(createPlNameInputRect, sfColor_fromRGBA(50, 50, 50, 150)); // Semi-transparent dark grey
-            sfRectangleShape_setOutlineThickness(createPlNameInputRect, 1);
-            sfRectangleShape_setOutlineColor(createPlNameInputRect, sfWhite);
-        }
+    if (w->target < 0 || w->target >= layout->count || !layout->widgets[w->target].drawable) {
+        w->bounds = (sfFloatRect){0, 0, 0, 0};
+        return;
+    }
+    sfFloatRect t = layout->widgets[w->target].bounds;
+    switch (w->placement) {
+        case PLACE_BELOW:
+            widgetPlace(w, t.left + t.width / 2 - size.width / 2, t.top + t.height + w->y, false);
+            break;
+        case PLACE_LEFT_OF:
+            widgetPlace(w, t.left - size.width - w->x, t.top, true);
+            break;
+        case PLACE_RIGHT_OF:
+            widgetPlace(w, t.left + t.width + w->x, t.top, true);
+            break;
+        default:
+            if (w->kind == WIDGET_RECT) {
+                sfRectangleShape_setSize((sfRectangleShape*)w->drawable, (sfVector2f){t.width + 2 * w->x, t.height + 2 * w->y});
+            }
+            widgetSetPosition(w, (sfVector2f){t.left - w->x, t.top - w->y});
+            w->bounds = widgetGetBounds(w);
+            break;
+    }
+}
 
-        createPlSongsHeading_s = createLabel(font, "Available Songs:", 50, 150, 20);
+// Cell range covered by a rectangle, clamped to the grid; false if it is off the window
+bool layoutCellRange(const Layout* layout, sfFloatRect r, int* c0, int* r0, int* c1, int* r1) {
+    if (r.width <= 0 || r.height <= 0) return false;
+    if (r.left + r.width < 0 || r.top + r.height < 0 || r.left >= layoutWidth || r.top >= layoutHeight) return false;
+    *c0 = r.left < 0 ? 0 : (int)(r.left / LAYOUT_CELL_SIZE);
+    *r0 = r.top < 0 ? 0 : (int)(r.top / LAYOUT_CELL_SIZE);
+    *c1 = (int)((r.left + r.width) / LAYOUT_CELL_SIZE);
+    *r1 = (int)((r.top + r.height) / LAYOUT_CELL_SIZE);
+    if (*c1 >= layout->gridColumns) *c1 = layout->gridColumns - 1;
+    if (*r1 >= layout->gridRows) *r1 = layout->gridRows - 1;
+    return true;
+}
 
-        // Populate selectable songs
-        Song* currentSongPtr = allSongs;
-        int i = 0;
-        float songY = 180;
-        while (currentSongPtr != NULL && i < MAX_SELECTABLE_SONGS) {
-            selectableSongTexts[i] = createLabel(font, currentSongPtr->name, 70, songY, 18);
-            if (selectableSongTexts[i]) sfText_setFillColor(selectableSongTexts[i], sfWhite); // Default color
-            songY += 25;
-            currentSongPtr = currentSongPtr->next;
-            i++;
+void layoutBuildGrid(Layout* layout) {
+    int columns = (int)(layoutWidth / LAYOUT_CELL_SIZE) + 1;
+    int rows = (int)(layoutHeight / LAYOUT_CELL_SIZE) + 1;
+    int cells = columns * rows;
+    if (cells + 1 > layout->cellStartCapacity) {
+        int* grown = realloc(layout->cellStart, (size_t)(cells + 1) * sizeof(int));
+        if (!grown) {
+            fprintf(stderr, "Failed to allocate the hit grid.\n");
+            layout->gridColumns = layout->gridRows = 0;
+            return;
         }
+        layout->cellStart = grown;
+        layout->cellStartCapacity = cells + 1;
+    }
+    layout->gridColumns = columns;
+    layout->gridRows = rows;
+    memset(layout->cellStart, 0, (size_t)(cells + 1) * sizeof(int));
+
+    // Count the widgets over each cell, turn the counts into start offsets, then fill
+    int c0, r0, c1, r1;
+    for (int i = 0; i < layout->count; i++) {
+        Widget* w = &layout->widgets[i];
+        if (!w->drawable || w->action == ACTION_NONE) continue;
+        if (!layoutCellRange(layout, w->bounds, &c0, &r0, &c1, &r1)) continue;
+        for (int r = r0; r <= r1; r++) {
+            for (int c = c0; c <= c1; c++) layout->cellStart[r * columns + c]++;
+        }
+    }
+    int total = 0;
+    for (int c = 0; c < cells; c++) {
+        int count = layout->cellStart[c];
+        layout->cellStart[c] = total;
+        total += count;
+    }
+    layout->cellStart[cells] = total;
+    if (total > layout->cellItemCapacity) {
+        short* grown = realloc(layout->cellItems, (size_t)total * sizeof(short));
+        if (!grown) {
+            fprintf(stderr, "Failed to allocate the hit grid.\n");
+            layout->gridColumns = layout->gridRows = 0;
+            return;
+        }
+        layout->cellItems = grown;
+        layout->cellItemCapacity = total;
+    }
+    for (int i = 0; i < layout->count; i++) {
+        Widget* w = &layout->widgets[i];
+        if (!w->drawable || w->action == ACTION_NONE) continue;
+        if (!layoutCellRange(layout, w->bounds, &c0, &r0, &c1, &r1)) continue;
+        for (int r = r0; r <= r1; r++) {
+            for (int c = c0; c <= c1; c++) layout->cellItems[layout->cellStart[r * columns + c]++] = (short)i;
+        }
+    }
+    // Filling advanced every start to the next cell's start; shift them back
+    for (int c = cells; c > 0; c--) layout->cellStart[c] = layout->cellStart[c - 1];
+    layout->cellStart[0] = 0;
+}
 
-        createPlCreateBtn_s = createLabel(font, "CREATE", 200, 450, 24);
-        if (createPlCreateBtn_s) sfText_setFillColor(createPlCreateBtn_s, sfGreen);
-        createPlCancelBtn_s = createLabel(font, "CANCEL", 400, 450, 24);
-        if (createPlCancelBtn_s) sfText_setFillColor(createPlCancelBtn_s, sfRed);
-
-        inputClock = sfClock_create();
-        uiInitialized = true;
-        mouseWasPressed = false; // Reset mouse state for this screen
+// Recomputes geometry and the hit grid if the window was resized or the widgets changed
+void layoutUpdate(Layout* layout) {
+    if (!layout->dirty && layout->generation == layoutGeneration) return;
+
+    // Window- and flow-relative widgets first, so relative ones can refer to any of them
+    int flowSlot = 0;
+    for (int i = 0; i < layout->count; i++) {
+        Widget* w = &layout->widgets[i];
+        if (w->placement != PLACE_ANCHORED && w->placement != PLACE_FLOW) continue;
+        if (w->placement == PLACE_FLOW) flowSlot++;
+        if (w->drawable) layoutPlaceWidget(layout, w, flowSlot - 1);
+        else w->bounds = (sfFloatRect){0, 0, 0, 0};
+    }
+    for (int i = 0; i < layout->count; i++) {
+        Widget* w = &layout->widgets[i];
+        if (w->placement == PLACE_ANCHORED || w->placement == PLACE_FLOW) continue;
+        if (w->drawable) layoutPlaceWidget(layout, w, 0);
+        else w->bounds = (sfFloatRect){0, 0, 0, 0};
     }
 
-    // --- Event Handling for Create Playlist Screen ---
-    if (event->type == sfEvtTextEntered) {
-        if (sfClock_getElapsedTime(inputClock).microseconds > 150000) {
-            if (event->text.unicode < 128) {
-                if (event->text.unicode == '\b') {
-                    if (strlen(createPlNameInput) > 0) {
-                        createPlNameInput[strlen(createPlNameInput) - 1] = '\0';
-                    }
-                } else if (event->text.unicode == '\n' || event->text.unicode == '\r') {
-                    // Ignore Enter key here, as we have a button
-                } else if (strlen(createPlNameInput) < MAX_PLAYLIST_NAME_LENGTH) {
-                    char c = (char)event->text.unicode;
-                    strncat(createPlNameInput, &c, 1);
-                }
-                if (createPlNameTextInput) sfText_setString(createPlNameTextInput, createPlNameInput);
-            }
-            sfClock_restart(inputClock);
-        }
-    } else if (event->type == sfEvtMouseButtonPressed) {
-        // Only process click if mouse wasn't pressed in previous frame to avoid multiple triggers
-        if (!mouseWasPressed) {
-            sfVector2i mouse = sfMouse_getPositionRenderWindow(window);
-
-            // Click on song names to select/deselect
-            Song* currentSongPtr = allSongs;
-            for (int i = 0; i < MAX_SELECTABLE_SONGS && currentSongPtr != NULL; i++) {
-                if (selectableSongTexts[i]) {
-                    sfFloatRect textBounds = sfText_getGlobalBounds(selectableSongTexts[i]);
-                    if (sfFloatRect_contains(&textBounds, (float)mouse.x, (float)mouse.y)) {
-                        songSelected[i] = !songSelected[i]; // Toggle selection
-                        if (songSelected[i]) {
-                            sfText_setFillColor(selectableSongTexts[i], sfCyan); // Highlight selected
-                        } else {
-                            sfText_setFillColor(selectableSongTexts[i], sfWhite); // Back to normal
-                        }
-                        mouseWasPressed = true; // Mark as processed
-                        break;
-                    }
-                }
-                currentSongPtr = currentSongPtr->next;
-            }
-
-            // Click on CREATE button
-            if (createPlCreateBtn_s) {
-                sfFloatRect createBtnBounds = sfText_getGlobalBounds(createPlCreateBtn_s);
-                if (sfFloatRect_contains(&createBtnBounds, (float)mouse.x, (float)mouse.y)) {
-                    if (strlen(createPlNameInput) > 0) {
-                        Playlist* newPl = createPlaylist(createPlNameInput);
-                        if (newPl) {
-                            Song* songToAddToPl = allSongs;
-                            for (int i = 0; i < MAX_SELECTABLE_SONGS && songToAddToPl != NULL; i++) {
-                                if (songSelected[i]) {
-                                    enqueueSong(newPl, songToAddToPl);
-                                }
-                                songToAddToPl = songToAddToPl->next;
-                            }
-                            printf("Playlist '%s' created with selected songs.\n", createPlNameInput);
-                        }
-                    } else {
-                        printf("Please enter a playlist name.\n");
-                        if (createPlNameTextInput) sfText_setFillColor(createPlNameTextInput, sfRed);
-                    }
-                    uiInitialized = false;
-                    if (inputClock) { sfClock_destroy(inputClock); inputClock = NULL; }
-                    currentAppState = MAIN_PLAYER;
-                    mouseWasPressed = true; // Mark as processed
-                    return true;
-                }
-            }
+    layoutBuildGrid(layout);
+    layout->dirty = false;
+    layout->generation = layoutGeneration;
+}
 
-            // Click on CANCEL button
-            if (createPlCancelBtn_s) {
-                sfFloatRect cancelBtnBounds = sfText_getGlobalBounds(createPlCancelBtn_s);
-                if (sfFloatRect_contains(&cancelBtnBounds, (float)mouse.x, (float)mouse.y)) {
-                    printf("Playlist creation canceled.\n");
-                    uiInitialized = false;
-                    if (inputClock) { sfClock_destroy(inputClock); inputClock = NULL; }
-                    currentAppState = MAIN_PLAYER;
-                    mouseWasPressed = true; // Mark as processed
-                    return true;
-                }
-            }
+// Topmost visible clickable widget under the point
+int layoutHitTest(Layout* layout, float x, float y) {
+    layoutUpdate(layout);
+    if (x < 0 || y < 0 || x >= layoutWidth || y >= layoutHeight || layout->gridColumns == 0) return ACTION_NONE;
+    int column = (int)(x / LAYOUT_CELL_SIZE);
+    int row = (int)(y / LAYOUT_CELL_SIZE);
+    int cell = row * layout->gridColumns + column;
+    for (int k = layout->cellStart[cell + 1] - 1; k >= layout->cellStart[cell]; k--) {
+        Widget* w = &layout->widgets[layout->cellItems[k]];
+        if (!w->hidden && sfFloatRect_contains(&w->bounds, x, y)) return w->action;
+    }
+    return ACTION_NONE;
+}
+
+void layoutDraw(sfRenderWindow* window, Layout* layout) {
+    layoutUpdate(layout);
+    for (int i = 0; i < layout->count; i++) {
+        Widget* w = &layout->widgets[i];
+        if (!w->drawable || w->hidden) continue;
+        switch (w->kind) {
+            case WIDGET_TEXT: sfRenderWindow_drawText(window, (sfText*)w->drawable, NULL); break;
+            case WIDGET_SPRITE: sfRenderWindow_drawSprite(window, (sfSprite*)w->drawable, NULL); break;
+            default: sfRenderWindow_drawRectangleShape(window, (sfRectangleShape*)w->drawable, NULL); break;
         }
-    } else if (event->type == sfEvtMouseButtonReleased) {
-        mouseWasPressed = false; // Reset flag when mouse button is released
     }
+}
 
-    // --- Drawing for Create Playlist Screen ---
-    sfRenderWindow_drawText(window, createPlTitle_s, NULL);
-    sfRenderWindow_drawText(window, createPlNameLabel, NULL);
-    if (createPlNameInputRect) sfRenderWindow_drawRectangleShape(window, createPlNameInputRect, NULL); // Draw the rectangle first
-    sfRenderWindow_drawText(window, createPlNameTextInput, NULL); // Then draw the text on top
-    sfRenderWindow_drawText(window, createPlSongsHeading_s, NULL);
+void layoutFree(Layout* layout) {
+    free(layout->cellStart);
+    free(layout->cellItems);
+    layout->cellStart = NULL;
+    layout->cellItems = NULL;
+    layout->cellStartCapacity = layout->cellItemCapacity = 0;
+    layout->gridColumns = layout->gridRows = 0;
+    layout->count = 0;
+}
 
-    for (int i = 0; i < MAX_SELECTABLE_SONGS; i++) {
-        if (selectableSongTexts[i]) {
-            sfRenderWindow_drawText(window, selectableSongTexts[i], NULL);
-        }
+// SFML does not report what an sf::Text holds; these cover the object and, per character,
+// its six 20-byte vertices plus the UTF-32 copy of the string
+#define UI_TEXT_BYTES 320
+#define UI_GLYPH_BYTES 124
+
+// Approximate bytes behind a layout: itself, its hit grid and the text widgets it holds
+size_t layoutBytes(const Layout* layout) {
+    size_t bytes = sizeof(Layout) + (size_t)layout->cellStartCapacity * sizeof(int) + (size_t)layout->cellItemCapacity * sizeof(short);
+    for (int i = 0; i < layout->count; i++) {
+        const Widget* w = &layout->widgets[i];
+        if (w->kind != WIDGET_TEXT || !w->drawable) continue;
+        const char* text = sfText_getString((const sfText*)w->drawable);
+        bytes += UI_TEXT_BYTES + (text ? strlen(text) : 0) * UI_GLYPH_BYTES;
     }
+    return bytes;
+}
 
-    sfRenderWindow_drawText(window, createPlCreateBtn_s, NULL);
-    sfRenderWindow_drawText(window, createPlCancelBtn_s, NULL);
+Layout mainLayout; // Main player screen
+
+// -------------------------- Timing Helpers --------------------------
+// Microsecond timestamps from the high resolution performance counter
+long long perfMicros(void) {
+    static LARGE_INTEGER frequency = {0};
+    LARGE_INTEGER now;
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (long long)(now.QuadPart / frequency.QuadPart) * 1000000LL +
+           (long long)(now.QuadPart % frequency.QuadPart) * 1000000LL / frequency.QuadPart;
+}
 
-    return false; // Screen is not finished yet
+long long fileTimeValue(FILETIME time) {
+    return ((long long)time.dwHighDateTime << 32) | time.dwLowDateTime;
 }
 
-// -------------------------- SELECT PLAYLIST SCREEN --------------------------
-// Declared static variables for UI elements for proper scope and cleanup handling
-static sfText* selectPlTitle_s = NULL;
-static sfText* playSelectedBtn_s = NULL;
+bool getFileStamp(const char* path, long long* size, long long* modified) {
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA(path, &data);
+    if (find == INVALID_HANDLE_VALUE) return false;
+    FindClose(find);
+    *size = ((long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    *modified = fileTimeValue(data.ftLastWriteTime);
+    return true;
+}
+
+// -------------------------- Input Events --------------------------
+// Every SFML event is queued with the time it was polled and dispatched exactly once to the
+// screen that is active when its turn comes, so fast typing and quick clicks are never
+// dropped or handled twice. Input latency runs from polling to the display of the first
+// frame drawn after the event was handled.
+#define INPUT_LATENCY_BUCKETS 64 // 1 ms buckets; the last one also counts anything slower
+
+typedef struct InputEvent {
+    sfEvent event;
+    long long polledMicros;
+    bool repeat; // Key press generated by key auto-repeat
+} InputEvent;
+
+typedef struct InputQueue {
+    InputEvent* events;
+    int count, capacity;
+    int next; // Next event to dispatch
+    bool keyDown[sfKeyCount];
+    long dispatched;
+    // Key, text and mouse button events only (mouse moves would swamp the numbers)
+    long measured;
+    long long totalMicros, worstMicros;
+    long histogram[INPUT_LATENCY_BUCKETS];
+} InputQueue;
+
+InputQueue inputQueue;
+
+bool inputPush(InputQueue* queue, const sfEvent* event, long long now) {
+    if (queue->count == queue->capacity) {
+        int capacity = queue->capacity ? queue->capacity * 2 : 64;
+        InputEvent* grown = realloc(queue->events, (size_t)capacity * sizeof(InputEvent));
+        if (!grown) {
+            fprintf(stderr, "Out of memory queueing input; event dropped.\n");
+            return false;
+        }
+        queue->events = grown;
+        queue->capacity = capacity;
+    }
+    InputEvent* input = &queue->events[queue->count++];
+    input->event = *event;
+    input->polledMicros = now;
+    input->repeat = false;
+
+    // Track held keys in event order so auto-repeat presses can be told apart
+    if (event->type == sfEvtKeyPressed || event->type == sfEvtKeyReleased) {
+        int code = event->key.code;
+        if (code >= 0 && code < sfKeyCount) {
+            input->repeat = event->type == sfEvtKeyPressed && queue->keyDown[code];
+            queue->keyDown[code] = event->type == sfEvtKeyPressed;
+        }
+    } else if (event->type == sfEvtLostFocus) {
+        memset(queue->keyDown, 0, sizeof(queue->keyDown)); // Releases elsewhere never reach us
+    }
+    return true;
+}
+
+// Queues everything the window has pending
+void inputPollWindow(InputQueue* queue, sfRenderWindow* window) {
+    sfEvent event;
+    while (sfRenderWindow_pollEvent(window, &event)) {
+        inputPush(queue, &event, perfMicros());
+    }
+}
+
+// Next undispatched event, or NULL once the queue is drained
+InputEvent* inputNext(InputQueue* queue) {
+    if (queue->next >= queue->count) return NULL;
+    queue->dispatched++;
+    return &queue->events[queue->next++];
+}
+
+// Call right after the frame is displayed: records latency for the events handled before
+// it was drawn and empties the queue
+void inputFrameShown(InputQueue* queue) {
+    long long now = perfMicros();
+    for (int i = 0; i < queue->next; i++) {
+        sfEventType type = queue->events[i].event.type;
+        if (type != sfEvtKeyPressed && type != sfEvtTextEntered && type != sfEvtMouseButtonPressed) continue;
+        long long latency = now - queue->events[i].polledMicros;
+        int bucket = (int)(latency / 1000);
+        if (bucket >= INPUT_LATENCY_BUCKETS) bucket = INPUT_LATENCY_BUCKETS - 1;
+        queue->histogram[bucket]++;
+        queue->measured++;
+        queue->totalMicros += latency;
+        if (latency > queue->worstMicros) queue->worstMicros = latency;
+    }
+    // Anything queued but not dispatched (none in the main loop) moves to the front
+    int left = queue->count - queue->next;
+    if (left > 0) memmove(queue->events, queue->events + queue->next, (size_t)left * sizeof(InputEvent));
+    queue->count = left;
+    queue->next = 0;
+}
+
+// Upper edge, in ms, of the bucket holding the given fraction of measured events
+int inputLatencyPercentile(const InputQueue* queue, double fraction) {
+    long wanted = (long)(queue->measured * fraction);
+    long seen = 0;
+    for (int i = 0; i < INPUT_LATENCY_BUCKETS; i++) {
+        seen += queue->histogram[i];
+        if (seen > wanted) return i + 1;
+    }
+    return INPUT_LATENCY_BUCKETS;
+}
+
+void inputFree(InputQueue* queue) {
+    free(queue->events);
+    queue->events = NULL;
+    queue->count = queue->capacity = queue->next = 0;
+}
+
+// -------------------------- Library Table --------------------------
+// Column store behind the sorted and grouped song views. Every library song is one row and
+// each field lives in its own array; strings are dictionary-encoded with an order-preserving
+// rank per dictionary, so a sort only ever compares 64-bit integers. Each sort key caches
+// its order. Rows added or changed since then are taken out, sorted on their own and merged
+// back in; a full parallel radix sort runs only when a big share of the library changed.
+// Nothing here reads tags, so artist and album come from the folder layout
+// (root\Artist\Album\file) or from an "Artist - Title" file name.
+#define LIBRARY_SORT_WORKERS 4
+#define LIBRARY_PARALLEL_ROWS 32768 // Smaller sorts stay on the calling thread
+#define LIBRARY_PATCH_DIVISOR 16 // Patch a cached order while under 1/16 of its rows changed
+
+typedef enum LibrarySortKey {
+    SORT_LIBRARY, // Order the songs were added in (allSongsList order)
+    SORT_TITLE,
+    SORT_ARTIST, // Grouped by artist, then album
+    SORT_ALBUM,
+    SORT_DURATION,
+    SORT_PLAY_COUNT,
+    SORT_DATE_ADDED, // File creation time
+    SORT_KEY_COUNT
+} LibrarySortKey;
+
+const char* librarySortNames[SORT_KEY_COUNT] = { "library", "title", "artist", "album", "duration", "plays", "added" };
+
+// Columns a change touched; each order lists the ones its key reads
+#define COLUMN_ROW 1 // Row added or removed
+#define COLUMN_TITLE 2
+#define COLUMN_ARTIST 4
+#define COLUMN_ALBUM 8
+#define COLUMN_DURATION 16
+#define COLUMN_PLAYS 32
+#define COLUMN_ADDED 64
+
+const unsigned char librarySortColumns[SORT_KEY_COUNT] = {
+    COLUMN_ROW,
+    COLUMN_ROW | COLUMN_TITLE | COLUMN_ARTIST,
+    COLUMN_ROW | COLUMN_ARTIST | COLUMN_ALBUM,
+    COLUMN_ROW | COLUMN_ALBUM | COLUMN_ARTIST,
+    COLUMN_ROW | COLUMN_DURATION | COLUMN_TITLE,
+    COLUMN_ROW | COLUMN_PLAYS | COLUMN_TITLE,
+    COLUMN_ROW | COLUMN_ADDED | COLUMN_TITLE,
+};
+
+typedef struct StringDictionary {
+    char** strings; // By code; codes are never reused
+    unsigned int count, capacity;
+    unsigned int* slots; // Open addressing over code + 1 (0 = empty), power-of-two size
+    unsigned int slotCount;
+    unsigned int* sorted; // Codes in collation order (the first 'rankedCount' codes)
+    unsigned int* rank; // Position of each code in 'sorted'
+    unsigned int rankedCount;
+} StringDictionary;
+
+typedef struct LibraryTableChange {
+    int row;
+    unsigned char columns;
+} LibraryTableChange;
+
+typedef struct LibraryOrder {
+    int* rows; // Live rows in key order
+    int count, capacity;
+    int changesSeen; // Entries of the change log already folded in
+    bool valid;
+} LibraryOrder;
+
+typedef struct LibraryTable {
+    int rows, capacity;
+    int deadRows; // Rows of removed songs, dropped by the next compaction
+    Song** song; // NULL for a removed song
+    unsigned int* title; // Dictionary codes
+    unsigned int* artist;
+    unsigned int* album;
+    unsigned int* durationMs; // 0 = not analysed yet
+    unsigned int* playCount;
+    unsigned int* added; // Seconds since 1970; 0 = not looked up, 1 = unknown
+    unsigned char* mark; // Scratch: rows changed since an order was built
+    unsigned long long* keys; // Scratch for sorting
+    unsigned long long* keyScratch;
+    int* rowScratch;
+    StringDictionary titles, artists, albums;
+    LibraryTableChange* changes;
+    int changeCount, changeCapacity;
+    LibraryOrder orders[SORT_KEY_COUNT];
+    // Shown in the debug stats view (F3)
+    long fullSorts;
+    long patches;
+    long long lastSortMicros;
+    LibrarySortKey lastSortKey;
+} LibraryTable;
+
+LibraryTable libraryTable = {0};
+
+int compareCollated(const char* a, const char* b) {
+    int order = _stricmp(a, b);
+    return order ? order : strcmp(a, b);
+}
+
+static const StringDictionary* rankingDictionary = NULL; // qsort has no context argument
+
+int compareDictionaryCodes(const void* a, const void* b) {
+    unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+    int order = compareCollated(rankingDictionary->strings[x], rankingDictionary->strings[y]);
+    return order ? order : (x > y) - (x < y);
+}
+
+bool dictionaryGrowSlots(StringDictionary* d) {
+    unsigned int slotCount = d->slotCount ? d->slotCount * 2 : 256;
+    unsigned int* slots = calloc(slotCount, sizeof(unsigned int));
+    if (!slots) return false;
+    for (unsigned int code = 0; code < d->count; code++) {
+        unsigned int i = hashKey(d->strings[code]) & (slotCount - 1);
+        while (slots[i]) i = (i + 1) & (slotCount - 1);
+        slots[i] = code + 1;
+    }
+    free(d->slots);
+    d->slots = slots;
+    d->slotCount = slotCount;
+    return true;
+}
+
+// Code of 'text', adding it if new; false when out of memory
+bool dictionaryIntern(StringDictionary* d, const char* text, unsigned int* code) {
+    if ((d->count + 1) * 2 > d->slotCount && !dictionaryGrowSlots(d)) return false;
+    unsigned int i = hashKey(text) & (d->slotCount - 1);
+    for (; d->slots[i]; i = (i + 1) & (d->slotCount - 1)) {
+        if (strcmp(d->strings[d->slots[i] - 1], text) == 0) {
+            *code = d->slots[i] - 1;
+            return true;
+        }
+    }
+    if (d->count == d->capacity) {
+        unsigned int capacity = d->capacity ? d->capacity * 2 : 256;
+        char** strings = realloc(d->strings, capacity * sizeof(char*));
+        if (strings) d->strings = strings;
+        unsigned int* sorted = realloc(d->sorted, capacity * sizeof(unsigned int));
+        if (sorted) d->sorted = sorted;
+        unsigned int* rank = realloc(d->rank, capacity * sizeof(unsigned int));
+        if (rank) d->rank = rank;
+        if (!strings || !sorted || !rank) return false;
+        d->capacity = capacity;
+    }
+    char* copy = strdup(text);
+    if (!copy) return false;
+    d->strings[d->count] = copy;
+    d->slots[i] = d->count + 1;
+    *code = d->count++;
+    return true;
+}
+
+// Brings the ranks up to date: new codes are sorted on their own and merged into the order
+void dictionaryRank(StringDictionary* d) {
+    if (d->rankedCount == d->count) return;
+    unsigned int ranked = d->rankedCount;
+    for (unsigned int code = ranked; code < d->count; code++) d->sorted[code] = code;
+    rankingDictionary = d;
+    qsort(d->sorted + ranked, d->count - ranked, sizeof(unsigned int), compareDictionaryCodes);
+    // 'rank' is rebuilt below, so it doubles as the merge buffer
+    unsigned int a = 0, b = ranked, out = 0;
+    while (a < ranked && b < d->count) {
+        d->rank[out++] = compareDictionaryCodes(&d->sorted[a], &d->sorted[b]) <= 0 ? d->sorted[a++] : d->sorted[b++];
+    }
+    while (a < ranked) d->rank[out++] = d->sorted[a++];
+    while (b < d->count) d->rank[out++] = d->sorted[b++];
+    unsigned int* sorted = d->rank;
+    d->rank = d->sorted;
+    d->sorted = sorted;
+    for (unsigned int position = 0; position < d->count; position++) d->rank[d->sorted[position]] = position;
+    d->rankedCount = d->count;
+}
+
+void dictionaryFree(StringDictionary* d) {
+    for (unsigned int code = 0; code < d->count; code++) free(d->strings[code]);
+    free(d->strings);
+    free(d->slots);
+    free(d->sorted);
+    free(d->rank);
+    memset(d, 0, sizeof(*d));
+}
+
+// Artist and album of a song, derived from where the file sits and what it is called
+void describeLibrarySong(const Song* song, char* artist, char* album, size_t size) {
+    const char* separators[3] = { NULL, NULL, NULL }; // Last three, newest first
+    for (const char* c = song->path; *c; c++) {
+        if (*c == '\\' || *c == '/') {
+            separators[2] = separators[1];
+            separators[1] = separators[0];
+            separators[0] = c;
+        }
+    }
+    artist[0] = album[0] = '\0';
+    if (separators[1]) {
+        int length = (int)(separators[0] - separators[1] - 1);
+        snprintf(album, size, "%.*s", length, separators[1] + 1);
+    }
+    if (separators[2]) {
+        int length = (int)(separators[1] - separators[2] - 1);
+        snprintf(artist, size, "%.*s", length, separators[2] + 1);
+    } else {
+        const char* dash = strstr(song->name, " - ");
+        if (dash) snprintf(artist, size, "%.*s", (int)(dash - song->name), song->name);
+    }
+}
+
+bool libraryTableReserve(LibraryTable* t, int rows) {
+    if (rows <= t->capacity) return true;
+    int capacity = t->capacity ? t->capacity : 1024;
+    while (capacity < rows) capacity *= 2;
+    // Each array is only replaced once it was reallocated, so a failure leaves the table intact
+    void** columns[] = { (void**)&t->song, (void**)&t->title, (void**)&t->artist, (void**)&t->album, (void**)&t->durationMs,
+                         (void**)&t->playCount, (void**)&t->added, (void**)&t->mark, (void**)&t->keys,
+                         (void**)&t->keyScratch, (void**)&t->rowScratch };
+    size_t sizes[] = { sizeof(Song*), sizeof(unsigned int), sizeof(unsigned int), sizeof(unsigned int), sizeof(unsigned int),
+                       sizeof(unsigned int), sizeof(unsigned int), sizeof(unsigned char), sizeof(unsigned long long),
+                       sizeof(unsigned long long), sizeof(int) };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        void* grown = realloc(*columns[i], (size_t)capacity * sizes[i]);
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed for the library table.\n");
+            return false;
+        }
+        *columns[i] = grown;
+    }
+    memset(t->mark + t->capacity, 0, capacity - t->capacity);
+    t->capacity = capacity;
+    return true;
+}
+
+// Records a change for the cached orders; a log longer than the table is not worth replaying
+void libraryTableLog(LibraryTable* t, int row, unsigned char columns) {
+    bool caughtUp = true;
+    for (int k = 0; k < SORT_KEY_COUNT; k++) {
+        if (t->orders[k].valid && t->orders[k].changesSeen < t->changeCount) caughtUp = false;
+    }
+    if (caughtUp) t->changeCount = 0;
+    if (t->changeCount == t->changeCapacity && t->changeCount < t->rows + 64) {
+        int capacity = t->changeCapacity ? t->changeCapacity * 2 : 256;
+        LibraryTableChange* changes = realloc(t->changes, capacity * sizeof(LibraryTableChange));
+        if (changes) {
+            t->changes = changes;
+            t->changeCapacity = capacity;
+        }
+    }
+    if (t->changeCount >= t->rows + 64 || t->changeCount == t->changeCapacity) {
+        for (int k = 0; k < SORT_KEY_COUNT; k++) t->orders[k].valid = false;
+        t->changeCount = 0;
+        return;
+    }
+    for (int k = 0; k < SORT_KEY_COUNT; k++) {
+        if (!t->orders[k].valid || t->changeCount == 0) t->orders[k].changesSeen = 0;
+    }
+    t->changes[t->changeCount].row = row;
+    t->changes[t->changeCount].columns = columns;
+    t->changeCount++;
+}
+
+// Fills the string and number columns of 'row' from its song; returns the columns that
+// changed, or -1 (row untouched) when a string could not be stored
+int libraryTableFill(LibraryTable* t, int row) {
+    const Song* song = t->song[row];
+    char artist[MAX_PATH_LENGTH], album[MAX_PATH_LENGTH];
+    describeLibrarySong(song, artist, album, sizeof(artist));
+    unsigned int title, artistCode, albumCode;
+    if (!dictionaryIntern(&t->titles, song->name, &title) || !dictionaryIntern(&t->artists, artist, &artistCode) ||
+        !dictionaryIntern(&t->albums, album, &albumCode)) {
+        fprintf(stderr, "Memory allocation failed for the library table strings.\n");
+        return -1;
+    }
+    int changed = 0;
+    if (t->title[row] != title) changed |= COLUMN_TITLE;
+    if (t->artist[row] != artistCode) changed |= COLUMN_ARTIST;
+    if (t->album[row] != albumCode) changed |= COLUMN_ALBUM;
+    if (t->durationMs[row] != song->durationMs) changed |= COLUMN_DURATION;
+    if (t->playCount[row] != song->playCount) changed |= COLUMN_PLAYS;
+    t->title[row] = title;
+    t->artist[row] = artistCode;
+    t->album[row] = albumCode;
+    t->durationMs[row] = song->durationMs;
+    t->playCount[row] = song->playCount;
+    return changed;
+}
+
+// Appends a row for 'song' (new songs always go to the end of allSongsList)
+void libraryTableAdd(LibraryTable* t, Song* song) {
+    if (!libraryTableReserve(t, t->rows + 1)) {
+        song->libraryRow = -1;
+        return;
+    }
+    int row = t->rows;
+    t->song[row] = song;
+    t->title[row] = t->artist[row] = t->album[row] = 0;
+    t->durationMs[row] = t->playCount[row] = t->added[row] = 0;
+    if (libraryTableFill(t, row) < 0) {
+        song->libraryRow = -1; // Left out of the sorted views
+        return;
+    }
+    t->rows++;
+    song->libraryRow = row;
+    libraryTableLog(t, row, COLUMN_ROW);
+}
+
+void libraryTableRemove(LibraryTable* t, Song* song) {
+    int row = song->libraryRow;
+    if (row < 0 || row >= t->rows || t->song[row] != song) return;
+    t->song[row] = NULL;
+    t->deadRows++;
+    song->libraryRow = -1;
+    libraryTableLog(t, row, COLUMN_ROW);
+}
+
+// Picks up edits to a song; 'fileChanged' when it now points at another file
+void libraryTableRefresh(LibraryTable* t, Song* song, bool fileChanged) {
+    int row = song->libraryRow;
+    if (row < 0 || row >= t->rows || t->song[row] != song) return;
+    int changed = libraryTableFill(t, row);
+    if (changed < 0) return;
+    if (fileChanged && t->added[row] != 0) {
+        t->added[row] = 0; // Looked up again on the next date sort
+        changed |= COLUMN_ADDED;
+    }
+    if (changed) libraryTableLog(t, row, changed);
+}
+
+void libraryTableFree(LibraryTable* t) {
+    for (int row = 0; row < t->rows; row++) {
+        if (t->song[row]) t->song[row]->libraryRow = -1;
+    }
+    free(t->song);
+    free(t->title);
+    free(t->artist);
+    free(t->album);
+    free(t->durationMs);
+    free(t->playCount);
+    free(t->added);
+    free(t->mark);
+    free(t->keys);
+    free(t->keyScratch);
+    free(t->rowScratch);
+    free(t->changes);
+    for (int k = 0; k < SORT_KEY_COUNT; k++) free(t->orders[k].rows);
+    dictionaryFree(&t->titles);
+    dictionaryFree(&t->artists);
+    dictionaryFree(&t->albums);
+    memset(t, 0, sizeof(*t));
+}
+
+size_t dictionaryBytes(const StringDictionary* d) {
+    size_t bytes = (size_t)d->capacity * (sizeof(char*) + 2 * sizeof(unsigned int)) + (size_t)d->slotCount * sizeof(unsigned int);
+    for (unsigned int code = 0; code < d->count; code++) bytes += strlen(d->strings[code]) + 1;
+    return bytes;
+}
+
+// Heap bytes behind the table: columns, sort scratch, change log, cached orders, dictionaries
+size_t libraryTableBytes(const LibraryTable* t) {
+    size_t rowBytes = sizeof(Song*) + 6 * sizeof(unsigned int) + sizeof(unsigned char) + 2 * sizeof(unsigned long long) + sizeof(int);
+    size_t bytes = (size_t)t->capacity * rowBytes + (size_t)t->changeCapacity * sizeof(LibraryTableChange);
+    for (int k = 0; k < SORT_KEY_COUNT; k++) bytes += (size_t)t->orders[k].capacity * sizeof(int);
+    return bytes + dictionaryBytes(&t->titles) + dictionaryBytes(&t->artists) + dictionaryBytes(&t->albums);
+}
+
+// One row per song of 'library', in list order
+void libraryTableRebuild(LibraryTable* t, Song* library) {
+    libraryTableFree(t);
+    for (Song* song = library; song; song = song->next) libraryTableAdd(t, song);
+    t->changeCount = 0;
+}
+
+// Drops the rows of removed songs; creation times already looked up are kept
+void libraryTableCompact(LibraryTable* t) {
+    int row = 0;
+    for (int from = 0; from < t->rows; from++) {
+        if (!t->song[from]) continue;
+        t->song[row] = t->song[from];
+        t->title[row] = t->title[from];
+        t->artist[row] = t->artist[from];
+        t->album[row] = t->album[from];
+        t->durationMs[row] = t->durationMs[from];
+        t->playCount[row] = t->playCount[from];
+        t->added[row] = t->added[from];
+        t->song[row]->libraryRow = row;
+        row++;
+    }
+    t->rows = row;
+    t->deadRows = 0;
+    t->changeCount = 0;
+    for (int k = 0; k < SORT_KEY_COUNT; k++) t->orders[k].valid = false;
+}
+
+// Creation times are only needed by the date sort, so they are looked up on its first use
+void libraryTableFillDates(LibraryTable* t) {
+    for (int row = 0; row < t->rows; row++) {
+        if (!t->song[row] || t->added[row] != 0) continue;
+        WIN32_FIND_DATAA data;
+        HANDLE find = FindFirstFileA(t->song[row]->path, &data);
+        t->added[row] = 1;
+        if (find == INVALID_HANDLE_VALUE) continue;
+        FindClose(find);
+        long long created = ((long long)data.ftCreationTime.dwHighDateTime << 32) | data.ftCreationTime.dwLowDateTime;
+        long long seconds = created / 10000000LL - 11644473600LL; // FILETIME counts 100 ns steps since 1601
+        if (seconds > 1) t->added[row] = seconds > 0xFFFFFFFFLL ? 0xFFFFFFFFu : (unsigned int)seconds;
+    }
+}
+
+// Sort key of 'row': primary field in the high half, tie-breaker in the low half. Rows with
+// equal keys keep library order.
+unsigned long long libraryRowKey(const LibraryTable* t, LibrarySortKey key, int row) {
+    unsigned int titleRank = t->titles.rank[t->title[row]];
+    unsigned int artistRank = t->artists.rank[t->artist[row]];
+    unsigned int albumRank = t->albums.rank[t->album[row]];
+    switch (key) {
+        case SORT_TITLE: return (unsigned long long)titleRank << 32 | artistRank;
+        case SORT_ARTIST: return (unsigned long long)artistRank << 32 | albumRank;
+        case SORT_ALBUM: return (unsigned long long)albumRank << 32 | artistRank;
+        case SORT_DURATION: return (unsigned long long)t->durationMs[row] << 32 | titleRank;
+        case SORT_PLAY_COUNT: return (unsigned long long)t->playCount[row] << 32 | titleRank;
+        case SORT_DATE_ADDED: return (unsigned long long)t->added[row] << 32 | titleRank;
+        default: return (unsigned long long)row;
+    }
+}
+
+// Stable LSD radix sort of (key, row) pairs, skipping bytes that are the same in every key
+void radixSortPairs(unsigned long long* keys, int* rows, unsigned long long* keyScratch, int* rowScratch, int count) {
+    if (count < 2) return;
+    unsigned long long differing = 0;
+    for (int i = 1; i < count; i++) differing |= keys[i] ^ keys[0];
+    unsigned long long* keyFrom = keys;
+    unsigned long long* keyTo = keyScratch;
+    int* rowFrom = rows;
+    int* rowTo = rowScratch;
+    for (int shift = 0; shift < 64; shift += 8) {
+        if (((differing >> shift) & 0xFF) == 0) continue;
+        int offsets[256] = {0};
+        for (int i = 0; i < count; i++) offsets[(keyFrom[i] >> shift) & 0xFF]++;
+        int total = 0;
+        for (int b = 0; b < 256; b++) {
+            int n = offsets[b];
+            offsets[b] = total;
+            total += n;
+        }
+        for (int i = 0; i < count; i++) {
+            int slot = offsets[(keyFrom[i] >> shift) & 0xFF]++;
+            keyTo[slot] = keyFrom[i];
+            rowTo[slot] = rowFrom[i];
+        }
+        unsigned long long* keySwap = keyFrom;
+        keyFrom = keyTo;
+        keyTo = keySwap;
+        int* rowSwap = rowFrom;
+        rowFrom = rowTo;
+        rowTo = rowSwap;
+    }
+    if (keyFrom != keys) {
+        memcpy(keys, keyFrom, count * sizeof(unsigned long long));
+        memcpy(rows, rowFrom, count * sizeof(int));
+    }
+}
+
+typedef struct LibrarySortJob {
+    unsigned long long* keys;
+    int* rows;
+    unsigned long long* keyScratch;
+    int* rowScratch;
+    int count;
+} LibrarySortJob;
+
+void librarySortWorker(void* userData) {
+    LibrarySortJob* job = userData;
+    radixSortPairs(job->keys, job->rows, job->keyScratch, job->rowScratch, job->count);
+}
+
+// Merges two sorted runs by (key, row) into 'keyOut' / 'rowOut'
+void mergeSortedPairs(const unsigned long long* keysA, const int* rowsA, int countA, const unsigned long long* keysB,
+                      const int* rowsB, int countB, unsigned long long* keyOut, int* rowOut) {
+    int a = 0, b = 0, out = 0;
+    while (a < countA && b < countB) {
+        bool takeA = keysA[a] < keysB[b] || (keysA[a] == keysB[b] && rowsA[a] < rowsB[b]);
+        if (takeA) {
+            keyOut[out] = keysA[a];
+            rowOut[out++] = rowsA[a++];
+        } else {
+            keyOut[out] = keysB[b];
+            rowOut[out++] = rowsB[b++];
+        }
+    }
+    for (; a < countA; a++, out++) {
+        keyOut[out] = keysA[a];
+        rowOut[out] = rowsA[a];
+    }
+    for (; b < countB; b++, out++) {
+        keyOut[out] = keysB[b];
+        rowOut[out] = rowsB[b];
+    }
+}
+
+// Sorts rows[0..count) by their keys (already in t->keys): big inputs are split between
+// worker threads and the sorted runs merged pairwise
+void librarySortKeyedRows(LibraryTable* t, int* rows, int count) {
+    int workers = 1;
+    if (count >= LIBRARY_PARALLEL_ROWS) {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        workers = (int)info.dwNumberOfProcessors;
+        if (workers > LIBRARY_SORT_WORKERS) workers = LIBRARY_SORT_WORKERS;
+    }
+    if (workers <= 1) {
+        radixSortPairs(t->keys, rows, t->keyScratch, t->rowScratch, count);
+        return;
+    }
+    LibrarySortJob jobs[LIBRARY_SORT_WORKERS];
+    sfThread* threads[LIBRARY_SORT_WORKERS];
+    int starts[LIBRARY_SORT_WORKERS + 1];
+    for (int w = 0; w <= workers; w++) starts[w] = (int)((long long)count * w / workers);
+    for (int w = 0; w < workers; w++) {
+        int start = starts[w];
+        jobs[w] = (LibrarySortJob){ t->keys + start, rows + start, t->keyScratch + start, t->rowScratch + start, starts[w + 1] - start };
+        threads[w] = w > 0 ? sfThread_create(librarySortWorker, &jobs[w]) : NULL;
+        if (threads[w]) sfThread_launch(threads[w]);
+    }
+    for (int w = 0; w < workers; w++) {
+        if (!threads[w]) librarySortWorker(&jobs[w]); // The calling thread takes the first run (and any that failed to start)
+    }
+    for (int w = 1; w < workers; w++) {
+        if (!threads[w]) continue;
+        sfThread_wait(threads[w]);
+        sfThread_destroy(threads[w]);
+    }
+
+    // Pairwise merges, ping-ponging between the sort buffers and the scratch buffers
+    unsigned long long* keyFrom = t->keys;
+    unsigned long long* keyTo = t->keyScratch;
+    int* rowFrom = rows;
+    int* rowTo = t->rowScratch;
+    for (int width = 1; width < workers; width *= 2) {
+        for (int w = 0; w < workers; w += 2 * width) {
+            int start = starts[w];
+            int middle = starts[w + width < workers ? w + width : workers];
+            int end = starts[w + 2 * width < workers ? w + 2 * width : workers];
+            mergeSortedPairs(keyFrom + start, rowFrom + start, middle - start, keyFrom + middle, rowFrom + middle, end - middle,
+                             keyTo + start, rowTo + start);
+        }
+        unsigned long long* keySwap = keyFrom;
+        keyFrom = keyTo;
+        keyTo = keySwap;
+        int* rowSwap = rowFrom;
+        rowFrom = rowTo;
+        rowTo = rowSwap;
+    }
+    if (rowFrom != rows) memcpy(rows, rowFrom, count * sizeof(int));
+}
+
+bool libraryOrderReserve(LibraryOrder* order, int count) {
+    if (count <= order->capacity) return true;
+    int capacity = order->capacity ? order->capacity : 1024;
+    while (capacity < count) capacity *= 2;
+    int* rows = realloc(order->rows, capacity * sizeof(int));
+    if (!rows) return false;
+    order->rows = rows;
+    order->capacity = capacity;
+    return true;
+}
+
+void libraryOrderFullSort(LibraryTable* t, LibrarySortKey key, LibraryOrder* order) {
+    int count = 0;
+    for (int row = 0; row < t->rows; row++) {
+        if (!t->song[row]) continue;
+        order->rows[count] = row;
+        t->keys[count++] = libraryRowKey(t, key, row);
+    }
+    librarySortKeyedRows(t, order->rows, count);
+    order->count = count;
+    t->fullSorts++;
+}
+
+// Folds 'changed' rows (marked in t->mark) into a still valid order. 'changed' may sit in the
+// row scratch: every entry is read before the slot it lives in is overwritten.
+void libraryOrderPatch(LibraryTable* t, LibrarySortKey key, LibraryOrder* order, const int* changed, int changedCount) {
+    // Unchanged rows keep their relative order even when dictionaries grew: ranks preserve it
+    int kept = 0;
+    for (int i = 0; i < order->count; i++) {
+        int row = order->rows[i];
+        if (!t->mark[row]) order->rows[kept++] = row;
+    }
+    for (int i = 0; i < changedCount; i++) t->mark[changed[i]] = 0;
+    // Changed rows that are still live, sorted on their own at the end of the buffers
+    int* fresh = t->rowScratch + kept;
+    unsigned long long* freshKeys = t->keys + kept;
+    int freshCount = 0;
+    for (int i = 0; i < changedCount; i++) {
+        if (!t->song[changed[i]]) continue;
+        fresh[freshCount] = changed[i];
+        freshKeys[freshCount++] = libraryRowKey(t, key, changed[i]);
+    }
+    for (int i = 0; i < kept; i++) t->keys[i] = libraryRowKey(t, key, order->rows[i]);
+    radixSortPairs(freshKeys, fresh, t->keyScratch, order->rows + kept, freshCount); // Spare room past 'kept' as row scratch
+    memcpy(t->rowScratch, order->rows, kept * sizeof(int));
+    mergeSortedPairs(t->keys, t->rowScratch, kept, freshKeys, fresh, freshCount, t->keyScratch, order->rows);
+    order->count = kept + freshCount;
+    t->patches++;
+}
+
+// Live rows sorted by 'key' (ascending), brought up to date with the library
+const int* libraryTableOrder(LibraryTable* t, LibrarySortKey key, int* count) {
+    LibraryOrder* order = &t->orders[key];
+    long long start = perfMicros();
+    if (t->deadRows > 64 && t->deadRows * 4 > t->rows) libraryTableCompact(t);
+    if (key == SORT_DATE_ADDED) libraryTableFillDates(t);
+    dictionaryRank(&t->titles);
+    dictionaryRank(&t->artists);
+    dictionaryRank(&t->albums);
+    if (!libraryOrderReserve(order, t->rows)) {
+        fprintf(stderr, "Memory allocation failed for a library sort order.\n");
+        *count = order->valid ? order->count : 0;
+        return order->rows;
+    }
+
+    int changedCount = 0;
+    bool sorted = false;
+    if (order->valid) {
+        // Distinct rows whose change matters to this key, kept in 'mark' / the key scratch
+        int* changed = (int*)t->keyScratch;
+        for (int i = order->changesSeen; i < t->changeCount; i++) {
+            int row = t->changes[i].row;
+            if (!(t->changes[i].columns & librarySortColumns[key]) || t->mark[row]) continue;
+            t->mark[row] = 1;
+            changed[changedCount++] = row;
+        }
+        int live = t->rows - t->deadRows;
+        if (changedCount > 0 && changedCount * LIBRARY_PATCH_DIVISOR <= live) {
+            // The patch reuses the key scratch, so the list moves to the row scratch's tail
+            int* list = t->rowScratch + (t->capacity - changedCount);
+            memmove(list, changed, changedCount * sizeof(int));
+            libraryOrderPatch(t, key, order, list, changedCount);
+            sorted = true;
+        } else {
+            for (int i = 0; i < changedCount; i++) t->mark[changed[i]] = 0;
+            if (changedCount > 0) order->valid = false;
+        }
+    }
+    if (!order->valid) {
+        libraryOrderFullSort(t, key, order);
+        order->valid = true;
+        sorted = true;
+    }
+    order->changesSeen = t->changeCount;
+    if (sorted) {
+        t->lastSortMicros = perfMicros() - start;
+        t->lastSortKey = key;
+    }
+    *count = order->count;
+    return order->rows;
+}
+
+// Heading a sorted view groups rows under (artist / album views); NULL for flat views
+const char* libraryTableGroup(const LibraryTable* t, LibrarySortKey key, int row) {
+    if (key == SORT_ARTIST) return t->artists.strings[t->artist[row]];
+    if (key == SORT_ALBUM) return t->albums.strings[t->album[row]];
+    return NULL;
+}
+
+// Synthetic library of 'count' tracks: sort, patch and rebuild timings (--library-bench)
+void runLibraryTableBenchmark(int count) {
+    Song* songs = calloc(count, sizeof(Song));
+    if (!songs) {
+        fprintf(stderr, "Memory allocation failed for library benchmark.\n");
+        return;
+    }
+    StringPool strings = { "Bench strings" };
+    unsigned int seed = 12345;
+    for (int i = 0; i < count; i++) {
+        seed = seed * 1103515245u + 12345u;
+        unsigned int artist = (seed >> 8) % (count / 40 + 1), album = (seed >> 4) % 12;
+        char name[MAX_SONG_NAME_LENGTH], path[MAX_PATH_LENGTH];
+        snprintf(name, sizeof(name), "Track %08x.ogg", seed * 2654435761u);
+        snprintf(path, sizeof(path), "music\\Artist %u\\Album %u\\%s", artist, album, name);
+        songs[i].name = stringPoolCopy(&strings, name, sizeof(name));
+        songs[i].path = stringPoolCopy(&strings, path, sizeof(path));
+        if (!songs[i].name || !songs[i].path) {
+            stringPoolDestroy(&strings);
+            free(songs);
+            return;
+        }
+        songs[i].durationMs = 60000 + (seed >> 12) % 400000;
+        songs[i].playCount = (seed >> 20) % 50;
+        songs[i].next = i + 1 < count ? &songs[i + 1] : NULL;
+        songs[i].prev = i > 0 ? &songs[i - 1] : NULL;
+    }
+    LibraryTable table = {0};
+    long long start = perfMicros();
+    libraryTableRebuild(&table, songs);
+    long long built = perfMicros();
+    dictionaryRank(&table.titles);
+    dictionaryRank(&table.artists);
+    dictionaryRank(&table.albums);
+    printf("Library table: %d rows built in %.1f ms, strings ranked in %.1f ms (%u titles, %u artists, %u albums)\n", count,
+           (built - start) / 1000.0, (perfMicros() - built) / 1000.0, table.titles.count, table.artists.count, table.albums.count);
+    for (int i = 0; i < count; i++) table.added[i] = 1600000000u + (unsigned int)(i * 37 % 100000); // No files to look up
+    printf("%-10s %10s %10s %12s\n", "key", "sort ms", "again ms", "100 plays ms");
+    for (int k = SORT_TITLE; k < SORT_KEY_COUNT; k++) {
+        int rows;
+        long long t0 = perfMicros();
+        libraryTableOrder(&table, (LibrarySortKey)k, &rows);
+        long long t1 = perfMicros();
+        libraryTableOrder(&table, (LibrarySortKey)k, &rows);
+        long long t2 = perfMicros();
+        for (int p = 0; p < 100; p++) {
+            Song* song = &songs[(p * 7919) % count];
+            song->playCount++;
+            libraryTableRefresh(&table, song, false);
+        }
+        long long t3 = perfMicros();
+        libraryTableOrder(&table, (LibrarySortKey)k, &rows);
+        long long t4 = perfMicros();
+        printf("%-10s %10.2f %10.3f %12.2f\n", librarySortNames[k], (t1 - t0) / 1000.0, (t2 - t1) / 1000.0, (t4 - t3) / 1000.0);
+    }
+    libraryTableFree(&table);
+    stringPoolDestroy(&strings);
+    free(songs);
+}
+
+// -------------------------- Track Input Sources --------------------------
+// Track files are read through a TrackSource instead of letting the decoder do small buffered
+// reads on the file itself. The decoder is either decodeTrack(), which decodes a whole track
+// into an sfSoundBuffer on the cache worker, or a streamed sfMusic that reads as it plays
+// (see playerStreams()). Three kinds are available (select with --source=...):
+//   SOURCE_FILE      - the decoder opens the file itself (sfSoundBuffer_createFromFile or
+//                      sfMusic_createFromFile), the old behaviour
+//   SOURCE_MMAP      - the whole file is memory mapped and handed over as memory
+//                      (sfSoundBuffer_createFromMemory or sfMusic_createFromMemory)
+//   SOURCE_READAHEAD - a reader thread keeps a prefetch window filled ahead of the decoder,
+//                      which reads from it as an sfInputStream (sfSoundBuffer_createFromStream
+//                      or sfMusic_createFromStream)
+typedef enum TrackSourceKind {
+    SOURCE_FILE,
+    SOURCE_MMAP,
+    SOURCE_READAHEAD
+} TrackSourceKind;
+
+#define DEFAULT_PREFETCH_WINDOW (1024 * 1024) // Read-ahead window in bytes
+#define READAHEAD_CHUNK (64 * 1024) // Size of each ReadFile issued by the reader thread
+
+TrackSourceKind trackSourceKind = SOURCE_READAHEAD;
+size_t prefetchWindowBytes = DEFAULT_PREFETCH_WINDOW;
+
+// Track I/O counters (updated from the cache worker and the audio thread, read by the debug
+// view). A streamed track that waits for the disk can be heard, while a decode that waits only
+// starts later, so the two kinds of waits are counted apart.
+typedef struct IoStats {
+    volatile LONG64 bytesRead; // Bytes handed to decoders, whole-track and streamed (and hashed by the transcoder)
+    volatile LONG64 bytesFetched; // Bytes read from disk by sources and hints
+    volatile LONG stallEvents; // Streamed playback reads that had to wait for the disk
+    volatile LONG64 stallMicros; // Total time spent waiting in those stalls
+    volatile LONG decodeWaits; // Whole-track decode reads that had to wait for the disk
+    volatile LONG64 decodeWaitMicros;
+    volatile LONG hintsIssued; // Read-ahead hints for upcoming tracks
+    volatile LONG64 ringBytes; // Read-ahead rings allocated right now
+} IoStats;
+
+IoStats ioStats = {0};
+
+typedef struct TrackSource {
+    TrackSourceKind kind;
+    bool playback; // Read by streamed playback rather than by a whole-track decode
+    sfInputStream stream; // Callbacks handed to sfSoundBuffer_createFromStream or sfMusic_createFromStream
+    HANDLE file;
+    sfInt64 size;
+    sfInt64 position; // Decoder's read position
+
+    // SOURCE_MMAP
+    HANDLE mapping;
+    const unsigned char* view;
+
+    // SOURCE_READAHEAD: ring buffer holding [windowStart, windowStart + windowLength) of the file
+    unsigned char* ring;
+    size_t ringCapacity;
+    size_t ringHead; // Ring index of windowStart
+    sfInt64 windowStart;
+    size_t windowLength;
+    unsigned long generation; // Bumped whenever a seek moves outside the window
+    bool stopReader;
+    bool readFailed; // Sticky: a ReadFile failed or the file turned out shorter than 'size'
+    sfMutex* lock;
+    HANDLE dataReady; // Signalled by the reader after each chunk
+    HANDLE spaceFree; // Signalled by the decoder after consuming data or seeking
+    sfThread* reader;
+} TrackSource;
+
+void readAheadThread(void* userData) {
+    TrackSource* src = (TrackSource*)userData;
+    unsigned char* chunk = (unsigned char*)malloc(READAHEAD_CHUNK);
+    if (!chunk) return;
+
+    for (;;) {
+        sfMutex_lock(src->lock);
+        if (src->stopReader) {
+            sfMutex_unlock(src->lock);
+            break;
+        }
+        // Drop whatever the decoder has already consumed
+        if (src->position > src->windowStart && src->position <= src->windowStart + (sfInt64)src->windowLength) {
+            size_t consumed = (size_t)(src->position - src->windowStart);
+            src->ringHead = (src->ringHead + consumed) % src->ringCapacity;
+            src->windowStart += consumed;
+            src->windowLength -= consumed;
+        }
+        sfInt64 fetchOffset = src->windowStart + (sfInt64)src->windowLength;
+        size_t space = src->ringCapacity - src->windowLength;
+        unsigned long generation = src->generation;
+        sfMutex_unlock(src->lock);
+
+        if (space == 0 || fetchOffset >= src->size) {
+            WaitForSingleObject(src->spaceFree, 100);
+            continue;
+        }
+
+        DWORD toRead = (DWORD)(space < READAHEAD_CHUNK ? space : READAHEAD_CHUNK);
+        if ((sfInt64)toRead > src->size - fetchOffset) toRead = (DWORD)(src->size - fetchOffset);
+        OVERLAPPED at = {0};
+        at.Offset = (DWORD)(fetchOffset & 0xFFFFFFFF);
+        at.OffsetHigh = (DWORD)(fetchOffset >> 32);
+        DWORD got = 0;
+        if (!ReadFile(src->file, chunk, toRead, &got, &at) || got == 0) {
+            // Retrying would most likely fail the same way; let the decoder see the error instead
+            fprintf(stderr, "Read-ahead failed at offset %lld (Error Code: %lu)\n", (long long)fetchOffset, GetLastError());
+            sfMutex_lock(src->lock);
+            src->readFailed = true;
+            sfMutex_unlock(src->lock);
+            SetEvent(src->dataReady);
+            break;
+        }
+        InterlockedExchangeAdd64(&ioStats.bytesFetched, got);
+
+        sfMutex_lock(src->lock);
+        // Discard the chunk if the decoder seeked elsewhere while we were reading
+        if (generation == src->generation && fetchOffset == src->windowStart + (sfInt64)src->windowLength) {
+            size_t tail = (src->ringHead + src->windowLength) % src->ringCapacity;
+            size_t firstPart = src->ringCapacity - tail;
+            if (firstPart > got) firstPart = got;
+            memcpy(src->ring + tail, chunk, firstPart);
+            memcpy(src->ring, chunk + firstPart, got - firstPart);
+            src->windowLength += got;
+        }
+        sfMutex_unlock(src->lock);
+        SetEvent(src->dataReady);
+    }
+    free(chunk);
+}
+
+sfInt64 readAheadRead(void* data, sfInt64 size, void* userData) {
+    TrackSource* src = (TrackSource*)userData;
+    if (size <= 0) return 0;
+
+    sfMutex_lock(src->lock);
+    if (src->position >= src->size) {
+        sfMutex_unlock(src->lock);
+        return 0;
+    }
+    // Restart the window at the read position if it moved outside of it
+    if (src->position < src->windowStart || src->position > src->windowStart + (sfInt64)src->windowLength) {
+        src->windowStart = src->position;
+        src->windowLength = 0;
+        src->generation++;
+        SetEvent(src->spaceFree);
+    }
+    long long waitStart = 0;
+    while (src->windowStart + (sfInt64)src->windowLength <= src->position && !src->readFailed && !src->stopReader) {
+        if (waitStart == 0) {
+            waitStart = perfMicros();
+            InterlockedIncrement(src->playback ? &ioStats.stallEvents : &ioStats.decodeWaits);
+        }
+        sfMutex_unlock(src->lock);
+        WaitForSingleObject(src->dataReady, 50);
+        sfMutex_lock(src->lock);
+        if (src->position < src->windowStart) { // Window was reset under us; restart it here
+            src->windowStart = src->position;
+            src->windowLength = 0;
+            src->generation++;
+            SetEvent(src->spaceFree);
+        }
+    }
+    if (waitStart != 0) InterlockedExchangeAdd64(src->playback ? &ioStats.stallMicros : &ioStats.decodeWaitMicros, perfMicros() - waitStart);
+    if (src->windowStart + (sfInt64)src->windowLength <= src->position) { // Nothing left to hand out
+        sfMutex_unlock(src->lock);
+        return -1;
+    }
+
+    size_t offsetInWindow = (size_t)(src->position - src->windowStart);
+    size_t available = src->windowLength - offsetInWindow;
+    size_t count = (size_t)size < available ? (size_t)size : available;
+    size_t start = (src->ringHead + offsetInWindow) % src->ringCapacity;
+    size_t firstPart = src->ringCapacity - start;
+    if (firstPart > count) firstPart = count;
+    memcpy(data, src->ring + start, firstPart);
+    memcpy((unsigned char*)data + firstPart, src->ring, count - firstPart);
+    src->position += count;
+    sfMutex_unlock(src->lock);
+
+    SetEvent(src->spaceFree);
+    InterlockedExchangeAdd64(&ioStats.bytesRead, (LONG64)count);
+    return (sfInt64)count;
+}
+
+sfInt64 trackSourceSeek(sfInt64 position, void* userData) {
+    TrackSource* src = (TrackSource*)userData;
+    if (position < 0 || position > src->size) return -1;
+    if (src->lock) sfMutex_lock(src->lock);
+    src->position = position;
+    if (src->lock) sfMutex_unlock(src->lock);
+    return position;
+}
+
+sfInt64 trackSourceTell(void* userData) {
+    TrackSource* src = (TrackSource*)userData;
+    if (!src->lock) return src->position;
+    sfMutex_lock(src->lock);
+    sfInt64 position = src->position;
+    sfMutex_unlock(src->lock);
+    return position;
+}
+
+sfInt64 trackSourceGetSize(void* userData) {
+    return ((TrackSource*)userData)->size;
+}
+
+void closeTrackSource(TrackSource* src) {
+    if (!src) return;
+    if (src->reader) {
+        sfMutex_lock(src->lock);
+        src->stopReader = true;
+        sfMutex_unlock(src->lock);
+        SetEvent(src->spaceFree);
+        sfThread_wait(src->reader);
+        sfThread_destroy(src->reader);
+    }
+    if (src->lock) sfMutex_destroy(src->lock);
+    if (src->dataReady) CloseHandle(src->dataReady);
+    if (src->spaceFree) CloseHandle(src->spaceFree);
+    if (src->ring) InterlockedExchangeAdd64(&ioStats.ringBytes, -(LONG64)src->ringCapacity);
+    free(src->ring);
+    if (src->view) UnmapViewOfFile(src->view);
+    if (src->mapping) CloseHandle(src->mapping);
+    if (src->file != INVALID_HANDLE_VALUE) CloseHandle(src->file);
+    free(src);
+}
+
+// Opens 'path' as the requested kind of source. Returns NULL for SOURCE_FILE or on failure,
+// in which case the caller lets the decoder open the file by name.
+TrackSource* openTrackSource(const char* path, TrackSourceKind kind) {
+    if (kind == SOURCE_FILE) return NULL;
+
+    TrackSource* src = (TrackSource*)calloc(1, sizeof(TrackSource));
+    if (!src) {
+        fprintf(stderr, "Memory allocation failed for TrackSource.\n");
+        return NULL;
+    }
+    src->kind = kind;
+    src->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (src->file == INVALID_HANDLE_VALUE) {
+        free(src);
+        return NULL;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(src->file, &fileSize) || fileSize.QuadPart == 0) {
+        closeTrackSource(src);
+        return NULL;
+    }
+    src->size = fileSize.QuadPart;
+
+    if (kind == SOURCE_MMAP) {
+        src->mapping = CreateFileMappingA(src->file, NULL, PAGE_READONLY, 0, 0, NULL);
+        src->view = src->mapping ? (const unsigned char*)MapViewOfFile(src->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        if (!src->view) {
+            fprintf(stderr, "Failed to map %s (Error Code: %lu)\n", path, GetLastError());
+            closeTrackSource(src);
+            return NULL;
+        }
+        // Ask the OS to page in the first prefetch window before the decoder touches it
+        WIN32_MEMORY_RANGE_ENTRY range = { (LPVOID)src->view, (SIZE_T)(src->size < (sfInt64)prefetchWindowBytes ? src->size : (sfInt64)prefetchWindowBytes) };
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+        return src;
+    }
+
+    src->ringCapacity = prefetchWindowBytes;
+    src->ring = (unsigned char*)malloc(src->ringCapacity);
+    if (src->ring) InterlockedExchangeAdd64(&ioStats.ringBytes, (LONG64)src->ringCapacity);
+    src->lock = sfMutex_create();
+    src->dataReady = CreateEventA(NULL, FALSE, FALSE, NULL);
+    src->spaceFree = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (!src->ring || !src->lock || !src->dataReady || !src->spaceFree) {
+        closeTrackSource(src);
+        return NULL;
+    }
+    src->stream.read = readAheadRead;
+    src->stream.seek = trackSourceSeek;
+    src->stream.tell = trackSourceTell;
+    src->stream.getSize = trackSourceGetSize;
+    src->stream.userData = src;
+    src->reader = sfThread_create(readAheadThread, src);
+    if (!src->reader) {
+        closeTrackSource(src);
+        return NULL;
+    }
+    sfThread_launch(src->reader);
+    return src;
+}
+
+// Creates a streamed sfMusic for 'src' (or straight from 'path' when there is no source)
+sfMusic* createMusicFromSource(TrackSource* src, const char* path) {
+    if (!src) return sfMusic_createFromFile(path);
+    if (src->kind == SOURCE_MMAP) {
+        InterlockedExchangeAdd64(&ioStats.bytesRead, src->size);
+        return sfMusic_createFromMemory(src->view, (size_t)src->size);
+    }
+    return sfMusic_createFromStream(&src->stream);
+}
+
+// -------------------------- Upcoming Track Hints --------------------------
+// Without a decoded-track cache nothing is decoded ahead (see prefetchUpcomingTrack), so while
+// a track plays, the first prefetch window of the next queued track is read on a helper
+// thread instead. The OS cache then already holds it when that track starts streaming.
+char hintPath[MAX_PATH_LENGTH] = "";
+bool hintPending = false;
+bool hintStop = false;
+sfMutex* hintLock = NULL;
+HANDLE hintWake = NULL;
+sfThread* hintThread = NULL;
+
+void hintWorker(void* userData) {
+    (void)userData;
+    unsigned char* chunk = (unsigned char*)malloc(READAHEAD_CHUNK);
+    if (!chunk) return;
+    for (;;) {
+        WaitForSingleObject(hintWake, INFINITE);
+        char path[MAX_PATH_LENGTH];
+        sfMutex_lock(hintLock);
+        if (hintStop) {
+            sfMutex_unlock(hintLock);
+            break;
+        }
+        bool pending = hintPending;
+        strcpy(path, hintPath);
+        hintPending = false;
+        sfMutex_unlock(hintLock);
+        if (!pending) continue;
+
+        HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE) continue;
+        size_t fetched = 0;
+        DWORD got = 0;
+        while (fetched < prefetchWindowBytes && ReadFile(file, chunk, READAHEAD_CHUNK, &got, NULL) && got > 0) {
+            fetched += got;
+        }
+        CloseHandle(file);
+        InterlockedExchangeAdd64(&ioStats.bytesFetched, (LONG64)fetched);
+    }
+    free(chunk);
+}
+
+void startTrackHints(void) {
+    hintLock = sfMutex_create();
+    hintWake = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (!hintLock || !hintWake) return;
+    hintThread = sfThread_create(hintWorker, NULL);
+    if (hintThread) sfThread_launch(hintThread);
+}
+
+void stopTrackHints(void) {
+    if (hintThread) {
+        sfMutex_lock(hintLock);
+        hintStop = true;
+        sfMutex_unlock(hintLock);
+        SetEvent(hintWake);
+        sfThread_wait(hintThread);
+        sfThread_destroy(hintThread);
+        hintThread = NULL;
+    }
+    if (hintLock) { sfMutex_destroy(hintLock); hintLock = NULL; }
+    if (hintWake) { CloseHandle(hintWake); hintWake = NULL; }
+}
+
+void hintUpcomingTrack(const Song* song) {
+    if (!song || !hintThread || trackSourceKind == SOURCE_FILE) return;
+    sfMutex_lock(hintLock);
+    strcpy(hintPath, song->path);
+    hintPending = true;
+    sfMutex_unlock(hintLock);
+    SetEvent(hintWake);
+    InterlockedIncrement(&ioStats.hintsIssued);
+}
+
+// -------------------------- DSP Chain --------------------------
+// Processing applied between decode and output: preamp -> 10-band parametric EQ -> limiter.
+// The EQ is a cascade of RBJ peaking biquads in transposed direct form II. Both stereo channels
+// run side by side in the two double lanes of an SSE2 register (scalar fallback otherwise).
+// Parameters are handed from the UI to the audio thread through a lock-free triple buffer.
+#define EQ_BANDS 10
+#define DSP_BLOCK_FRAMES 2048 // Frames processed per audio callback
+#define EQ_MAX_GAIN_DB 12.0f
+
+typedef struct EqBand {
+    float frequency; // Centre frequency in Hz
+    float gainDb;
+    float q;
+} EqBand;
+
+typedef struct DspParams {
+    bool enabled;
+    float preampDb;
+    EqBand bands[EQ_BANDS];
+    float limiterCeilingDb; // Output never exceeds this level
+    float limiterReleaseMs;
+} DspParams;
+
+typedef struct BiquadCoeffs {
+    double b0, b1, b2, a1, a2;
+} BiquadCoeffs;
+
+#define DSP_SLOT_DIRTY 4 // Set on the shared slot index when it holds unread parameters
+
+typedef struct DspChain {
+    // UI side
+    DspParams params; // What the UI edits
+    int backSlot;
+    // Shared
+    DspParams slots[3];
+    volatile LONG sharedSlot; // Slot index, ORed with DSP_SLOT_DIRTY after a publish
+    // Audio thread side
+    int frontSlot;
+    unsigned int sampleRate;
+    int activeBands; // Bands with non-zero gain, packed to the front of 'coeffs'
+    BiquadCoeffs coeffs[EQ_BANDS];
+    double state[EQ_BANDS][4] __attribute__((aligned(16))); // z1 (L,R), z2 (L,R) per band
+    double preampGain;
+    double ceiling;
+    double releaseCoef;
+    double limiterGain;
+    bool enabled;
+    double work[DSP_BLOCK_FRAMES * 2] __attribute__((aligned(16))); // Interleaved stereo scratch
+    // Load counters (audio thread writes, debug view reads)
+    volatile LONG64 processedFrames;
+    volatile LONG64 processMicros;
+} DspChain;
+
+// Default band layout: octave spaced from 31 Hz to 16 kHz
+const float eqDefaultFrequencies[EQ_BANDS] = {31, 62, 125, 250, 500, 1000, 2000, 4000, 8000, 16000};
+
+void dspDefaultParams(DspParams* params) {
+    params->enabled = true;
+    params->preampDb = 0.0f;
+    for (int i = 0; i < EQ_BANDS; i++) {
+        params->bands[i].frequency = eqDefaultFrequencies[i];
+        params->bands[i].gainDb = 0.0f;
+        params->bands[i].q = 1.41f;
+    }
+    params->limiterCeilingDb = 0.0f;
+    params->limiterReleaseMs = 50.0f;
+}
+
+// True when the chain would leave the samples as they are (bypassed, or no gain anywhere)
+bool dspParamsFlat(const DspParams* params) {
+    if (!params->enabled) return true;
+    if (params->preampDb != 0.0f) return false;
+    for (int i = 0; i < EQ_BANDS; i++) {
+        if (params->bands[i].gainDb != 0.0f) return false;
+    }
+    return true;
+}
+
+// UI thread: make the current 'params' visible to the audio thread
+void dspPublish(DspChain* dsp) {
+    dsp->slots[dsp->backSlot] = dsp->params;
+    LONG previous = InterlockedExchange(&dsp->sharedSlot, dsp->backSlot | DSP_SLOT_DIRTY);
+    dsp->backSlot = previous & 3;
+}
+
+void dspInit(DspChain* dsp) {
+    memset(dsp, 0, sizeof(*dsp));
+    dspDefaultParams(&dsp->params);
+    for (int i = 0; i < 3; i++) dsp->slots[i] = dsp->params;
+    dsp->frontSlot = 0;
+    dsp->sharedSlot = 1;
+    dsp->backSlot = 2;
+    dsp->limiterGain = 1.0;
+    dspPublish(dsp);
+}
+
+void dspComputePeaking(BiquadCoeffs* c, double frequency, double gainDb, double q, double sampleRate) {
+    // RBJ audio EQ cookbook, peaking EQ
+    double a = pow(10.0, gainDb / 40.0);
+    double w0 = 2.0 * 3.14159265358979323846 * frequency / sampleRate;
+    double alpha = sin(w0) / (2.0 * q);
+    double cosW0 = cos(w0);
+    double a0 = 1.0 + alpha / a;
+    c->b0 = (1.0 + alpha * a) / a0;
+    c->b1 = (-2.0 * cosW0) / a0;
+    c->b2 = (1.0 - alpha * a) / a0;
+    c->a1 = (-2.0 * cosW0) / a0;
+    c->a2 = (1.0 - alpha / a) / a0;
+}
+
+// Audio thread: derive coefficients from a parameter set. No allocation, keeps filter state
+// of bands that stay active so parameter changes do not click.
+void dspApplyParams(DspChain* dsp, const DspParams* params) {
+    double nyquist = dsp->sampleRate * 0.5;
+    int active = 0;
+    for (int i = 0; i < EQ_BANDS; i++) {
+        const EqBand* band = &params->bands[i];
+        if (band->gainDb == 0.0f || band->frequency <= 0.0f || band->frequency >= nyquist) continue;
+        dspComputePeaking(&dsp->coeffs[active], band->frequency, band->gainDb, band->q > 0.05f ? band->q : 0.05f, dsp->sampleRate);
+        active++;
+    }
+    for (int i = active; i < dsp->activeBands; i++) {
+        memset(dsp->state[i], 0, sizeof(dsp->state[i]));
+    }
+    dsp->activeBands = active;
+    dsp->preampGain = pow(10.0, params->preampDb / 20.0);
+    dsp->ceiling = pow(10.0, params->limiterCeilingDb / 20.0);
+    dsp->releaseCoef = exp(-1.0 / (params->limiterReleaseMs * 0.001 * dsp->sampleRate));
+    dsp->enabled = params->enabled;
+}
+
+// Audio thread: called when a new track (and possibly a new sample rate) starts
+void dspPrepare(DspChain* dsp, unsigned int sampleRate) {
+    dsp->sampleRate = sampleRate;
+    memset(dsp->state, 0, sizeof(dsp->state));
+    dsp->limiterGain = 1.0;
+    dspApplyParams(dsp, &dsp->slots[dsp->frontSlot]);
+}
+
+void dspReset(DspChain* dsp) {
+    memset(dsp->state, 0, sizeof(dsp->state));
+    dsp->limiterGain = 1.0;
+}
+
+void dspRunBiquads(DspChain* dsp, double* work, size_t frames) {
+    for (int band = 0; band < dsp->activeBands; band++) {
+        const BiquadCoeffs* c = &dsp->coeffs[band];
+        double* st = dsp->state[band];
+#ifdef __SSE2__
+        __m128d b0 = _mm_set1_pd(c->b0), b1 = _mm_set1_pd(c->b1), b2 = _mm_set1_pd(c->b2);
+        __m128d a1 = _mm_set1_pd(c->a1), a2 = _mm_set1_pd(c->a2);
+        __m128d z1 = _mm_load_pd(st), z2 = _mm_load_pd(st + 2);
+        for (size_t i = 0; i < frames; i++) {
+            __m128d x = _mm_load_pd(work + i * 2);
+            __m128d y = _mm_add_pd(_mm_mul_pd(b0, x), z1);
+            z1 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b1, x), _mm_mul_pd(a1, y)), z2);
+            z2 = _mm_sub_pd(_mm_mul_pd(b2, x), _mm_mul_pd(a2, y));
+            _mm_store_pd(work + i * 2, y);
+        }
+        _mm_store_pd(st, z1);
+        _mm_store_pd(st + 2, z2);
+#else
+        for (int ch = 0; ch < 2; ch++) {
+            double z1 = st[ch], z2 = st[2 + ch];
+            for (size_t i = 0; i < frames; i++) {
+                double x = work[i * 2 + ch];
+                double y = c->b0 * x + z1;
+                z1 = (c->b1 * x - c->a1 * y) + z2;
+                z2 = c->b2 * x - c->a2 * y;
+                work[i * 2 + ch] = y;
+            }
+            st[ch] = z1;
+            st[2 + ch] = z2;
+        }
+#endif
+    }
+}
+
+sfInt16 dspToInt16(double x) {
+    double s = x * 32768.0;
+    if (s > 32767.0) s = 32767.0;
+    if (s < -32768.0) s = -32768.0;
+    return (sfInt16)lrint(s);
+}
+
+// Audio thread: process 'frames' frames of 1 or 2 channel audio from 'in' into 'out'
+void dspProcess(DspChain* dsp, const sfInt16* in, sfInt16* out, size_t frames, unsigned int channels) {
+    long long start = perfMicros();
+
+    // Pick up parameters published by the UI since the last block
+    if (dsp->sharedSlot & DSP_SLOT_DIRTY) {
+        LONG previous = InterlockedExchange(&dsp->sharedSlot, dsp->frontSlot);
+        dsp->frontSlot = previous & 3;
+        dspApplyParams(dsp, &dsp->slots[dsp->frontSlot]);
+    }
+
+    if (!dsp->enabled || channels < 1 || channels > 2) {
+        memcpy(out, in, frames * channels * sizeof(sfInt16));
+    } else {
+        const double scale = dsp->preampGain / 32768.0;
+        for (size_t done = 0; done < frames; done += DSP_BLOCK_FRAMES) {
+            size_t count = frames - done < DSP_BLOCK_FRAMES ? frames - done : DSP_BLOCK_FRAMES;
+            const sfInt16* src = in + done * channels;
+            sfInt16* dst = out + done * channels;
+            double* work = dsp->work;
+
+            for (size_t i = 0; i < count; i++) {
+                work[i * 2] = src[i * channels] * scale;
+                work[i * 2 + 1] = src[i * channels + channels - 1] * scale; // Mono feeds both lanes
+            }
+            dspRunBiquads(dsp, work, count);
+
+            // Stereo-linked peak limiter: instant attack, exponential release
+            double gain = dsp->limiterGain;
+            const double ceiling = dsp->ceiling, release = dsp->releaseCoef;
+            for (size_t i = 0; i < count; i++) {
+                double l = work[i * 2], r = work[i * 2 + 1];
+                double peak = fabs(l) > fabs(r) ? fabs(l) : fabs(r);
+                gain = 1.0 - (1.0 - gain) * release;
+                if (peak * gain > ceiling) gain = ceiling / peak;
+                dst[i * channels] = dspToInt16(l * gain);
+                if (channels == 2) dst[i * 2 + 1] = dspToInt16(r * gain);
+            }
+            dsp->limiterGain = gain;
+        }
+    }
+
+    InterlockedExchangeAdd64(&dsp->processedFrames, (LONG64)frames);
+    InterlockedExchangeAdd64(&dsp->processMicros, perfMicros() - start);
+}
+
+// -------------------------- Resampler --------------------------
+// Every track is converted to one output rate (--output-rate) before the DSP chain, so the
+// EQ, the device and transitions between tracks always run at the same rate. Conversion uses
+// Kaiser-windowed sinc filters stored as polyphase tables: one row of taps per fractional
+// position, built once per input rate and shared by all players. The dot products run on
+// SSE2 (stereo uses tables with every coefficient doubled so L and R share a register).
+// Tracks already at the output rate bypass the stage and stay bit-exact.
+#define DEFAULT_OUTPUT_RATE 44100
+#define MAX_RESAMPLE_TABLES 8
+
+typedef enum ResampleQuality {
+    RESAMPLE_FAST,
+    RESAMPLE_MEDIUM,
+    RESAMPLE_BEST,
+    RESAMPLE_QUALITY_COUNT
+} ResampleQuality;
+
+typedef struct ResampleTier {
+    const char* name;
+    int taps; // Filter length in input samples (multiple of 4)
+    int phases; // Fractional positions per input sample
+    bool interpolate; // Blend the two nearest phases instead of picking one
+    double kaiserBeta;
+    double rolloff; // Passband edge as a fraction of the lower Nyquist frequency
+} ResampleTier;
+
+const ResampleTier resampleTiers[RESAMPLE_QUALITY_COUNT] = {
+    { "fast",   16, 128, false, 6.0,  0.85 },
+    { "medium", 32, 256, true,  8.0,  0.91 },
+    { "best",   64, 512, true,  10.0, 0.95 },
+};
+
+typedef struct ResampleTable {
+    unsigned int inRate;
+    unsigned int outRate;
+    ResampleQuality quality;
+    int taps;
+    int phases;
+    bool interpolate;
+    float* mono; // (phases + 1) rows of 'taps' coefficients
+    float* stereo; // Same rows with each coefficient stored twice (L, R)
+} ResampleTable;
+
+typedef struct Resampler {
+    const ResampleTable* table; // NULL when the track is already at the output rate
+    sfUint64 frame; // Source frame at or before the next output sample
+    unsigned int frac; // Distance past 'frame', in 1/outRate steps
+} Resampler;
+
+unsigned int outputSampleRate = DEFAULT_OUTPUT_RATE; // 0 keeps each track's own rate
+ResampleQuality resampleQuality = RESAMPLE_MEDIUM;
+ResampleTable resampleTables[MAX_RESAMPLE_TABLES];
+int resampleTableCount = 0;
+sfMutex* resampleTableLock = NULL; // Created once zone scheduler threads load tracks too
+
+// Zeroth order modified Bessel function, for the Kaiser window
+double besselI0(double x) {
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 50; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12) break;
+    }
+    return sum;
+}
+
+bool buildResampleTable(ResampleTable* table, unsigned int inRate, unsigned int outRate, ResampleQuality quality) {
+    const ResampleTier* tier = &resampleTiers[quality];
+    size_t rowCount = (size_t)tier->phases + 1;
+    table->mono = (float*)malloc(rowCount * tier->taps * sizeof(float));
+    table->stereo = (float*)malloc(rowCount * tier->taps * 2 * sizeof(float));
+    if (!table->mono || !table->stereo) {
+        fprintf(stderr, "Memory allocation failed for resampler tables.\n");
+        free(table->mono);
+        free(table->stereo);
+        return false;
+    }
+    table->inRate = inRate;
+    table->outRate = outRate;
+    table->quality = quality;
+    table->taps = tier->taps;
+    table->phases = tier->phases;
+    table->interpolate = tier->interpolate;
+
+    // Downsampling lowers the cutoff below the output Nyquist frequency to avoid aliasing
+    const double pi = 3.14159265358979323846;
+    double cutoff = tier->rolloff * (outRate < inRate ? (double)outRate / inRate : 1.0);
+    double half = tier->taps / 2.0;
+    double windowNorm = besselI0(tier->kaiserBeta);
+    for (size_t row = 0; row < rowCount; row++) {
+        double phase = (double)row / tier->phases;
+        float* coeffs = table->mono + row * tier->taps;
+        double sum = 0.0;
+        for (int k = 0; k < tier->taps; k++) {
+            double d = k - half + 1.0 - phase; // Distance from the output instant, in input samples
+            double x = cutoff * d;
+            double sinc = fabs(x) < 1e-9 ? 1.0 : sin(pi * x) / (pi * x);
+            double w = d / half;
+            double window = fabs(w) >= 1.0 ? 0.0 : besselI0(tier->kaiserBeta * sqrt(1.0 - w * w)) / windowNorm;
+            double c = cutoff * sinc * window;
+            coeffs[k] = (float)c;
+            sum += c;
+        }
+        for (int k = 0; k < tier->taps; k++) {
+            coeffs[k] = (float)(coeffs[k] / sum); // Unity gain at DC for every phase
+            table->stereo[(row * tier->taps + k) * 2] = coeffs[k];
+            table->stereo[(row * tier->taps + k) * 2 + 1] = coeffs[k];
+        }
+    }
+    return true;
+}
+
+// Returns the shared table for converting 'inRate' to 'outRate', building it on first use
+const ResampleTable* getResampleTable(unsigned int inRate, unsigned int outRate, ResampleQuality quality) {
+    if (resampleTableLock) sfMutex_lock(resampleTableLock);
+    const ResampleTable* found = NULL;
+    for (int i = 0; i < resampleTableCount && !found; i++) {
+        const ResampleTable* table = &resampleTables[i];
+        if (table->inRate == inRate && table->outRate == outRate && table->quality == quality) found = table;
+    }
+    if (!found && resampleTableCount == MAX_RESAMPLE_TABLES) {
+        printf("Too many different sample rates, playing %u Hz at its own rate.\n", inRate);
+    } else if (!found && buildResampleTable(&resampleTables[resampleTableCount], inRate, outRate, quality)) {
+        found = &resampleTables[resampleTableCount++];
+    }
+    if (resampleTableLock) sfMutex_unlock(resampleTableLock);
+    return found;
+}
+
+void freeResampleTables(void) {
+    for (int i = 0; i < resampleTableCount; i++) {
+        free(resampleTables[i].mono);
+        free(resampleTables[i].stereo);
+    }
+    resampleTableCount = 0;
+}
+
+// Coefficient memory of the tables built so far
+size_t resampleTableBytes(void) {
+    size_t bytes = 0;
+    if (resampleTableLock) sfMutex_lock(resampleTableLock);
+    for (int i = 0; i < resampleTableCount; i++) {
+        bytes += (size_t)(resampleTables[i].phases + 1) * resampleTables[i].taps * sizeof(float) * 3; // Mono plus stereo rows
+    }
+    if (resampleTableLock) sfMutex_unlock(resampleTableLock);
+    return bytes;
+}
+
+// Frames a track of 'frames' input frames produces at the output rate
+sfUint64 resampledFrameCount(const ResampleTable* table, sfUint64 frames) {
+    if (!table) return frames;
+    return (frames * table->outRate + table->inRate - 1) / table->inRate;
+}
+
+#ifdef __SSE2__
+// Four int16 samples widened to floats
+static inline __m128 loadSamples4(const sfInt16* src) {
+    __m128i s = _mm_loadl_epi64((const __m128i*)src);
+    return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+}
+#endif
+
+// Dot product of one coefficient row with 'count' consecutive interleaved samples
+// (count = taps for mono, 2 * taps for stereo); lanes 0/2 and 1/3 hold L and R partial sums
+static inline void resampleDot(const float* coeffs, const sfInt16* src, int count, unsigned int channels, float* out) {
+#ifdef __SSE2__
+    __m128 acc = _mm_setzero_ps();
+    for (int i = 0; i < count; i += 4) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(coeffs + i), loadSamples4(src + i)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    if (channels == 2) {
+        out[0] = lanes[0] + lanes[2];
+        out[1] = lanes[1] + lanes[3];
+    } else {
+        out[0] = (lanes[0] + lanes[2]) + (lanes[1] + lanes[3]);
+    }
+#else
+    float left = 0.0f, right = 0.0f;
+    for (int i = 0; i < count; i += 2) {
+        left += coeffs[i] * src[i];
+        right += coeffs[i + 1] * src[i + 1];
+    }
+    if (channels == 2) {
+        out[0] = left;
+        out[1] = right;
+    } else {
+        out[0] = left + right;
+    }
+#endif
+}
+
+static inline sfInt16 resampleToInt16(float x) {
+    if (x > 32767.0f) return 32767;
+    if (x < -32768.0f) return -32768;
+    return (sfInt16)lrintf(x);
+}
+
+// Produces up to 'maxFrames' output frames from the whole decoded track 'src'. Returns the
+// number written; 0 once the track is exhausted.
+size_t resampleFrames(Resampler* rs, const sfInt16* src, sfUint64 srcFrames, unsigned int channels, sfInt16* out, size_t maxFrames) {
+    const ResampleTable* t = rs->table;
+    const int taps = t->taps;
+    const float* rows = channels == 2 ? t->stereo : t->mono;
+    const int rowLength = taps * (int)channels;
+    size_t produced = 0;
+
+    while (produced < maxFrames && rs->frame < srcFrames) {
+        sfUint64 scaled = (sfUint64)rs->frac * t->phases;
+        int phase = (int)(scaled / t->outRate);
+        float alpha = (float)(scaled % t->outRate) / t->outRate;
+        long long first = (long long)rs->frame - taps / 2 + 1;
+        float result[2];
+
+        if (first >= 0 && first + taps <= (long long)srcFrames) {
+            const sfInt16* window = src + first * channels;
+            resampleDot(rows + (size_t)phase * rowLength, window, rowLength, channels, result);
+            if (t->interpolate && alpha > 0.0f) {
+                float next[2];
+                resampleDot(rows + (size_t)(phase + 1) * rowLength, window, rowLength, channels, next);
+                for (unsigned int c = 0; c < channels; c++) result[c] += alpha * (next[c] - result[c]);
+            }
+        } else {
+            // Track edges: samples outside the track count as silence
+            const float* row0 = t->mono + (size_t)phase * taps;
+            const float* row1 = row0 + taps;
+            for (unsigned int c = 0; c < channels; c++) {
+                float a = 0.0f, b = 0.0f;
+                for (int k = 0; k < taps; k++) {
+                    long long index = first + k;
+                    if (index < 0 || index >= (long long)srcFrames) continue;
+                    float s = src[index * channels + c];
+                    a += row0[k] * s;
+                    b += row1[k] * s;
+                }
+                result[c] = t->interpolate ? a + alpha * (b - a) : a;
+            }
+        }
+        for (unsigned int c = 0; c < channels; c++) out[produced * channels + c] = resampleToInt16(result[c]);
+        produced++;
+
+        rs->frac += t->inRate;
+        rs->frame += rs->frac / t->outRate;
+        rs->frac %= t->outRate;
+    }
+    return produced;
+}
+
+// Quality / cost check for every tier on a 997 Hz sine (--resample-bench)
+void runResamplerBenchmark(void) {
+    static const unsigned int conversions[][2] = { {44100, 48000}, {48000, 44100}, {96000, 44100}, {22050, 44100} };
+    const double pi = 3.14159265358979323846, seconds = 10.0, frequency = 997.0, amplitude = 16384.0;
+    printf("Resampler benchmark: %.0f s stereo %.0f Hz sine per case\n", seconds, frequency);
+    printf("%-7s %-15s %9s %11s %8s\n", "tier", "conversion", "ns/frame", "x realtime", "SNR dB");
+
+    for (size_t c = 0; c < sizeof(conversions) / sizeof(conversions[0]); c++) {
+        unsigned int inRate = conversions[c][0], outRate = conversions[c][1];
+        sfUint64 inFrames = (sfUint64)(seconds * inRate);
+        sfInt16* input = (sfInt16*)malloc(inFrames * 2 * sizeof(sfInt16));
+        sfUint64 outCapacity = (sfUint64)(seconds * outRate) + 16;
+        sfInt16* output = (sfInt16*)malloc(outCapacity * 2 * sizeof(sfInt16));
+        if (!input || !output) {
+            fprintf(stderr, "Memory allocation failed for resampler benchmark.\n");
+            free(input);
+            free(output);
+            return;
+        }
+        for (sfUint64 i = 0; i < inFrames; i++) {
+            sfInt16 s = (sfInt16)lrint(amplitude * sin(2.0 * pi * frequency * i / inRate));
+            input[i * 2] = s;
+            input[i * 2 + 1] = s;
+        }
+
+        for (int q = 0; q < RESAMPLE_QUALITY_COUNT; q++) {
+            Resampler rs = { getResampleTable(inRate, outRate, (ResampleQuality)q), 0, 0 };
+            if (!rs.table) continue;
+            long long start = perfMicros();
+            sfUint64 produced = 0;
+            size_t got;
+            while ((got = resampleFrames(&rs, input, inFrames, 2, output + produced * 2, DSP_BLOCK_FRAMES)) > 0) {
+                produced += got;
+                if (produced + DSP_BLOCK_FRAMES > outCapacity) break;
+            }
+            long long micros = perfMicros() - start;
+
+            // Error against the ideal sine, skipping the filter's run-in at both ends
+            double signal = 0.0, noise = 0.0;
+            sfUint64 margin = (sfUint64)outRate / 10;
+            for (sfUint64 i = margin; i + margin < produced; i++) {
+                double ideal = amplitude * sin(2.0 * pi * frequency * i / outRate);
+                double error = output[i * 2] - ideal;
+                signal += ideal * ideal;
+                noise += error * error;
+            }
+            char conversion[32];
+            snprintf(conversion, sizeof(conversion), "%u->%u", inRate, outRate);
+            printf("%-7s %-15s %9.1f %11.0f %8.1f\n", resampleTiers[q].name, conversion,
+                   produced ? micros * 1000.0 / produced : 0.0,
+                   micros > 0 ? (produced / (double)outRate) * 1000000.0 / micros : 0.0,
+                   noise > 0.0 ? 10.0 * log10(signal / noise) : 999.0);
+        }
+        free(input);
+        free(output);
+        freeResampleTables(); // Standalone mode: no player is holding them
+    }
+}
+
+// -------------------------- Decoded PCM Cache --------------------------
+// LRU cache of decoded tracks bounded by a memory budget (--pcm-cache-mb). Players hold a
+// reference on the entry they are playing, so restart, Prev and replays of recent songs
+// start straight from memory. Decoding runs on a background thread, also with a budget of 0:
+// the main player asks for a track there (pcmCacheRequest) and keeps the window responsive
+// while it is decoded, and the track that will play next is decoded ahead of time. With a
+// budget of 0 and a flat EQ the main player streams tracks instead (see playerStreams()).
+#define DEFAULT_PCM_CACHE_MB 256
+#define PCM_PREFETCH_QUEUE 4 // Pending background decodes nobody is waiting for yet
+#define PCM_CACHE_BUCKETS 256 // Path hash chains
+
+typedef struct PcmCacheEntry {
+    char path[MAX_PATH_LENGTH];
+    sfSoundBuffer* pcm;
+    size_t bytes;
+    int refCount; // Players currently playing (or waiting for) this entry
+    bool decoding; // Not decoded yet
+    bool claimed; // A thread is decoding it
+    bool queued; // Waiting in the worker's request list
+    HANDLE decoded; // Manual-reset; set once decoding finished, whether or not it worked
+    unsigned int hash; // hashKey(path)
+    bool indexed; // In pcmCache.buckets (not after pcmCacheForget)
+    struct PcmCacheEntry* nextInBucket;
+    struct PcmCacheEntry* nextRequest;
+    struct PcmCacheEntry* newer; // LRU list, most recently used at pcmCache.newest
+    struct PcmCacheEntry* older;
+} PcmCacheEntry;
+
+typedef struct PcmCache {
+    size_t budgetBytes;
+    size_t usedBytes;
+    int entryCount;
+    PcmCacheEntry* newest;
+    PcmCacheEntry* oldest;
+    PcmCacheEntry* buckets[PCM_CACHE_BUCKETS];
+    // Latest look-ahead; it is kept until it is played (or another one replaces it) and its
+    // size is not held against the budget, so a budget smaller than one track still works
+    PcmCacheEntry* upcoming;
+    sfMutex* lock;
+    // Background decode requests, in the order the worker takes them
+    PcmCacheEntry* requests;
+    int requestCount;
+    HANDLE wake;
+    bool stop;
+    sfThread* worker;
+    // Counters for the debug stats view
+    volatile LONG hits;
+    volatile LONG misses;
+    volatile LONG evictions;
+    volatile LONG prefetched;
+} PcmCache;
+
+PcmCache pcmCache = {0};
+
+// Decodes 'path' into a sound buffer, reading it through the configured TrackSource
+sfSoundBuffer* decodeTrack(const char* path) {
+    TrackSource* src = openTrackSource(path, trackSourceKind);
+    sfSoundBuffer* pcm = NULL;
+    if (!src) {
+        pcm = sfSoundBuffer_createFromFile(path);
+    } else if (src->kind == SOURCE_MMAP) {
+        InterlockedExchangeAdd64(&ioStats.bytesRead, src->size);
+        pcm = sfSoundBuffer_createFromMemory(src->view, (size_t)src->size);
+    } else {
+        pcm = sfSoundBuffer_createFromStream(&src->stream);
+    }
+    closeTrackSource(src);
+    return pcm;
+}
+
+// Caller holds pcmCache.lock for all the list helpers below
+void pcmCacheUnlink(PcmCacheEntry* entry) {
+    if (entry->newer) entry->newer->older = entry->older; else pcmCache.newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer; else pcmCache.oldest = entry->newer;
+    entry->newer = entry->older = NULL;
+}
+
+void pcmCachePushNewest(PcmCacheEntry* entry) {
+    entry->older = pcmCache.newest;
+    entry->newer = NULL;
+    if (pcmCache.newest) pcmCache.newest->newer = entry;
+    pcmCache.newest = entry;
+    if (!pcmCache.oldest) pcmCache.oldest = entry;
+}
+
+PcmCacheEntry* pcmCacheFind(const char* path) {
+    unsigned int hash = hashKey(path);
+    for (PcmCacheEntry* entry = pcmCache.buckets[hash % PCM_CACHE_BUCKETS]; entry; entry = entry->nextInBucket) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) return entry;
+    }
+    return NULL;
+}
+
+void pcmCacheUnindex(PcmCacheEntry* entry) {
+    if (!entry->indexed) return;
+    PcmCacheEntry** link = &pcmCache.buckets[entry->hash % PCM_CACHE_BUCKETS];
+    while (*link != entry) link = &(*link)->nextInBucket;
+    *link = entry->nextInBucket;
+    entry->nextInBucket = NULL;
+    entry->indexed = false;
+}
+
+// Takes a pending entry off the worker's request list
+void pcmCacheDequeue(PcmCacheEntry* entry) {
+    if (!entry->queued) return;
+    PcmCacheEntry** link = &pcmCache.requests;
+    while (*link != entry) link = &(*link)->nextRequest;
+    *link = entry->nextRequest;
+    entry->nextRequest = NULL;
+    entry->queued = false;
+    pcmCache.requestCount--;
+}
+
+// Hands a pending entry to the worker, in front of the queue if someone waits for it
+void pcmCacheEnqueue(PcmCacheEntry* entry, bool urgent) {
+    PcmCacheEntry** link = &pcmCache.requests;
+    if (!urgent) while (*link) link = &(*link)->nextRequest;
+    entry->nextRequest = *link;
+    *link = entry;
+    entry->queued = true;
+    pcmCache.requestCount++;
+    SetEvent(pcmCache.wake);
+}
+
+void pcmCacheDestroyEntry(PcmCacheEntry* entry) {
+    pcmCacheDequeue(entry);
+    pcmCacheUnindex(entry);
+    pcmCacheUnlink(entry);
+    if (pcmCache.upcoming == entry) pcmCache.upcoming = NULL;
+    pcmCache.usedBytes -= entry->bytes;
+    pcmCache.entryCount--;
+    if (entry->pcm) sfSoundBuffer_destroy(entry->pcm);
+    if (entry->decoded) CloseHandle(entry->decoded);
+    free(entry);
+}
+
+// Drops an entry that must not be found again; one still referenced just leaves the index
+// and goes when it is released
+void pcmCacheForget(PcmCacheEntry* entry) {
+    if (entry->refCount == 0) pcmCacheDestroyEntry(entry);
+    else pcmCacheUnindex(entry);
+}
+
+// Drops least recently used, unreferenced entries until the cache fits its budget
+void pcmCacheEvict(void) {
+    PcmCacheEntry* entry = pcmCache.oldest;
+    size_t exempt = pcmCache.upcoming ? pcmCache.upcoming->bytes : 0;
+    while (entry && pcmCache.usedBytes - exempt > pcmCache.budgetBytes) {
+        PcmCacheEntry* newer = entry->newer;
+        if (entry->refCount == 0 && !entry->decoding && entry != pcmCache.upcoming) {
+            pcmCacheDestroyEntry(entry);
+            InterlockedIncrement(&pcmCache.evictions);
+        }
+        entry = newer;
+    }
+}
+
+PcmCacheEntry* pcmCacheInsertPending(const char* path) {
+    PcmCacheEntry* entry = (PcmCacheEntry*)calloc(1, sizeof(PcmCacheEntry));
+    if (!entry) {
+        fprintf(stderr, "Memory allocation failed for PcmCacheEntry.\n");
+        return NULL;
+    }
+    entry->decoded = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!entry->decoded) {
+        free(entry);
+        return NULL;
+    }
+    strncpy(entry->path, path, sizeof(entry->path) - 1);
+    entry->decoding = true;
+    entry->hash = hashKey(entry->path);
+    entry->nextInBucket = pcmCache.buckets[entry->hash % PCM_CACHE_BUCKETS];
+    pcmCache.buckets[entry->hash % PCM_CACHE_BUCKETS] = entry;
+    entry->indexed = true;
+    pcmCachePushNewest(entry);
+    pcmCache.entryCount++;
+    return entry;
+}
+
+// Decodes into a pending entry with the lock released; removes the entry again on failure
+bool pcmCacheFill(PcmCacheEntry* entry) {
+    pcmCacheDequeue(entry);
+    entry->claimed = true;
+    sfMutex_unlock(pcmCache.lock);
+    sfSoundBuffer* pcm = decodeTrack(entry->path);
+    sfMutex_lock(pcmCache.lock);
+    entry->decoding = false;
+    entry->claimed = false;
+    if (pcm) {
+        entry->pcm = pcm;
+        entry->bytes = (size_t)sfSoundBuffer_getSampleCount(pcm) * sizeof(sfInt16);
+        pcmCache.usedBytes += entry->bytes;
+    }
+    SetEvent(entry->decoded); // After 'pcm' is set: pcmCacheReady() does not take the lock
+    if (!pcm && entry->refCount == 0) pcmCacheDestroyEntry(entry);
+    return pcm != NULL;
+}
+
+void pcmCacheWorker(void* userData) {
+    (void)userData;
+    for (;;) {
+        WaitForSingleObject(pcmCache.wake, INFINITE);
+        sfMutex_lock(pcmCache.lock);
+        while (!pcmCache.stop && pcmCache.requests) {
+            PcmCacheEntry* entry = pcmCache.requests;
+            bool wanted = entry->refCount > 0; // Otherwise a look-ahead
+            if (pcmCacheFill(entry)) {
+                if (!wanted) {
+                    InterlockedIncrement(&pcmCache.prefetched);
+                    if (entry->refCount == 0) pcmCache.upcoming = entry;
+                }
+                pcmCacheEvict();
+            }
+        }
+        bool stop = pcmCache.stop;
+        sfMutex_unlock(pcmCache.lock);
+        if (stop) break;
+    }
+}
+
+void pcmCacheStart(size_t budgetBytes) {
+    pcmCache.budgetBytes = budgetBytes;
+    pcmCache.lock = sfMutex_create();
+    pcmCache.wake = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (!pcmCache.lock || !pcmCache.wake) return;
+    pcmCache.worker = sfThread_create(pcmCacheWorker, NULL);
+    if (pcmCache.worker) sfThread_launch(pcmCache.worker);
+}
+
+void pcmCacheStop(void) {
+    if (pcmCache.worker) {
+        sfMutex_lock(pcmCache.lock);
+        pcmCache.stop = true;
+        sfMutex_unlock(pcmCache.lock);
+        SetEvent(pcmCache.wake);
+        sfThread_wait(pcmCache.worker);
+        sfThread_destroy(pcmCache.worker);
+        pcmCache.worker = NULL;
+    }
+    while (pcmCache.oldest) pcmCacheDestroyEntry(pcmCache.oldest);
+    if (pcmCache.lock) { sfMutex_destroy(pcmCache.lock); pcmCache.lock = NULL; }
+    if (pcmCache.wake) { CloseHandle(pcmCache.wake); pcmCache.wake = NULL; }
+}
+
+// Returns a referenced entry holding the decoded track, decoding it now on a miss.
+// Release it with pcmCacheRelease(). Returns NULL if the track cannot be decoded.
+PcmCacheEntry* pcmCacheAcquire(const char* path) {
+    sfMutex_lock(pcmCache.lock);
+    PcmCacheEntry* entry = pcmCacheFind(path);
+    if (entry && entry->decoding && !entry->claimed) { // Still queued: decode it here instead
+        entry->refCount++;
+        pcmCacheFill(entry);
+        entry->refCount--;
+    }
+    if (entry) {
+        // The prefetch thread may still be working on it; waiting is cheaper than decoding twice
+        if (entry->decoding) {
+            entry->refCount++; // Keeps the entry alive while unlocked
+            sfMutex_unlock(pcmCache.lock);
+            WaitForSingleObject(entry->decoded, INFINITE);
+            sfMutex_lock(pcmCache.lock);
+            entry->refCount--;
+        }
+        if (!entry->pcm) { // Prefetch decode failed
+            pcmCacheForget(entry);
+            entry = NULL;
+        }
+    }
+    if (entry) {
+        InterlockedIncrement(&pcmCache.hits);
+    } else {
+        InterlockedIncrement(&pcmCache.misses);
+        entry = pcmCacheInsertPending(path);
+        if (entry) {
+            entry->refCount++;
+            bool decoded = pcmCacheFill(entry);
+            entry->refCount--;
+            if (!decoded) {
+                pcmCacheForget(entry);
+                entry = NULL;
+            }
+        }
+    }
+    if (entry) {
+        entry->refCount++;
+        if (pcmCache.upcoming == entry) pcmCache.upcoming = NULL; // Counts against the budget again
+        pcmCacheUnlink(entry);
+        pcmCachePushNewest(entry);
+        pcmCacheEvict();
+    }
+    sfMutex_unlock(pcmCache.lock);
+    return entry;
+}
+
+void pcmCacheRelease(PcmCacheEntry* entry) {
+    if (!entry) return;
+    sfMutex_lock(pcmCache.lock);
+    entry->refCount--;
+    if (entry->refCount == 0 && !entry->decoding && !entry->pcm) pcmCacheDestroyEntry(entry); // Failed decode
+    else pcmCacheEvict();
+    sfMutex_unlock(pcmCache.lock);
+}
+
+// Returns a referenced entry for 'path' without waiting: the worker decodes it if it is not
+// cached yet. Poll pcmCacheReady() and release it with pcmCacheRelease().
+PcmCacheEntry* pcmCacheRequest(const char* path) {
+    sfMutex_lock(pcmCache.lock);
+    PcmCacheEntry* entry = pcmCacheFind(path);
+    if (entry && !entry->decoding && !entry->pcm) { // Earlier decode failed; try again
+        pcmCacheForget(entry);
+        entry = NULL;
+    }
+    if (entry) {
+        InterlockedIncrement(&pcmCache.hits);
+        if (entry->queued) { // A look-ahead that is now wanted
+            pcmCacheDequeue(entry);
+            pcmCacheEnqueue(entry, true);
+        }
+        pcmCacheUnlink(entry);
+        pcmCachePushNewest(entry);
+    } else {
+        InterlockedIncrement(&pcmCache.misses);
+        entry = pcmCacheInsertPending(path);
+        if (entry) pcmCacheEnqueue(entry, true);
+    }
+    if (entry) {
+        entry->refCount++;
+        if (pcmCache.upcoming == entry) pcmCache.upcoming = NULL;
+    }
+    sfMutex_unlock(pcmCache.lock);
+    return entry;
+}
+
+// True once a requested entry has been decoded (or failed to; its 'pcm' is NULL then)
+bool pcmCacheReady(PcmCacheEntry* entry) {
+    return WaitForSingleObject(entry->decoded, 0) == WAIT_OBJECT_0;
+}
+
+// Drops the cached decode of 'path' (e.g. the file changed on disk). A player still using
+// it keeps its reference; the entry just stops being found.
+void pcmCacheInvalidate(const char* path) {
+    if (!pcmCache.lock) return;
+    sfMutex_lock(pcmCache.lock);
+    PcmCacheEntry* entry = pcmCacheFind(path);
+    if (entry && !entry->decoding) pcmCacheForget(entry);
+    sfMutex_unlock(pcmCache.lock);
+}
+
+// Queues a background decode of 'path' so a later pcmCacheAcquire() hits
+void pcmCachePrefetch(const char* path) {
+    if (!pcmCache.worker) return;
+    sfMutex_lock(pcmCache.lock);
+    if (!pcmCacheFind(path)) {
+        if (pcmCache.requestCount >= PCM_PREFETCH_QUEUE) { // Drop the stalest look-ahead
+            PcmCacheEntry* stalest = NULL;
+            for (PcmCacheEntry* queued = pcmCache.requests; queued; queued = queued->nextRequest) {
+                if (queued->refCount == 0) stalest = queued;
+            }
+            if (stalest) pcmCacheDestroyEntry(stalest);
+        }
+        PcmCacheEntry* entry = pcmCache.requestCount < PCM_PREFETCH_QUEUE ? pcmCacheInsertPending(path) : NULL;
+        if (entry) pcmCacheEnqueue(entry, false);
+    }
+    sfMutex_unlock(pcmCache.lock);
+}
+
+// Gets the track after 'song' ready: fully decoded when the cache is on, otherwise just
+// its first read-ahead window in the OS cache
+void prefetchUpcomingTrack(const Song* song) {
+    if (!song) return;
+    if (pcmCache.budgetBytes > 0) pcmCachePrefetch(song->path);
+    else hintUpcomingTrack(song);
+}
+
+// -------------------------- Playback Clock --------------------------
+// Where playback is, in output frames. The audio callback counts the frames it hands to the
+// device; the device's own position (sfSoundStream_getPlayingOffset) trails that count by
+// what is buffered and only moves in mixer-period steps. The UI reads the device once a frame
+// and runs a smoothed clock on perfMicros() at the output rate times a drift ratio. Each
+// reading nudges the clock's phase and ratio (a small phase-locked loop), so the position is
+// steady between readings and does not wander off the device clock over a long track. Large
+// errors (seek, pause, an audio stall) snap it back. Track changes and ends are recorded by
+// the callback as the output frame they fall on, so the UI can act on them when they are
+// heard instead of whenever a poll notices that the stream stopped.
+#define CLOCK_PHASE_GAIN 0.1 // Share of a reading's error taken into the position
+#define CLOCK_DRIFT_GAIN 0.005 // Ratio change per second of error
+#define CLOCK_MAX_DRIFT 0.002 // The ratio stays within 2000 ppm of nominal
+#define CLOCK_RESYNC_MICROS 100000 // Errors beyond this snap the clock to the device
+
+typedef struct PlaybackClock {
+    // Written by the audio callback (or playerSeek); read by the UI without a lock
+    volatile LONG64 framesHanded; // Output frames given to the device since the stream started
+    volatile LONG64 trackStart; // Output frame the current track starts at
+    volatile LONG64 trackFrames; // Its length in output frames
+    volatile LONG64 previousStart; // The track before it, still heard until 'trackStart'
+    volatile LONG64 previousFrames;
+    volatile LONG64 trackEnd; // Frame after the last one of the track, -1 while it goes on
+    // UI thread
+    unsigned int rate; // Output frames per second
+    bool locked; // Following a playing stream
+    double device; // Last device reading, in frames
+    double anchorFrame; // Smoothed position at 'anchorMicros'
+    long long anchorMicros;
+    double ratio; // Device frames per nominal frame
+    double position; // Smoothed position; does not move backwards while locked
+    // Statistics since startup (UI thread)
+    long readings;
+    long resyncs;
+    double jitterSquares; // Device reading minus smoothed clock, in microseconds
+    double jitterWorst;
+    double latencySum; // Handed to the device but not played yet, in microseconds
+    double latencyWorst;
+    long boundaries; // Track changes and ends acted on
+    double boundaryLateWorst; // How long after a boundary was heard it was acted on, in microseconds
+} PlaybackClock;
+
+// Audio side reset, for a new stream; the statistics are kept
+void clockReset(PlaybackClock* c, unsigned int rate, sfUint64 trackFrames) {
+    InterlockedExchange64(&c->framesHanded, 0);
+    InterlockedExchange64(&c->trackStart, 0);
+    InterlockedExchange64(&c->trackFrames, (LONG64)trackFrames);
+    InterlockedExchange64(&c->previousStart, 0);
+    InterlockedExchange64(&c->previousFrames, 0);
+    InterlockedExchange64(&c->trackEnd, -1);
+    c->rate = rate;
+    c->locked = false;
+    c->device = c->position = 0.0;
+    if (c->ratio == 0.0) c->ratio = 1.0; // The device's drift outlives the stream
+}
+
+// Audio thread: the next track starts after the frames handed so far
+void clockStartTrack(PlaybackClock* c, sfUint64 trackFrames) {
+    InterlockedExchange64(&c->previousStart, c->trackStart);
+    InterlockedExchange64(&c->previousFrames, c->trackFrames);
+    InterlockedExchange64(&c->trackFrames, (LONG64)trackFrames);
+    InterlockedExchange64(&c->trackStart, c->framesHanded);
+    InterlockedExchange64(&c->trackEnd, -1);
+}
+
+// Audio thread: the track ran out and nothing follows it on this stream
+void clockEndTrack(PlaybackClock* c) {
+    InterlockedCompareExchange64(&c->trackEnd, c->framesHanded, -1);
+}
+
+// UI thread: takes a device reading (in frames). Without a playing stream the reading is
+// used as it is.
+void clockUpdate(PlaybackClock* c, bool playing, double device, long long now) {
+    c->device = device;
+    if (!playing || c->rate == 0) {
+        c->locked = false;
+        c->position = device;
+        return;
+    }
+    double predicted = c->anchorFrame + (now - c->anchorMicros) * c->ratio * c->rate / 1000000.0;
+    double error = (device - predicted) * 1000000.0 / c->rate;
+    if (!c->locked || fabs(error) > CLOCK_RESYNC_MICROS) {
+        if (c->locked) c->resyncs++;
+        c->locked = true;
+        c->anchorFrame = c->position = device;
+        c->anchorMicros = now;
+        return;
+    }
+    double latency = ((double)c->framesHanded - device) * 1000000.0 / c->rate;
+    c->readings++;
+    c->jitterSquares += error * error;
+    if (fabs(error) > c->jitterWorst) c->jitterWorst = fabs(error);
+    c->latencySum += latency;
+    if (latency > c->latencyWorst) c->latencyWorst = latency;
+
+    c->anchorFrame = predicted + error * CLOCK_PHASE_GAIN * c->rate / 1000000.0;
+    c->anchorMicros = now;
+    c->ratio += error / 1000000.0 * CLOCK_DRIFT_GAIN;
+    if (c->ratio > 1.0 + CLOCK_MAX_DRIFT) c->ratio = 1.0 + CLOCK_MAX_DRIFT;
+    if (c->ratio < 1.0 - CLOCK_MAX_DRIFT) c->ratio = 1.0 - CLOCK_MAX_DRIFT;
+    // Never ahead of what was handed out, never backwards
+    double position = c->anchorFrame < (double)c->framesHanded ? c->anchorFrame : (double)c->framesHanded;
+    if (position > c->position) c->position = position;
+}
+
+// UI thread: a boundary at 'frame' is being acted on now
+void clockBoundary(PlaybackClock* c, double frame) {
+    c->boundaries++;
+    double late = c->rate && c->device > frame ? (c->device - frame) * 1000000.0 / c->rate : 0.0;
+    if (late > c->boundaryLateWorst) c->boundaryLateWorst = late;
+}
+
+int formatClockStats(const PlaybackClock* c, char* buffer, size_t size) {
+    double readings = c->readings ? (double)c->readings : 1.0;
+    int written = snprintf(buffer, size,
+                           "Clock         latency avg %.1f ms (max %.1f)  jitter rms %.2f ms (max %.2f)  drift %+.0f ppm  resyncs %ld  track changes %ld (acted on %.1f ms late at most)\n",
+                           c->latencySum / readings / 1000.0, c->latencyWorst / 1000.0, sqrt(c->jitterSquares / readings) / 1000.0,
+                           c->jitterWorst / 1000.0, (c->ratio - 1.0) * 1e6, c->resyncs, c->boundaries, c->boundaryLateWorst / 1000.0);
+    return (written < 0) ? 0 : ((size_t)written >= size ? (int)size - 1 : written);
+}
+
+// -------------------------- Playback Engine --------------------------
+// Tracks are decoded to PCM through their TrackSource and played by a custom sfSoundStream
+// whose callback resamples to the output rate and runs the DSP chain over fixed-size blocks.
+// A decoded track can be armed behind the current one; the callback then continues into it
+// without a gap (and without waiting for the UI) when the current one runs out.
+// A decoded track is held in memory whole (about 10 MB a minute of 44.1 kHz stereo), and
+// CSFML has no decoder that hands out a part of a file. So without a decoded-track cache
+// (--pcm-cache-mb=0, which --low-memory implies) the main player streams a track through
+// sfMusic from its TrackSource instead, as long as the EQ leaves it unchanged. That track
+// plays at its own rate and is not followed gaplessly. If the EQ is switched on, the track
+// is decoded in the background and carries on from the same position through the DSP chain.
+
+// Decoded track waiting to be continued with
+typedef struct PlayerTrack {
+    PcmCacheEntry* entry;
+    const sfInt16* samples;
+    sfUint64 sampleCount;
+    unsigned int channels;
+    unsigned int sampleRate;
+    unsigned int outputRate;
+    const ResampleTable* table;
+} PlayerTrack;
+
+typedef struct Player {
+    sfSoundStream* stream;
+    PcmCacheEntry* track; // Decoded track (referenced while loaded)
+    PcmCacheEntry* pending; // Requested from the cache worker, started by playerPoll() once decoded
+    PcmCacheEntry* arming; // Requested for the armed slot, armed by playerPollArm() once decoded
+    sfMusic* music; // Streamed track (see playerStreams()); 'stream' and 'track' are NULL then
+    TrackSource* source; // Read by 'music', closed after it
+    char musicPath[MAX_PATH_LENGTH];
+    bool musicStarted; // Playing, not reported by playerPoll() yet
+    bool decodeRequested; // 'pending' takes over from 'music' at its position (once per track)
+    const sfInt16* samples;
+    sfUint64 sampleCount; // Interleaved samples in 'samples'
+    unsigned int channels;
+    unsigned int sampleRate; // Rate of the decoded track
+    unsigned int outputRate; // Rate the stream and the DSP chain run at
+    sfUint64 cursor; // Next interleaved sample to hand out (without resampling)
+    Resampler resampler;
+    DspChain dsp;
+    sfInt16 resampleBlock[DSP_BLOCK_FRAMES * 2]; // Resampler output, DSP input
+    sfInt16 outBlock[DSP_BLOCK_FRAMES * 2]; // Chunk handed to SFML (copied by it before the next callback)
+    PlaybackClock clock;
+    // Handed between the arming thread and the audio callback. 'armedReady' is 0 while the
+    // slot is empty, 1 while it holds a track and 2 while the callback is taking it.
+    PlayerTrack armed;
+    volatile LONG armedReady;
+    PcmCacheEntry* volatile retired; // Finished track, released off the audio thread
+    volatile LONG switches; // Armed tracks continued with
+} Player;
+
+Player player; // The main window's player
+
+sfBool playerGetData(sfSoundStreamChunk* chunk, void* userData) {
+    Player* p = (Player*)userData;
+    size_t frames;
+    if (p->resampler.table) {
+        frames = resampleFrames(&p->resampler, p->samples, p->sampleCount / p->channels, p->channels,
+                                p->resampleBlock, DSP_BLOCK_FRAMES);
+        if (frames == 0) {
+            clockEndTrack(&p->clock);
+            return sfFalse;
+        }
+        dspProcess(&p->dsp, p->resampleBlock, p->outBlock, frames, p->channels);
+    } else {
+        sfUint64 remaining = (p->sampleCount - p->cursor) / p->channels;
+        if (remaining == 0) {
+            clockEndTrack(&p->clock);
+            return sfFalse;
+        }
+        frames = remaining < DSP_BLOCK_FRAMES ? (size_t)remaining : DSP_BLOCK_FRAMES;
+        dspProcess(&p->dsp, p->samples + p->cursor, p->outBlock, frames, p->channels);
+        p->cursor += (sfUint64)frames * p->channels;
+    }
+    chunk->samples = p->outBlock;
+    chunk->sampleCount = (unsigned int)(frames * p->channels);
+    InterlockedExchangeAdd64(&p->clock.framesHanded, (LONG64)frames);
+    return sfTrue;
+}
+
+// Audio thread (or the zone scheduler for file sinks): continue with the armed track. Without
+// a loaded track any format is taken; otherwise it needs the same channel count and output rate.
+bool playerSwapTrack(Player* p) {
+    // Claimed first, so playerDisarm() cannot release the track while it is being copied
+    if (InterlockedCompareExchange(&p->armedReady, 2, 1) != 1) return false;
+    const PlayerTrack* next = &p->armed;
+    if (p->track && (next->channels != p->channels || next->outputRate != p->outputRate)) {
+        InterlockedExchange(&p->armedReady, 1);
+        return false;
+    }
+    p->retired = p->track;
+    p->track = next->entry;
+    p->samples = next->samples;
+    p->sampleCount = next->sampleCount;
+    p->channels = next->channels;
+    p->sampleRate = next->sampleRate;
+    p->outputRate = next->outputRate;
+    p->cursor = 0;
+    p->resampler.table = next->table;
+    p->resampler.frame = 0;
+    p->resampler.frac = 0;
+    dspPrepare(&p->dsp, p->outputRate);
+    p->clock.rate = p->outputRate;
+    clockStartTrack(&p->clock, resampledFrameCount(next->table, next->sampleCount / next->channels));
+    InterlockedExchange(&p->armedReady, 0);
+    InterlockedIncrement(&p->switches);
+    return true;
+}
+
+// Main player stream
+sfBool playerStreamData(sfSoundStreamChunk* chunk, void* userData) {
+    Player* p = (Player*)userData;
+    if (playerGetData(chunk, p)) return sfTrue;
+    return playerSwapTrack(p) && playerGetData(chunk, p);
+}
+
+void playerSeek(sfTime offset, void* userData) {
+    Player* p = (Player*)userData;
+    sfUint64 frame = offset.microseconds <= 0 ? 0 : (sfUint64)offset.microseconds * p->sampleRate / 1000000;
+    sfUint64 cursor = frame * p->channels;
+    p->cursor = cursor < p->sampleCount ? cursor : p->sampleCount;
+    p->resampler.frame = p->cursor / p->channels;
+    p->resampler.frac = 0;
+    dspReset(&p->dsp);
+    // The stream's position is now 'offset' into this track
+    PlaybackClock* c = &p->clock;
+    LONG64 position = offset.microseconds <= 0 ? 0 : (LONG64)((sfUint64)offset.microseconds * p->outputRate / 1000000);
+    InterlockedExchange64(&c->framesHanded, position);
+    InterlockedExchange64(&c->previousFrames, 0);
+    InterlockedExchange64(&c->trackStart, 0);
+    InterlockedExchange64(&c->trackEnd, -1);
+}
+
+void playerInit(Player* p) {
+    memset(p, 0, sizeof(*p));
+    dspInit(&p->dsp);
+    clockReset(&p->clock, 0, 0);
+}
+
+void playerReleaseRetired(Player* p) {
+    PcmCacheEntry* retired = (PcmCacheEntry*)InterlockedExchangePointer((void* volatile*)&p->retired, NULL);
+    pcmCacheRelease(retired);
+}
+
+// Puts a decoded entry into the empty armed slot (taking over its reference); false if it
+// cannot be played
+bool playerArmEntry(Player* p, PcmCacheEntry* entry) {
+    PlayerTrack* track = &p->armed;
+    track->samples = NULL;
+    if (entry && entry->pcm) {
+        track->entry = entry;
+        track->samples = sfSoundBuffer_getSamples(entry->pcm);
+        track->sampleCount = sfSoundBuffer_getSampleCount(entry->pcm);
+        track->channels = sfSoundBuffer_getChannelCount(entry->pcm);
+        track->sampleRate = sfSoundBuffer_getSampleRate(entry->pcm);
+        track->outputRate = outputSampleRate ? outputSampleRate : track->sampleRate;
+        track->table = track->outputRate != track->sampleRate ? getResampleTable(track->sampleRate, track->outputRate, resampleQuality) : NULL;
+        if (!track->table) track->outputRate = track->sampleRate;
+    }
+    if (!entry || !track->samples || track->channels == 0 || track->channels > 2) {
+        pcmCacheRelease(entry);
+        return false;
+    }
+    InterlockedExchange(&p->armedReady, 1);
+    return true;
+}
+
+// Decodes 'path' on the calling thread into the armed slot (zone scheduler)
+bool playerArm(Player* p, const char* path) {
+    return playerArmEntry(p, pcmCacheAcquire(path));
+}
+
+// UI thread: has the cache worker decode 'path' for the armed slot; playerPollArm() arms it
+bool playerRequestArm(Player* p, const char* path) {
+    pcmCacheRelease(p->arming);
+    p->arming = pcmCacheRequest(path);
+    return p->arming != NULL;
+}
+
+// UI thread, every frame: returns 1 once the requested track is armed, -1 if it cannot be
+// played and 0 while it is still being decoded (or nothing was requested)
+int playerPollArm(Player* p) {
+    if (!p->arming || !pcmCacheReady(p->arming)) return 0;
+    PcmCacheEntry* entry = p->arming;
+    p->arming = NULL;
+    return playerArmEntry(p, entry) ? 1 : -1;
+}
+
+void playerCancelArm(Player* p) {
+    pcmCacheRelease(p->arming);
+    p->arming = NULL;
+}
+
+// Takes the armed track back; false if the callback already continued with it (or none was armed)
+bool playerDisarm(Player* p) {
+    for (;;) {
+        LONG state = InterlockedCompareExchange(&p->armedReady, 0, 1);
+        if (state == 1) break;
+        if (state == 0) return false;
+        Sleep(0); // The callback is taking it, or putting it back after a format mismatch
+    }
+    pcmCacheRelease(p->armed.entry);
+    return true;
+}
+
+// Stops playback and releases the stream and the decoded track
+void playerStopMusic(Player* p) {
+    if (p->music) {
+        sfMusic_stop(p->music);
+        sfMusic_destroy(p->music);
+        p->music = NULL;
+    }
+    closeTrackSource(p->source); // Only after the music reading from it is gone
+    p->source = NULL;
+    p->musicStarted = false;
+}
+
+void playerUnload(Player* p) {
+    if (p->stream) {
+        sfSoundStream_stop(p->stream);
+        sfSoundStream_destroy(p->stream);
+        p->stream = NULL;
+    }
+    playerStopMusic(p);
+    p->decodeRequested = false;
+    playerReleaseRetired(p);
+    pcmCacheRelease(p->pending);
+    p->pending = NULL;
+    playerCancelArm(p);
+    pcmCacheRelease(p->track);
+    p->track = NULL;
+    p->samples = NULL;
+    p->sampleCount = 0;
+    p->cursor = 0;
+}
+
+// Prepares the DSP chain for a decoded entry (taking over its reference) without creating an
+// output stream
+bool playerLoadEntry(Player* p, PcmCacheEntry* entry) {
+    p->track = entry;
+    if (!p->track) return false;
+    p->samples = sfSoundBuffer_getSamples(p->track->pcm);
+    p->sampleCount = sfSoundBuffer_getSampleCount(p->track->pcm);
+    p->channels = sfSoundBuffer_getChannelCount(p->track->pcm);
+    p->sampleRate = sfSoundBuffer_getSampleRate(p->track->pcm);
+    if (!p->samples || p->channels == 0 || p->channels > 2) {
+        playerUnload(p);
+        return false;
+    }
+    p->cursor = 0;
+    p->outputRate = outputSampleRate ? outputSampleRate : p->sampleRate;
+    p->resampler.table = p->outputRate != p->sampleRate ? getResampleTable(p->sampleRate, p->outputRate, resampleQuality) : NULL;
+    if (!p->resampler.table) p->outputRate = p->sampleRate;
+    p->resampler.frame = 0;
+    p->resampler.frac = 0;
+    dspPrepare(&p->dsp, p->outputRate);
+    clockReset(&p->clock, p->outputRate, resampledFrameCount(p->resampler.table, p->sampleCount / p->channels));
+    return true;
+}
+
+// Decodes 'path' on the calling thread and loads it
+bool playerLoad(Player* p, const char* path) {
+    playerUnload(p);
+    return playerLoadEntry(p, pcmCacheAcquire(path));
+}
+
+// Whether the next track is streamed instead of decoded whole: only without a decoded-track
+// cache, and only while the DSP chain would not change the samples
+bool playerStreams(const Player* p) {
+    return pcmCache.budgetBytes == 0 && dspParamsFlat(&p->dsp.params);
+}
+
+// Opens 'path' as streamed music and starts it
+bool playerStartMusic(Player* p, const char* path) {
+    p->source = openTrackSource(path, trackSourceKind);
+    if (p->source) p->source->playback = true;
+    p->music = createMusicFromSource(p->source, path);
+    if (!p->music) {
+        playerStopMusic(p);
+        return false;
+    }
+    snprintf(p->musicPath, sizeof(p->musicPath), "%s", path);
+    p->channels = sfMusic_getChannelCount(p->music);
+    p->sampleRate = p->outputRate = sfMusic_getSampleRate(p->music);
+    p->resampler.table = NULL;
+    sfInt64 duration = sfTime_asMicroseconds(sfMusic_getDuration(p->music));
+    clockReset(&p->clock, p->outputRate, duration > 0 ? (sfUint64)duration * p->outputRate / 1000000 : 0);
+    sfMusic_play(p->music);
+    p->musicStarted = true;
+    return true;
+}
+
+// Stops what is playing and starts 'path': streamed right away if playerStreams(), otherwise
+// once the cache worker has decoded it. playerPoll() reports the start either way.
+bool playerRequest(Player* p, const char* path) {
+    playerUnload(p);
+    if (playerStreams(p)) return playerStartMusic(p, path);
+    p->pending = pcmCacheRequest(path);
+    return p->pending != NULL;
+}
+
+// UI thread, every frame: a streamed track needs decoding once the EQ is switched on. The
+// cache worker decodes it and playerPoll() moves playback over at the same position.
+void playerRequestDecode(Player* p) {
+    if (!p->music || p->decodeRequested || playerStreams(p)) return;
+    p->decodeRequested = true;
+    p->pending = pcmCacheRequest(p->musicPath);
+}
+
+// Loads a decoded entry (taking over its reference) and starts the custom stream on it
+bool playerStartDecoded(Player* p, PcmCacheEntry* entry) {
+    if (!entry->pcm) {
+        pcmCacheRelease(entry);
+        return false;
+    }
+    if (!playerLoadEntry(p, entry)) return false;
+    p->stream = sfSoundStream_create(playerStreamData, playerSeek, p->channels, p->outputRate, p);
+    if (!p->stream) {
+        playerUnload(p);
+        return false;
+    }
+    sfSoundStream_play(p->stream);
+    return true;
+}
+
+// UI thread, every frame: starts the requested track once it is decoded (or reports the
+// streamed one started). Returns 1 when it started, -1 if it could not be decoded or played
+// and 0 while there is nothing to start yet.
+int playerPoll(Player* p) {
+    if (p->musicStarted) {
+        p->musicStarted = false;
+        return 1;
+    }
+    if (!p->pending || !pcmCacheReady(p->pending)) return 0;
+    PcmCacheEntry* entry = p->pending;
+    p->pending = NULL;
+    if (!p->music) return playerStartDecoded(p, entry) ? 1 : -1;
+
+    // Taking over from the streamed track: same position, same paused or playing state. If
+    // the decode failed, or the track ended meanwhile, the streamed one is simply kept.
+    sfSoundStatus status = sfMusic_getStatus(p->music);
+    sfTime offset = sfMusic_getPlayingOffset(p->music);
+    if (!entry->pcm || status == sfStopped) {
+        pcmCacheRelease(entry);
+        return 0;
+    }
+    playerStopMusic(p);
+    if (!playerStartDecoded(p, entry)) return -1;
+    sfSoundStream_setPlayingOffset(p->stream, offset);
+    if (status == sfPaused) sfSoundStream_pause(p->stream);
+    return 0;
+}
+
+// True while a track is loaded, playing or paused, on either path
+bool playerHasTrack(const Player* p) {
+    return p->stream || p->music;
+}
+
+sfSoundStatus playerGetStatus(const Player* p) {
+    if (p->music) return sfMusic_getStatus(p->music);
+    return p->stream ? sfSoundStream_getStatus(p->stream) : sfStopped;
+}
+
+void playerPause(Player* p) {
+    if (p->music) sfMusic_pause(p->music);
+    if (p->stream) sfSoundStream_pause(p->stream);
+}
+
+void playerResume(Player* p) {
+    if (p->music) sfMusic_play(p->music);
+    if (p->stream) sfSoundStream_play(p->stream);
+}
+
+// Plays the loaded track again from the start (stopping rewinds through playerSeek)
+void playerRestart(Player* p) {
+    if (p->music) {
+        sfMusic_stop(p->music);
+        sfMusic_play(p->music);
+    }
+    if (!p->stream) return;
+    sfSoundStream_stop(p->stream);
+    sfSoundStream_play(p->stream);
+}
+
+// UI thread, once a frame: reads the device position into the player's clock. Outputs without
+// a device (file and null zones) are heard as soon as they are written. Streamed music hands
+// out no frame counts to steer by, so its position is taken as the device reports it.
+void playerClockUpdate(Player* p) {
+    PlaybackClock* c = &p->clock;
+    if (p->music) {
+        double device = (double)sfTime_asMicroseconds(sfMusic_getPlayingOffset(p->music)) * c->rate / 1000000.0;
+        clockUpdate(c, false, device, perfMicros());
+        return;
+    }
+    if (!p->stream) {
+        clockUpdate(c, false, (double)c->framesHanded, perfMicros());
+        return;
+    }
+    sfSoundStatus status = sfSoundStream_getStatus(p->stream);
+    double device = (double)sfTime_asMicroseconds(sfSoundStream_getPlayingOffset(p->stream)) * c->rate / 1000000.0;
+    if (status == sfStopped && c->trackEnd >= 0) device = (double)c->trackEnd; // Played out
+    clockUpdate(c, status == sfPlaying, device, perfMicros());
+}
+
+// UI thread: true once the track has been played to its last frame and nothing was armed to
+// follow it (or the stream stopped for another reason)
+bool playerTrackEnded(Player* p) {
+    if (!playerHasTrack(p)) return false;
+    LONG64 end = p->clock.trackEnd;
+    bool ended = (end >= 0 && p->clock.device >= (double)end) || playerGetStatus(p) == sfStopped;
+    if (ended) clockBoundary(&p->clock, end >= 0 ? (double)end : p->clock.device);
+    return ended;
+}
+
+// UI thread: true once a track the callback continued with can be heard. 'seen' is the
+// caller's copy of the switch count.
+bool playerSwitchHeard(Player* p, LONG* seen) {
+    LONG switches = p->switches;
+    if (switches == *seen) return false;
+    double start = (double)p->clock.trackStart;
+    if (p->stream && p->clock.device < start && playerGetStatus(p) != sfStopped) return false;
+    *seen = switches;
+    clockBoundary(&p->clock, start);
+    return true;
+}
+
+// Microseconds of audio left until the current track has been heard to its end (read without
+// a lock; a track change in between only makes it briefly wrong)
+long long playerRemainingMicros(const Player* p) {
+    const PlaybackClock* c = &p->clock;
+    if (!p->track || c->rate == 0) return 0;
+    double end = (double)(c->trackStart + c->trackFrames);
+    return end > c->device ? (long long)((end - c->device) * 1000000.0 / c->rate) : 0;
+}
+
+// Position in the track being heard and its length, in microseconds, from the smoothed clock
+void playerTrackPosition(const Player* p, long long* position, long long* length) {
+    const PlaybackClock* c = &p->clock;
+    *position = *length = 0;
+    if ((!p->track && !p->music) || c->rate == 0) return;
+    double start = (double)c->trackStart, frames = (double)c->trackFrames;
+    if (c->position < start) { // The callback moved on, but the previous track is still playing
+        start = (double)c->previousStart;
+        frames = (double)c->previousFrames;
+    }
+    double offset = c->position - start;
+    if (offset < 0) offset = 0;
+    if (offset > frames) offset = frames;
+    *position = (long long)(offset * 1000000.0 / c->rate);
+    *length = (long long)(frames * 1000000.0 / c->rate);
+}
+
+// Percentage of real time spent inside the DSP chain since the last call
+double dspLoadPercent(DspChain* dsp) {
+    static LONG64 lastFrames = 0, lastMicros = 0;
+    LONG64 frames = dsp->processedFrames, micros = dsp->processMicros;
+    double audioMicros = dsp->sampleRate ? (frames - lastFrames) * 1000000.0 / dsp->sampleRate : 0.0;
+    double load = audioMicros > 0.0 ? 100.0 * (micros - lastMicros) / audioMicros : 0.0;
+    lastFrames = frames;
+    lastMicros = micros;
+    return load;
+}
+
+// -------------------------- Equalizer Overlay --------------------------
+// F2 on the main screen shows the EQ; Left/Right pick a band (or the preamp), Up/Down change
+// its gain by 1 dB and E switches the whole chain on or off.
+bool eqOverlayVisible = false;
+int eqSelectedBand = 0; // EQ_BANDS selects the preamp
+sfText* eqOverlayText = NULL;
+
+void refreshEqOverlay(void) {
+    if (!eqOverlayText) return;
+    const DspParams* params = &player.dsp.params;
+    char text[1024];
+    int len = snprintf(text, sizeof(text), "[F2] Equalizer %s   (E toggles)\n", params->enabled ? "ON" : "OFF");
+    len += snprintf(text + len, sizeof(text) - len, "%s Preamp %+5.1f dB\n", eqSelectedBand == EQ_BANDS ? ">" : " ", params->preampDb);
+    for (int i = 0; i < EQ_BANDS; i++) {
+        const EqBand* band = &params->bands[i];
+        len += snprintf(text + len, sizeof(text) - len, "%s %5.0f Hz %+5.1f dB\n",
+                        eqSelectedBand == i ? ">" : " ", band->frequency, band->gainDb);
+    }
+    sfText_setString(eqOverlayText, text);
+}
+
+// Returns true if the key was used by the overlay
+bool handleEqKey(sfKeyCode key) {
+    if (!eqOverlayVisible) return false;
+    DspParams* params = &player.dsp.params;
+    float* gain = eqSelectedBand == EQ_BANDS ? &params->preampDb : &params->bands[eqSelectedBand].gainDb;
+    switch (key) {
+        case sfKeyLeft: eqSelectedBand = (eqSelectedBand + EQ_BANDS) % (EQ_BANDS + 1); break;
+        case sfKeyRight: eqSelectedBand = (eqSelectedBand + 1) % (EQ_BANDS + 1); break;
+        case sfKeyUp: if (*gain < EQ_MAX_GAIN_DB) *gain += 1.0f; break;
+        case sfKeyDown: if (*gain > -EQ_MAX_GAIN_DB) *gain -= 1.0f; break;
+        case sfKeyE: params->enabled = !params->enabled; break;
+        default: return false;
+    }
+    dspPublish(&player.dsp);
+    refreshEqOverlay();
+    return true;
+}
+
+// Parses "--eq=g1,g2,...,g10" (dB per band, missing bands stay flat)
+void parseEqGains(const char* list, DspParams* params) {
+    for (int i = 0; i < EQ_BANDS && *list; i++) {
+        char* end;
+        float gain = strtof(list, &end);
+        if (end == list) break;
+        if (gain > EQ_MAX_GAIN_DB) gain = EQ_MAX_GAIN_DB;
+        if (gain < -EQ_MAX_GAIN_DB) gain = -EQ_MAX_GAIN_DB;
+        params->bands[i].gainDb = gain;
+        list = (*end == ',') ? end + 1 : end;
+    }
+}
+
+// -------------------------- Display Recent --------------------------
+void refreshRecentDisplay(sfFont* font) {
+    StackNode* temp = recentStack;
+    for (int i = 0; i < 5; i++) {
+        if (recentText[i]) {
+            if (temp) {
+                sfText_setString(recentText[i], temp->song->name);
+                temp = temp->next;
+            } else {
+                sfText_setString(recentText[i], "");
+            }
+        }
+    }
+}
+
+// -------------------------- Music Control --------------------------
+#define PLAYER_ARM_AHEAD_MICROS 3000000 // The next song is armed this long before the current one ends
+
+Song* armedSong = NULL; // Song the main player continues with when 'current' runs out
+Song* armingSong = NULL; // Being decoded by the cache worker, armed once it is ready
+Song* armFailedSong = NULL; // Could not be armed; left to playNewSong, which reports the error
+LONG playerSwitchesSeen = 0;
+
+// Song that auto-advance will pick after 'current' (the same choice the main loop makes), or
+// NULL if it cannot be known yet
+Song* peekNextSong(void) {
+    if (currentPlaylist && currentPlaylist->front) return currentPlaylist->front->song;
+    if (!allSongsList || !current) return NULL;
+    if (autoDjEnabled) return autoDjAnchor == current && autoDjUpcomingCount > 0 ? autoDjUpcoming[0] : NULL;
+    return current->next ? current->next : allSongsList;
+}
+
+// UI thread, every frame: has the next song decoded once the current one is close to its
+// end, arms it when it is ready, and takes it back if the queue changed in the meantime. The
+// decode runs on the cache worker, so the UI never waits for it.
+void updateArmedSong(void) {
+    playerReleaseRetired(&player);
+    Song* upcoming = player.stream && !lowMemoryMode ? peekNextSong() : NULL; // An armed track is a second one decoded
+    if (armingSong && armingSong != upcoming) {
+        playerCancelArm(&player);
+        armingSong = NULL;
+    }
+    if (armedSong && armedSong != upcoming && playerDisarm(&player)) armedSong = NULL;
+    if (armingSong) {
+        int armed = playerPollArm(&player);
+        if (armed > 0) armedSong = armingSong;
+        else if (armed < 0) armFailedSong = armingSong;
+        if (armed != 0) armingSong = NULL;
+        return;
+    }
+    if (armedSong || !upcoming || upcoming == armFailedSong) return;
+    if (playerGetStatus(&player) == sfStopped || playerRemainingMicros(&player) > PLAYER_ARM_AHEAD_MICROS) return;
+    if (playerRequestArm(&player, upcoming->path)) armingSong = upcoming;
+    else armFailedSong = upcoming;
+}
+
+// Labels, recent list and play counts for 'current', which just started playing
+void songStarted(sfText* songLabel, sfFont* font, sfSprite* playSprite, sfTexture* pauseTex) {
+    armFailedSong = NULL;
+    if (songLabel) sfText_setString(songLabel, current->name);
+    if (playSprite && pauseTex) sfSprite_setTexture(playSprite, pauseTex, sfTrue); // Set to pause icon when playing
+    pushRecent(current);
+    current->lastPlayedTurn = ++playTurn;
+    current->playCount++;
+    libraryTableRefresh(&libraryTable, current, false);
+    if (font) refreshRecentDisplay(font);
+
+    // Get whatever will play after this track ready
+    if (currentPlaylist && currentPlaylist->front) {
+        prefetchUpcomingTrack(currentPlaylist->front->song);
+    } else if (!currentPlaylist && autoDjEnabled && autoDjAnchor == current && autoDjUpcomingCount > 0) {
+        prefetchUpcomingTrack(autoDjUpcoming[0]);
+    } else if (!currentPlaylist) {
+        prefetchUpcomingTrack(current->next ? current->next : allSongsList);
+    }
+}
+
+// Function to play a new song, uses global sprites/textures for consistency. The song is
+// decoded in the background and started by updateLoadingSong().
+void playNewSong(sfText* songLabel, sfFont* font, sfSprite* playSprite, sfTexture* pauseTex, sfTexture* playTex) {
+    playerDisarm(&player);
+    playerCancelArm(&player);
+    armedSong = armingSong = NULL;
+    if (!current) {
+        playerUnload(&player);
+        if (songLabel) sfText_setString(songLabel, "No Song Selected");
+        if (playSprite && playTex) sfSprite_setTexture(playSprite, playTex, sfTrue);
+        return;
+    }
+
+    if (!playerRequest(&player, current->path)) {
+        printf("Failed to load: %s\n", current->path);
+        if (songLabel) sfText_setString(songLabel, "Error loading song!");
+        if (playSprite && playTex) sfSprite_setTexture(playSprite, playTex, sfTrue);
+        return;
+    }
+    char loading[MAX_SONG_NAME_LENGTH + 16];
+    snprintf(loading, sizeof(loading), "Loading %s...", current->name);
+    if (songLabel) sfText_setString(songLabel, loading);
+}
+
+// UI thread, every frame: starts the song playNewSong() asked for once it has been decoded
+void updateLoadingSong(sfText* songLabel, sfFont* font, sfSprite* playSprite, sfTexture* pauseTex, sfTexture* playTex) {
+    playerRequestDecode(&player);
+    int started = playerPoll(&player);
+    if (started == 0) return;
+    if (started < 0 || !current) {
+        playerUnload(&player);
+        printf("Failed to load: %s\n", current ? current->path : "(removed song)");
+        if (songLabel) sfText_setString(songLabel, "Error loading song!");
+        if (playSprite && playTex) sfSprite_setTexture(playSprite, playTex, sfTrue);
+        return;
+    }
+    playerSwitchesSeen = player.switches;
+    songStarted(songLabel, font, playSprite, pauseTex);
+}
+
+// -------------------------- WAV Output --------------------------
+// PCM sink shared by the offline renderer and the file / null outputs of playback zones.
+// The data is hashed as it is written so two outputs are easy to compare.
+typedef struct RenderSink {
+    FILE* fp; // NULL for the null sink
+    unsigned int channels; // Output format, taken from the first rendered track
+    unsigned int sampleRate;
+    sfUint64 dataBytes;
+    sfUint64 hash; // FNV-1a over the PCM data
+} RenderSink;
+
+void writeLe16(unsigned char* dst, unsigned int value) {
+    dst[0] = (unsigned char)value;
+    dst[1] = (unsigned char)(value >> 8);
+}
+
+void writeLe32(unsigned char* dst, sfUint64 value) {
+    for (int i = 0; i < 4; i++) dst[i] = (unsigned char)(value >> (8 * i));
+}
+
+// Writes the 44 byte PCM WAV header; called again at the end once the data size is known
+bool writeWavHeader(RenderSink* sink) {
+    unsigned char header[44];
+    unsigned int blockAlign = sink->channels * sizeof(sfInt16);
+    sfUint64 dataBytes = sink->dataBytes > 0xFFFFFFFFull - 36 ? 0xFFFFFFFFull - 36 : sink->dataBytes;
+    memcpy(header, "RIFF", 4);
+    writeLe32(header + 4, 36 + dataBytes);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    writeLe32(header + 16, 16);
+    writeLe16(header + 20, 1); // Integer PCM
+    writeLe16(header + 22, sink->channels);
+    writeLe32(header + 24, sink->sampleRate);
+    writeLe32(header + 28, (sfUint64)sink->sampleRate * blockAlign);
+    writeLe16(header + 32, blockAlign);
+    writeLe16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    writeLe32(header + 40, dataBytes);
+    return fseek(sink->fp, 0, SEEK_SET) == 0 && fwrite(header, 1, sizeof(header), sink->fp) == sizeof(header);
+}
+
+// Samples are written in host order, which is little endian on every target this builds for
+bool renderSinkWrite(RenderSink* sink, const sfInt16* samples, size_t count) {
+    const unsigned char* bytes = (const unsigned char*)samples;
+    size_t size = count * sizeof(sfInt16);
+    sfUint64 hash = sink->hash;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    sink->hash = hash;
+    sink->dataBytes += size;
+    return !sink->fp || fwrite(samples, sizeof(sfInt16), count, sink->fp) == count;
+}
+
+// -------------------------- Playback Zones --------------------------
+// Extra outputs that play their own queue next to the main player (--zone=...). Every zone has
+// its own Player (position, DSP state), queue and volume; the library, the PCM cache and the
+// resample tables are shared. A zone moves on to its next track inside its own audio callback,
+// so tracks follow each other without a gap, but it never decodes there: a small pool of
+// scheduler threads decodes ("arms") the next track of every zone ahead of time, taking the
+// zone whose audio runs out soonest first. One zone stuck on a slow decode therefore cannot
+// starve the others. File and null outputs have no audio device pulling data; the scheduler
+// feeds them itself at real-time pace.
+#define MAX_ZONES 16
+#define MAX_ZONE_WORKERS 4
+#define ZONE_RENDER_AHEAD_MICROS 250000 // File / null outputs are kept this far ahead of real time
+#define ZONE_RENDER_BLOCKS 8 // Blocks a scheduler thread renders for one zone before picking again
+#define ZONE_RETRY_MICROS 1000000 // Pause before picking again after repeated skips
+
+typedef enum ZoneSinkKind {
+    ZONE_SINK_DEVICE, // Own sfSoundStream on the default audio device
+    ZONE_SINK_FILE, // WAV file
+    ZONE_SINK_NULL // Discarded (throughput checks)
+} ZoneSinkKind;
+
+typedef struct Zone {
+    char source[100]; // Playlist name, or "*" for the whole library
+    ZoneSinkKind sinkKind;
+    const char* sinkPath;
+    volatile LONG volume; // 0..100, applied by the audio callback
+    Player player;
+    RenderSink sink; // File and null outputs
+    long long sinkStartMicros;
+    sfUint64 sinkFrames; // Frames written to 'sink'
+    // UI thread only
+    Playlist* queue; // Copy of the source playlist, refilled when it runs out
+    Song* lastPicked; // Library zones continue after this song
+    Song* current; // For display; NULL if it left the library
+    Song* next;
+    bool pending; // A next track was handed to the scheduler and has not started yet
+    LONG switchesSeen;
+    LONG skipsSeen;
+    int skipStreak; // Skips since the last track started
+    long long retryAt;
+    // Guarded by zoneScheduler.lock
+    char nextPath[MAX_PATH_LENGTH]; // Track to arm, empty once armed
+    long long deadline; // perfMicros() by which it has to be armed
+    bool busy; // A scheduler thread is working on this zone
+    // Handed between the scheduler and the audio callback (the armed track is in 'player')
+    volatile LONG skips; // Tracks that failed to decode or did not fit the output format
+    volatile LONG underruns; // Track ended before the next one was armed
+    long long worstLateMicros; // Latest a scheduler job started after its deadline
+} Zone;
+
+typedef struct ZoneScheduler {
+    sfMutex* lock;
+    HANDLE wake;
+    bool stop;
+    sfThread* workers[MAX_ZONE_WORKERS];
+    int workerCount;
+    volatile LONG jobs;
+} ZoneScheduler;
+
+Zone zones[MAX_ZONES];
+int zoneCount = 0;
+ZoneScheduler zoneScheduler = {0};
+
+// Adds a zone from --zone=NAME; --zone-out and --zone-volume then apply to it
+Zone* addZone(const char* source) {
+    if (zoneCount == MAX_ZONES) {
+        printf("At most %d zones are supported, ignoring '%s'.\n", MAX_ZONES, source);
+        return NULL;
+    }
+    Zone* zone = &zones[zoneCount++];
+    memset(zone, 0, sizeof(*zone));
+    strncpy(zone->source, source, sizeof(zone->source) - 1);
+    zone->sinkKind = ZONE_SINK_DEVICE;
+    zone->volume = 100;
+    return zone;
+}
+
+// Audio thread (or the scheduler for file sinks): continue with the armed track
+bool zoneSwapTrack(Zone* zone) {
+    Player* p = &zone->player;
+    if (!p->armedReady) {
+        if (p->track) InterlockedIncrement(&zone->underruns);
+        return false;
+    }
+    return playerSwapTrack(p);
+}
+
+sfBool zoneGetData(sfSoundStreamChunk* chunk, void* userData) {
+    Zone* zone = (Zone*)userData;
+    Player* p = &zone->player;
+    if (!p->track || !playerGetData(chunk, p)) {
+        if (!zoneSwapTrack(zone) || !playerGetData(chunk, p)) return sfFalse;
+    }
+    LONG volume = zone->volume;
+    if (volume < 100) {
+        int gain = (int)volume * 32768 / 100;
+        for (unsigned int i = 0; i < chunk->sampleCount; i++) p->outBlock[i] = (sfInt16)((p->outBlock[i] * gain) >> 15);
+    }
+    return sfTrue;
+}
+
+void zoneSeek(sfTime offset, void* userData) {
+    playerSeek(offset, &((Zone*)userData)->player);
+}
+
+// Scheduler thread: decode 'path' into the zone's armed slot
+void zoneArm(Zone* zone, const char* path) {
+    playerReleaseRetired(&zone->player);
+    if (!playerArm(&zone->player, path)) InterlockedIncrement(&zone->skips);
+}
+
+long long zoneRenderDeadline(const Zone* zone) {
+    if (zone->sinkFrames == 0) return 0; // Not started: due now
+    return zone->sinkStartMicros + (long long)(zone->sinkFrames * 1000000 / zone->player.outputRate) - ZONE_RENDER_AHEAD_MICROS;
+}
+
+bool zoneHasData(const Player* p) {
+    if (!p->track) return false;
+    if (p->resampler.table) return p->resampler.frame < p->sampleCount / p->channels;
+    return p->cursor < p->sampleCount;
+}
+
+// Scheduler thread: feed a file or null output until it is ZONE_RENDER_AHEAD_MICROS ahead
+void zoneRender(Zone* zone) {
+    Player* p = &zone->player;
+    for (int i = 0; i < ZONE_RENDER_BLOCKS; i++) {
+        if (zone->sinkFrames > 0 && zoneRenderDeadline(zone) > perfMicros()) break;
+        sfSoundStreamChunk chunk;
+        if (!zoneGetData(&chunk, zone)) {
+            // The armed track does not fit the file's format: skip it like the offline renderer
+            if (p->track && playerDisarm(p)) InterlockedIncrement(&zone->skips);
+            break;
+        }
+        if (zone->sinkFrames == 0) {
+            zone->sinkStartMicros = perfMicros();
+            zone->sink.channels = p->channels;
+            zone->sink.sampleRate = p->outputRate;
+            if (zone->sink.fp && !writeWavHeader(&zone->sink)) printf("Failed writing zone output: %s\n", zone->sinkPath);
+        }
+        renderSinkWrite(&zone->sink, chunk.samples, chunk.sampleCount);
+        zone->sinkFrames += chunk.sampleCount / p->channels;
+    }
+    playerReleaseRetired(p);
+}
+
+// Scheduler thread: runs the most urgent job, earliest deadline first. Arming can start any
+// time; feeding a file or null output waits until it is due.
+void zoneWorker(void* userData) {
+    (void)userData;
+    sfMutex_lock(zoneScheduler.lock);
+    while (!zoneScheduler.stop) {
+        long long now = perfMicros();
+        Zone* best = NULL;
+        long long bestDeadline = 0;
+        long long nextDue = now + 100000;
+        bool arm = false;
+        for (int i = 0; i < zoneCount; i++) {
+            Zone* zone = &zones[i];
+            if (zone->busy) continue;
+            if (zone->nextPath[0] && !zone->player.armedReady && (!best || zone->deadline < bestDeadline)) {
+                best = zone;
+                bestDeadline = zone->deadline;
+                arm = true;
+            }
+            if (zone->sinkKind != ZONE_SINK_DEVICE && (zone->player.armedReady || zoneHasData(&zone->player))) {
+                long long due = zoneRenderDeadline(zone);
+                if (due > now) {
+                    if (due < nextDue) nextDue = due;
+                } else if (!best || due < bestDeadline) {
+                    best = zone;
+                    bestDeadline = due;
+                    arm = false;
+                }
+            }
+        }
+        if (!best) {
+            sfMutex_unlock(zoneScheduler.lock);
+            WaitForSingleObject(zoneScheduler.wake, (DWORD)((nextDue - now) / 1000 + 1));
+            sfMutex_lock(zoneScheduler.lock);
+            continue;
+        }
+
+        best->busy = true;
+        if (bestDeadline > 0 && now - bestDeadline > best->worstLateMicros) best->worstLateMicros = now - bestDeadline;
+        char path[MAX_PATH_LENGTH];
+        if (arm) strcpy(path, best->nextPath);
+        sfMutex_unlock(zoneScheduler.lock);
+        if (arm) zoneArm(best, path);
+        else zoneRender(best);
+        InterlockedIncrement(&zoneScheduler.jobs);
+        sfMutex_lock(zoneScheduler.lock);
+        if (arm) best->nextPath[0] = '\0';
+        best->busy = false;
+    }
+    sfMutex_unlock(zoneScheduler.lock);
+}
+
+// Library zones walk the library in order; playlist zones play a copy of their playlist and
+// start it over when it runs out
+Song* zoneNextSong(Zone* zone) {
+    if (strcmp(zone->source, "*") == 0) {
+        zone->lastPicked = zone->lastPicked && zone->lastPicked->next ? zone->lastPicked->next : allSongsList;
+        return zone->lastPicked;
+    }
+    if (!zone->queue || !zone->queue->front) {
+        Playlist* source = playlists;
+        while (source && strcmp(source->name, zone->source) != 0) source = source->next;
+        if (!source || !source->front) return NULL;
+        if (!zone->queue) zone->queue = createTemporaryPlaylist(source->name);
+        for (PlaylistNode* node = source->front; node; node = node->next) enqueueSong(zone->queue, node->song);
+    }
+    return dequeueSong(zone->queue);
+}
+
+// (Re)opens the device stream on the armed track; needed at the start, after an underrun and
+// when the next track has a different channel count or rate
+void zoneStartStream(Zone* zone) {
+    Player* p = &zone->player;
+    playerUnload(p);
+    clockReset(&p->clock, 0, 0);
+    if (!zoneSwapTrack(zone)) return;
+    p->stream = sfSoundStream_create(zoneGetData, zoneSeek, p->channels, p->outputRate, zone);
+    if (!p->stream) {
+        printf("Zone %d: could not open an audio stream.\n", (int)(zone - zones) + 1);
+        playerUnload(p);
+        return;
+    }
+    sfSoundStream_play(p->stream);
+}
+
+// UI thread, every frame: follow track changes, restart stopped streams and hand each zone
+// its next track
+void updateZones(void) {
+    long long now = perfMicros();
+    for (int i = 0; i < zoneCount; i++) {
+        Zone* zone = &zones[i];
+        playerClockUpdate(&zone->player);
+        LONG skips = zone->skips;
+        if (playerSwitchHeard(&zone->player, &zone->switchesSeen)) {
+            zone->current = zone->next;
+            zone->next = NULL;
+            zone->pending = false;
+            zone->skipStreak = 0;
+        }
+        if (skips != zone->skipsSeen) {
+            zone->skipsSeen = skips;
+            zone->next = NULL;
+            zone->pending = false;
+            if (++zone->skipStreak > 1) zone->retryAt = now + ZONE_RETRY_MICROS; // Don't spin on a run of bad files
+        }
+        if (zone->sinkKind == ZONE_SINK_DEVICE && zone->player.armedReady && playerGetStatus(&zone->player) == sfStopped) {
+            zoneStartStream(zone);
+        }
+        if (zone->pending || now < zone->retryAt) continue;
+
+        Song* song = zoneNextSong(zone);
+        if (!song) continue;
+        sfMutex_lock(zoneScheduler.lock);
+        strncpy(zone->nextPath, song->path, MAX_PATH_LENGTH - 1);
+        zone->nextPath[MAX_PATH_LENGTH - 1] = '\0';
+        zone->deadline = now + playerRemainingMicros(&zone->player);
+        sfMutex_unlock(zoneScheduler.lock);
+        zone->next = song;
+        zone->pending = true;
+        SetEvent(zoneScheduler.wake);
+    }
+}
+
+// Clears references to a song that is about to leave the library (queues are handled by
+// removeSongFromLibrary)
+void zonesForgetSong(const Song* song) {
+    for (int i = 0; i < zoneCount; i++) {
+        Zone* zone = &zones[i];
+        if (zone->current == song) zone->current = NULL;
+        if (zone->next == song) zone->next = NULL;
+        if (zone->lastPicked == song) zone->lastPicked = song->prev;
+    }
+}
+
+const char* zoneSinkName(const Zone* zone) {
+    if (zone->sinkKind == ZONE_SINK_DEVICE) return "device";
+    return zone->sinkKind == ZONE_SINK_NULL ? "null" : zone->sinkPath;
+}
+
+void startZones(void) {
+    if (zoneCount == 0) return;
+    zoneScheduler.lock = sfMutex_create();
+    zoneScheduler.wake = CreateEventA(NULL, FALSE, FALSE, NULL);
+    resampleTableLock = sfMutex_create();
+    if (!zoneScheduler.lock || !zoneScheduler.wake || !resampleTableLock) {
+        fprintf(stderr, "Could not start the zone scheduler.\n");
+        zoneCount = 0;
+        return;
+    }
+
+    for (int i = 0; i < zoneCount; i++) {
+        Zone* zone = &zones[i];
+        playerInit(&zone->player);
+        zone->player.dsp.params = player.dsp.params; // Same EQ as the main player to begin with
+        dspPublish(&zone->player.dsp);
+        zone->sink.hash = 14695981039346656037ull;
+        if (zone->sinkKind == ZONE_SINK_FILE) {
+            zone->sink.fp = fopen(zone->sinkPath, "wb");
+            if (!zone->sink.fp) {
+                printf("Zone %d: could not open %s, discarding its output.\n", i + 1, zone->sinkPath);
+                zone->sinkKind = ZONE_SINK_NULL;
+            }
+        }
+        printf("Zone %d: %s -> %s at %ld%% volume\n", i + 1, strcmp(zone->source, "*") == 0 ? "library" : zone->source,
+               zoneSinkName(zone), (long)zone->volume);
+    }
+
+    // Decodes dominate the work, so a few threads serve many zones
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int workers = (int)info.dwNumberOfProcessors - 1;
+    if (workers > zoneCount) workers = zoneCount;
+    if (workers > MAX_ZONE_WORKERS) workers = MAX_ZONE_WORKERS;
+    if (workers < 1) workers = 1;
+    for (int i = 0; i < workers; i++) {
+        sfThread* thread = sfThread_create(zoneWorker, NULL);
+        if (!thread) break;
+        zoneScheduler.workers[zoneScheduler.workerCount++] = thread;
+        sfThread_launch(thread);
+    }
+    updateZones();
+}
+
+void stopZones(void) {
+    if (!zoneScheduler.lock) return;
+    sfMutex_lock(zoneScheduler.lock);
+    zoneScheduler.stop = true;
+    sfMutex_unlock(zoneScheduler.lock);
+    for (int i = 0; i < zoneScheduler.workerCount; i++) SetEvent(zoneScheduler.wake);
+    for (int i = 0; i < zoneScheduler.workerCount; i++) {
+        sfThread_wait(zoneScheduler.workers[i]);
+        sfThread_destroy(zoneScheduler.workers[i]);
+    }
+    zoneScheduler.workerCount = 0;
+
+    for (int i = 0; i < zoneCount; i++) {
+        Zone* zone = &zones[i];
+        playerDisarm(&zone->player);
+        playerUnload(&zone->player);
+        destroyTemporaryPlaylist(zone->queue);
+        zone->queue = NULL;
+        if (zone->sink.fp) {
+            if (zone->sink.channels == 0) { // Nothing played; still leave a valid (empty) file behind
+                zone->sink.channels = 2;
+                zone->sink.sampleRate = 44100;
+            }
+            if (!writeWavHeader(&zone->sink) || fclose(zone->sink.fp) != 0) printf("Failed writing zone output: %s\n", zone->sinkPath);
+            zone->sink.fp = NULL;
+        }
+        printf("Zone %d: %ld tracks, %ld skipped, %ld underruns, worst scheduling delay %.1f ms",
+               i + 1, (long)zone->player.switches, (long)zone->skips, (long)zone->underruns, zone->worstLateMicros / 1000.0);
+        if (zone->sinkKind != ZONE_SINK_DEVICE) {
+            printf(", %.1f s written, hash %016llx", zone->sink.sampleRate ? (double)zone->sinkFrames / zone->sink.sampleRate : 0.0,
+                   (unsigned long long)zone->sink.hash);
+        }
+        printf("\n");
+    }
+    sfMutex_destroy(zoneScheduler.lock);
+    CloseHandle(zoneScheduler.wake);
+    zoneScheduler.lock = NULL;
+    zoneScheduler.wake = NULL;
+    sfMutex_destroy(resampleTableLock); // Only the UI thread loads tracks from here on
+    resampleTableLock = NULL;
+}
+// -------------------------- Cover Art --------------------------
+// Per-track artwork. A worker thread finds a track's picture: a FLAC PICTURE block, a
+// METADATA_BLOCK_PICTURE (or older COVERART) comment in an Ogg Vorbis / Opus header, or a
+// cover / folder / front image next to the file. It decodes the picture and box-filters it
+// down to ART_LARGE_SIZE and ART_SMALL_SIZE once. The thumbnails go into ART_CACHE_FILE, an
+// append-only pack of RGB images keyed by a hash of the picture bytes, so the tracks of an
+// album share one image and later runs skip the decode. The UI thread never decodes. It only
+// copies finished thumbnails into one atlas texture, at most ART_UPLOADS_PER_FRAME per frame,
+// and draws sprites that point into it.
+#define ART_LARGE_SIZE 160 // Now playing, on the main screen
+#define ART_SMALL_SIZE 32 // Song list rows
+#define ART_ATLAS_SIZE 1024
+#define ART_LARGE_ROWS 3 // Atlas rows of large slots (18); small slots fill the rest (544)
+#define ART_LOW_MEMORY_ATLAS_SIZE 512 // --low-memory: 4 MB -> 1 MB of texture
+#define ART_LOW_MEMORY_LARGE_ROWS 1 // 3 large slots and 176 small ones
+#define ART_UPLOADS_PER_FRAME 4
+#define ART_MAX_ENTRIES 1024 // Tracks the UI remembers; past this, those without art in the atlas are dropped
+#define ART_MAX_PICTURE_BYTES (16 * 1024 * 1024)
+#define ART_MAX_HEADER_BYTES (ART_MAX_PICTURE_BYTES / 3 * 4 + 65536) // Base64 picture plus the other comments
+#define ART_CACHE_FILE "art_cache.bin"
+#define ART_CACHE_MAX_BYTES (256L * 1024 * 1024) // Nothing more is appended past this
+#define ART_RECORD_TRACK 0x4B525441u // "ATRK": stamp, image id and path of a track
+#define ART_RECORD_IMAGE 0x474D4941u // "AIMG": image id and its RGB thumbnails
+#define ART_IMAGE_BYTES ((ART_LARGE_SIZE * ART_LARGE_SIZE + ART_SMALL_SIZE * ART_SMALL_SIZE) * 3)
+
+typedef enum ArtSize { ART_LARGE, ART_SMALL, ART_SIZE_COUNT } ArtSize;
+
+const int artSizes[ART_SIZE_COUNT] = { ART_LARGE_SIZE, ART_SMALL_SIZE };
+const char* artFolderImages[] = { "cover.jpg", "folder.jpg", "front.jpg", "cover.png", "folder.png", "front.png", "albumart.jpg" };
+
+typedef struct ArtCacheHeader {
+    char magic[8];
+    unsigned int largeSize, smallSize; // A cache made for other sizes is started again
+} ArtCacheHeader;
+
+typedef struct ArtRecordHeader {
+    unsigned int kind;
+    unsigned int length; // Bytes that follow
+} ArtRecordHeader;
+
+// Worker side: what the pack holds
+typedef struct ArtTrackRecord {
+    char path[MAX_PATH_LENGTH];
+    long long size, modified; // File stamp the image id belongs to
+    unsigned long long imageId; // 0 = the track has no art
+} ArtTrackRecord;
+
+typedef struct ArtImageRecord {
+    unsigned long long imageId;
+    long offset; // Of the RGB pixels in the pack
+    bool referenced; // By a live track record (compaction)
+} ArtImageRecord;
+
+typedef struct ArtResult {
+    char path[MAX_PATH_LENGTH];
+    unsigned long long imageId; // 0 = no art
+    unsigned char* pixels; // RGBA, large then small; NULL when there is no art
+} ArtResult;
+
+// UI side: one entry per track asked about, one slot per atlas cell
+typedef struct ArtEntry {
+    char path[MAX_PATH_LENGTH];
+    unsigned long long imageId;
+    bool known; // 'imageId' came back from the worker
+    bool pending; // Queued, result not applied yet
+    unsigned char wanted; // Sizes asked for (bit per ArtSize)
+    int slot[ART_SIZE_COUNT]; // Atlas slot last seen holding the image, -1 = none
+} ArtEntry;
+
+typedef struct ArtSlot {
+    unsigned long long imageId; // 0 = free
+    unsigned int lastUsed; // Frame the slot was last drawn
+} ArtSlot;
+
+typedef struct CoverArt {
+    // Work queue (lock held). Jobs are taken newest first, so the rows on screen come first.
+    char (*jobs)[MAX_PATH_LENGTH];
+    int jobCount;
+    int jobCapacity;
+    ArtResult* results;
+    int resultCount;
+    int resultCapacity;
+    sfMutex* lock;
+    HANDLE wake; // Manual reset, signalled while jobs are waiting
+    bool stop;
+    sfThread* worker;
+    // Pack file and its index (worker thread only once it runs; cacheEnd is also read by
+    // the stats view, so the worker changes it under the lock)
+    FILE* cache;
+    long cacheEnd;
+    ArtTrackRecord* tracks;
+    int trackCount, trackCapacity;
+    int* trackSlots; // Open addressing on the path, -1 = empty
+    int trackSlotCapacity;
+    ArtImageRecord* images;
+    int imageCount, imageCapacity;
+    int* imageSlots; // Open addressing on the image id, -1 = empty
+    int imageSlotCapacity;
+    // Atlas and entries (UI thread only)
+    sfTexture* atlas;
+    int atlasSize; // Pixels per side
+    int largeRows; // Rows of large slots at the top; small slots fill the rest
+    ArtSlot slots[ART_SIZE_COUNT][(ART_ATLAS_SIZE / ART_SMALL_SIZE) * (ART_ATLAS_SIZE / ART_SMALL_SIZE)];
+    int slotCount[ART_SIZE_COUNT];
+    ArtEntry* entries;
+    int entryCount, entryCapacity;
+    int entryLimit; // Count that triggers the next artDropEntries, at least ART_MAX_ENTRIES
+    int* entrySlots;
+    int entrySlotCapacity;
+    unsigned int frame;
+    // Counters for the debug stats view; the worker's under the lock, the atlas ones UI only
+    long decoded;
+    long cacheHits;
+    long noArt;
+    long failed;
+    long uploads;
+    long evictions;
+} CoverArt;
+
+CoverArt coverArt = {0};
+bool coverArtEnabled = true;
+
+unsigned int artReadBe32(const unsigned char* p) {
+    return (unsigned int)p[0] << 24 | (unsigned int)p[1] << 16 | (unsigned int)p[2] << 8 | p[3];
+}
+
+unsigned int artReadLe32(const unsigned char* p) {
+    return (unsigned int)p[3] << 24 | (unsigned int)p[2] << 16 | (unsigned int)p[1] << 8 | p[0];
+}
+
+// Slots of an open addressing table double with its entries, keeping the load at most 1/2
+bool artGrowSlots(int** slots, int* slotCapacity, int entryCount, unsigned int (*hashEntry)(int)) {
+    int capacity = *slotCapacity ? *slotCapacity * 2 : 256;
+    int* grown = (int*)malloc((size_t)capacity * sizeof(int));
+    if (!grown) return false;
+    memset(grown, 0xff, (size_t)capacity * sizeof(int));
+    for (int e = 0; e < entryCount; e++) {
+        int i = (int)(hashEntry(e) & (capacity - 1));
+        while (grown[i] >= 0) i = (i + 1) & (capacity - 1);
+        grown[i] = e;
+    }
+    free(*slots);
+    *slots = grown;
+    *slotCapacity = capacity;
+    return true;
+}
+
+unsigned int artHashImageId(unsigned long long id) {
+    return (unsigned int)(id ^ id >> 32);
+}
+
+unsigned int artTrackHash(int e) { return hashKey(coverArt.tracks[e].path); }
+unsigned int artImageHash(int e) { return artHashImageId(coverArt.images[e].imageId); }
+unsigned int artEntryHash(int e) { return hashKey(coverArt.entries[e].path); }
+
+int artTrackFind(const char* path) {
+    if (!coverArt.trackSlotCapacity) return -1;
+    int mask = coverArt.trackSlotCapacity - 1;
+    for (int i = (int)(hashKey(path) & mask); coverArt.trackSlots[i] >= 0; i = (i + 1) & mask) {
+        if (strcmp(coverArt.tracks[coverArt.trackSlots[i]].path, path) == 0) return coverArt.trackSlots[i];
+    }
+    return -1;
+}
+
+bool artTrackPut(const char* path, long long size, long long modified, unsigned long long imageId) {
+    int e = artTrackFind(path);
+    if (e < 0) {
+        if (coverArt.trackCount == coverArt.trackCapacity) {
+            int capacity = coverArt.trackCapacity ? coverArt.trackCapacity * 2 : 256;
+            ArtTrackRecord* grown = (ArtTrackRecord*)realloc(coverArt.tracks, (size_t)capacity * sizeof(ArtTrackRecord));
+            if (!grown) return false;
+            coverArt.tracks = grown;
+            coverArt.trackCapacity = capacity;
+        }
+        if ((coverArt.trackCount + 1) * 2 > coverArt.trackSlotCapacity &&
+            !artGrowSlots(&coverArt.trackSlots, &coverArt.trackSlotCapacity, coverArt.trackCount, artTrackHash)) return false;
+        e = coverArt.trackCount++;
+        snprintf(coverArt.tracks[e].path, MAX_PATH_LENGTH, "%s", path);
+        int mask = coverArt.trackSlotCapacity - 1;
+        int i = (int)(hashKey(path) & mask);
+        while (coverArt.trackSlots[i] >= 0) i = (i + 1) & mask;
+        coverArt.trackSlots[i] = e;
+    }
+    coverArt.tracks[e].size = size;
+    coverArt.tracks[e].modified = modified;
+    coverArt.tracks[e].imageId = imageId;
+    return true;
+}
+
+int artImageFind(unsigned long long imageId) {
+    if (!coverArt.imageSlotCapacity) return -1;
+    int mask = coverArt.imageSlotCapacity - 1;
+    for (int i = (int)(artHashImageId(imageId) & mask); coverArt.imageSlots[i] >= 0; i = (i + 1) & mask) {
+        if (coverArt.images[coverArt.imageSlots[i]].imageId == imageId) return coverArt.imageSlots[i];
+    }
+    return -1;
+}
+
+bool artImagePut(unsigned long long imageId, long offset) {
+    int e = artImageFind(imageId);
+    if (e < 0) {
+        if (coverArt.imageCount == coverArt.imageCapacity) {
+            int capacity = coverArt.imageCapacity ? coverArt.imageCapacity * 2 : 256;
+            ArtImageRecord* grown = (ArtImageRecord*)realloc(coverArt.images, (size_t)capacity * sizeof(ArtImageRecord));
+            if (!grown) return false;
+            coverArt.images = grown;
+            coverArt.imageCapacity = capacity;
+        }
+        if ((coverArt.imageCount + 1) * 2 > coverArt.imageSlotCapacity &&
+            !artGrowSlots(&coverArt.imageSlots, &coverArt.imageSlotCapacity, coverArt.imageCount, artImageHash)) return false;
+        e = coverArt.imageCount++;
+        coverArt.images[e].imageId = imageId;
+        int mask = coverArt.imageSlotCapacity - 1;
+        int i = (int)(artHashImageId(imageId) & mask);
+        while (coverArt.imageSlots[i] >= 0) i = (i + 1) & mask;
+        coverArt.imageSlots[i] = e;
+    }
+    coverArt.images[e].offset = offset;
+    coverArt.images[e].referenced = false;
+    return true;
+}
+
+// Appends one record at the end of the pack; false if it would not fit or the write failed
+bool artCacheAppend(unsigned int kind, const void* head, size_t headSize, const void* body, size_t bodySize) {
+    if (!coverArt.cache) return false;
+    ArtRecordHeader header = { kind, (unsigned int)(headSize + bodySize) };
+    long end = coverArt.cacheEnd + (long)(sizeof(header) + headSize + bodySize);
+    if (end > ART_CACHE_MAX_BYTES || fseek(coverArt.cache, coverArt.cacheEnd, SEEK_SET) != 0) return false;
+    if (fwrite(&header, sizeof(header), 1, coverArt.cache) != 1 || fwrite(head, headSize, 1, coverArt.cache) != 1 ||
+        (bodySize && fwrite(body, bodySize, 1, coverArt.cache) != 1) || fflush(coverArt.cache) != 0) {
+        return false;
+    }
+    sfMutex_lock(coverArt.lock);
+    coverArt.cacheEnd = end;
+    sfMutex_unlock(coverArt.lock);
+    return true;
+}
+
+bool artCacheAppendTrack(const ArtTrackRecord* track) {
+    long long stamp[2] = { track->size, track->modified };
+    unsigned char head[sizeof(stamp) + sizeof(track->imageId)];
+    memcpy(head, stamp, sizeof(stamp));
+    memcpy(head + sizeof(stamp), &track->imageId, sizeof(track->imageId));
+    return artCacheAppend(ART_RECORD_TRACK, head, sizeof(head), track->path, strlen(track->path));
+}
+
+bool artCacheAppendImage(unsigned long long imageId, const unsigned char* rgb) {
+    long offset = coverArt.cacheEnd + (long)(sizeof(ArtRecordHeader) + sizeof(imageId));
+    return artCacheAppend(ART_RECORD_IMAGE, &imageId, sizeof(imageId), rgb, ART_IMAGE_BYTES) && artImagePut(imageId, offset);
+}
+
+bool artCacheReadImage(int image, unsigned char* rgb) {
+    return coverArt.cache && fseek(coverArt.cache, coverArt.images[image].offset, SEEK_SET) == 0 &&
+           fread(rgb, ART_IMAGE_BYTES, 1, coverArt.cache) == 1;
+}
+
+// Rewrites the pack with only the newest record of each track and the images they use
+void artCacheCompact(void) {
+    char tempPath[64];
+    snprintf(tempPath, sizeof(tempPath), "%s.%lu.tmp", ART_CACHE_FILE, (unsigned long)GetCurrentProcessId());
+    FILE* out = fopen(tempPath, "w+b");
+    unsigned char* rgb = (unsigned char*)malloc(ART_IMAGE_BYTES);
+    ArtCacheHeader header = { "ARTCACHE", ART_LARGE_SIZE, ART_SMALL_SIZE };
+    bool ok = out && rgb && fwrite(&header, sizeof(header), 1, out) == 1;
+
+    FILE* in = coverArt.cache;
+    ArtImageRecord* images = coverArt.images;
+    int imageCount = coverArt.imageCount;
+    coverArt.cache = out;
+    coverArt.cacheEnd = (long)sizeof(header);
+    coverArt.images = NULL;
+    coverArt.imageCount = coverArt.imageCapacity = 0;
+    free(coverArt.imageSlots);
+    coverArt.imageSlots = NULL;
+    coverArt.imageSlotCapacity = 0;
+    for (int i = 0; ok && i < imageCount; i++) {
+        if (!images[i].referenced) continue;
+        ok = fseek(in, images[i].offset, SEEK_SET) == 0 && fread(rgb, ART_IMAGE_BYTES, 1, in) == 1 &&
+             artCacheAppendImage(images[i].imageId, rgb);
+    }
+    for (int i = 0; ok && i < coverArt.trackCount; i++) ok = artCacheAppendTrack(&coverArt.tracks[i]);
+    free(images);
+    free(rgb);
+    fclose(in);
+    if (out) fclose(out);
+    coverArt.cache = NULL;
+    if (!ok || !MoveFileExA(tempPath, ART_CACHE_FILE, MOVEFILE_REPLACE_EXISTING)) {
+        printf("Could not compact the cover art cache (Error Code: %lu)\n", GetLastError());
+        DeleteFileA(tempPath);
+        coverArt.trackCount = coverArt.imageCount = 0; // Start over with an empty pack
+        if (coverArt.trackSlots) memset(coverArt.trackSlots, 0xff, (size_t)coverArt.trackSlotCapacity * sizeof(int));
+        if (coverArt.imageSlots) memset(coverArt.imageSlots, 0xff, (size_t)coverArt.imageSlotCapacity * sizeof(int));
+        coverArt.cache = fopen(ART_CACHE_FILE, "w+b");
+        coverArt.cacheEnd = (long)sizeof(header);
+        if (coverArt.cache && fwrite(&header, sizeof(header), 1, coverArt.cache) != 1) {
+            fclose(coverArt.cache);
+            coverArt.cache = NULL;
+        }
+        return;
+    }
+    coverArt.cache = fopen(ART_CACHE_FILE, "r+b");
+}
+
+// Reads the pack's index. A torn tail (a write cut short) or more than half of the file in
+// replaced records gets the pack rewritten.
+void loadArtCache(void) {
+    ArtCacheHeader header = { "ARTCACHE", ART_LARGE_SIZE, ART_SMALL_SIZE };
+    ArtCacheHeader found;
+    coverArt.cache = fopen(ART_CACHE_FILE, "r+b");
+    if (!coverArt.cache || fread(&found, sizeof(found), 1, coverArt.cache) != 1 || memcmp(&found, &header, sizeof(header)) != 0) {
+        if (coverArt.cache) fclose(coverArt.cache);
+        coverArt.cache = fopen(ART_CACHE_FILE, "w+b");
+        coverArt.cacheEnd = (long)sizeof(header);
+        if (!coverArt.cache || fwrite(&header, sizeof(header), 1, coverArt.cache) != 1) {
+            printf("Could not create cover art cache: %s\n", ART_CACHE_FILE);
+            if (coverArt.cache) fclose(coverArt.cache);
+            coverArt.cache = NULL;
+        }
+        return;
+    }
+
+    fseek(coverArt.cache, 0, SEEK_END);
+    long fileEnd = ftell(coverArt.cache);
+    long offset = (long)sizeof(header);
+    ArtRecordHeader record;
+    fseek(coverArt.cache, offset, SEEK_SET);
+    while (fread(&record, sizeof(record), 1, coverArt.cache) == 1) {
+        long body = offset + (long)sizeof(record);
+        if (record.length > (unsigned long)(fileEnd - body)) break; // Cut short
+        if (record.kind == ART_RECORD_IMAGE && record.length == sizeof(unsigned long long) + ART_IMAGE_BYTES) {
+            unsigned long long imageId;
+            if (fread(&imageId, sizeof(imageId), 1, coverArt.cache) != 1 || fseek(coverArt.cache, ART_IMAGE_BYTES, SEEK_CUR) != 0) break;
+            artImagePut(imageId, body + (long)sizeof(imageId));
+        } else if (record.kind == ART_RECORD_TRACK && record.length > 24 && record.length < 24 + MAX_PATH_LENGTH) {
+            unsigned char data[24 + MAX_PATH_LENGTH];
+            if (fread(data, record.length, 1, coverArt.cache) != 1) break;
+            long long stamp[2];
+            unsigned long long imageId;
+            memcpy(stamp, data, sizeof(stamp));
+            memcpy(&imageId, data + sizeof(stamp), sizeof(imageId));
+            data[record.length] = '\0';
+            artTrackPut((const char*)data + 24, stamp[0], stamp[1], imageId);
+        } else {
+            break;
+        }
+        offset = body + (long)record.length;
+    }
+    coverArt.cacheEnd = offset;
+
+    long live = (long)sizeof(header);
+    for (int i = 0; i < coverArt.trackCount; i++) {
+        live += (long)(sizeof(ArtRecordHeader) + 24 + strlen(coverArt.tracks[i].path));
+        int image = coverArt.tracks[i].imageId ? artImageFind(coverArt.tracks[i].imageId) : -1;
+        if (image >= 0 && !coverArt.images[image].referenced) {
+            coverArt.images[image].referenced = true;
+            live += (long)(sizeof(ArtRecordHeader) + sizeof(unsigned long long) + ART_IMAGE_BYTES);
+        }
+    }
+    if (offset != fileEnd || live * 2 < offset) artCacheCompact();
+}
+
+// Decodes base64 in place; returns the decoded length (stops at the first other character)
+size_t artBase64Decode(unsigned char* text, size_t length) {
+    size_t out = 0;
+    unsigned int bits = 0;
+    int count = 0;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = text[i];
+        int value;
+        if (c >= 'A' && c <= 'Z') value = c - 'A';
+        else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') value = c - '0' + 52;
+        else if (c == '+') value = 62;
+        else if (c == '/') value = 63;
+        else break; // Padding or the end of the value
+        bits = bits << 6 | (unsigned int)value;
+        if (++count == 4) {
+            text[out++] = (unsigned char)(bits >> 16);
+            text[out++] = (unsigned char)(bits >> 8);
+            text[out++] = (unsigned char)bits;
+            bits = 0;
+            count = 0;
+        }
+    }
+    if (count == 2) text[out++] = (unsigned char)(bits >> 4);
+    if (count == 3) {
+        text[out++] = (unsigned char)(bits >> 10);
+        text[out++] = (unsigned char)(bits >> 2);
+    }
+    return out;
+}
+
+// Image data inside a FLAC PICTURE block (also what METADATA_BLOCK_PICTURE holds); sets its
+// size and picture type (3 = front cover), NULL if the block is malformed
+const unsigned char* artParsePictureBlock(const unsigned char* block, size_t size, size_t* imageSize, unsigned int* type) {
+    if (size < 32) return NULL;
+    *type = artReadBe32(block);
+    size_t at = 4;
+    for (int skip = 0; skip < 2; skip++) { // MIME type, then description
+        size_t length = artReadBe32(block + at);
+        if (length > size - at - 4) return NULL;
+        at += 4 + length;
+        if (size - at < 4) return NULL;
+    }
+    if (size - at < 20) return NULL;
+    at += 16; // Width, height, depth, colours: the image says for itself
+    size_t length = artReadBe32(block + at);
+    at += 4;
+    if (length == 0 || length > size - at) return NULL;
+    *imageSize = length;
+    return block + at;
+}
+
+// Keeps the better of two pictures in *best: a front cover beats anything else, otherwise
+// the first one found stays. Takes ownership of 'data' (the picture starts at 'image').
+void artOfferPicture(unsigned char** best, size_t* bestSize, bool* bestIsFront, unsigned char* data, const unsigned char* image,
+                     size_t size, bool front) {
+    if (*best && (*bestIsFront || !front)) {
+        free(data);
+        return;
+    }
+    memmove(data, image, size);
+    free(*best);
+    *best = data;
+    *bestSize = size;
+    *bestIsFront = front;
+}
+
+unsigned char* artFromFlac(FILE* fp, size_t* size) {
+    unsigned char* best = NULL;
+    bool bestIsFront = false;
+    unsigned char header[4];
+    while (!bestIsFront && fread(header, 4, 1, fp) == 1) {
+        size_t length = (size_t)header[1] << 16 | (size_t)header[2] << 8 | header[3];
+        if ((header[0] & 0x7F) == 6 && length <= ART_MAX_PICTURE_BYTES + 4096) {
+            unsigned char* block = (unsigned char*)malloc(length ? length : 1);
+            if (!block || fread(block, length, 1, fp) != 1) {
+                free(block);
+                break;
+            }
+            size_t imageSize;
+            unsigned int type;
+            const unsigned char* image = artParsePictureBlock(block, length, &imageSize, &type);
+            if (image && imageSize <= ART_MAX_PICTURE_BYTES) artOfferPicture(&best, size, &bestIsFront, block, image, imageSize, type == 3);
+            else free(block);
+        } else if (fseek(fp, (long)length, SEEK_CUR) != 0) {
+            break;
+        }
+        if (header[0] & 0x80) break; // Last metadata block
+    }
+    return best;
+}
+
+// Vorbis / Opus comment header: every picture comment is decoded and the best one kept
+unsigned char* artFromComments(unsigned char* packet, size_t length, size_t* size) {
+    size_t at;
+    if (length >= 7 && memcmp(packet, "\x03vorbis", 7) == 0) at = 7;
+    else if (length >= 8 && memcmp(packet, "OpusTags", 8) == 0) at = 8;
+    else return NULL;
+    if (length - at < 8) return NULL;
+    size_t vendor = artReadLe32(packet + at);
+    if (vendor > length - at - 8) return NULL;
+    at += 4 + vendor;
+    unsigned int count = artReadLe32(packet + at);
+    at += 4;
+    unsigned char* best = NULL;
+    bool bestIsFront = false;
+    for (unsigned int c = 0; c < count && length - at >= 4; c++) {
+        size_t commentLength = artReadLe32(packet + at);
+        at += 4;
+        if (commentLength > length - at) break;
+        unsigned char* comment = packet + at;
+        at += commentLength;
+        bool block = commentLength > 23 && _strnicmp((const char*)comment, "METADATA_BLOCK_PICTURE=", 23) == 0;
+        bool raw = commentLength > 9 && _strnicmp((const char*)comment, "COVERART=", 9) == 0;
+        if (!block && !raw) continue;
+        size_t prefix = block ? 23 : 9;
+        unsigned char* data = (unsigned char*)malloc(commentLength - prefix);
+        if (!data) break;
+        memcpy(data, comment + prefix, commentLength - prefix);
+        size_t decoded = artBase64Decode(data, commentLength - prefix);
+        size_t imageSize = decoded;
+        unsigned int type = 0;
+        const unsigned char* image = block ? artParsePictureBlock(data, decoded, &imageSize, &type) : data;
+        if (image && imageSize > 0 && imageSize <= ART_MAX_PICTURE_BYTES) artOfferPicture(&best, size, &bestIsFront, data, image, imageSize, type == 3);
+        else free(data);
+    }
+    return best;
+}
+
+// Reassembles the second packet of the first logical stream (the comment header) from the
+// Ogg pages and looks for pictures in it
+unsigned char* artFromOgg(FILE* fp, size_t* size) {
+    unsigned char header[27], lacing[255];
+    unsigned char* packet = NULL;
+    size_t length = 0, capacity = 0;
+    unsigned int serial = 0;
+    bool first = true, complete = false;
+    int packetIndex = 0;
+    while (!complete && fread(header, 27, 1, fp) == 1 && memcmp(header, "OggS", 4) == 0) {
+        int segments = header[26];
+        if (fread(lacing, 1, segments, fp) != (size_t)segments) break;
+        unsigned int pageSerial = artReadLe32(header + 14);
+        if (first) serial = pageSerial;
+        first = false;
+        if (pageSerial != serial) { // Another stream interleaved with ours
+            long skip = 0;
+            for (int s = 0; s < segments; s++) skip += lacing[s];
+            if (fseek(fp, skip, SEEK_CUR) != 0) break;
+            continue;
+        }
+        bool failed = false;
+        for (int s = 0; s < segments && !complete && !failed; s++) {
+            if (packetIndex == 1) {
+                if (length + lacing[s] + 1 > capacity) {
+                    size_t wanted = capacity ? capacity * 2 : 65536;
+                    unsigned char* grown = length + lacing[s] <= ART_MAX_HEADER_BYTES ? (unsigned char*)realloc(packet, wanted) : NULL;
+                    if (!grown) {
+                        failed = true;
+                        break;
+                    }
+                    packet = grown;
+                    capacity = wanted;
+                }
+                if (lacing[s] && fread(packet + length, lacing[s], 1, fp) != 1) failed = true;
+                length += lacing[s];
+            } else if (fseek(fp, lacing[s], SEEK_CUR) != 0) {
+                failed = true;
+            }
+            if (lacing[s] < 255) { // End of a packet
+                if (packetIndex == 1) complete = true;
+                packetIndex++;
+            }
+        }
+        if (failed) break;
+    }
+    unsigned char* picture = complete ? artFromComments(packet, length, size) : NULL;
+    free(packet);
+    return picture;
+}
+
+unsigned char* artReadWholeFile(const char* path, size_t* size) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    unsigned char* data = NULL;
+    long length = fseek(fp, 0, SEEK_END) == 0 ? ftell(fp) : -1;
+    if (length > 0 && length <= ART_MAX_PICTURE_BYTES && fseek(fp, 0, SEEK_SET) == 0) {
+        data = (unsigned char*)malloc((size_t)length);
+        if (data && fread(data, (size_t)length, 1, fp) != 1) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(fp);
+    *size = data ? (size_t)length : 0;
+    return data;
+}
+
+// Encoded picture for a track (malloc'd), embedded art first, then an image in its folder
+unsigned char* findTrackPicture(const char* path, size_t* size) {
+    unsigned char* picture = NULL;
+    FILE* fp = fopen(path, "rb");
+    if (fp) {
+        char magic[4];
+        if (fread(magic, 4, 1, fp) == 1) {
+            if (memcmp(magic, "fLaC", 4) == 0) {
+                picture = artFromFlac(fp, size);
+            } else if (memcmp(magic, "OggS", 4) == 0 && fseek(fp, 0, SEEK_SET) == 0) {
+                picture = artFromOgg(fp, size);
+            }
+        }
+        fclose(fp);
+    }
+    if (picture) return picture;
+
+    char imagePath[MAX_PATH_LENGTH];
+    int folder = 0;
+    for (int i = 0; path[i]; i++) {
+        if (path[i] == '\\' || path[i] == '/') folder = i + 1;
+    }
+    for (size_t i = 0; i < sizeof(artFolderImages) / sizeof(artFolderImages[0]) && !picture; i++) {
+        if (snprintf(imagePath, sizeof(imagePath), "%.*s%s", folder, path, artFolderImages[i]) >= (int)sizeof(imagePath)) continue;
+        picture = artReadWholeFile(imagePath, size);
+    }
+    return picture;
+}
+
+unsigned long long artHashBytes(const unsigned char* data, size_t size) {
+    unsigned long long hash = 14695981039346656037ull; // FNV-1a
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash ? hash : 1; // 0 means "no art"
+}
+
+// Centre-crops a picture to a square and box-filters it to size x size RGB. Every output
+// pixel averages the source pixels it covers, so big pictures shrink without aliasing.
+void artScale(const unsigned char* src, int width, int height, int channels, int size, unsigned char* out) {
+    int side = width < height ? width : height;
+    int left = (width - side) / 2, top = (height - side) / 2;
+    for (int y = 0; y < size; y++) {
+        int y0 = top + (int)((long long)y * side / size), y1 = top + (int)((long long)(y + 1) * side / size);
+        if (y1 <= y0) y1 = y0 + 1;
+        for (int x = 0; x < size; x++) {
+            int x0 = left + (int)((long long)x * side / size), x1 = left + (int)((long long)(x + 1) * side / size);
+            if (x1 <= x0) x1 = x0 + 1;
+            unsigned long long sum[3] = {0};
+            for (int sy = y0; sy < y1; sy++) {
+                const unsigned char* p = src + ((size_t)sy * width + x0) * channels;
+                for (int sx = x0; sx < x1; sx++, p += channels) {
+                    sum[0] += p[0];
+                    sum[1] += p[1];
+                    sum[2] += p[2];
+                }
+            }
+            unsigned long long count = (unsigned long long)(y1 - y0) * (x1 - x0);
+            for (int c = 0; c < 3; c++) *out++ = (unsigned char)((sum[c] + count / 2) / count);
+        }
+    }
+}
+
+// Worker thread: decodes a picture into the large and small RGB thumbnails
+bool artDecode(const unsigned char* picture, size_t size, unsigned char* rgb) {
+    sfImage* image = sfImage_createFromMemory(picture, size);
+    if (!image) return false;
+    sfVector2u dimensions = sfImage_getSize(image);
+    const sfUint8* pixels = sfImage_getPixelsPtr(image);
+    bool ok = pixels && dimensions.x > 0 && dimensions.y > 0;
+    if (ok) {
+        artScale(pixels, (int)dimensions.x, (int)dimensions.y, 4, ART_LARGE_SIZE, rgb);
+        // The small size comes from the large one: far fewer pixels to average
+        artScale(rgb, ART_LARGE_SIZE, ART_LARGE_SIZE, 3, ART_SMALL_SIZE, rgb + ART_LARGE_SIZE * ART_LARGE_SIZE * 3);
+    }
+    sfImage_destroy(image);
+    return ok;
+}
+
+// Worker thread: finds the art of 'path' through the pack or the file itself. Returns the
+// image id (0 = none) with its thumbnails in 'rgb'.
+unsigned long long artLoadTrack(const char* path, unsigned char* rgb) {
+    long long size, modified;
+    if (!getFileStamp(path, &size, &modified)) return 0;
+    int track = artTrackFind(path);
+    if (track >= 0 && coverArt.tracks[track].size == size && coverArt.tracks[track].modified == modified) {
+        unsigned long long imageId = coverArt.tracks[track].imageId;
+        int image = imageId ? artImageFind(imageId) : -1;
+        if (imageId == 0 || (image >= 0 && artCacheReadImage(image, rgb))) {
+            sfMutex_lock(coverArt.lock);
+            coverArt.cacheHits++;
+            sfMutex_unlock(coverArt.lock);
+            return imageId;
+        }
+    }
+
+    size_t pictureSize = 0;
+    unsigned char* picture = findTrackPicture(path, &pictureSize);
+    bool found = picture != NULL, decoded = false;
+    unsigned long long imageId = found ? artHashBytes(picture, pictureSize) : 0;
+    int image = imageId ? artImageFind(imageId) : -1;
+    if (imageId && !(image >= 0 && artCacheReadImage(image, rgb))) { // Not shared with a track seen before
+        decoded = artDecode(picture, pictureSize, rgb);
+        if (!decoded) imageId = 0;
+        else artCacheAppendImage(imageId, rgb);
+    }
+    free(picture);
+    ArtTrackRecord record;
+    snprintf(record.path, sizeof(record.path), "%s", path);
+    record.size = size;
+    record.modified = modified;
+    record.imageId = imageId;
+    if (artTrackPut(path, size, modified, imageId)) artCacheAppendTrack(&record);
+    sfMutex_lock(coverArt.lock);
+    if (decoded) coverArt.decoded++;
+    else if (imageId) coverArt.cacheHits++; // Same picture as a track seen before
+    else if (found) coverArt.failed++;
+    else coverArt.noArt++;
+    sfMutex_unlock(coverArt.lock);
+    return imageId;
+}
+
+void coverArtWorker(void* userData) {
+    (void)userData;
+    unsigned char* rgb = (unsigned char*)malloc(ART_IMAGE_BYTES);
+    if (!rgb) {
+        fprintf(stderr, "Memory allocation failed for cover art worker.\n");
+        return;
+    }
+    sfMutex_lock(coverArt.lock);
+    while (!coverArt.stop) {
+        if (coverArt.jobCount == 0) {
+            ResetEvent(coverArt.wake);
+            sfMutex_unlock(coverArt.lock);
+            WaitForSingleObject(coverArt.wake, INFINITE);
+            sfMutex_lock(coverArt.lock);
+            continue;
+        }
+        ArtResult result;
+        memset(&result, 0, sizeof(result));
+        strcpy(result.path, coverArt.jobs[--coverArt.jobCount]);
+        sfMutex_unlock(coverArt.lock);
+
+        result.imageId = artLoadTrack(result.path, rgb);
+        if (result.imageId) {
+            // RGBA for the texture upload, so the UI thread only copies
+            result.pixels = (unsigned char*)malloc(ART_IMAGE_BYTES / 3 * 4);
+            if (result.pixels) {
+                for (int i = 0; i < ART_IMAGE_BYTES / 3; i++) {
+                    memcpy(result.pixels + i * 4, rgb + i * 3, 3);
+                    result.pixels[i * 4 + 3] = 255;
+                }
+            } else {
+                result.imageId = 0;
+            }
+        }
+
+        sfMutex_lock(coverArt.lock);
+        coverArt.results[coverArt.resultCount++] = result; // Room was made when the job was queued
+    }
+    sfMutex_unlock(coverArt.lock);
+    free(rgb);
+}
+
+// Results get their room here, so every queued job is sure to be answered
+bool queueCoverArt(const char* path) {
+    sfMutex_lock(coverArt.lock);
+    if (coverArt.jobCount == coverArt.jobCapacity) {
+        int newCapacity = coverArt.jobCapacity ? coverArt.jobCapacity * 2 : 64;
+        char (*grown)[MAX_PATH_LENGTH] = realloc(coverArt.jobs, (size_t)newCapacity * MAX_PATH_LENGTH);
+        if (grown) {
+            coverArt.jobs = grown;
+            coverArt.jobCapacity = newCapacity;
+        }
+    }
+    int needed = coverArt.jobCount + coverArt.resultCount + 2; // This job and the one being worked on
+    if (needed > coverArt.resultCapacity) {
+        int newCapacity = coverArt.resultCapacity ? coverArt.resultCapacity * 2 : 64;
+        if (newCapacity < needed) newCapacity = needed;
+        ArtResult* grown = (ArtResult*)realloc(coverArt.results, (size_t)newCapacity * sizeof(ArtResult));
+        if (grown) {
+            coverArt.results = grown;
+            coverArt.resultCapacity = newCapacity;
+        }
+    }
+    bool queued = coverArt.jobCount < coverArt.jobCapacity && needed <= coverArt.resultCapacity;
+    if (queued) {
+        snprintf(coverArt.jobs[coverArt.jobCount++], MAX_PATH_LENGTH, "%s", path);
+        SetEvent(coverArt.wake);
+    } else {
+        fprintf(stderr, "Memory allocation failed for cover art queue.\n");
+    }
+    sfMutex_unlock(coverArt.lock);
+    return queued;
+}
+
+// UI thread, once the window exists: creates the atlas, reads the pack and starts the worker
+void startCoverArt(void) {
+    if (!coverArtEnabled || coverArt.lock) return;
+    coverArt.atlasSize = lowMemoryMode ? ART_LOW_MEMORY_ATLAS_SIZE : ART_ATLAS_SIZE;
+    coverArt.largeRows = lowMemoryMode ? ART_LOW_MEMORY_LARGE_ROWS : ART_LARGE_ROWS;
+    coverArt.atlas = sfTexture_create(coverArt.atlasSize, coverArt.atlasSize);
+    if (!coverArt.atlas) {
+        fprintf(stderr, "Failed to create the cover art atlas.\n");
+        return;
+    }
+    sfTexture_setSmooth(coverArt.atlas, sfTrue);
+    int largeColumns = coverArt.atlasSize / ART_LARGE_SIZE;
+    coverArt.slotCount[ART_LARGE] = largeColumns * coverArt.largeRows;
+    coverArt.slotCount[ART_SMALL] = (coverArt.atlasSize / ART_SMALL_SIZE) * ((coverArt.atlasSize - coverArt.largeRows * ART_LARGE_SIZE) / ART_SMALL_SIZE);
+    coverArt.lock = sfMutex_create();
+    coverArt.wake = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!coverArt.lock || !coverArt.wake) return;
+    loadArtCache();
+    coverArt.worker = sfThread_create(coverArtWorker, NULL);
+    if (coverArt.worker) sfThread_launch(coverArt.worker);
+}
+
+sfIntRect artSlotRect(ArtSize size, int slot) {
+    int pixels = artSizes[size];
+    int columns = coverArt.atlasSize / pixels;
+    int top = size == ART_SMALL ? coverArt.largeRows * ART_LARGE_SIZE : 0;
+    return (sfIntRect){ (slot % columns) * pixels, top + (slot / columns) * pixels, pixels, pixels };
+}
+
+int artAtlasFind(ArtSize size, unsigned long long imageId) {
+    for (int i = 0; i < coverArt.slotCount[size]; i++) {
+        if (coverArt.slots[size][i].imageId == imageId) return i;
+    }
+    return -1;
+}
+
+// Copies one thumbnail into a free slot, or the least recently drawn one that was not drawn
+// this frame; -1 if every slot is on screen
+int artAtlasUpload(ArtSize size, unsigned long long imageId, const unsigned char* pixels) {
+    int slot = -1;
+    for (int i = 0; i < coverArt.slotCount[size]; i++) {
+        const ArtSlot* candidate = &coverArt.slots[size][i];
+        if (candidate->imageId == 0) {
+            slot = i;
+            break;
+        }
+        if (candidate->lastUsed != coverArt.frame && (slot < 0 || candidate->lastUsed < coverArt.slots[size][slot].lastUsed)) slot = i;
+    }
+    if (slot < 0) return -1;
+    if (coverArt.slots[size][slot].imageId) coverArt.evictions++;
+    sfIntRect rect = artSlotRect(size, slot);
+    sfTexture_updateFromPixels(coverArt.atlas, pixels, rect.width, rect.height, rect.left, rect.top);
+    coverArt.slots[size][slot].imageId = imageId;
+    coverArt.slots[size][slot].lastUsed = coverArt.frame;
+    coverArt.uploads++;
+    return slot;
+}
+
+// Drops the entries whose art is neither on its way nor in the atlas; their tracks are looked
+// up again (in the pack, so cheaply) if they come back on screen. Entry pointers go stale.
+void artDropEntries(void) {
+    int kept = 0;
+    for (int e = 0; e < coverArt.entryCount; e++) {
+        const ArtEntry* entry = &coverArt.entries[e];
+        bool keep = entry->pending;
+        for (int s = 0; s < ART_SIZE_COUNT && !keep; s++) {
+            keep = entry->imageId && entry->slot[s] >= 0 && coverArt.slots[s][entry->slot[s]].imageId == entry->imageId;
+        }
+        if (keep && kept != e) coverArt.entries[kept] = *entry;
+        kept += keep;
+    }
+    coverArt.entryCount = kept;
+    int mask = coverArt.entrySlotCapacity - 1;
+    memset(coverArt.entrySlots, 0xff, (size_t)coverArt.entrySlotCapacity * sizeof(int));
+    for (int e = 0; e < kept; e++) {
+        int i = (int)(artEntryHash(e) & mask);
+        while (coverArt.entrySlots[i] >= 0) i = (i + 1) & mask;
+        coverArt.entrySlots[i] = e;
+    }
+    // Everything still in use stays, so the table may outgrow the limit by that much
+    coverArt.entryLimit = kept * 2 > ART_MAX_ENTRIES ? kept * 2 : ART_MAX_ENTRIES;
+}
+
+ArtEntry* artEntryFor(const char* path) {
+    int mask = coverArt.entrySlotCapacity - 1;
+    int i = coverArt.entrySlotCapacity ? (int)(hashKey(path) & mask) : 0;
+    for (; coverArt.entrySlotCapacity && coverArt.entrySlots[i] >= 0; i = (i + 1) & mask) {
+        if (strcmp(coverArt.entries[coverArt.entrySlots[i]].path, path) == 0) return &coverArt.entries[coverArt.entrySlots[i]];
+    }
+    if (coverArt.entryCount >= coverArt.entryLimit && coverArt.entryCount >= ART_MAX_ENTRIES) {
+        artDropEntries();
+        i = (int)(hashKey(path) & mask);
+        while (coverArt.entrySlots[i] >= 0) i = (i + 1) & mask;
+    }
+    if (coverArt.entryCount == coverArt.entryCapacity) {
+        int capacity = coverArt.entryCapacity ? coverArt.entryCapacity * 2 : 256;
+        ArtEntry* grown = (ArtEntry*)realloc(coverArt.entries, (size_t)capacity * sizeof(ArtEntry));
+        if (!grown) return NULL;
+        coverArt.entries = grown;
+        coverArt.entryCapacity = capacity;
+    }
+    if ((coverArt.entryCount + 1) * 2 > coverArt.entrySlotCapacity) {
+        if (!artGrowSlots(&coverArt.entrySlots, &coverArt.entrySlotCapacity, coverArt.entryCount, artEntryHash)) return NULL;
+        mask = coverArt.entrySlotCapacity - 1;
+        i = (int)(hashKey(path) & mask);
+        while (coverArt.entrySlots[i] >= 0) i = (i + 1) & mask;
+    }
+    ArtEntry* entry = &coverArt.entries[coverArt.entryCount];
+    memset(entry, 0, sizeof(*entry));
+    snprintf(entry->path, sizeof(entry->path), "%s", path);
+    for (int s = 0; s < ART_SIZE_COUNT; s++) entry->slot[s] = -1;
+    coverArt.entrySlots[i] = coverArt.entryCount++;
+    return entry;
+}
+
+// Atlas rectangle holding the art of 'path' at 'size'. When it is not there yet the track
+// is queued for the worker and false is returned; the art shows up a few frames later.
+bool coverArtRect(const char* path, ArtSize size, sfIntRect* rect) {
+    if (!coverArt.lock || !path) return false;
+    ArtEntry* entry = artEntryFor(path);
+    if (!entry) return false;
+    entry->wanted |= (unsigned char)(1 << size);
+    if (entry->pending || (entry->known && entry->imageId == 0)) return false;
+    if (entry->known) {
+        int slot = entry->slot[size];
+        if (slot < 0 || coverArt.slots[size][slot].imageId != entry->imageId) slot = entry->slot[size] = artAtlasFind(size, entry->imageId);
+        if (slot >= 0) {
+            coverArt.slots[size][slot].lastUsed = coverArt.frame;
+            *rect = artSlotRect(size, slot);
+            return true;
+        }
+    }
+    entry->pending = queueCoverArt(path); // Unknown, or evicted from the atlas: the worker reads the pack again
+    return false;
+}
+
+// Points 'sprite' at the art of 'path', drawn 'pixels' wide; false while there is none
+bool showCoverArt(sfSprite* sprite, const char* path, ArtSize size, float pixels) {
+    sfIntRect rect;
+    if (!coverArtRect(path, size, &rect)) return false;
+    sfSprite_setTexture(sprite, coverArt.atlas, sfFalse);
+    sfSprite_setTextureRect(sprite, rect);
+    sfSprite_setScale(sprite, (sfVector2f){pixels / artSizes[size], pixels / artSizes[size]});
+    return true;
+}
+
+// Gives a sprite its final size before any art arrived, so layouts can place it
+void prepareArtSprite(sfSprite* sprite, ArtSize size, float pixels) {
+    if (!sprite || !coverArt.atlas) return;
+    sfSprite_setTexture(sprite, coverArt.atlas, sfFalse);
+    sfSprite_setTextureRect(sprite, artSlotRect(size, 0));
+    sfSprite_setScale(sprite, (sfVector2f){pixels / artSizes[size], pixels / artSizes[size]});
+}
+
+// UI thread, every frame: uploads a few finished thumbnails into the atlas
+void applyCoverArtResults(void) {
+    if (!coverArt.lock) return;
+    coverArt.frame++;
+    ArtResult batch[ART_UPLOADS_PER_FRAME];
+    sfMutex_lock(coverArt.lock);
+    int count = coverArt.resultCount < ART_UPLOADS_PER_FRAME ? coverArt.resultCount : ART_UPLOADS_PER_FRAME;
+    if (count > 0) {
+        memcpy(batch, coverArt.results, (size_t)count * sizeof(ArtResult));
+        memmove(coverArt.results, coverArt.results + count, (size_t)(coverArt.resultCount - count) * sizeof(ArtResult));
+        coverArt.resultCount -= count;
+    }
+    sfMutex_unlock(coverArt.lock);
+
+    for (int i = 0; i < count; i++) {
+        ArtEntry* entry = artEntryFor(batch[i].path);
+        if (entry) {
+            entry->pending = false;
+            entry->known = true;
+            entry->imageId = batch[i].imageId;
+            const unsigned char* pixels = batch[i].pixels;
+            for (int s = 0; s < ART_SIZE_COUNT && pixels; s++) {
+                if (entry->wanted & (1 << s)) {
+                    entry->slot[s] = artAtlasFind((ArtSize)s, entry->imageId);
+                    if (entry->slot[s] < 0) entry->slot[s] = artAtlasUpload((ArtSize)s, entry->imageId, pixels);
+                }
+                pixels += artSizes[s] * artSizes[s] * 4;
+            }
+        }
+        free(batch[i].pixels);
+    }
+}
+
+void stopCoverArt(void) {
+    if (coverArt.worker) {
+        sfMutex_lock(coverArt.lock);
+        coverArt.stop = true;
+        SetEvent(coverArt.wake);
+        sfMutex_unlock(coverArt.lock);
+        sfThread_wait(coverArt.worker);
+        sfThread_destroy(coverArt.worker);
+    }
+    for (int i = 0; i < coverArt.resultCount; i++) free(coverArt.results[i].pixels);
+    if (coverArt.cache) fclose(coverArt.cache);
+    if (coverArt.atlas) sfTexture_destroy(coverArt.atlas);
+    if (coverArt.lock) sfMutex_destroy(coverArt.lock);
+    if (coverArt.wake) CloseHandle(coverArt.wake);
+    free(coverArt.jobs);
+    free(coverArt.results);
+    free(coverArt.tracks);
+    free(coverArt.trackSlots);
+    free(coverArt.images);
+    free(coverArt.imageSlots);
+    free(coverArt.entries);
+    free(coverArt.entrySlots);
+    memset(&coverArt, 0, sizeof(coverArt));
+}
+
+// -------------------------- Create Playlist Screen Variables & Functions --------------------------
+
+// Input for playlist name
+char createPlNameInput[MAX_PLAYLIST_NAME_LENGTH + 1] = "";
+sfText* createPlNameLabel = NULL;
+sfText* createPlNameTextInput = NULL;
+sfRectangleShape* createPlNameInputRect = NULL; // New: Rectangle for input field
+
+// UI elements for the Create Playlist Screen (static to persist across calls)
+static sfText* createPlTitle_s = NULL;
+static sfText* createPlSongsHeading_s = NULL;
+static sfText* createPlCreateBtn_s = NULL;
+static sfText* createPlCancelBtn_s = NULL;
+
+int songSelected[MAX_SELECTABLE_SONGS]; // 0 for unselected, 1 for selected
+sfText* selectableSongTexts[MAX_SELECTABLE_SONGS]; // Text objects for each song name
+Song* selectableSongs[MAX_SELECTABLE_SONGS]; // Song shown on each row
+sfText* selectableGroupTexts[MAX_SELECTABLE_SONGS]; // Artist / album heading shown above a row
+sfSprite* selectableArtSprites[MAX_SELECTABLE_SONGS]; // Cover art left of each row
+int selectableArtWidgets[MAX_SELECTABLE_SONGS];
+#define SONG_ROW_ART_SIZE 20
+#define SONG_ROW_ART_GAP 4
+#define SONG_ROW_INDENT (SONG_ROW_ART_SIZE + SONG_ROW_ART_GAP + 6) // Kept free for the next column's art
+bool hideDuplicateSongs = false; // F5: leave fingerprint duplicates out of the list
+LibrarySortKey createSortKey = SORT_LIBRARY; // F7 cycles through the sort keys
+bool createSortReversed = false; // F8
+static Layout createLayout;
+
+// Selected rows are cyan; songs that duplicate an earlier recording are greyed out
+void styleSelectableSong(int i) {
+    if (!selectableSongTexts[i]) return;
+    if (songSelected[i]) sfText_setFillColor(selectableSongTexts[i], sfCyan);
+    else if (selectableSongs[i]->duplicateOf) sfText_setFillColor(selectableSongTexts[i], sfColor_fromRGB(140, 140, 140));
+    else sfText_setFillColor(selectableSongTexts[i], sfWhite);
+}
+
+void updateCreateSongsHeading(void) {
+    if (!createPlSongsHeading_s) return;
+    char heading[160];
+    snprintf(heading, sizeof(heading), "Available Songs by %s%s: (F5 hides duplicates, F7 sorts, F8 reverses)",
+             librarySortNames[createSortKey], createSortReversed ? ", reversed" : "");
+    sfText_setString(createPlSongsHeading_s, heading);
+}
+
+// (Re)builds the song rows in the chosen sort order, keeping the selection of songs that
+// stay visible. Artist and album headings take a slot of the row budget each.
+void buildSelectableSongRows(sfFont* font, Song* allSongs) {
+    Song* selected[MAX_SELECTABLE_SONGS];
+    int selectedCount = 0;
+    for (int i = 0; i < MAX_SELECTABLE_SONGS; i++) {
+        if (selectableSongs[i] && songSelected[i]) selected[selectedCount++] = selectableSongs[i];
+        if (selectableSongTexts[i]) sfText_destroy(selectableSongTexts[i]);
+        if (selectableGroupTexts[i]) sfText_destroy(selectableGroupTexts[i]);
+        selectableSongTexts[i] = NULL;
+        selectableGroupTexts[i] = NULL;
+        selectableSongs[i] = NULL;
+        songSelected[i] = 0;
+    }
+
+    // Songs the table could not take are left out of its orders, so an empty order means
+    // the table is unusable and the rows fall back to library order
+    int orderCount = 0;
+    const int* order = libraryTableOrder(&libraryTable, createSortKey, &orderCount);
+    Song* currentSongPtr = allSongs;
+    const char* lastGroup = NULL;
+    int i = 0, slots = 0;
+    for (int n = 0; slots < MAX_SELECTABLE_SONGS; n++) {
+        Song* song;
+        int row = -1;
+        if (orderCount > 0) {
+            if (n >= orderCount) break;
+            row = order[createSortReversed ? orderCount - 1 - n : n];
+            song = libraryTable.song[row];
+        } else {
+            if (!currentSongPtr) break;
+            song = currentSongPtr;
+            currentSongPtr = currentSongPtr->next;
+        }
+        if (hideDuplicateSongs && song->duplicateOf) continue;
+
+        const char* group = row >= 0 ? libraryTableGroup(&libraryTable, createSortKey, row) : NULL;
+        if (group && (!lastGroup || strcmp(group, lastGroup) != 0)) {
+            if (slots + 2 > MAX_SELECTABLE_SONGS) break;
+            selectableGroupTexts[i] = createLabel(font, group[0] ? group : "(unknown)", 0, 0, 18);
+            if (selectableGroupTexts[i]) sfText_setFillColor(selectableGroupTexts[i], sfYellow);
+            ellipsizeLabel(selectableGroupTexts[i], LIST_COLUMN_WIDTH - SONG_ROW_INDENT);
+            lastGroup = group;
+            slots++;
+        }
+
+        char label[160];
+        int length = snprintf(label, sizeof(label), song->duplicateOf ? "%s (duplicate)" : "%s", song->name);
+        if (length < 0 || length >= (int)sizeof(label)) length = sizeof(label) - 1;
+        if (createSortKey == SORT_DURATION && song->durationMs > 0) {
+            unsigned int seconds = song->durationMs / 1000;
+            snprintf(label + length, sizeof(label) - length, "  %u:%02u", seconds / 60, seconds % 60);
+        } else if (createSortKey == SORT_PLAY_COUNT && song->playCount > 0) {
+            snprintf(label + length, sizeof(label) - length, "  (%u plays)", song->playCount);
+        }
+        selectableSongTexts[i] = createLabel(font, label, 0, 0, 18);
+        ellipsizeLabel(selectableSongTexts[i], LIST_COLUMN_WIDTH - SONG_ROW_INDENT);
+        selectableSongs[i] = song;
+        if (!selectableArtSprites[i]) {
+            selectableArtSprites[i] = sfSprite_create();
+            prepareArtSprite(selectableArtSprites[i], ART_SMALL, SONG_ROW_ART_SIZE);
+        }
+        for (int s = 0; s < selectedCount; s++) {
+            if (selected[s] == song) songSelected[i] = 1;
+        }
+        styleSelectableSong(i);
+        i++;
+        slots++;
+    }
+}
+
+// Song rows flow into as many columns as fit above the buttons
+void layoutCreatePlaylistScreen(void) {
+    layoutReset(&createLayout);
+    layoutSetFlow(&createLayout, 70, 180, 25, LIST_COLUMN_WIDTH, 60);
+    layoutAnchor(&createLayout, WIDGET_TEXT, createPlTitle_s, 0.5f, -150, 0, 20, 0);
+    layoutAnchor(&createLayout, WIDGET_TEXT, createPlNameLabel, 0, 50, 0, 80, 0);
+    layoutAnchor(&createLayout, WIDGET_RECT, createPlNameInputRect, 0, 195, 0, 75, 0); // Behind the input text
+    layoutAnchor(&createLayout, WIDGET_TEXT, createPlNameTextInput, 0, 200, 0, 80, 0);
+    layoutAnchor(&createLayout, WIDGET_TEXT, createPlSongsHeading_s, 0, 50, 0, 150, 0);
+    for (int i = 0; i < MAX_SELECTABLE_SONGS && selectableSongs[i] != NULL; i++) {
+        if (selectableGroupTexts[i]) layoutFlow(&createLayout, WIDGET_TEXT, selectableGroupTexts[i]);
+        int row = layoutFlow(&createLayout, WIDGET_TEXT, selectableSongTexts[i]);
+        layoutSetAction(&createLayout, row, ACTION_ROW + i);
+        selectableArtWidgets[i] = layoutAttach(&createLayout, WIDGET_SPRITE, selectableArtSprites[i], PLACE_LEFT_OF, row, SONG_ROW_ART_GAP, 0);
+        layoutSetHidden(&createLayout, selectableArtWidgets[i], true);
+    }
+    layoutSetAction(&createLayout, layoutAnchor(&createLayout, WIDGET_TEXT, createPlCreateBtn_s, 0.5f, -200, 1, -50, 0), ACTION_CREATE);
+    layoutSetAction(&createLayout, layoutAnchor(&createLayout, WIDGET_TEXT, createPlCancelBtn_s, 0.5f, 0, 1, -50, 0), ACTION_CANCEL);
+}
+
+static bool createPlUiInitialized = false;
+
+// Initialize/Reset UI elements when entering the screen
+void initCreatePlaylistScreen(sfFont* font, Song* allSongs) {
+    if (!createPlUiInitialized) {
+        // Clear previous selections and input
+        memset(songSelected, 0, sizeof(songSelected));
+        strcpy(createPlNameInput, ""); // Clear name input
+
+        // Destroy previous UI elements if re-initializing to prevent memory leaks
+        if (createPlTitle_s) sfText_destroy(createPlTitle_s);
+        if (createPlNameLabel) sfText_destroy(createPlNameLabel);
+        if (createPlNameTextInput) sfText_destroy(createPlNameTextInput);
+        if (createPlNameInputRect) sfRectangleShape_destroy(createPlNameInputRect); // Destroy the rectangle
+        if (createPlSongsHeading_s) sfText_destroy(createPlSongsHeading_s);
+        if (createPlCreateBtn_s) sfText_destroy(createPlCreateBtn_s);
+        if (createPlCancelBtn_s) sfText_destroy(createPlCancelBtn_s);
+
+        createPlTitle_s = createLabel(font, "Create New Playlist", 0, 0, 30);
+        if (createPlTitle_s) sfText_setFillColor(createPlTitle_s, sfGreen);
+
+        createPlNameLabel = createLabel(font, "Playlist Name:", 0, 0, 20);
+        createPlNameTextInput = createLabel(font, "", 0, 0, 20);
+        if (createPlNameTextInput) sfText_setFillColor(createPlNameTextInput, sfYellow);
+
+        // New: Create rectangle for input field
+        createPlNameInputRect = sfRectangleShape_create();
+        if (createPlNameInputRect) {
+            sfRectangleShape_setSize(createPlNameInputRect, (sfVector2f){300, 30}); // Adjust size as needed
+            sfRectangleShape_setFillColor(createPlNameInputRect, sfColor_fromRGBA(50, 50, 50, 150)); // Semi-transparent dark grey
+            sfRectangleShape_setOutlineThickness(createPlNameInputRect, 1);
+            sfRectangleShape_setOutlineColor(createPlNameInputRect, sfWhite);
+        }
+
+        createPlSongsHeading_s = createLabel(font, "", 0, 0, 20);
+        updateCreateSongsHeading();
+
+        // Populate selectable songs
+        buildSelectableSongRows(font, allSongs);
+
+        createPlCreateBtn_s = createLabel(font, "CREATE", 0, 0, 24);
+        if (createPlCreateBtn_s) sfText_setFillColor(createPlCreateBtn_s, sfGreen);
+        createPlCancelBtn_s = createLabel(font, "CANCEL", 0, 0, 24);
+        if (createPlCancelBtn_s) sfText_setFillColor(createPlCancelBtn_s, sfRed);
+        layoutCreatePlaylistScreen();
+
+        createPlUiInitialized = true;
+    }
+}
+
+// Low-memory mode: the screen's text objects and layout are rebuilt on the next visit anyway
+void releaseCreatePlaylistScreen(void) {
+    if (createPlTitle_s) { sfText_destroy(createPlTitle_s); createPlTitle_s = NULL; }
+    if (createPlNameLabel) { sfText_destroy(createPlNameLabel); createPlNameLabel = NULL; }
+    if (createPlNameTextInput) { sfText_destroy(createPlNameTextInput); createPlNameTextInput = NULL; }
+    if (createPlNameInputRect) { sfRectangleShape_destroy(createPlNameInputRect); createPlNameInputRect = NULL; }
+    if (createPlSongsHeading_s) { sfText_destroy(createPlSongsHeading_s); createPlSongsHeading_s = NULL; }
+    if (createPlCreateBtn_s) { sfText_destroy(createPlCreateBtn_s); createPlCreateBtn_s = NULL; }
+    if (createPlCancelBtn_s) { sfText_destroy(createPlCancelBtn_s); createPlCancelBtn_s = NULL; }
+    for (int i = 0; i < MAX_SELECTABLE_SONGS; i++) {
+        if (selectableSongTexts[i]) { sfText_destroy(selectableSongTexts[i]); selectableSongTexts[i] = NULL; }
+        if (selectableGroupTexts[i]) { sfText_destroy(selectableGroupTexts[i]); selectableGroupTexts[i] = NULL; }
+        if (selectableArtSprites[i]) { sfSprite_destroy(selectableArtSprites[i]); selectableArtSprites[i] = NULL; }
+        selectableSongs[i] = NULL;
+    }
+    layoutFree(&createLayout);
+}
+
+// Handles one queued event for the Create Playlist screen
+// Returns true when the screen is finished (create or cancel)
+bool handleCreatePlaylistScreen(sfRenderWindow* window, const InputEvent* input, sfFont* font, Song* allSongs, Playlist** allPlaylists) {
+    const sfEvent* event = &input->event;
+    initCreatePlaylistScreen(font, allSongs);
+
+    // --- Event Handling for Create Playlist Screen ---
+    if (event->type == sfEvtTextEntered) {
+        sfUint32 c = event->text.unicode;
+        if (c == '\b') {
+            if (strlen(createPlNameInput) > 0) {
+                createPlNameInput[strlen(createPlNameInput) - 1] = '\0';
+            }
+        } else if (c < 32 || c >= 127) {
+            // Enter (we have a button), other control keys and non-ASCII are ignored
+        } else if (strlen(createPlNameInput) < MAX_PLAYLIST_NAME_LENGTH) {
+            char ch = (char)c;
+            strncat(createPlNameInput, &ch, 1);
+        }
+        if (createPlNameTextInput) sfText_setString(createPlNameTextInput, createPlNameInput);
+    } else if (event->type == sfEvtKeyPressed && event->key.code == sfKeyF5 && !input->repeat) {
+        hideDuplicateSongs = !hideDuplicateSongs;
+        buildSelectableSongRows(font, allSongs);
+        layoutCreatePlaylistScreen(); // The rows are new sfText objects
+    } else if (event->type == sfEvtKeyPressed && (event->key.code == sfKeyF7 || event->key.code == sfKeyF8) && !input->repeat) {
+        if (event->key.code == sfKeyF7) createSortKey = (LibrarySortKey)((createSortKey + 1) % SORT_KEY_COUNT);
+        else createSortReversed = !createSortReversed;
+        updateCreateSongsHeading();
+        buildSelectableSongRows(font, allSongs);
+        layoutCreatePlaylistScreen();
+    } else if (event->type == sfEvtMouseButtonPressed) {
+        sfVector2f mouse = sfRenderWindow_mapPixelToCoords(window, (sfVector2i){event->mouseButton.x, event->mouseButton.y}, NULL);
+        int action = layoutHitTest(&createLayout, mouse.x, mouse.y);
+
+        // Click on song names to select/deselect
+        if (action >= ACTION_ROW) {
+            int i = action - ACTION_ROW;
+            songSelected[i] = !songSelected[i]; // Toggle selection
+            styleSelectableSong(i); // Highlight selected
+        }
+
+        // Click on CREATE button
+        if (action == ACTION_CREATE) {
+            if (strlen(createPlNameInput) > 0) {
+                Playlist* newPl = createPlaylist(createPlNameInput);
+                if (newPl) {
+                    for (int i = 0; i < MAX_SELECTABLE_SONGS && selectableSongs[i] != NULL; i++) {
+                        if (songSelected[i]) {
+                            enqueueSong(newPl, selectableSongs[i]);
+                        }
+                    }
+                    printf("Playlist '%s' created with selected songs.\n", createPlNameInput);
+                }
+            } else {
+                printf("Please enter a playlist name.\n");
+                if (createPlNameTextInput) sfText_setFillColor(createPlNameTextInput, sfRed);
+            }
+            createPlUiInitialized = false;
+            if (lowMemoryMode) releaseCreatePlaylistScreen();
+            currentAppState = MAIN_PLAYER;
+            return true;
+        }
+
+        // Click on CANCEL button
+        if (action == ACTION_CANCEL) {
+            printf("Playlist creation canceled.\n");
+            createPlUiInitialized = false;
+            if (lowMemoryMode) releaseCreatePlaylistScreen();
+            currentAppState = MAIN_PLAYER;
+            return true;
+        }
+    }
+
+    return false; // Screen is not finished yet
+}
+
+void drawCreatePlaylistScreen(sfRenderWindow* window, sfFont* font, Song* allSongs) {
+    initCreatePlaylistScreen(font, allSongs);
+    // Art appears as the worker delivers it; a row without any keeps its sprite hidden
+    for (int i = 0; i < MAX_SELECTABLE_SONGS && selectableSongs[i] != NULL; i++) {
+        bool shown = selectableArtSprites[i] && showCoverArt(selectableArtSprites[i], selectableSongs[i]->path, ART_SMALL, SONG_ROW_ART_SIZE);
+        layoutSetHidden(&createLayout, selectableArtWidgets[i], !shown);
+    }
+    layoutDraw(window, &createLayout);
+}
+
+// -------------------------- SELECT PLAYLIST SCREEN --------------------------
+// Declared static variables for UI elements for proper scope and cleanup handling
+static sfText* selectPlTitle_s = NULL;
+static sfText* playSelectedBtn_s = NULL;
 static sfText* cancelSelectBtn_s = NULL;
 static sfText* playlistText_s[MAX_VISIBLE_LIST_ITEMS]; // To display available playlists
 static sfRectangleShape* playlistRect_s[MAX_VISIBLE_LIST_ITEMS]; // New: Rectangles for playlist names
 static Playlist* selectedPlaylist_s = NULL; // To store the currently selected playlist
 static int playlistSelectedIndex_s = -1; // Index of the selected playlist
+static Layout selectLayout;
+
+
+static bool selectPlUiInitialized = false;
+
+void initSelectPlaylistScreen(sfFont* font, Playlist* allPlaylists) {
+    if (!selectPlUiInitialized) {
+        // Cleanup existing elements if re-entering
+        if (selectPlTitle_s) { sfText_destroy(selectPlTitle_s); selectPlTitle_s = NULL; }
+        if (playSelectedBtn_s) { sfText_destroy(playSelectedBtn_s); playSelectedBtn_s = NULL; }
+        if (cancelSelectBtn_s) { sfText_destroy(cancelSelectBtn_s); cancelSelectBtn_s = NULL; }
+        for(int i = 0; i < MAX_VISIBLE_LIST_ITEMS; ++i) {
+            if (playlistText_s[i]) { sfText_destroy(playlistText_s[i]); playlistText_s[i] = NULL; }
+            if (playlistRect_s[i]) { sfRectangleShape_destroy(playlistRect_s[i]); playlistRect_s[i] = NULL; } // Destroy rectangles
+        }
+
+        selectPlTitle_s = createLabel(font, "Select Playlist to Play", 0, 0, 30);
+        if(selectPlTitle_s) sfText_setFillColor(selectPlTitle_s, sfBlue);
+
+        layoutReset(&selectLayout);
+        layoutSetFlow(&selectLayout, 50, 60, 25, LIST_COLUMN_WIDTH, 60);
+        layoutAnchor(&selectLayout, WIDGET_TEXT, selectPlTitle_s, 0.5f, -200, 0, 20, 0);
+
+        // Populate playlist names and create their rectangles
+        Playlist* tempPl = allPlaylists;
+        int i = 0;
+        while(tempPl && i < MAX_VISIBLE_LIST_ITEMS) {
+            playlistText_s[i] = createLabel(font, tempPl->name, 0, 0, 20);
+            ellipsizeLabel(playlistText_s[i], LIST_COLUMN_WIDTH - 2 * 10 - 4); // Inside the row frame, clear of the next one
+            if(playlistText_s[i]) {
+                sfText_setFillColor(playlistText_s[i], sfWhite); // Default color
+
+                // Create rectangle for playlist name
+                playlistRect_s[i] = sfRectangleShape_create();
+                if (playlistRect_s[i]) {
+                    sfRectangleShape_setFillColor(playlistRect_s[i], sfColor_fromRGBA(0, 0, 0, 100)); // Semi-transparent black
+                    sfRectangleShape_setOutlineThickness(playlistRect_s[i], 1);
+                    sfRectangleShape_setOutlineColor(playlistRect_s[i], sfWhite);
+                }
+            }
+            // The rectangle (with some padding) frames the row text added right after it and
+            // gives a bigger hit area than the text
+            int frame = layoutAttach(&selectLayout, WIDGET_RECT, playlistRect_s[i], PLACE_AROUND, selectLayout.count + 1, 10, 5);
+            layoutSetAction(&selectLayout, frame, ACTION_ROW + i);
+            layoutFlow(&selectLayout, WIDGET_TEXT, playlistText_s[i]);
+            tempPl = tempPl->next;
+            i++;
+        }
+
+        playSelectedBtn_s = createLabel(font, "PLAY SELECTED", 0, 0, 24);
+        if(playSelectedBtn_s) sfText_setFillColor(playSelectedBtn_s, sfGreen);
+        cancelSelectBtn_s = createLabel(font, "CANCEL", 0, 0, 24);
+        if(cancelSelectBtn_s) sfText_setFillColor(cancelSelectBtn_s, sfRed);
+        layoutSetAction(&selectLayout, layoutAnchor(&selectLayout, WIDGET_TEXT, playSelectedBtn_s, 0.5f, -200, 1, -50, 0), ACTION_PLAY_SELECTED);
+        layoutSetAction(&selectLayout, layoutAnchor(&selectLayout, WIDGET_TEXT, cancelSelectBtn_s, 0.5f, 50, 1, -50, 0), ACTION_CANCEL);
+
+        selectedPlaylist_s = NULL;
+        playlistSelectedIndex_s = -1;
+        selectPlUiInitialized = true;
+    }
+}
+
+void releaseSelectPlaylistScreen(void) {
+    if (selectPlTitle_s) { sfText_destroy(selectPlTitle_s); selectPlTitle_s = NULL; }
+    if (playSelectedBtn_s) { sfText_destroy(playSelectedBtn_s); playSelectedBtn_s = NULL; }
+    if (cancelSelectBtn_s) { sfText_destroy(cancelSelectBtn_s); cancelSelectBtn_s = NULL; }
+    for (int i = 0; i < MAX_VISIBLE_LIST_ITEMS; ++i) {
+        if (playlistText_s[i]) { sfText_destroy(playlistText_s[i]); playlistText_s[i] = NULL; }
+        if (playlistRect_s[i]) { sfRectangleShape_destroy(playlistRect_s[i]); playlistRect_s[i] = NULL; }
+    }
+    selectedPlaylist_s = NULL;
+    layoutFree(&selectLayout);
+}
+
+// Handles one queued event for the Select Playlist screen
+bool handleSelectPlaylistScreen(sfRenderWindow* window, const InputEvent* input, sfFont* font, Playlist* allPlaylists) {
+    const sfEvent* event = &input->event;
+    initSelectPlaylistScreen(font, allPlaylists);
+
+    if (event->type == sfEvtMouseButtonPressed) {
+        sfVector2f mouse = sfRenderWindow_mapPixelToCoords(window, (sfVector2i){event->mouseButton.x, event->mouseButton.y}, NULL);
+        int action = layoutHitTest(&selectLayout, mouse.x, mouse.y);
+
+        // Check for clicks on playlist names (the hit area is the row's rectangle)
+        if (action >= ACTION_ROW) {
+            int i = action - ACTION_ROW;
+            // Deselect previous visual
+            if (playlistSelectedIndex_s != -1 && playlistRect_s[playlistSelectedIndex_s]) {
+                sfRectangleShape_setOutlineColor(playlistRect_s[playlistSelectedIndex_s], sfWhite);
+                sfRectangleShape_setFillColor(playlistRect_s[playlistSelectedIndex_s], sfColor_fromRGBA(0,0,0,100));
+            }
+
+            // Select new visual
+            playlistSelectedIndex_s = i;
+            sfRectangleShape_setOutlineColor(playlistRect_s[i], sfCyan); // Highlight selected outline
+            sfRectangleShape_setFillColor(playlistRect_s[i], sfColor_fromRGBA(0, 100, 100, 150)); // Darker cyan fill
+
+            // Find the actual playlist pointer based on its position in the list
+            selectedPlaylist_s = allPlaylists;
+            for(int j = 0; j < i; ++j) {
+                if (selectedPlaylist_s) selectedPlaylist_s = selectedPlaylist_s->next;
+            }
+        }
+
+        // Click on PLAY SELECTED button
+        if (action == ACTION_PLAY_SELECTED) {
+            if (selectedPlaylist_s && selectedPlaylist_s->front) {
+                // Cleanup previous currentPlaylist if exists (to avoid memory leaks if switching playlists)
+                destroyTemporaryPlaylist(currentPlaylist);
+                currentPlaylist = NULL;
+
+                // Create a new temporary playlist (copy) to be the current playing queue
+                currentPlaylist = createTemporaryPlaylist(selectedPlaylist_s->name);
+                PlaylistNode* tempNode = selectedPlaylist_s->front;
+                while(tempNode){
+                    enqueueSong(currentPlaylist, tempNode->song);
+                    tempNode = tempNode->next;
+                }
+
+                current = dequeueSong(currentPlaylist); // Get first song from the copy
+                if (current) {
+                    playNewSong(globalSongLabel, globalFont, globalPlaySprite, pauseTexture, playTexture);
+                } else {
+                    printf("Selected playlist is empty after copying.\n");
+                    destroyTemporaryPlaylist(currentPlaylist);
+                    currentPlaylist = NULL; // No songs, clear playlist
+                }
+                refreshQueueDisplay(globalFont, currentPlaylist); // Refresh main queue display
+
+                selectPlUiInitialized = false;
+                if (lowMemoryMode) releaseSelectPlaylistScreen();
+                currentAppState = MAIN_PLAYER;
+                return true;
+            } else {
+                printf("No playlist selected or selected playlist is empty.\n");
+            }
+        }
+
+        // Click on CANCEL button
+        if (action == ACTION_CANCEL) {
+            printf("Playlist selection canceled.\n");
+            selectPlUiInitialized = false;
+            if (lowMemoryMode) releaseSelectPlaylistScreen();
+            currentAppState = MAIN_PLAYER;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void drawSelectPlaylistScreen(sfRenderWindow* window, sfFont* font, Playlist* allPlaylists) {
+    initSelectPlaylistScreen(font, allPlaylists);
+    layoutDraw(window, &selectLayout); // Each rectangle is drawn before its row text
+}
+
+// -------------------------- Directory Scanning (Windows Specific) --------------------------
+bool hasOggExtension(const char* name) {
+    size_t len = strlen(name);
+    if (len < 4) return false;
+    const char* ext = name + len - 4;
+    return ext[0] == '.' && (ext[1] | 0x20) == 'o' && (ext[2] | 0x20) == 'g' && (ext[3] | 0x20) == 'g';
+}
+
+// Adds the .ogg files in 'directoryPath' and its subfolders (album folders) to the list
+void loadSongsFromDirectory(Song** allSongsList, const char* directoryPath) {
+    WIN32_FIND_DATAA findFileData;
+    HANDLE hFind;
+    char searchPath[MAX_PATH_LENGTH];
+    char fullFilePath[MAX_PATH_LENGTH];
+
+    snprintf(searchPath, sizeof(searchPath), "%s\\*", directoryPath);
+
+    printf("Scanning directory: %s for .ogg files...\n", searchPath);
+
+    hFind = FindFirstFileA(searchPath, &findFileData);
+    if (hFind == INVALID_HANDLE_VALUE) {
+        printf("Error opening directory: %s (Error Code: %lu)\n", directoryPath, GetLastError());
+        return;
+    }
+
+    do {
+        if (strcmp(findFileData.cFileName, ".") == 0 || strcmp(findFileData.cFileName, "..") == 0) {
+            continue;
+        }
+        if (snprintf(fullFilePath, sizeof(fullFilePath), "%s\\%s", directoryPath, findFileData.cFileName) >= (int)sizeof(fullFilePath)) {
+            printf("Path too long, skipped: %s\\%s\n", directoryPath, findFileData.cFileName);
+            continue;
+        }
+
+        if (findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            loadSongsFromDirectory(allSongsList, fullFilePath);
+        } else if (hasOggExtension(findFileData.cFileName)) {
+            addSong(allSongsList, findFileData.cFileName, fullFilePath);
+            printf("Found and added: %s\n", fullFilePath);
+        }
+    } while (FindNextFileA(hFind, &findFileData) != 0);
+
+    FindClose(hFind);
+}
+
+// -------------------------- Playlist Persistence --------------------------
+
+// Helper to find a Song* by its path from the allSongsList (through the hashed path index)
+Song* findSongByPath(const char* path) {
+    return songIndexFind(&songPathIndex, path);
+}
+
+// Returns the part of 'path' after the last directory separator
+const char* pathBaseName(const char* path) {
+    const char* base = path;
+    for (const char* c = path; *c; c++) {
+        if (*c == '\\' || *c == '/') base = c + 1;
+    }
+    return base;
+}
+
+// Longest playlist line accepted. Longer lines are skipped as a whole instead of being split
+// into bogus entries; the line buffer grows on demand up to this size.
+#define MAX_PLAYLIST_LINE 32768
+
+typedef struct LineReader {
+    FILE* fp;
+    char* line;
+    size_t capacity;
+    long lineNumber;
+    long skippedLines; // Lines longer than MAX_PLAYLIST_LINE
+} LineReader;
+
+// Reads the next line without its line ending into reader->line; returns false at end of file
+bool readLine(LineReader* reader) {
+    size_t len = 0;
+    bool tooLong = false, gotAny = false;
+    for (;;) {
+        if (len + 2 > reader->capacity) {
+            if (reader->capacity >= MAX_PLAYLIST_LINE) {
+                tooLong = true; // Keep consuming until the end of this line
+                len = 0;
+            } else {
+                size_t newCapacity = reader->capacity ? reader->capacity * 2 : 512;
+                if (newCapacity > MAX_PLAYLIST_LINE) newCapacity = MAX_PLAYLIST_LINE;
+                char* grown = (char*)realloc(reader->line, newCapacity);
+                if (!grown) {
+                    fprintf(stderr, "Memory allocation failed for playlist line buffer.\n");
+                    return false;
+                }
+                reader->line = grown;
+                reader->capacity = newCapacity;
+            }
+        }
+        if (!fgets(reader->line + len, (int)(reader->capacity - len), reader->fp)) break;
+        gotAny = true;
+        len += strlen(reader->line + len);
+        if (len > 0 && reader->line[len - 1] == '\n') break;
+    }
+    if (!gotAny) return false;
+    reader->lineNumber++;
+    if (tooLong) {
+        reader->skippedLines++;
+        len = 0;
+    }
+    while (len > 0 && (reader->line[len - 1] == '\n' || reader->line[len - 1] == '\r')) len--;
+    reader->line[len] = '\0';
+    return true;
+}
+
+void closeLineReader(LineReader* reader) {
+    free(reader->line);
+    reader->line = NULL;
+    reader->capacity = 0;
+}
+
+// Playlist entries are collected and resolved against the song index in batches; whatever
+// cannot be found is counted and summarized once instead of printed line by line.
+#define IMPORT_BATCH_SIZE 256
+#define IMPORT_REPORT_SAMPLES 3 // Unresolved paths quoted in the summary
+
+typedef struct ImportReport {
+    long entries;
+    long resolved;
+    long relinked; // Found by file name after the path did not match
+    long unresolved;
+    long skippedLines;
+    char samples[IMPORT_REPORT_SAMPLES][MAX_PATH_LENGTH];
+} ImportReport;
+
+typedef struct ImportBatch {
+    Playlist* target;
+    ImportReport* report;
+    char baseDir[MAX_PATH_LENGTH]; // Relative entries are resolved against this ("" = working directory)
+    char paths[IMPORT_BATCH_SIZE][MAX_PATH_LENGTH];
+    int count;
+} ImportBatch;
+
+ImportBatch importBatch; // Large; one import runs at a time
+
+bool isAbsolutePath(const char* path) {
+    return path[0] == '\\' || path[0] == '/' || (path[0] && path[1] == ':');
+}
+
+// Each entry is normalized once and then probed against both indices with that key
+void flushImportBatch(ImportBatch* batch) {
+    for (int i = 0; i < batch->count; i++) {
+        const char* path = batch->paths[i];
+        char key[MAX_PATH_LENGTH];
+        songPathKey(path, key, sizeof(key));
+        Song* song = songIndexFindKey(&songPathIndex, key);
+        if (song) {
+            batch->report->resolved++;
+        } else if ((song = songIndexFindKey(&songNameIndex, key)) != NULL) {
+            // The file may have moved to another library folder; relink by file name
+            batch->report->relinked++;
+        } else {
+            if (batch->report->unresolved < IMPORT_REPORT_SAMPLES) {
+                strcpy(batch->report->samples[batch->report->unresolved], path);
+            }
+            batch->report->unresolved++;
+            continue;
+        }
+        if (batch->target) enqueueSong(batch->target, song);
+    }
+    batch->count = 0;
+}
+
+void addImportEntry(ImportBatch* batch, const char* entry) {
+    while (*entry == ' ' || *entry == '\t') entry++;
+    if (!*entry) return;
+    batch->report->entries++;
+    char* dest = batch->paths[batch->count];
+    int written;
+    if (batch->baseDir[0] && !isAbsolutePath(entry)) {
+        written = snprintf(dest, MAX_PATH_LENGTH, "%s\\%s", batch->baseDir, entry);
+    } else {
+        written = snprintf(dest, MAX_PATH_LENGTH, "%s", entry);
+    }
+    if (written < 0 || written >= MAX_PATH_LENGTH) { // Cannot name a library file
+        if (batch->report->unresolved < IMPORT_REPORT_SAMPLES) {
+            snprintf(batch->report->samples[batch->report->unresolved], MAX_PATH_LENGTH, "%.200s...", entry);
+        }
+        batch->report->unresolved++;
+        return;
+    }
+    if (++batch->count == IMPORT_BATCH_SIZE) flushImportBatch(batch);
+}
+
+void beginImportBatch(ImportBatch* batch, Playlist* target, ImportReport* report, const char* baseDir) {
+    batch->target = target;
+    batch->report = report;
+    batch->count = 0;
+    strncpy(batch->baseDir, baseDir ? baseDir : "", sizeof(batch->baseDir) - 1);
+    batch->baseDir[sizeof(batch->baseDir) - 1] = '\0';
+}
+
+void printImportReport(const char* source, const ImportReport* report) {
+    printf("  %s: %ld entries, %ld resolved", source, report->entries, report->resolved + report->relinked);
+    if (report->relinked) printf(" (%ld relinked by file name)", report->relinked);
+    if (report->unresolved) printf(", %ld not in library", report->unresolved);
+    if (report->skippedLines) printf(", %ld over-long lines skipped", report->skippedLines);
+    printf("\n");
+    for (long i = 0; i < report->unresolved && i < IMPORT_REPORT_SAMPLES; i++) {
+        printf("    e.g. %s\n", report->samples[i]);
+    }
+}
+
+// Writes one playlist in the playlists.txt format
+void writePlaylist(FILE* fp, const Playlist* pl) {
+    fprintf(fp, "#PLAYLIST_START:%s\n", pl->name);
+    for (const PlaylistNode* node = pl->front; node; node = node->next) {
+        fprintf(fp, "%s\n", node->song->path); // Save full path
+    }
+    fprintf(fp, "#PLAYLIST_END\n");
+}
+
+// Function to save all playlists to a file
+void savePlaylistsToFile(const char* filename, Playlist* allPlaylists) {
+    FILE* fp = fopen(filename, "w");
+    if (!fp) {
+        fprintf(stderr, "Error: Could not open playlist file for writing: %s\n", filename);
+        return;
+    }
+
+    for (const Playlist* pl = allPlaylists; pl; pl = pl->next) writePlaylist(fp, pl);
+
+    fclose(fp);
+    printf("Playlists saved to %s\n", filename);
+}
+
+// Reads playlists in the playlists.txt format from 'fp'; 'source' names it in messages.
+// The playlists keep the order they have in the file, in front of any already loaded.
+void loadPlaylistsFromStream(FILE* fp, const char* source, Playlist** allPlaylists) {
+    LineReader reader = { fp, NULL, 0, 0, 0 };
+    ImportReport report = {0};
+    Playlist* currentLoadingPlaylist = NULL;
+    Playlist* existing = *allPlaylists;
+
+    while (readLine(&reader)) {
+        const char* line = reader.line;
+        if (strncmp(line, "#PLAYLIST_START:", 16) == 0) { // Starts with #PLAYLIST_START:
+            if (currentLoadingPlaylist) flushImportBatch(&importBatch);
+            char playlistName[MAX_PLAYLIST_NAME_LENGTH + 1];
+            snprintf(playlistName, sizeof(playlistName), "%s", line + 16); // Read name after prefix (truncated)
+            for (char* c = playlistName; *c; c++) {
+                if ((unsigned char)*c < 0x20) *c = ' '; // A stray '\r' would not survive the next save
+            }
+            currentLoadingPlaylist = createPlaylist(playlistName); // Creates and adds to global 'playlists' list
+            beginImportBatch(&importBatch, currentLoadingPlaylist, &report, NULL);
+            printf("Loading playlist: %s\n", playlistName);
+        } else if (strcmp(line, "#PLAYLIST_END") == 0) {
+            if (currentLoadingPlaylist) flushImportBatch(&importBatch);
+            currentLoadingPlaylist = NULL; // End of current playlist
+        } else if (currentLoadingPlaylist) {
+            // This line is a song path
+            addImportEntry(&importBatch, line);
+        }
+    }
+    if (currentLoadingPlaylist) flushImportBatch(&importBatch);
+    report.skippedLines = reader.skippedLines;
+    closeLineReader(&reader);
+
+    // createPlaylist() prepends, which left the loaded playlists reversed; saving writes the
+    // list front to back, so without this the order flipped on every restart
+    Playlist* reversed = existing;
+    for (Playlist* pl = *allPlaylists; pl != existing;) {
+        Playlist* next = pl->next;
+        pl->next = reversed;
+        reversed = pl;
+        pl = next;
+    }
+    *allPlaylists = reversed;
+    printImportReport(source, &report);
+}
+
+// Function to load playlists from a file
+void loadPlaylistsFromFile(const char* filename, Playlist** allPlaylists) {
+    FILE* fp = fopen(filename, "r");
+    if (!fp) {
+        printf("No existing playlist file found: %s. Starting fresh.\n", filename);
+        return;
+    }
+    loadPlaylistsFromStream(fp, filename, allPlaylists);
+    fclose(fp);
+    printf("Playlists loaded from %s\n", filename);
+}
+
+// -------------------------- Playlist Import / Export --------------------------
+// Streaming readers and writers for M3U/M3U8, PLS and XSPF. Readers hold one line (or one
+// XML text node) at a time plus the current resolve batch, so very large playlists import
+// in bounded memory.
+typedef enum PlaylistFormat {
+    FORMAT_UNKNOWN,
+    FORMAT_M3U, // Also M3U8; paths are passed through byte for byte
+    FORMAT_PLS,
+    FORMAT_XSPF
+} PlaylistFormat;
+
+PlaylistFormat playlistFormatFromPath(const char* path) {
+    const char* dot = strrchr(pathBaseName(path), '.');
+    if (!dot) return FORMAT_UNKNOWN;
+    char ext[8] = "";
+    for (int i = 0; i < 7 && dot[i + 1]; i++) ext[i] = (char)(dot[i + 1] | 0x20);
+    if (strcmp(ext, "m3u") == 0 || strcmp(ext, "m3u8") == 0) return FORMAT_M3U;
+    if (strcmp(ext, "pls") == 0) return FORMAT_PLS;
+    if (strcmp(ext, "xspf") == 0) return FORMAT_XSPF;
+    return FORMAT_UNKNOWN;
+}
+
+int hexDigitValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c = (char)(c | 0x20);
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// Turns a playlist location into a file path: file:// URLs (and every XSPF location, which
+// is a URI) are percent-decoded into a Windows path. Other plain paths are returned
+// unchanged. Decodes in place.
+void locationToPath(char* location, bool isUri) {
+    bool fileUrl = strncmp(location, "file:", 5) == 0;
+    if (!fileUrl && !isUri) return;
+    const char* src = fileUrl ? location + 5 : location;
+    char* dst = location;
+    if (!fileUrl) {
+        // Relative URI reference, decoded as is
+    } else if (strncmp(src, "///", 3) == 0) {
+        src += 3; // file:///C:/music/a.ogg
+    } else if (strncmp(src, "//", 2) == 0) {
+        src += 2; // file://server/share
+        *dst++ = '\\';
+        *dst++ = '\\';
+    }
+    for (; *src; src++) {
+        int hi, lo;
+        if (*src == '%' && (hi = hexDigitValue(src[1])) >= 0 && (lo = hexDigitValue(src[2])) >= 0) {
+            *dst++ = (char)(hi * 16 + lo);
+            src += 2;
+        } else {
+            *dst++ = (*src == '/') ? '\\' : *src;
+        }
+    }
+    *dst = '\0';
+}
+
+// Reads a numeric character reference ("&#233;" or "&#xE9;") at 'src'. Returns its length
+// and stores the code point, or returns 0 if it is not a valid one.
+size_t parseXmlCharRef(const char* src, unsigned long* codePoint) {
+    if (src[0] != '&' || src[1] != '#') return 0;
+    bool hex = src[2] == 'x';
+    size_t i = hex ? 3 : 2;
+    unsigned long value = 0;
+    size_t digits = 0;
+    for (;; i++, digits++) {
+        int digit = hex ? hexDigitValue(src[i]) : (src[i] >= '0' && src[i] <= '9' ? src[i] - '0' : -1);
+        if (digit < 0) break;
+        value = value * (hex ? 16 : 10) + (unsigned long)digit;
+        if (value > 0x10FFFF) return 0;
+    }
+    if (digits == 0 || src[i] != ';' || value == 0 || (value >= 0xD800 && value <= 0xDFFF)) return 0;
+    *codePoint = value;
+    return i + 1;
+}
+
+// Writes 'codePoint' as UTF-8 (what percent-decoded URIs hold as well); returns the bytes written
+size_t encodeUtf8(unsigned long codePoint, char* dst) {
+    if (codePoint < 0x80) {
+        dst[0] = (char)codePoint;
+        return 1;
+    }
+    if (codePoint < 0x800) {
+        dst[0] = (char)(0xC0 | (codePoint >> 6));
+        dst[1] = (char)(0x80 | (codePoint & 0x3F));
+        return 2;
+    }
+    if (codePoint < 0x10000) {
+        dst[0] = (char)(0xE0 | (codePoint >> 12));
+        dst[1] = (char)(0x80 | ((codePoint >> 6) & 0x3F));
+        dst[2] = (char)(0x80 | (codePoint & 0x3F));
+        return 3;
+    }
+    dst[0] = (char)(0xF0 | (codePoint >> 18));
+    dst[1] = (char)(0x80 | ((codePoint >> 12) & 0x3F));
+    dst[2] = (char)(0x80 | ((codePoint >> 6) & 0x3F));
+    dst[3] = (char)(0x80 | (codePoint & 0x3F));
+    return 4;
+}
+
+// Replaces the five predefined XML entities and numeric character references in place. A
+// reference is never shorter than its UTF-8 encoding ("&#x80;" is 6 bytes for 2), so the text
+// only shrinks.
+void decodeXmlEntities(char* text) {
+    static const char* entities[5][2] = { {"&amp;", "&"}, {"&lt;", "<"}, {"&gt;", ">"}, {"&quot;", "\""}, {"&apos;", "'"} };
+    char* dst = text;
+    for (const char* src = text; *src;) {
+        bool replaced = false;
+        unsigned long codePoint;
+        size_t refLen = parseXmlCharRef(src, &codePoint);
+        if (refLen > 0) {
+            dst += encodeUtf8(codePoint, dst);
+            src += refLen;
+            replaced = true;
+        }
+        if (*src == '&' && !replaced) {
+            for (int i = 0; i < 5 && !replaced; i++) {
+                size_t len = strlen(entities[i][0]);
+                if (strncmp(src, entities[i][0], len) == 0) {
+                    *dst++ = entities[i][1][0];
+                    src += len;
+                    replaced = true;
+                }
+            }
+        }
+        if (!replaced) *dst++ = *src++;
+    }
+    *dst = '\0';
+}
+
+void importLineFormat(FILE* fp, PlaylistFormat format, ImportBatch* batch) {
+    LineReader reader = { fp, NULL, 0, 0, 0 };
+    while (readLine(&reader)) {
+        char* line = reader.line;
+        if (reader.lineNumber == 1 && (unsigned char)line[0] == 0xEF && (unsigned char)line[1] == 0xBB && (unsigned char)line[2] == 0xBF) {
+            line += 3; // UTF-8 byte order mark
+        }
+        if (format == FORMAT_M3U) {
+            if (line[0] == '#' || line[0] == '\0') continue; // #EXTM3U, #EXTINF and comments
+        } else { // PLS: FileN=location
+            if (strncmp(line, "File", 4) != 0) continue;
+            char* equals = strchr(line, '=');
+            if (!equals) continue;
+            line = equals + 1;
+        }
+        locationToPath(line, false);
+        addImportEntry(batch, line);
+    }
+    batch->report->skippedLines += reader.skippedLines;
+    closeLineReader(&reader);
+}
+
+// Scans the XML as a character stream and picks out the text of every <location> element
+void importXspf(FILE* fp, ImportBatch* batch) {
+    char tag[16];
+    int tagLen = 0;
+    char text[MAX_PATH_LENGTH * 3]; // Percent-encoding can triple a path's length
+    size_t textLen = 0;
+    bool inTag = false, inLocation = false, textOverflow = false;
+    int c;
+    while ((c = fgetc(fp)) != EOF) {
+        if (inTag) {
+            bool nameEnded = c == '>' || c == ' ' || c == '\t' || c == '\r' || c == '\n' || (c == '/' && tagLen > 0);
+            if (!nameEnded) {
+                if (tagLen < (int)sizeof(tag) - 1) tag[tagLen++] = (char)c;
+                continue;
+            }
+            tag[tagLen] = '\0';
+            inTag = false;
+            int last = c;
+            while (c != '>' && c != EOF) { // Skip attributes up to the end of the tag
+                last = c;
+                c = fgetc(fp);
+            }
+            bool selfClosing = (last == '/');
+            if (strcmp(tag, "location") == 0 && !selfClosing) {
+                inLocation = true;
+                textLen = 0;
+                textOverflow = false;
+            } else if (strcmp(tag, "/location") == 0 && inLocation) {
+                inLocation = false;
+                text[textLen] = '\0';
+                if (textOverflow) {
+                    batch->report->skippedLines++;
+                } else {
+                    decodeXmlEntities(text);
+                    locationToPath(text, true);
+                    addImportEntry(batch, text);
+                }
+            }
+        } else if (c == '<') {
+            inTag = true;
+            tagLen = 0;
+        } else if (inLocation) {
+            if (textLen < sizeof(text) - 1) text[textLen++] = (char)c;
+            else textOverflow = true;
+        }
+    }
+}
+
+// Imports a playlist file as a new playlist named after the file. Returns NULL if the
+// format is unknown, the file cannot be read or a playlist of that name already exists.
+Playlist* importPlaylist(const char* filename) {
+    PlaylistFormat format = playlistFormatFromPath(filename);
+    if (format == FORMAT_UNKNOWN) {
+        printf("Unknown playlist format: %s\n", filename);
+        return NULL;
+    }
+
+    char name[MAX_PLAYLIST_NAME_LENGTH + 1];
+    snprintf(name, sizeof(name), "%s", pathBaseName(filename));
+    char* dot = strrchr(name, '.');
+    if (dot && dot != name) *dot = '\0';
+    for (Playlist* pl = playlists; pl; pl = pl->next) {
+        if (strcmp(pl->name, name) == 0) {
+            printf("Playlist '%s' already exists, not importing %s\n", name, filename);
+            return NULL;
+        }
+    }
+
+    FILE* fp = fopen(filename, "r");
+    if (!fp) {
+        printf("Could not open playlist: %s\n", filename);
+        return NULL;
+    }
+
+    // Relative entries are relative to the folder holding the playlist
+    char baseDir[MAX_PATH_LENGTH];
+    snprintf(baseDir, sizeof(baseDir), "%.*s", (int)(pathBaseName(filename) - filename), filename);
+    size_t baseLen = strlen(baseDir);
+    if (baseLen > 0) baseDir[baseLen - 1] = '\0'; // Drop the trailing separator
+
+    Playlist* pl = createPlaylist(name);
+    if (!pl) {
+        fclose(fp);
+        return NULL;
+    }
+    ImportReport report = {0};
+    beginImportBatch(&importBatch, pl, &report, baseDir);
+    if (format == FORMAT_XSPF) importXspf(fp, &importBatch);
+    else importLineFormat(fp, format, &importBatch);
+    flushImportBatch(&importBatch);
+    fclose(fp);
+
+    printf("Imported playlist '%s'\n", name);
+    printImportReport(filename, &report);
+    return pl;
+}
+
+void writeXmlEscaped(FILE* fp, const char* text) {
+    for (; *text; text++) {
+        switch (*text) {
+            case '&': fputs("&amp;", fp); break;
+            case '<': fputs("&lt;", fp); break;
+            case '>': fputs("&gt;", fp); break;
+            case '"': fputs("&quot;", fp); break;
+            default: fputc(*text, fp);
+        }
+    }
+}
+
+// Writes 'path' as a file:/// URL with forward slashes and unsafe bytes percent-encoded
+void writeFileUrl(FILE* fp, const char* path) {
+    fputs(path[0] == '\\' && path[1] == '\\' ? "file:" : "file:///", fp);
+    for (const unsigned char* c = (const unsigned char*)path; *c; c++) {
+        if (*c == '\\') fputc('/', fp);
+        else if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || strchr("-._~:/()", *c)) fputc(*c, fp);
+        else fprintf(fp, "%%%02X", *c);
+    }
+}
+
+// Writes 'pl' to 'filename' in the given format; entries are streamed node by node
+bool exportPlaylist(const Playlist* pl, const char* filename, PlaylistFormat format) {
+    FILE* fp = fopen(filename, "w");
+    if (!fp) {
+        fprintf(stderr, "Error: Could not open %s for writing.\n", filename);
+        return false;
+    }
+    char fullPath[MAX_PATH_LENGTH];
+    int index = 0;
+
+    if (format == FORMAT_M3U) fprintf(fp, "#EXTM3U\n#PLAYLIST:%s\n", pl->name);
+    else if (format == FORMAT_PLS) fprintf(fp, "[playlist]\n");
+    else {
+        fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<playlist version=\"1\" xmlns=\"http://xspf.org/ns/0/\">\n  <title>");
+        writeXmlEscaped(fp, pl->name);
+        fprintf(fp, "</title>\n  <trackList>\n");
+    }
+
+    for (const PlaylistNode* node = pl->front; node; node = node->next) {
+        const Song* song = node->song;
+        DWORD len = GetFullPathNameA(song->path, sizeof(fullPath), fullPath, NULL);
+        const char* path = (len > 0 && len < sizeof(fullPath)) ? fullPath : song->path;
+        index++;
+        if (format == FORMAT_M3U) {
+            fprintf(fp, "#EXTINF:-1,%s\n%s\n", song->name, path);
+        } else if (format == FORMAT_PLS) {
+            fprintf(fp, "File%d=%s\nTitle%d=%s\n", index, path, index, song->name);
+        } else {
+            fprintf(fp, "    <track><location>");
+            writeFileUrl(fp, path);
+            fprintf(fp, "</location><title>");
+            writeXmlEscaped(fp, song->name);
+            fprintf(fp, "</title></track>\n");
+        }
+    }
+
+    if (format == FORMAT_PLS) fprintf(fp, "NumberOfEntries=%d\nVersion=2\n", index);
+    else if (format == FORMAT_XSPF) fprintf(fp, "  </trackList>\n</playlist>\n");
+
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+// Exports every playlist into 'directory' as <name>.<ext>
+void exportAllPlaylists(const char* directory, PlaylistFormat format) {
+    const char* ext = format == FORMAT_PLS ? "pls" : (format == FORMAT_XSPF ? "xspf" : "m3u8");
+    CreateDirectoryA(directory, NULL);
+    int exported = 0;
+    for (Playlist* pl = playlists; pl; pl = pl->next) {
+        char filename[MAX_PATH_LENGTH];
+        char safeName[sizeof(pl->name)];
+        strcpy(safeName, pl->name);
+        for (char* c = safeName; *c; c++) {
+            if (strchr("\\/:*?\"<>|", *c)) *c = '_'; // Characters not allowed in Windows file names
+        }
+        snprintf(filename, sizeof(filename), "%s\\%s.%s", directory, safeName, ext);
+        if (exportPlaylist(pl, filename, format)) exported++;
+    }
+    printf("Exported %d playlist(s) to %s\n", exported, directory);
+}
+
+// -------------------------- Tempo & Key Estimation --------------------------
+// Tempo comes from an onset envelope: the log energy of the signal's first difference in
+// short hops rises sharply at every attack, and the envelope's autocorrelation peaks at the
+// beat period. Key comes from a track's average chroma correlated against the
+// Krumhansl-Schmuckler major and minor key profiles.
+#define TEMPO_ANALYSIS_SECONDS 60 // Longest stretch of a track the tempo is estimated from
+#define TEMPO_HOP 128 // Analysis samples per onset envelope frame
+#define TEMPO_MEAN_FRAMES 16 // Moving average removed from the envelope
+#define TEMPO_MIN_BPM 60.0
+#define TEMPO_MAX_BPM 180.0
+#define TEMPO_MAX_LAGS 512
+
+// Sum of squares of 'count' floats
+static inline float sumSquares(const float* x, int count) {
+    int i = 0;
+    float sum = 0.0f;
+#ifdef __SSE2__
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4) {
+        __m128 v = _mm_loadu_ps(x + i);
+        acc = _mm_add_ps(acc, _mm_mul_ps(v, v));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    sum = (lanes[0] + lanes[2]) + (lanes[1] + lanes[3]);
+#endif
+    for (; i < count; i++) sum += x[i] * x[i];
+    return sum;
+}
+
+static inline float dotProduct(const float* a, const float* b, int count) {
+    int i = 0;
+    float sum = 0.0f;
+#ifdef __SSE2__
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4) acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    sum = (lanes[0] + lanes[2]) + (lanes[1] + lanes[3]);
+#endif
+    for (; i < count; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+// Estimates the tempo of 'count' mono samples at 'rate' Hz. The signal is overwritten.
+// Returns 0 when no steady beat stands out.
+float estimateTempo(float* signal, int count, double rate) {
+    const double frameRate = rate / TEMPO_HOP;
+    const int minLag = (int)(60.0 * frameRate / TEMPO_MAX_BPM);
+    const int maxLag = (int)ceil(60.0 * frameRate / TEMPO_MIN_BPM) + 1;
+    const int frames = count / TEMPO_HOP;
+    if (minLag < 2 || 2 * maxLag + 2 > TEMPO_MAX_LAGS || frames < maxLag * 4) return 0.0f;
+    float* envelope = (float*)malloc((size_t)frames * 2 * sizeof(float));
+    if (!envelope) return 0.0f;
+    float* onset = envelope + frames;
+
+    // First difference emphasises attacks over sustained low notes
+    for (int i = count - 1; i > 0; i--) signal[i] -= signal[i - 1];
+    signal[0] = 0.0f;
+    float previous = 0.0f;
+    for (int f = 0; f < frames; f++) {
+        float level = logf(1e-9f + sumSquares(signal + (size_t)f * TEMPO_HOP, TEMPO_HOP) / TEMPO_HOP);
+        envelope[f] = f > 0 && level > previous ? level - previous : 0.0f;
+        previous = level;
+    }
+    // Keep only what rises above the local average
+    float running = 0.0f;
+    for (int f = 0; f < frames; f++) {
+        running += envelope[f];
+        if (f >= TEMPO_MEAN_FRAMES) running -= envelope[f - TEMPO_MEAN_FRAMES];
+        float mean = running / (f < TEMPO_MEAN_FRAMES ? f + 1 : TEMPO_MEAN_FRAMES);
+        onset[f] = envelope[f] > mean ? envelope[f] - mean : 0.0f;
+    }
+    // Spread each onset over neighbouring frames so beat periods that fall between two
+    // lags still correlate as strongly as whole-frame ones
+    for (int f = 1; f + 1 < frames; f++) envelope[f] = 0.25f * onset[f - 1] + 0.5f * onset[f] + 0.25f * onset[f + 1];
+    envelope[0] = envelope[frames - 1] = 0.0f;
+    onset = envelope;
+
+    // Autocorrelation up to twice the slowest beat period
+    double correlation[TEMPO_MAX_LAGS];
+    for (int lag = minLag; lag <= 2 * maxLag + 1; lag++) {
+        correlation[lag] = dotProduct(onset, onset + lag, frames - lag) / (frames - lag);
+    }
+    // Each period also collects the correlation at twice its length, so a steady beat
+    // outscores its own half-time reading; a prior centred on 120 BPM settles the rest
+    double scores[TEMPO_MAX_LAGS];
+    double total = 0.0, best = 0.0;
+    int bestLag = 0;
+    int lags = maxLag - minLag + 1;
+    for (int i = 0; i < lags; i++) {
+        int lag = minLag + i;
+        double twice = fmax(correlation[2 * lag], fmax(correlation[2 * lag - 1], correlation[2 * lag + 1]));
+        double octaves = log2(60.0 * frameRate / lag / 120.0);
+        scores[i] = (correlation[lag] + 0.5 * twice) * exp(-0.5 * octaves * octaves / 0.8);
+        total += scores[i];
+        if (scores[i] > best) {
+            best = scores[i];
+            bestLag = i;
+        }
+    }
+    free(envelope);
+    if (best <= 0.0 || best < 1.5 * total / lags || bestLag == 0 || bestLag == lags - 1) return 0.0f;
+
+    // Parabolic interpolation around the peak for sub-frame precision
+    double a = scores[bestLag - 1], b = scores[bestLag], c = scores[bestLag + 1];
+    double offset = a - 2 * b + c < 0 ? 0.5 * (a - c) / (a - 2 * b + c) : 0.0;
+    return (float)(60.0 * frameRate / (minLag + bestLag + offset));
+}
+
+// Returns 0-11 for a major key, 12-23 for a minor key (tonic pitch class, 0 = C), or -1
+int estimateKey(const double chroma[12]) {
+    static const double majorProfile[12] = {6.35, 2.23, 3.48, 2.33, 4.38, 4.09, 2.52, 5.19, 2.39, 3.66, 2.29, 2.88};
+    static const double minorProfile[12] = {6.33, 2.68, 3.52, 5.38, 2.60, 3.53, 2.54, 4.75, 3.98, 2.69, 3.34, 3.17};
+    double chromaMean = 0.0;
+    for (int p = 0; p < 12; p++) chromaMean += chroma[p] / 12.0;
+    if (chromaMean <= 0.0) return -1;
+    int bestKey = -1;
+    double bestCorrelation = -2.0;
+    for (int mode = 0; mode < 2; mode++) {
+        const double* profile = mode ? minorProfile : majorProfile;
+        double profileMean = 0.0;
+        for (int p = 0; p < 12; p++) profileMean += profile[p] / 12.0;
+        for (int tonic = 0; tonic < 12; tonic++) {
+            double sxy = 0.0, sxx = 0.0, syy = 0.0;
+            for (int p = 0; p < 12; p++) {
+                double x = chroma[(tonic + p) % 12] - chromaMean, y = profile[p] - profileMean;
+                sxy += x * y;
+                sxx += x * x;
+                syy += y * y;
+            }
+            double correlation = sxx > 0.0 ? sxy / sqrt(sxx * syy) : 0.0;
+            if (correlation > bestCorrelation) {
+                bestCorrelation = correlation;
+                bestKey = mode * 12 + tonic;
+            }
+        }
+    }
+    return bestKey;
+}
+
+// -------------------------- Auto-DJ --------------------------
+// With auto-DJ on (F6) and no playlist active, the track after the current one is picked for
+// a smooth transition instead of taken in library order: a close tempo (or half / double
+// time) and a key next to the current one on the Camelot wheel. Analysed songs sit in one
+// tempo-sorted bucket per key, so a pick only scores the songs around the target tempo in the
+// four compatible keys. Picks are made AUTO_DJ_LOOKAHEAD tracks ahead and topped up one at a
+// time as tracks finish.
+#define AUTO_DJ_TEMPO_TOLERANCE 0.08 // Fraction of the tempo a pick may differ by
+#define AUTO_DJ_MAX_CANDIDATES 256 // Songs scored per bucket and tempo target
+#define AUTO_DJ_REPEAT_GAP 50 // Tracks played before a song can be picked again
+#define AUTO_DJ_MAX_WALK 1000 // Library order fallback gives up after this many songs
+
+typedef struct AutoDjBucket {
+    Song** songs; // Sorted by bpm
+    int count;
+    int capacity;
+} AutoDjBucket;
+
+AutoDjBucket autoDjBuckets[24];
+int autoDjIndexed = 0;
+long autoDjPicks = 0;
+long long autoDjPickMicros = 0;
+
+// First position in 'bucket' with bpm >= 'bpm'
+int autoDjLowerBound(const AutoDjBucket* bucket, float bpm) {
+    int lo = 0, hi = bucket->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (bucket->songs[mid]->bpm < bpm) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+// Takes 'song' out of its bucket; call before its bpm or key change
+void autoDjUnindexSong(Song* song) {
+    if (song->bpm <= 0.0f || song->musicalKey < 0) return;
+    AutoDjBucket* bucket = &autoDjBuckets[song->musicalKey];
+    for (int i = autoDjLowerBound(bucket, song->bpm); i < bucket->count && bucket->songs[i]->bpm == song->bpm; i++) {
+        if (bucket->songs[i] == song) {
+            memmove(bucket->songs + i, bucket->songs + i + 1, (size_t)(bucket->count - i - 1) * sizeof(Song*));
+            bucket->count--;
+            autoDjIndexed--;
+            return;
+        }
+    }
+}
+
+void autoDjIndexSong(Song* song) {
+    if (song->bpm <= 0.0f || song->musicalKey < 0) return;
+    AutoDjBucket* bucket = &autoDjBuckets[song->musicalKey];
+    if (bucket->count == bucket->capacity) {
+        int newCapacity = bucket->capacity ? bucket->capacity * 2 : 64;
+        Song** grown = (Song**)realloc(bucket->songs, (size_t)newCapacity * sizeof(Song*));
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed for auto-DJ index.\n");
+            return;
+        }
+        bucket->songs = grown;
+        bucket->capacity = newCapacity;
+    }
+    int at = autoDjLowerBound(bucket, song->bpm);
+    memmove(bucket->songs + at + 1, bucket->songs + at, (size_t)(bucket->count - at) * sizeof(Song*));
+    bucket->songs[at] = song;
+    bucket->count++;
+    autoDjIndexed++;
+    autoDjExhausted = false;
+}
+
+void autoDjReset(void) {
+    autoDjUpcomingCount = 0;
+    autoDjAnchor = NULL;
+    autoDjExhausted = false;
+}
+
+// A song is leaving the library
+void autoDjForgetSong(Song* song) {
+    autoDjUnindexSong(song);
+    autoDjExhausted = false;
+    if (song == autoDjAnchor) autoDjReset();
+    for (int i = 0; i < autoDjUpcomingCount; i++) {
+        if (autoDjUpcoming[i] == song) {
+            autoDjUpcomingCount = i; // Later picks followed it; they are made again
+            break;
+        }
+    }
+}
+
+bool autoDjEligible(const Song* song, const Song* from, bool allowRepeats) {
+    if (song == from || song == current || song->duplicateOf) return false;
+    if (!allowRepeats && song->lastPlayedTurn && playTurn - song->lastPlayedTurn < AUTO_DJ_REPEAT_GAP) return false;
+    for (int i = 0; i < autoDjUpcomingCount; i++) {
+        if (autoDjUpcoming[i] == song) return false;
+    }
+    return true;
+}
+
+// Lower is better: tempo distance in tolerances plus key distance on the wheel
+double autoDjScore(const Song* from, const Song* song) {
+    double tempo = 1e9;
+    for (int t = 0; t < 3; t++) {
+        double target = from->bpm * (t == 0 ? 1.0 : (t == 1 ? 2.0 : 0.5));
+        double difference = fabs(song->bpm - target) / target;
+        if (difference < tempo) tempo = difference;
+    }
+    return tempo / AUTO_DJ_TEMPO_TOLERANCE + keyDistance(from->musicalKey, song->musicalKey);
+}
+
+// Scores up to AUTO_DJ_MAX_CANDIDATES songs of 'bucket' nearest to 'target' bpm, outwards
+void autoDjScanBucket(const AutoDjBucket* bucket, const Song* from, float target, double tolerance, Song** best, double* bestScore) {
+    int above = autoDjLowerBound(bucket, target), below = above - 1;
+    for (int scanned = 0; scanned < AUTO_DJ_MAX_CANDIDATES && (above < bucket->count || below >= 0); scanned++) {
+        bool takeAbove = below < 0 || (above < bucket->count && bucket->songs[above]->bpm - target < target - bucket->songs[below]->bpm);
+        Song* song = takeAbove ? bucket->songs[above++] : bucket->songs[below--];
+        if (fabs(song->bpm - target) > target * tolerance) break; // Everything further out is too
+        if (!autoDjEligible(song, from, false)) continue;
+        double score = autoDjScore(from, song);
+        if (score < *bestScore) {
+            *bestScore = score;
+            *best = song;
+        }
+    }
+}
+
+Song* autoDjPick(const Song* from) {
+    Song* best = NULL;
+    double bestScore = 1e18;
+    if (from->bpm > 0.0f && from->musicalKey >= 0) {
+        int mode = from->musicalKey / 12, tonic = from->musicalKey % 12;
+        // Same key, relative major / minor, one fifth up and down
+        int keys[4] = { from->musicalKey, mode ? (tonic + 3) % 12 : 12 + (tonic + 9) % 12,
+                        mode * 12 + (tonic + 7) % 12, mode * 12 + (tonic + 5) % 12 };
+        for (int k = 0; k < 4; k++) {
+            for (int t = 0; t < 3; t++) {
+                float target = from->bpm * (t == 0 ? 1.0f : (t == 1 ? 2.0f : 0.5f));
+                autoDjScanBucket(&autoDjBuckets[keys[k]], from, target, AUTO_DJ_TEMPO_TOLERANCE, &best, &bestScore);
+            }
+        }
+        // Nothing compatible left: the closest tempo in any key
+        for (int k = 0; k < 24 && !best; k++) {
+            autoDjScanBucket(&autoDjBuckets[k], from, from->bpm, 1.0, &best, &bestScore);
+        }
+        if (best) return best;
+    }
+    // Unanalysed or exhausted: library order, as without auto-DJ
+    const Song* song = from;
+    for (int walked = 0; walked < AUTO_DJ_MAX_WALK; walked++) {
+        song = song->next ? song->next : allSongsList;
+        if (!song || song == from) break;
+        if (autoDjEligible(song, from, true)) return (Song*)song;
+    }
+    return NULL;
+}
+
+// Main loop: keeps AUTO_DJ_LOOKAHEAD picks queued after the current song. Returns true if
+// the upcoming list changed.
+bool autoDjFill(void) {
+    if (!autoDjEnabled || !current) return false;
+    bool changed = false;
+    if (autoDjAnchor != current) {
+        changed = autoDjUpcomingCount > 0;
+        autoDjUpcomingCount = 0;
+        autoDjAnchor = current;
+        autoDjExhausted = false;
+    }
+    // A small or used-up library would otherwise walk it again every frame
+    while (!autoDjExhausted && autoDjUpcomingCount < AUTO_DJ_LOOKAHEAD) {
+        const Song* from = autoDjUpcomingCount ? autoDjUpcoming[autoDjUpcomingCount - 1] : current;
+        long long start = perfMicros();
+        Song* pick = autoDjPick(from);
+        autoDjPickMicros += perfMicros() - start;
+        autoDjPicks++;
+        if (!pick) {
+            autoDjExhausted = true;
+            break;
+        }
+        autoDjUpcoming[autoDjUpcomingCount++] = pick;
+        changed = true;
+    }
+    return changed;
+}
+
+// Next track to play in auto-DJ mode, or NULL if there is none
+Song* autoDjNext(void) {
+    autoDjFill();
+    if (autoDjUpcomingCount == 0) return NULL;
+    Song* next = autoDjUpcoming[0];
+    memmove(autoDjUpcoming, autoDjUpcoming + 1, (size_t)(autoDjUpcomingCount - 1) * sizeof(Song*));
+    autoDjUpcomingCount--;
+    autoDjAnchor = next; // The remaining picks already follow it
+    autoDjExhausted = false;
+    return next;
+}
+
+void freeAutoDjIndex(void) {
+    for (int k = 0; k < 24; k++) {
+        free(autoDjBuckets[k].songs);
+        memset(&autoDjBuckets[k], 0, sizeof(autoDjBuckets[k]));
+    }
+    autoDjIndexed = 0;
+    autoDjReset();
+}
+
+// -------------------------- Audio Fingerprints --------------------------
+// Finds the same recording stored under different names, folders or formats. A background pass
+// decodes each track and reduces it to a 384-bit fingerprint: at 32 points spread over the
+// track a short window is analysed into a 12-bin chroma (energy per pitch class), and each bin
+// is compared with its neighbour. Re-encoding rarely flips these comparisons, so copies of a
+// recording differ in only a few bits. Fingerprints are cached in FINGERPRINT_CACHE_FILE and
+// kept in a multi-index hash keyed by each segment's 12-bit pattern. Two prints that differ in
+// fewer than FINGERPRINT_SEGMENTS bits keep at least one segment intact and so share a bucket;
+// duplicates are at most FINGERPRINT_MAX_DISTANCE bits apart, so a lookup never scans the
+// whole library.
+// The same decode also yields each track's tempo and key, cached alongside for the auto-DJ.
+#define FINGERPRINT_SEGMENTS 32
+#define FINGERPRINT_WORDS 6 // 32 segments x 12 bits
+#define FINGERPRINT_SEGMENT_KEYS 4096
+#define FINGERPRINT_MAX_DISTANCE 24 // Must stay below FINGERPRINT_SEGMENTS
+#define FINGERPRINT_FFT_SIZE 4096
+#define FINGERPRINT_WINDOW_FFTS 4 // Consecutive FFT frames per segment (about 1.5 s)
+#define FINGERPRINT_ANALYSIS_RATE 11025
+#define FINGERPRINT_CACHE_FILE "fingerprints.txt"
+#define MAX_FINGERPRINT_WORKERS 16
+
+typedef struct Fingerprint {
+    unsigned long long bits[FINGERPRINT_WORDS];
+    unsigned int durationMs;
+} Fingerprint;
+
+typedef struct FingerprintResult {
+    char path[MAX_PATH_LENGTH];
+    long long size; // File stamp the fingerprint belongs to
+    long long modified;
+    bool valid; // False if the track could not be analysed (too short, undecodable)
+    bool fromCache;
+    Fingerprint print;
+    float bpm; // 0 = no steady beat found
+    signed char musicalKey; // -1 = unknown
+} FingerprintResult;
+
+typedef struct Fingerprinter {
+    // Work queue (lock held)
+    char (*jobs)[MAX_PATH_LENGTH];
+    int jobCount;
+    int jobCapacity;
+    int nextJob;
+    int running;
+    FingerprintResult* results; // Finished, waiting for the main loop
+    int resultCount;
+    int resultCapacity;
+    FingerprintResult* spare; // Swapped with 'results' when the main loop takes a batch
+    int spareCapacity;
+    sfMutex* lock;
+    HANDLE wake; // Manual reset, signalled while jobs are waiting
+    bool stop;
+    sfThread* workers[MAX_FINGERPRINT_WORKERS];
+    int workerCount;
+    // Persistent cache, open addressing on the path (lock held; workers read it)
+    FingerprintResult* cache;
+    int cacheCount;
+    int cacheCapacity;
+    int* cacheSlots; // Index into 'cache', -1 when empty
+    int slotCapacity; // Power of two
+    bool cacheDirty;
+    // Counters for the debug stats view
+    long analysed;
+    long cacheHits;
+    long failed;
+    volatile LONG64 decodedBytes; // Whole tracks the workers hold decoded right now
+} Fingerprinter;
+
+typedef struct FingerprintIndexEntry {
+    Song* song; // NULL once the song left the library
+    Fingerprint print;
+    unsigned int queryMark; // Last lookup that compared against this entry
+} FingerprintIndexEntry;
+
+// Main thread only. Entry i is linked into one bucket per segment through next[i * SEGMENTS + s].
+// Entries of re-analysed or removed songs are unlinked and their slots reused.
+typedef struct FingerprintIndex {
+    FingerprintIndexEntry* entries;
+    int* next;
+    int count; // Slots handed out, including free ones
+    int capacity;
+    int live; // Entries holding a song
+    int freeSlots; // Free slot + 1, chained through next[slot * SEGMENTS]; 0 = none
+    int heads[FINGERPRINT_SEGMENTS][FINGERPRINT_SEGMENT_KEYS];
+    unsigned int queryMark;
+    long duplicates;
+} FingerprintIndex;
+
+Fingerprinter fingerprinter = {0};
+FingerprintIndex fingerprintIndex;
+bool fingerprintingEnabled = true;
+int analysisWorkerLimit = 0; // 0 = one worker per spare core
+double fingerprintHann[FINGERPRINT_FFT_SIZE];
+double fftCos[FINGERPRINT_FFT_SIZE / 2];
+double fftSin[FINGERPRINT_FFT_SIZE / 2];
+
+// In-place radix-2 FFT over FINGERPRINT_FFT_SIZE interleaved complex values
+void fftTransform(double* data) {
+    const int n = FINGERPRINT_FFT_SIZE;
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            double re = data[2 * i], im = data[2 * i + 1];
+            data[2 * i] = data[2 * j];
+            data[2 * i + 1] = data[2 * j + 1];
+            data[2 * j] = re;
+            data[2 * j + 1] = im;
+        }
+    }
+    for (int len = 2; len <= n; len <<= 1) {
+        int stride = n / len;
+        for (int i = 0; i < n; i += len) {
+            for (int k = 0; k < len / 2; k++) {
+                double wr = fftCos[k * stride], wi = -fftSin[k * stride];
+                double* a = data + 2 * (i + k);
+                double* b = data + 2 * (i + k + len / 2);
+                double tr = b[0] * wr - b[1] * wi, ti = b[0] * wi + b[1] * wr;
+                b[0] = a[0] - tr;
+                b[1] = a[1] - ti;
+                a[0] += tr;
+                a[1] += ti;
+            }
+        }
+    }
+}
+
+unsigned int fingerprintSegmentKey(const Fingerprint* print, int segment) {
+    int bit = segment * 12, word = bit >> 6, offset = bit & 63;
+    unsigned long long value = print->bits[word] >> offset;
+    if (offset > 52) value |= print->bits[word + 1] << (64 - offset);
+    return (unsigned int)(value & (FINGERPRINT_SEGMENT_KEYS - 1));
+}
+
+int fingerprintDistance(const Fingerprint* a, const Fingerprint* b) {
+    int distance = 0;
+    for (int i = 0; i < FINGERPRINT_WORDS; i++) distance += __builtin_popcountll(a->bits[i] ^ b->bits[i]);
+    return distance;
+}
+
+// Worker thread: decodes result->path and fills in its fingerprint, tempo and key.
+// 'fft' is 2 * FINGERPRINT_FFT_SIZE scratch.
+bool analyseTrack(FingerprintResult* result, double* fft) {
+    Fingerprint* print = &result->print;
+    sfSoundBuffer* pcm = decodeTrack(result->path);
+    if (!pcm) return false;
+    LONG64 pcmBytes = (LONG64)(sfSoundBuffer_getSampleCount(pcm) * sizeof(sfInt16));
+    InterlockedExchangeAdd64(&fingerprinter.decodedBytes, pcmBytes);
+    const sfInt16* samples = sfSoundBuffer_getSamples(pcm);
+    unsigned int channels = sfSoundBuffer_getChannelCount(pcm);
+    unsigned int rate = sfSoundBuffer_getSampleRate(pcm);
+    sfUint64 frames = channels ? sfSoundBuffer_getSampleCount(pcm) / channels : 0;
+    unsigned int step = rate >= 2 * FINGERPRINT_ANALYSIS_RATE ? rate / FINGERPRINT_ANALYSIS_RATE : 1;
+    sfUint64 analysisFrames = frames / step;
+    const sfUint64 windowFrames = (sfUint64)FINGERPRINT_FFT_SIZE * FINGERPRINT_WINDOW_FFTS;
+    if (!samples || rate == 0 || analysisFrames < windowFrames) {
+        InterlockedExchangeAdd64(&fingerprinter.decodedBytes, -pcmBytes);
+        sfSoundBuffer_destroy(pcm);
+        return false;
+    }
+    print->durationMs = (unsigned int)(frames * 1000 / rate);
+    memset(print->bits, 0, sizeof(print->bits));
+
+    // Pitch class of every FFT bin between 55 Hz and 4 kHz (-1 outside)
+    signed char binClass[FINGERPRINT_FFT_SIZE / 2];
+    double binHz = (double)rate / step / FINGERPRINT_FFT_SIZE;
+    for (int k = 0; k < FINGERPRINT_FFT_SIZE / 2; k++) {
+        double frequency = k * binHz;
+        binClass[k] = frequency < 55.0 || frequency > 4000.0 ? -1 : (signed char)(lrint(69.0 + 12.0 * log2(frequency / 440.0)) % 12);
+    }
+
+    const double scale = 1.0 / (32768.0 * step * channels);
+    double keyChroma[12] = {0};
+    for (int segment = 0; segment < FINGERPRINT_SEGMENTS; segment++) {
+        // Windows are spread over the middle 90% of the track, skipping intros and fade-outs
+        sfUint64 centre = (sfUint64)(analysisFrames * (0.05 + 0.9 * (segment + 0.5) / FINGERPRINT_SEGMENTS));
+        sfUint64 start = centre > windowFrames / 2 ? centre - windowFrames / 2 : 0;
+        if (start + windowFrames > analysisFrames) start = analysisFrames - windowFrames;
+
+        double chroma[12] = {0};
+        for (int w = 0; w < FINGERPRINT_WINDOW_FFTS; w++) {
+            for (int i = 0; i < FINGERPRINT_FFT_SIZE; i++) {
+                // Downmix and box-filter 'step' frames to one analysis sample
+                const sfInt16* src = samples + (start + (sfUint64)w * FINGERPRINT_FFT_SIZE + i) * step * channels;
+                long sum = 0;
+                for (unsigned int j = 0; j < step * channels; j++) sum += src[j];
+                fft[2 * i] = sum * scale * fingerprintHann[i];
+                fft[2 * i + 1] = 0.0;
+            }
+            fftTransform(fft);
+            for (int k = 1; k < FINGERPRINT_FFT_SIZE / 2; k++) {
+                if (binClass[k] >= 0) chroma[binClass[k]] += fft[2 * k] * fft[2 * k] + fft[2 * k + 1] * fft[2 * k + 1];
+            }
+        }
+        double energy = 0.0;
+        for (int p = 0; p < 12; p++) {
+            energy += chroma[p];
+            if (chroma[p] > chroma[(p + 1) % 12]) {
+                int bit = segment * 12 + p;
+                print->bits[bit >> 6] |= 1ull << (bit & 63);
+            }
+        }
+        // Every segment votes equally for the key, loud or quiet
+        for (int p = 0; p < 12 && energy > 0.0; p++) keyChroma[p] += chroma[p] / energy;
+    }
+    result->musicalKey = (signed char)estimateKey(keyChroma);
+
+    // Tempo from the middle of the track, downmixed the same way
+    sfUint64 tempoFrames = (sfUint64)TEMPO_ANALYSIS_SECONDS * rate / step;
+    if (tempoFrames > analysisFrames) tempoFrames = analysisFrames;
+    float* mono = (float*)malloc((size_t)tempoFrames * sizeof(float));
+    result->bpm = 0.0f;
+    if (mono) {
+        const sfInt16* src = samples + (analysisFrames - tempoFrames) / 2 * step * channels;
+        for (sfUint64 i = 0; i < tempoFrames; i++, src += step * channels) {
+            long sum = 0;
+            for (unsigned int j = 0; j < step * channels; j++) sum += src[j];
+            mono[i] = (float)(sum * scale);
+        }
+        result->bpm = estimateTempo(mono, (int)tempoFrames, (double)rate / step);
+        free(mono);
+    }
+    InterlockedExchangeAdd64(&fingerprinter.decodedBytes, -pcmBytes);
+    sfSoundBuffer_destroy(pcm);
+    return true;
+}
+
+// Caller holds fingerprinter.lock
+int fingerprintCacheFind(const char* path) {
+    if (!fingerprinter.slotCapacity) return -1;
+    int mask = fingerprinter.slotCapacity - 1;
+    for (int i = (int)(hashKey(path) & mask); fingerprinter.cacheSlots[i] >= 0; i = (i + 1) & mask) {
+        if (strcmp(fingerprinter.cache[fingerprinter.cacheSlots[i]].path, path) == 0) return fingerprinter.cacheSlots[i];
+    }
+    return -1;
+}
+
+bool fingerprintCacheGrow(void) {
+    int newSlots = fingerprinter.slotCapacity ? fingerprinter.slotCapacity * 2 : 1024;
+    int* slots = (int*)malloc((size_t)newSlots * sizeof(int));
+    FingerprintResult* entries = (FingerprintResult*)realloc(fingerprinter.cache, (size_t)(newSlots / 2) * sizeof(FingerprintResult));
+    if (!slots || !entries) {
+        fprintf(stderr, "Memory allocation failed for fingerprint cache.\n");
+        free(slots);
+        if (entries) fingerprinter.cache = entries;
+        return false;
+    }
+    fingerprinter.cache = entries;
+    fingerprinter.cacheCapacity = newSlots / 2; // Keeps the load factor at or below 1/2
+    memset(slots, 0xff, (size_t)newSlots * sizeof(int));
+    for (int e = 0; e < fingerprinter.cacheCount; e++) {
+        int i = (int)(hashKey(entries[e].path) & (newSlots - 1));
+        while (slots[i] >= 0) i = (i + 1) & (newSlots - 1);
+        slots[i] = e;
+    }
+    free(fingerprinter.cacheSlots);
+    fingerprinter.cacheSlots = slots;
+    fingerprinter.slotCapacity = newSlots;
+    return true;
+}
+
+void fingerprintCachePut(const FingerprintResult* result) {
+    int existing = fingerprintCacheFind(result->path);
+    if (existing < 0) {
+        if (fingerprinter.cacheCount == fingerprinter.cacheCapacity && !fingerprintCacheGrow()) return;
+        existing = fingerprinter.cacheCount++;
+        int mask = fingerprinter.slotCapacity - 1;
+        int i = (int)(hashKey(result->path) & mask);
+        while (fingerprinter.cacheSlots[i] >= 0) i = (i + 1) & mask;
+        fingerprinter.cacheSlots[i] = existing;
+    }
+    fingerprinter.cache[existing] = *result;
+    fingerprinter.cache[existing].fromCache = true;
+    fingerprinter.cacheDirty = true;
+}
+
+// Cache lines: size <TAB> modified <TAB> duration ms <TAB> bpm <TAB> key <TAB> 96 hex digits (or '-') <TAB> path
+void loadFingerprintCache(void) {
+    FILE* fp = fopen(FINGERPRINT_CACHE_FILE, "r");
+    if (!fp) return;
+    LineReader reader = { fp, NULL, 0, 0, 0 };
+    while (readLine(&reader)) {
+        char* fields[7];
+        fields[0] = reader.line;
+        int count = 1;
+        for (char* c = reader.line; *c && count < 7; c++) {
+            if (*c == '\t') {
+                *c = '\0';
+                fields[count++] = c + 1;
+            }
+        }
+        if (count < 7) continue; // Older cache without tempo and key: analysed again
+        FingerprintResult entry;
+        memset(&entry, 0, sizeof(entry));
+        snprintf(entry.path, sizeof(entry.path), "%s", fields[6]);
+        entry.size = strtoll(fields[0], NULL, 10);
+        entry.modified = strtoll(fields[1], NULL, 10);
+        entry.print.durationMs = (unsigned int)strtoul(fields[2], NULL, 10);
+        entry.bpm = strtof(fields[3], NULL);
+        long key = strtol(fields[4], NULL, 10);
+        entry.musicalKey = (signed char)(key >= 0 && key < 24 ? key : -1);
+        entry.valid = strlen(fields[5]) == FINGERPRINT_WORDS * 16;
+        for (int w = 0; entry.valid && w < FINGERPRINT_WORDS; w++) {
+            char word[17];
+            memcpy(word, fields[5] + w * 16, 16);
+            word[16] = '\0';
+            entry.print.bits[w] = strtoull(word, NULL, 16);
+        }
+        fingerprintCachePut(&entry);
+    }
+    closeLineReader(&reader);
+    fclose(fp);
+    fingerprinter.cacheDirty = false;
+}
+
+void saveFingerprintCache(void) {
+    char tempPath[64]; // Per process: other player instances may save at the same time
+    snprintf(tempPath, sizeof(tempPath), "%s.%lu.tmp", FINGERPRINT_CACHE_FILE, (unsigned long)GetCurrentProcessId());
+    FILE* fp = fopen(tempPath, "w");
+    if (!fp) {
+        printf("Could not write fingerprint cache: %s\n", tempPath);
+        return;
+    }
+    sfMutex_lock(fingerprinter.lock);
+    for (int i = 0; i < fingerprinter.cacheCount; i++) {
+        const FingerprintResult* entry = &fingerprinter.cache[i];
+        fprintf(fp, "%lld\t%lld\t%u\t%.2f\t%d\t", entry->size, entry->modified, entry->print.durationMs, entry->bpm, entry->musicalKey);
+        if (entry->valid) {
+            for (int w = 0; w < FINGERPRINT_WORDS; w++) fprintf(fp, "%016llx", entry->print.bits[w]);
+        } else {
+            fputc('-', fp);
+        }
+        fprintf(fp, "\t%s\n", entry->path);
+    }
+    fingerprinter.cacheDirty = false;
+    sfMutex_unlock(fingerprinter.lock);
+    if (fclose(fp) != 0 || !MoveFileExA(tempPath, FINGERPRINT_CACHE_FILE, MOVEFILE_REPLACE_EXISTING)) {
+        printf("Could not replace fingerprint cache (Error Code: %lu)\n", GetLastError());
+    }
+}
+
+void fingerprintWorker(void* userData) {
+    (void)userData;
+    double* fft = (double*)malloc(2 * FINGERPRINT_FFT_SIZE * sizeof(double));
+    if (!fft) {
+        fprintf(stderr, "Memory allocation failed for fingerprint worker.\n");
+        return;
+    }
+    sfMutex_lock(fingerprinter.lock);
+    while (!fingerprinter.stop) {
+        if (fingerprinter.nextJob == fingerprinter.jobCount) {
+            ResetEvent(fingerprinter.wake);
+            sfMutex_unlock(fingerprinter.lock);
+            WaitForSingleObject(fingerprinter.wake, INFINITE);
+            sfMutex_lock(fingerprinter.lock);
+            continue;
+        }
+        FingerprintResult result;
+        memset(&result, 0, sizeof(result));
+        strcpy(result.path, fingerprinter.jobs[fingerprinter.nextJob++]);
+        fingerprinter.running++;
+        sfMutex_unlock(fingerprinter.lock);
+
+        bool stamped = getFileStamp(result.path, &result.size, &result.modified);
+        sfMutex_lock(fingerprinter.lock);
+        int cached = stamped ? fingerprintCacheFind(result.path) : -1;
+        if (cached >= 0 && fingerprinter.cache[cached].size == result.size && fingerprinter.cache[cached].modified == result.modified) {
+            result = fingerprinter.cache[cached];
+            fingerprinter.cacheHits++;
+        } else if (stamped) {
+            sfMutex_unlock(fingerprinter.lock);
+            result.valid = analyseTrack(&result, fft);
+            sfMutex_lock(fingerprinter.lock);
+            if (result.valid) fingerprinter.analysed++; else fingerprinter.failed++;
+        }
+        fingerprinter.running--;
+        if (!stamped) continue; // The file is gone
+        if (fingerprinter.resultCount == fingerprinter.resultCapacity) {
+            int newCapacity = fingerprinter.resultCapacity ? fingerprinter.resultCapacity * 2 : 64;
+            FingerprintResult* grown = (FingerprintResult*)realloc(fingerprinter.results, (size_t)newCapacity * sizeof(FingerprintResult));
+            if (!grown) {
+                fprintf(stderr, "Memory allocation failed for fingerprint results.\n");
+                continue;
+            }
+            fingerprinter.results = grown;
+            fingerprinter.resultCapacity = newCapacity;
+        }
+        fingerprinter.results[fingerprinter.resultCount++] = result;
+    }
+    sfMutex_unlock(fingerprinter.lock);
+    free(fft);
+}
+
+void queueFingerprint(const char* path) {
+    if (!fingerprinter.lock) return;
+    sfMutex_lock(fingerprinter.lock);
+    if (fingerprinter.jobCount == fingerprinter.jobCapacity) {
+        int newCapacity = fingerprinter.jobCapacity ? fingerprinter.jobCapacity * 2 : 256;
+        char (*grown)[MAX_PATH_LENGTH] = realloc(fingerprinter.jobs, (size_t)newCapacity * MAX_PATH_LENGTH);
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed for fingerprint queue.\n");
+            sfMutex_unlock(fingerprinter.lock);
+            return;
+        }
+        fingerprinter.jobs = grown;
+        fingerprinter.jobCapacity = newCapacity;
+    }
+    snprintf(fingerprinter.jobs[fingerprinter.jobCount++], MAX_PATH_LENGTH, "%s", path);
+    SetEvent(fingerprinter.wake);
+    sfMutex_unlock(fingerprinter.lock);
+}
+
+// Loads the cache, starts the analysis workers and queues every song in the library
+void startFingerprinting(Song* library) {
+    if (!fingerprintingEnabled || fingerprinter.lock) return;
+    fingerprinter.lock = sfMutex_create();
+    fingerprinter.wake = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!fingerprinter.lock || !fingerprinter.wake) return;
+
+    const double pi = 3.14159265358979323846;
+    for (int i = 0; i < FINGERPRINT_FFT_SIZE; i++) fingerprintHann[i] = 0.5 - 0.5 * cos(2.0 * pi * i / FINGERPRINT_FFT_SIZE);
+    for (int i = 0; i < FINGERPRINT_FFT_SIZE / 2; i++) {
+        fftCos[i] = cos(2.0 * pi * i / FINGERPRINT_FFT_SIZE);
+        fftSin[i] = sin(2.0 * pi * i / FINGERPRINT_FFT_SIZE);
+    }
+    memset(fingerprintIndex.heads, 0xff, sizeof(fingerprintIndex.heads));
+    loadFingerprintCache();
+
+    for (Song* song = library; song; song = song->next) queueFingerprint(song->path);
+
+    // One core is left for playback and the UI unless --analysis-workers says otherwise
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int workers = analysisWorkerLimit ? analysisWorkerLimit : (int)info.dwNumberOfProcessors - 1;
+    if (workers < 1) workers = 1;
+    if (workers > MAX_FINGERPRINT_WORKERS) workers = MAX_FINGERPRINT_WORKERS;
+    for (int i = 0; i < workers; i++) {
+        sfThread* thread = sfThread_create(fingerprintWorker, NULL);
+        if (!thread) break;
+        fingerprinter.workers[fingerprinter.workerCount++] = thread;
+        sfThread_launch(thread);
+    }
+}
+
+// Takes the song's entry out of every segment bucket and frees its slot
+void fingerprintIndexRemove(Song* song) {
+    FingerprintIndex* index = &fingerprintIndex;
+    if (song->fingerprintSlot <= 0) return;
+    int slot = song->fingerprintSlot - 1;
+    FingerprintIndexEntry* entry = &index->entries[slot];
+    for (int s = 0; s < FINGERPRINT_SEGMENTS; s++) {
+        int* link = &index->heads[s][fingerprintSegmentKey(&entry->print, s)];
+        while (*link >= 0 && *link != slot) link = &index->next[*link * FINGERPRINT_SEGMENTS + s];
+        if (*link == slot) *link = index->next[slot * FINGERPRINT_SEGMENTS + s];
+    }
+    entry->song = NULL;
+    index->next[slot * FINGERPRINT_SEGMENTS] = index->freeSlots - 1;
+    index->freeSlots = slot + 1;
+    index->live--;
+    song->fingerprintSlot = 0;
+}
+
+// Adds 'song' to the index and returns the closest earlier recording within
+// FINGERPRINT_MAX_DISTANCE bits, or NULL if it is unique
+Song* fingerprintIndexAdd(Song* song, const Fingerprint* print) {
+    FingerprintIndex* index = &fingerprintIndex;
+    fingerprintIndexRemove(song); // Re-analysed
+
+    if (!index->freeSlots && index->count == index->capacity) {
+        int newCapacity = index->capacity ? index->capacity * 2 : 256;
+        FingerprintIndexEntry* entries = (FingerprintIndexEntry*)realloc(index->entries, (size_t)newCapacity * sizeof(FingerprintIndexEntry));
+        if (entries) index->entries = entries;
+        int* next = (int*)realloc(index->next, (size_t)newCapacity * FINGERPRINT_SEGMENTS * sizeof(int));
+        if (next) index->next = next;
+        if (!entries || !next) {
+            fprintf(stderr, "Memory allocation failed for fingerprint index.\n");
+            return NULL;
+        }
+        index->capacity = newCapacity;
+    }
+
+    // Every print within reach shares at least one segment pattern with this one
+    index->queryMark++;
+    const FingerprintIndexEntry* best = NULL;
+    int bestDistance = FINGERPRINT_MAX_DISTANCE + 1;
+    unsigned int durationSlack = print->durationMs / 50 > 2000 ? print->durationMs / 50 : 2000;
+    for (int s = 0; s < FINGERPRINT_SEGMENTS; s++) {
+        for (int e = index->heads[s][fingerprintSegmentKey(print, s)]; e >= 0; e = index->next[e * FINGERPRINT_SEGMENTS + s]) {
+            FingerprintIndexEntry* candidate = &index->entries[e];
+            if (candidate->queryMark == index->queryMark) continue;
+            candidate->queryMark = index->queryMark;
+            if (!candidate->song) continue;
+            unsigned int a = candidate->print.durationMs, b = print->durationMs;
+            if ((a > b ? a - b : b - a) > durationSlack) continue;
+            int distance = fingerprintDistance(&candidate->print, print);
+            if (distance < bestDistance) {
+                bestDistance = distance;
+                best = candidate;
+            }
+        }
+    }
+
+    int slot;
+    if (index->freeSlots) {
+        slot = index->freeSlots - 1;
+        index->freeSlots = index->next[slot * FINGERPRINT_SEGMENTS] + 1;
+    } else {
+        slot = index->count++;
+    }
+    index->live++;
+    FingerprintIndexEntry* entry = &index->entries[slot];
+    entry->song = song;
+    entry->print = *print;
+    entry->queryMark = 0;
+    for (int s = 0; s < FINGERPRINT_SEGMENTS; s++) {
+        unsigned int key = fingerprintSegmentKey(print, s);
+        index->next[slot * FINGERPRINT_SEGMENTS + s] = index->heads[s][key];
+        index->heads[s][key] = slot;
+    }
+    song->fingerprintSlot = slot + 1;
+
+    if (!best) return NULL;
+    Song* original = best->song->duplicateOf ? best->song->duplicateOf : best->song;
+    return original != song ? original : NULL;
+}
+
+// Main loop: indexes finished fingerprints. Returns true if new duplicates were found.
+bool applyFingerprintResults(void) {
+    if (!fingerprinter.lock) return false;
+    sfMutex_lock(fingerprinter.lock);
+    FingerprintResult* batch = fingerprinter.results;
+    int count = fingerprinter.resultCount;
+    int capacity = fingerprinter.resultCapacity;
+    fingerprinter.results = fingerprinter.spare;
+    fingerprinter.resultCapacity = fingerprinter.spareCapacity;
+    fingerprinter.resultCount = 0;
+    for (int i = 0; i < count; i++) {
+        if (!batch[i].fromCache) fingerprintCachePut(&batch[i]);
+    }
+    bool idle = fingerprinter.nextJob == fingerprinter.jobCount && fingerprinter.running == 0 && fingerprinter.resultCount == 0;
+    if (idle) fingerprinter.jobCount = fingerprinter.nextJob = 0;
+    bool passDone = idle && count > 0;
+    bool save = idle && fingerprinter.cacheDirty;
+    sfMutex_unlock(fingerprinter.lock);
+
+    bool found = false;
+    for (int i = 0; i < count; i++) {
+        Song* song = batch[i].valid ? findSongByPath(batch[i].path) : NULL;
+        if (!song) continue;
+        autoDjUnindexSong(song);
+        song->bpm = batch[i].bpm;
+        song->musicalKey = batch[i].musicalKey;
+        song->durationMs = batch[i].print.durationMs;
+        libraryTableRefresh(&libraryTable, song, false);
+        autoDjIndexSong(song);
+        Song* original = fingerprintIndexAdd(song, &batch[i].print);
+        if (original != song->duplicateOf) {
+            song->duplicateOf = original;
+            if (original) {
+                fingerprintIndex.duplicates++;
+                printf("Duplicate: %s is the same recording as %s\n", song->path, original->path);
+                found = true;
+            }
+        }
+    }
+    // Hand the drained buffer back for the workers to fill next time
+    fingerprinter.spare = batch;
+    fingerprinter.spareCapacity = capacity;
+    if (save) saveFingerprintCache();
+    if (passDone) printf("Fingerprinting done: %d tracks indexed, %ld duplicate(s)\n", fingerprintIndex.live, fingerprintIndex.duplicates);
+    return found;
+}
+
+// A song is leaving the library: drop it from the index and promote one of its copies
+void forgetFingerprint(Song* song, Song* library) {
+    fingerprintIndexRemove(song);
+    Song* promoted = NULL;
+    for (Song* other = library; other; other = other->next) {
+        if (other->duplicateOf != song) continue;
+        if (!promoted) {
+            promoted = other;
+            other->duplicateOf = NULL;
+        } else {
+            other->duplicateOf = promoted;
+        }
+    }
+}
+
+void stopFingerprinting(void) {
+    if (!fingerprinter.lock) return;
+    sfMutex_lock(fingerprinter.lock);
+    fingerprinter.stop = true;
+    SetEvent(fingerprinter.wake);
+    sfMutex_unlock(fingerprinter.lock);
+    for (int i = 0; i < fingerprinter.workerCount; i++) {
+        sfThread_wait(fingerprinter.workers[i]);
+        sfThread_destroy(fingerprinter.workers[i]);
+    }
+    fingerprinter.workerCount = 0;
+    for (int i = 0; i < fingerprinter.resultCount; i++) {
+        if (!fingerprinter.results[i].fromCache) fingerprintCachePut(&fingerprinter.results[i]);
+    }
+    if (fingerprinter.cacheDirty) saveFingerprintCache(); // Keep the work done so far
+    free(fingerprinter.jobs);
+    free(fingerprinter.results);
+    free(fingerprinter.spare);
+    free(fingerprinter.cache);
+    free(fingerprinter.cacheSlots);
+    free(fingerprintIndex.entries);
+    free(fingerprintIndex.next);
+    sfMutex_destroy(fingerprinter.lock);
+    CloseHandle(fingerprinter.wake);
+    memset(&fingerprinter, 0, sizeof(fingerprinter));
+    memset(&fingerprintIndex, 0, sizeof(fingerprintIndex));
+}
+
+// -------------------------- Library Editing --------------------------
+// Appends a song to the library and keeps the path / file name indices in step
+void addLibrarySong(const char* name, const char* path) {
+    Song* last = allSongsList;
+    while (last && last->next) last = last->next;
+    addSong(&allSongsList, name, path);
+    Song* added = last ? last->next : allSongsList;
+    if (!added) return;
+    songIndexInsert(&songPathIndex, added);
+    songIndexInsert(&songNameIndex, added);
+    libraryTableAdd(&libraryTable, added);
+    queueFingerprint(added->path);
+    autoDjExhausted = false; // The library-order fallback may pick it
+}
+
+// Removes every queue entry for 'song' from 'pl'; returns how many were dropped
+int removeSongFromPlaylist(Playlist* pl, const Song* song) {
+    int removed = 0;
+    PlaylistNode* prev = NULL;
+    PlaylistNode* node = pl ? pl->front : NULL;
+    while (node) {
+        PlaylistNode* next = node->next;
+        if (node->song == song) {
+            if (prev) prev->next = next; else pl->front = next;
+            if (pl->rear == node) pl->rear = prev;
+            pl->length--;
+            poolFree(&playlistNodePool, node);
+            removed++;
+        } else {
+            prev = node;
+        }
+        node = next;
+    }
+    return removed;
+}
+
+// Drops a song that disappeared from disk from the library, all playlists and the recent stack
+void removeSongFromLibrary(Song* song) {
+    int dropped = 0;
+    for (Playlist* pl = playlists; pl; pl = pl->next) dropped += removeSongFromPlaylist(pl, song);
+    dropped += removeSongFromPlaylist(currentPlaylist, song);
+    for (int i = 0; i < zoneCount; i++) dropped += removeSongFromPlaylist(zones[i].queue, song);
+    if (dropped > 0) printf("  Dropped %d playlist entr%s for %s\n", dropped, dropped == 1 ? "y" : "ies", song->name);
+
+    StackNode* prevStack = NULL;
+    StackNode* stackNode = recentStack;
+    while (stackNode) {
+        StackNode* next = stackNode->next;
+        if (stackNode->song == song) {
+            if (prevStack) prevStack->next = next; else recentStack = next;
+            poolFree(&stackNodePool, stackNode);
+        } else {
+            prevStack = stackNode;
+        }
+        stackNode = next;
+    }
+    // Dropping B from A,B,A would show A twice in a row, which pushRecent() never allows
+    for (StackNode* node = recentStack; node && node->next;) {
+        if (node->next->song == node->song) {
+            StackNode* repeated = node->next;
+            node->next = repeated->next;
+            poolFree(&stackNodePool, repeated);
+        } else {
+            node = node->next;
+        }
+    }
+
+    // Keep 'current' on the song before it so Next / auto-advance continue where they would have
+    if (current == song) {
+        Song* last = allSongsList;
+        while (last && last->next) last = last->next;
+        current = song->prev ? song->prev : (last != song ? last : NULL);
+    }
+
+    zonesForgetSong(song);
+    forgetFingerprint(song, allSongsList);
+    autoDjForgetSong(song);
+    libraryTableRemove(&libraryTable, song);
+    songIndexRemove(&songPathIndex, song);
+    songIndexRemove(&songNameIndex, song);
+    if (song->prev) song->prev->next = song->next; else allSongsList = song->next;
+    if (song->next) song->next->prev = song->prev;
+    freeSong(song);
+}
+
+// Points 'song' at a new file in place: playlists hold the Song, so they follow automatically
+void relinkLibrarySong(Song* song, const char* name, const char* path) {
+    songIndexRemove(&songPathIndex, song);
+    songIndexRemove(&songNameIndex, song);
+    char key[MAX_PATH_LENGTH];
+    songPathKey(path, key, sizeof(key));
+    char* newName = stringPoolCopy(&songStrings, name, MAX_SONG_NAME_LENGTH);
+    char* newPath = newName ? stringPoolCopy(&songStrings, path, MAX_PATH_LENGTH) : NULL;
+    char* newKey = newPath ? stringPoolCopy(&songStrings, key, MAX_PATH_LENGTH) : NULL;
+    if (newKey) { // Otherwise the song keeps its old file
+        stringPoolFree(&songStrings, song->name);
+        stringPoolFree(&songStrings, song->path);
+        stringPoolFree(&songStrings, song->key);
+        song->name = newName;
+        song->path = newPath;
+        song->key = newKey;
+    } else {
+        stringPoolFree(&songStrings, newName);
+        stringPoolFree(&songStrings, newPath);
+    }
+    songIndexInsert(&songPathIndex, song);
+    songIndexInsert(&songNameIndex, song);
+    libraryTableRefresh(&libraryTable, song, true);
+    queueFingerprint(song->path);
+}
+
+// -------------------------- Transcoding Cache --------------------------
+// Audio files the player does not pick up natively (anything but .ogg) are converted once
+// into 16-bit FLAC under TRANSCODE_CACHE_DIR, named after a hash of the source file's
+// content, and the library plays the cached copy. A pool of worker threads (one per spare
+// core) does the conversions and the main loop adds each track as soon as its job is done.
+// A manifest maps every source, stamped with its size and modification time, to its cache
+// file so unchanged sources are neither hashed nor converted again on the next start.
+// SFML decodes what it can; anything else goes through an external tool (--transcoder).
+#define TRANSCODE_CACHE_DIR "transcode_cache"
+#define TRANSCODE_MANIFEST TRANSCODE_CACHE_DIR "\\manifest.txt"
+#define MAX_TRANSCODE_WORKERS 8
+#define TRANSCODE_READ_CHUNK (256 * 1024)
+
+typedef enum TranscodeJobState {
+    JOB_PENDING,
+    JOB_RUNNING,
+    JOB_CONVERTED,
+    JOB_CACHED, // Content hash already had a cache file
+    JOB_FAILED,
+    JOB_CANCELLED
+} TranscodeJobState;
+
+typedef struct TranscodeJob {
+    char sourcePath[MAX_PATH_LENGTH];
+    char name[100]; // Library name: the source file name
+    char outputPath[MAX_PATH_LENGTH];
+    long long size; // Source stamp recorded in the manifest
+    long long modified;
+    TranscodeJobState state;
+    bool applied; // Result handed to the library by the main loop
+    long long micros;
+} TranscodeJob;
+
+typedef struct TranscodeEntry {
+    char sourcePath[MAX_PATH_LENGTH];
+    char outputPath[MAX_PATH_LENGTH];
+    long long size;
+    long long modified;
+} TranscodeEntry;
+
+typedef struct Transcoder {
+    // Job queue (lock held). Jobs are handed out in order from 'nextJob'; the array is
+    // emptied again once every job has finished and been applied.
+    TranscodeJob* jobs;
+    int jobCount;
+    int jobCapacity;
+    int nextJob;
+    int firstUnapplied;
+    int running;
+    int finished; // Jobs finished since the queue was last empty, for progress output
+    sfMutex* lock;
+    HANDLE wake; // Manual reset, signalled while jobs are waiting
+    bool stop;
+    volatile LONG generation; // Bumped by cancelTranscodes(); running jobs compare against it
+    sfThread* workers[MAX_TRANSCODE_WORKERS];
+    int workerCount;
+    // Manifest, sorted by source path (main thread only)
+    TranscodeEntry* manifest;
+    int manifestCount;
+    int manifestCapacity;
+    bool manifestDirty;
+    // Counters for the debug stats view
+    long converted;
+    long cached;
+    long failed;
+    long cancelled;
+} Transcoder;
+
+Transcoder transcoder = {0};
+const char* transcoderCommand = NULL; // ffmpeg compatible tool for formats SFML cannot read
+int transcodeWorkerLimit = 0; // 0 = one worker per spare core
+
+bool hasExtension(const char* name, const char* ext) {
+    size_t len = strlen(name), extLen = strlen(ext);
+    if (len <= extLen) return false;
+    const char* tail = name + len - extLen;
+    for (size_t i = 0; i < extLen; i++) {
+        if ((tail[i] | 0x20) != ext[i]) return false;
+    }
+    return true;
+}
+
+bool hasTranscodableExtension(const char* name) {
+    static const char* extensions[] = {".mp3", ".m4a", ".aac", ".wma", ".opus", ".flac", ".wav", ".aif", ".aiff"};
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        if (hasExtension(name, extensions[i])) return true;
+    }
+    return false;
+}
+
+// Binary search; returns the entry for 'sourcePath' or where it would be inserted
+int manifestPosition(const char* sourcePath, bool* found) {
+    int lo = 0, hi = transcoder.manifestCount;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(transcoder.manifest[mid].sourcePath, sourcePath);
+        if (cmp == 0) {
+            *found = true;
+            return mid;
+        }
+        if (cmp < 0) lo = mid + 1; else hi = mid;
+    }
+    *found = false;
+    return lo;
+}
+
+TranscodeEntry* manifestFind(const char* sourcePath) {
+    bool found;
+    int pos = manifestPosition(sourcePath, &found);
+    return found ? &transcoder.manifest[pos] : NULL;
+}
+
+void manifestPut(const char* sourcePath, const char* outputPath, long long size, long long modified) {
+    bool found;
+    int pos = manifestPosition(sourcePath, &found);
+    if (!found) {
+        if (transcoder.manifestCount == transcoder.manifestCapacity) {
+            int newCapacity = transcoder.manifestCapacity ? transcoder.manifestCapacity * 2 : 64;
+            TranscodeEntry* grown = (TranscodeEntry*)realloc(transcoder.manifest, (size_t)newCapacity * sizeof(TranscodeEntry));
+            if (!grown) {
+                fprintf(stderr, "Memory allocation failed for transcode manifest.\n");
+                return;
+            }
+            transcoder.manifest = grown;
+            transcoder.manifestCapacity = newCapacity;
+        }
+        memmove(&transcoder.manifest[pos + 1], &transcoder.manifest[pos], (size_t)(transcoder.manifestCount - pos) * sizeof(TranscodeEntry));
+        transcoder.manifestCount++;
+        snprintf(transcoder.manifest[pos].sourcePath, MAX_PATH_LENGTH, "%s", sourcePath);
+    }
+    TranscodeEntry* entry = &transcoder.manifest[pos];
+    snprintf(entry->outputPath, MAX_PATH_LENGTH, "%s", outputPath);
+    entry->size = size;
+    entry->modified = modified;
+    transcoder.manifestDirty = true;
+}
+
+void manifestRemove(const char* sourcePath) {
+    bool found;
+    int pos = manifestPosition(sourcePath, &found);
+    if (!found) return;
+    transcoder.manifestCount--;
+    memmove(&transcoder.manifest[pos], &transcoder.manifest[pos + 1], (size_t)(transcoder.manifestCount - pos) * sizeof(TranscodeEntry));
+    transcoder.manifestDirty = true;
+}
+
+// True when a source other than 'sourcePath' converts to the same cache file (identical content)
+bool manifestOutputShared(const char* outputPath, const char* sourcePath) {
+    for (int i = 0; i < transcoder.manifestCount; i++) {
+        const TranscodeEntry* entry = &transcoder.manifest[i];
+        if (strcmp(entry->outputPath, outputPath) == 0 && strcmp(entry->sourcePath, sourcePath) != 0) return true;
+    }
+    return false;
+}
+
+// Manifest lines: size <TAB> modified <TAB> cache file <TAB> source file
+void loadTranscodeManifest(void) {
+    FILE* fp = fopen(TRANSCODE_MANIFEST, "r");
+    if (!fp) return;
+    LineReader reader = { fp, NULL, 0, 0, 0 };
+    while (readLine(&reader)) {
+        char* fields[4];
+        fields[0] = reader.line;
+        int count = 1;
+        for (char* c = reader.line; *c && count < 4; c++) {
+            if (*c == '\t') {
+                *c = '\0';
+                fields[count++] = c + 1;
+            }
+        }
+        if (count < 4) continue;
+        manifestPut(fields[3], fields[2], strtoll(fields[0], NULL, 10), strtoll(fields[1], NULL, 10));
+    }
+    closeLineReader(&reader);
+    fclose(fp);
+    transcoder.manifestDirty = false;
+}
+
+void saveTranscodeManifest(void) {
+    if (!transcoder.manifestDirty) return;
+    const char* tempPath = TRANSCODE_MANIFEST ".tmp";
+    FILE* fp = fopen(tempPath, "w");
+    if (!fp) {
+        printf("Could not write transcode manifest: %s\n", tempPath);
+        return;
+    }
+    for (int i = 0; i < transcoder.manifestCount; i++) {
+        const TranscodeEntry* entry = &transcoder.manifest[i];
+        fprintf(fp, "%lld\t%lld\t%s\t%s\n", entry->size, entry->modified, entry->outputPath, entry->sourcePath);
+    }
+    bool written = fclose(fp) == 0;
+    if (written && MoveFileExA(tempPath, TRANSCODE_MANIFEST, MOVEFILE_REPLACE_EXISTING)) {
+        transcoder.manifestDirty = false;
+    } else {
+        printf("Could not replace transcode manifest (Error Code: %lu)\n", GetLastError());
+    }
+}
+
+// FNV-1a over the whole file; gives up early if the job is cancelled
+bool hashSourceFile(const char* path, LONG generation, unsigned long long* hashOut) {
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    unsigned char* buffer = (unsigned char*)malloc(TRANSCODE_READ_CHUNK);
+    unsigned long long hash = 14695981039346656037ull;
+    bool ok = buffer != NULL;
+    while (ok) {
+        DWORD got = 0;
+        if (!ReadFile(file, buffer, TRANSCODE_READ_CHUNK, &got, NULL)) ok = false;
+        if (got == 0) break;
+        for (DWORD i = 0; i < got; i++) hash = (hash ^ buffer[i]) * 1099511628211ull;
+        InterlockedExchangeAdd64(&ioStats.bytesRead, got);
+        if (transcoder.generation != generation) ok = false;
+    }
+    free(buffer);
+    CloseHandle(file);
+    *hashOut = hash;
+    return ok;
+}
+
+// Runs the external tool to convert 'source' into 16-bit FLAC at 'target'
+bool runExternalTranscoder(const char* source, const char* target, LONG generation) {
+    char commandLine[3 * MAX_PATH_LENGTH + 128];
+    snprintf(commandLine, sizeof(commandLine), "\"%s\" -nostdin -v error -y -i \"%s\" -vn -c:a flac -sample_fmt s16 \"%s\"",
+             transcoderCommand, source, target);
+    STARTUPINFOA startup = {0};
+    startup.cb = sizeof(startup);
+    PROCESS_INFORMATION process = {0};
+    if (!CreateProcessA(NULL, commandLine, NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL, &startup, &process)) {
+        printf("Could not start transcoder %s (Error Code: %lu)\n", transcoderCommand, GetLastError());
+        return false;
+    }
+    while (WaitForSingleObject(process.hProcess, 100) == WAIT_TIMEOUT) {
+        if (transcoder.generation != generation) {
+            TerminateProcess(process.hProcess, 1);
+            WaitForSingleObject(process.hProcess, INFINITE);
+            break;
+        }
+    }
+    DWORD exitCode = 1;
+    GetExitCodeProcess(process.hProcess, &exitCode);
+    CloseHandle(process.hThread);
+    CloseHandle(process.hProcess);
+    return exitCode == 0 && transcoder.generation == generation;
+}
+
+// Worker thread: converts one job (a private copy, the queue may be reallocated meanwhile)
+void runTranscodeJob(TranscodeJob* job, int index, LONG generation) {
+    long long start = perfMicros();
+    unsigned long long hash;
+    if (!hashSourceFile(job->sourcePath, generation, &hash)) {
+        job->state = transcoder.generation != generation ? JOB_CANCELLED : JOB_FAILED;
+        return;
+    }
+    snprintf(job->outputPath, sizeof(job->outputPath), "%s\\%016llx.flac", TRANSCODE_CACHE_DIR, hash);
+    if (GetFileAttributesA(job->outputPath) != INVALID_FILE_ATTRIBUTES) {
+        job->state = JOB_CACHED;
+        job->micros = perfMicros() - start;
+        return;
+    }
+
+    // Written under a per-job name and moved into place, so a cache file is always complete
+    char partPath[MAX_PATH_LENGTH];
+    snprintf(partPath, sizeof(partPath), "%s\\%016llx.%d.part.flac", TRANSCODE_CACHE_DIR, hash, index);
+    bool ok = false;
+    sfSoundBuffer* pcm = sfSoundBuffer_createFromFile(job->sourcePath);
+    if (pcm) {
+        ok = sfSoundBuffer_saveToFile(pcm, partPath);
+        sfSoundBuffer_destroy(pcm);
+    } else if (transcoderCommand) {
+        ok = runExternalTranscoder(job->sourcePath, partPath, generation);
+    }
+    if (ok && transcoder.generation == generation && MoveFileExA(partPath, job->outputPath, MOVEFILE_REPLACE_EXISTING)) {
+        job->state = JOB_CONVERTED;
+    } else {
+        DeleteFileA(partPath);
+        job->state = transcoder.generation != generation ? JOB_CANCELLED : JOB_FAILED;
+    }
+    job->micros = perfMicros() - start;
+}
+
+void transcodeWorker(void* userData) {
+    (void)userData;
+    sfMutex_lock(transcoder.lock);
+    while (!transcoder.stop) {
+        if (transcoder.nextJob == transcoder.jobCount) {
+            ResetEvent(transcoder.wake);
+            sfMutex_unlock(transcoder.lock);
+            WaitForSingleObject(transcoder.wake, INFINITE);
+            sfMutex_lock(transcoder.lock);
+            continue;
+        }
+        int index = transcoder.nextJob++;
+        transcoder.jobs[index].state = JOB_RUNNING;
+        TranscodeJob job = transcoder.jobs[index];
+        LONG generation = transcoder.generation;
+        transcoder.running++;
+        sfMutex_unlock(transcoder.lock);
+
+        runTranscodeJob(&job, index, generation);
+
+        sfMutex_lock(transcoder.lock);
+        TranscodeJob* slot = &transcoder.jobs[index];
+        strcpy(slot->outputPath, job.outputPath);
+        slot->state = job.state;
+        slot->micros = job.micros;
+        transcoder.running--;
+        switch (job.state) {
+            case JOB_CONVERTED: transcoder.converted++; break;
+            case JOB_CACHED: transcoder.cached++; break;
+            case JOB_CANCELLED: transcoder.cancelled++; break;
+            default: transcoder.failed++; break;
+        }
+    }
+    sfMutex_unlock(transcoder.lock);
+}
+
+// Creates the lock, the cache directory and the worker pool on first use
+bool startTranscodeWorkers(void) {
+    if (transcoder.lock) return true;
+    transcoder.lock = sfMutex_create();
+    transcoder.wake = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!transcoder.lock || !transcoder.wake) return false;
+    CreateDirectoryA(TRANSCODE_CACHE_DIR, NULL);
+
+    // Leave one core for the UI and audio threads
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int workers = transcodeWorkerLimit > 0 ? transcodeWorkerLimit : (int)info.dwNumberOfProcessors - 1;
+    if (workers < 1) workers = 1;
+    if (workers > MAX_TRANSCODE_WORKERS) workers = MAX_TRANSCODE_WORKERS;
+    for (int i = 0; i < workers; i++) {
+        sfThread* thread = sfThread_create(transcodeWorker, NULL);
+        if (!thread) break;
+        transcoder.workers[transcoder.workerCount++] = thread;
+        sfThread_launch(thread);
+    }
+    return transcoder.workerCount > 0;
+}
+
+void queueTranscode(const char* sourcePath, const char* name, long long size, long long modified) {
+    if (!startTranscodeWorkers()) return;
+    sfMutex_lock(transcoder.lock);
+    if (transcoder.jobCount == transcoder.jobCapacity) {
+        int newCapacity = transcoder.jobCapacity ? transcoder.jobCapacity * 2 : 32;
+        TranscodeJob* grown = (TranscodeJob*)realloc(transcoder.jobs, (size_t)newCapacity * sizeof(TranscodeJob));
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed for transcode queue.\n");
+            sfMutex_unlock(transcoder.lock);
+            return;
+        }
+        transcoder.jobs = grown;
+        transcoder.jobCapacity = newCapacity;
+    }
+    TranscodeJob* job = &transcoder.jobs[transcoder.jobCount++];
+    memset(job, 0, sizeof(*job));
+    snprintf(job->sourcePath, sizeof(job->sourcePath), "%s", sourcePath);
+    snprintf(job->name, sizeof(job->name), "%s", name);
+    job->size = size;
+    job->modified = modified;
+    job->state = JOB_PENDING;
+    SetEvent(transcoder.wake);
+    sfMutex_unlock(transcoder.lock);
+}
+
+// Startup: adds already converted sources in 'directoryPath' to 'list' and queues the rest
+void scanTranscodeSources(Song** list, const char* directoryPath) {
+    WIN32_FIND_DATAA data;
+    char searchPath[MAX_PATH_LENGTH];
+    snprintf(searchPath, sizeof(searchPath), "%s\\*", directoryPath);
+    HANDLE find = FindFirstFileA(searchPath, &data);
+    if (find == INVALID_HANDLE_VALUE) return;
+
+    int reused = 0, queued = 0;
+    do {
+        if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || !hasTranscodableExtension(data.cFileName)) continue;
+        char sourcePath[MAX_PATH_LENGTH];
+        snprintf(sourcePath, sizeof(sourcePath), "%s\\%s", directoryPath, data.cFileName);
+        long long size = ((long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+        long long modified = fileTimeValue(data.ftLastWriteTime);
+        const TranscodeEntry* entry = manifestFind(sourcePath);
+        if (entry && entry->size == size && entry->modified == modified && GetFileAttributesA(entry->outputPath) != INVALID_FILE_ATTRIBUTES) {
+            addSong(list, data.cFileName, entry->outputPath);
+            reused++;
+        } else {
+            queueTranscode(sourcePath, data.cFileName, size, modified);
+            queued++;
+        }
+    } while (FindNextFileA(find, &data) != 0);
+    FindClose(find);
+
+    if (queued > 0) printf("Transcode cache: %d track(s) ready, %d queued on %d worker(s)\n", reused, queued, transcoder.workerCount);
+    else if (reused > 0) printf("Transcode cache: %d track(s) ready\n", reused);
+}
+
+// Marks every waiting job cancelled and tells running ones to stop
+void cancelTranscodes(void) {
+    if (!transcoder.lock) return;
+    sfMutex_lock(transcoder.lock);
+    InterlockedIncrement(&transcoder.generation);
+    int dropped = transcoder.jobCount - transcoder.nextJob;
+    for (int i = transcoder.nextJob; i < transcoder.jobCount; i++) transcoder.jobs[i].state = JOB_CANCELLED;
+    transcoder.nextJob = transcoder.jobCount;
+    transcoder.cancelled += dropped;
+    int running = transcoder.running;
+    sfMutex_unlock(transcoder.lock);
+    if (dropped > 0 || running > 0) printf("Transcode: cancelled %d queued and %d running job(s)\n", dropped, running);
+}
+
+void waitForTranscodes(void) {
+    if (!transcoder.lock) return;
+    for (;;) {
+        sfMutex_lock(transcoder.lock);
+        bool idle = transcoder.nextJob == transcoder.jobCount && transcoder.running == 0;
+        sfMutex_unlock(transcoder.lock);
+        if (idle) return;
+        Sleep(20);
+    }
+}
+
+// Main loop: puts finished conversions into the library. Returns true if the library changed.
+bool applyTranscodeResults(void) {
+    if (!transcoder.lock) return false;
+    // Finished jobs are copied out under the lock and applied to the library after it is
+    // released, so the workers can pick up their next job meanwhile
+    TranscodeJob* done = NULL;
+    int doneCount = 0, firstFinished = 0, total = 0;
+    sfMutex_lock(transcoder.lock);
+    for (int i = transcoder.firstUnapplied; i < transcoder.jobCount; i++) {
+        TranscodeJob* job = &transcoder.jobs[i];
+        if (job->applied || job->state == JOB_PENDING || job->state == JOB_RUNNING) continue;
+        if (!done) {
+            done = malloc(sizeof(TranscodeJob) * (transcoder.jobCount - i));
+            if (!done) break; // Retried next frame
+            firstFinished = transcoder.finished;
+            total = transcoder.jobCount;
+        }
+        job->applied = true;
+        transcoder.finished++;
+        done[doneCount++] = *job;
+    }
+    while (transcoder.firstUnapplied < transcoder.jobCount && transcoder.jobs[transcoder.firstUnapplied].applied) {
+        transcoder.firstUnapplied++;
+    }
+    if (transcoder.firstUnapplied == transcoder.jobCount && transcoder.nextJob == transcoder.jobCount) {
+        transcoder.jobCount = transcoder.nextJob = transcoder.firstUnapplied = 0;
+        transcoder.finished = 0;
+    }
+    sfMutex_unlock(transcoder.lock);
+
+    bool changed = false;
+    for (int i = 0; i < doneCount; i++) {
+        TranscodeJob* job = &done[i];
+        if (job->state == JOB_CONVERTED || job->state == JOB_CACHED) {
+            if (GetFileAttributesA(job->sourcePath) == INVALID_FILE_ATTRIBUTES) continue; // Deleted meanwhile
+            const TranscodeEntry* previous = manifestFind(job->sourcePath);
+            Song* song = previous ? findSongByPath(previous->outputPath) : NULL;
+            Song* sharing = findSongByPath(job->outputPath); // Sources with identical content share the file
+            if (song && song != sharing && manifestOutputShared(song->path, job->sourcePath)) {
+                song = NULL; // The old content still belongs to another source
+            }
+            if (song && song != sharing) {
+                pcmCacheInvalidate(song->path); // The source was edited
+                if (sharing) {
+                    removeSongFromLibrary(song); // Its new content is already in the library
+                } else {
+                    relinkLibrarySong(song, job->name, job->outputPath);
+                }
+            } else if (!song && !sharing) {
+                addLibrarySong(job->name, job->outputPath);
+            }
+            manifestPut(job->sourcePath, job->outputPath, job->size, job->modified);
+            changed = true;
+            printf("Transcode [%d/%d] %s: %s in %.1f s\n", firstFinished + i + 1, total, job->name,
+                   job->state == JOB_CACHED ? "already cached" : "converted", job->micros / 1000000.0);
+        } else if (job->state == JOB_FAILED) {
+            printf("Transcode [%d/%d] %s: could not convert%s\n", firstFinished + i + 1, total, job->name,
+                   transcoderCommand ? "" : " (no --transcoder given for formats SFML cannot read)");
+        }
+    }
+    free(done);
+    if (!changed) return false;
+    if (!current) current = allSongsList;
+    saveTranscodeManifest();
+    return true;
+}
+
+// Library watcher hooks for files that need converting
+void transcodeSourceAdded(const char* path, const char* name) {
+    long long size, modified;
+    const TranscodeEntry* entry = manifestFind(path);
+    if (getFileStamp(path, &size, &modified) && (!entry || entry->size != size || entry->modified != modified)) {
+        queueTranscode(path, name, size, modified);
+    }
+}
+
+void transcodeSourceRemoved(const char* path) {
+    const TranscodeEntry* entry = manifestFind(path);
+    if (!entry) return;
+    Song* song = manifestOutputShared(entry->outputPath, path) ? NULL : findSongByPath(entry->outputPath);
+    if (song) {
+        printf("Library: removed %s\n", path);
+        removeSongFromLibrary(song);
+    }
+    manifestRemove(path); // The cache file stays; identical content elsewhere may use it
+    saveTranscodeManifest();
+}
+
+void transcodeSourceRenamed(const char* oldPath, const char* path, const char* name) {
+    const TranscodeEntry* entry = manifestFind(oldPath);
+    if (!entry) {
+        if (hasTranscodableExtension(name)) transcodeSourceAdded(path, name);
+        return;
+    }
+    if (!hasTranscodableExtension(name)) {
+        transcodeSourceRemoved(oldPath);
+        return;
+    }
+    TranscodeEntry moved = *entry;
+    Song* song = findSongByPath(moved.outputPath);
+    if (song) relinkLibrarySong(song, name, moved.outputPath);
+    manifestRemove(oldPath);
+    manifestPut(path, moved.outputPath, moved.size, moved.modified);
+    saveTranscodeManifest();
+}
+
+void stopTranscodeWorkers(void) {
+    if (!transcoder.lock) return;
+    cancelTranscodes();
+    sfMutex_lock(transcoder.lock);
+    transcoder.stop = true;
+    SetEvent(transcoder.wake);
+    sfMutex_unlock(transcoder.lock);
+    for (int i = 0; i < transcoder.workerCount; i++) {
+        sfThread_wait(transcoder.workers[i]);
+        sfThread_destroy(transcoder.workers[i]);
+    }
+    transcoder.workerCount = 0;
+    applyTranscodeResults(); // Keep whatever finished before the cancel
+    saveTranscodeManifest();
+    free(transcoder.jobs);
+    transcoder.jobs = NULL;
+    transcoder.jobCount = transcoder.jobCapacity = transcoder.nextJob = transcoder.firstUnapplied = 0;
+    free(transcoder.manifest);
+    transcoder.manifest = NULL;
+    transcoder.manifestCount = transcoder.manifestCapacity = 0;
+    sfMutex_destroy(transcoder.lock);
+    transcoder.lock = NULL;
+    CloseHandle(transcoder.wake);
+    transcoder.wake = NULL;
+}
+
+// -------------------------- Library Watching (Windows Specific) --------------------------
+// Each library root and its subfolders are watched with ReadDirectoryChangesW on a background
+// thread. Raw notifications are queued and applied from the main loop in batches, once the
+// directory has been quiet for LIBRARY_SETTLE_MS (a file copy produces a burst of events).
+// Names in a change are relative to the root ("Album\\track.ogg").
+#define MAX_LIBRARY_ROOTS 8
+#define MAX_PENDING_CHANGES 256 // Beyond this the batch is replaced by a full rescan
+#define LIBRARY_SETTLE_MS 500
+#define WATCH_BUFFER_BYTES 16384
+
+typedef enum LibraryChangeKind {
+    CHANGE_ADDED,
+    CHANGE_REMOVED,
+    CHANGE_RENAMED,
+    CHANGE_MODIFIED
+} LibraryChangeKind;
+
+typedef struct LibraryChange {
+    LibraryChangeKind kind;
+    int root; // Index into libraryWatcher.roots
+    char name[MAX_PATH_LENGTH]; // File name (new name for renames)
+    char oldName[MAX_PATH_LENGTH]; // Previous name for renames
+} LibraryChange;
+
+typedef struct LibraryRoot {
+    char path[MAX_PATH_LENGTH];
+    HANDLE directory;
+    HANDLE ioEvent;
+    sfThread* thread;
+    char pendingOldName[MAX_PATH_LENGTH]; // First half of a rename pair
+} LibraryRoot;
+
+typedef struct LibraryWatcher {
+    LibraryRoot roots[MAX_LIBRARY_ROOTS];
+    int rootCount;
+    HANDLE stopEvent;
+    sfMutex* lock;
+    LibraryChange pending[MAX_PENDING_CHANGES];
+    int pendingCount;
+    bool rescanNeeded[MAX_LIBRARY_ROOTS]; // Set when notifications were lost
+    long long lastEventMicros;
+    // Counters for the debug stats view
+    long batchesApplied;
+    long changesApplied;
+    long rescans;
+} LibraryWatcher;
+
+LibraryWatcher libraryWatcher = {0};
+
+void queueLibraryChange(int root, LibraryChangeKind kind, const char* name, const char* oldName) {
+    sfMutex_lock(libraryWatcher.lock);
+    LibraryChange* last = libraryWatcher.pendingCount ? &libraryWatcher.pending[libraryWatcher.pendingCount - 1] : NULL;
+    // Saving a file fires several modifications in a row; keep just one
+    bool duplicate = last && last->kind == kind && last->root == root && strcmp(last->name, name) == 0 && kind != CHANGE_RENAMED;
+    if (!duplicate) {
+        if (libraryWatcher.pendingCount == MAX_PENDING_CHANGES) {
+            libraryWatcher.rescanNeeded[root] = true;
+        } else {
+            LibraryChange* change = &libraryWatcher.pending[libraryWatcher.pendingCount++];
+            change->kind = kind;
+            change->root = root;
+            strncpy(change->name, name, sizeof(change->name) - 1);
+            change->name[sizeof(change->name) - 1] = '\0';
+            strncpy(change->oldName, oldName ? oldName : "", sizeof(change->oldName) - 1);
+            change->oldName[sizeof(change->oldName) - 1] = '\0';
+        }
+    }
+    libraryWatcher.lastEventMicros = perfMicros();
+    sfMutex_unlock(libraryWatcher.lock);
+}
+
+void libraryWatchThread(void* userData) {
+    LibraryRoot* root = (LibraryRoot*)userData;
+    int rootIndex = (int)(root - libraryWatcher.roots);
+    DWORD buffer[WATCH_BUFFER_BYTES / sizeof(DWORD)]; // DWORD aligned as the API requires
+    HANDLE waitHandles[2] = { root->ioEvent, libraryWatcher.stopEvent };
+
+    for (;;) {
+        OVERLAPPED overlapped = {0};
+        overlapped.hEvent = root->ioEvent;
+        if (!ReadDirectoryChangesW(root->directory, buffer, sizeof(buffer), TRUE,
+                                   FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE,
+                                   NULL, &overlapped, NULL)) {
+            fprintf(stderr, "Stopped watching %s (Error Code: %lu)\n", root->path, GetLastError());
+            return;
+        }
+        DWORD bytes = 0;
+        if (WaitForMultipleObjects(2, waitHandles, FALSE, INFINITE) != WAIT_OBJECT_0) {
+            CancelIoEx(root->directory, &overlapped);
+            GetOverlappedResult(root->directory, &overlapped, &bytes, TRUE);
+            return;
+        }
+        if (!GetOverlappedResult(root->directory, &overlapped, &bytes, FALSE) || bytes == 0) {
+            // The kernel buffer overflowed and events were dropped
+            sfMutex_lock(libraryWatcher.lock);
+            libraryWatcher.rescanNeeded[rootIndex] = true;
+            libraryWatcher.lastEventMicros = perfMicros();
+            sfMutex_unlock(libraryWatcher.lock);
+            continue;
+        }
+
+        const unsigned char* cursor = (const unsigned char*)buffer;
+        for (;;) {
+            const FILE_NOTIFY_INFORMATION* info = (const FILE_NOTIFY_INFORMATION*)cursor;
+            char name[MAX_PATH_LENGTH];
+            int len = WideCharToMultiByte(CP_ACP, 0, info->FileName, (int)(info->FileNameLength / sizeof(WCHAR)),
+                                          name, sizeof(name) - 1, NULL, NULL);
+            bool usable = len > 0 && strlen(root->path) + 1 + (size_t)len < sizeof(name);
+            name[len > 0 ? len : 0] = '\0';
+            if (!usable) { // Too long to be played from; let a rescan sort out the rest
+                sfMutex_lock(libraryWatcher.lock);
+                libraryWatcher.rescanNeeded[rootIndex] = true;
+                libraryWatcher.lastEventMicros = perfMicros();
+                sfMutex_unlock(libraryWatcher.lock);
+                if (info->Action == FILE_ACTION_RENAMED_OLD_NAME) root->pendingOldName[0] = '\0';
+                if (info->NextEntryOffset == 0) break;
+                cursor += info->NextEntryOffset;
+                continue;
+            }
+
+            switch (info->Action) {
+                case FILE_ACTION_ADDED: queueLibraryChange(rootIndex, CHANGE_ADDED, name, NULL); break;
+                case FILE_ACTION_REMOVED: queueLibraryChange(rootIndex, CHANGE_REMOVED, name, NULL); break;
+                case FILE_ACTION_MODIFIED: queueLibraryChange(rootIndex, CHANGE_MODIFIED, name, NULL); break;
+                case FILE_ACTION_RENAMED_OLD_NAME: strcpy(root->pendingOldName, name); break;
+                case FILE_ACTION_RENAMED_NEW_NAME:
+                    queueLibraryChange(rootIndex, CHANGE_RENAMED, name, root->pendingOldName);
+                    root->pendingOldName[0] = '\0';
+                    break;
+            }
+            if (info->NextEntryOffset == 0) break;
+            cursor += info->NextEntryOffset;
+        }
+    }
+}
+
+void watchLibraryRoot(const char* directoryPath) {
+    if (libraryWatcher.rootCount == MAX_LIBRARY_ROOTS) return;
+    if (!libraryWatcher.lock) {
+        libraryWatcher.lock = sfMutex_create();
+        libraryWatcher.stopEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+        if (!libraryWatcher.lock || !libraryWatcher.stopEvent) return;
+    }
+    LibraryRoot* root = &libraryWatcher.roots[libraryWatcher.rootCount];
+    strncpy(root->path, directoryPath, sizeof(root->path) - 1);
+    root->directory = CreateFileA(directoryPath, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                  NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    if (root->directory == INVALID_HANDLE_VALUE) {
+        printf("Cannot watch %s for changes (Error Code: %lu)\n", directoryPath, GetLastError());
+        return;
+    }
+    root->ioEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    root->thread = root->ioEvent ? sfThread_create(libraryWatchThread, root) : NULL;
+    if (!root->thread) {
+        if (root->ioEvent) CloseHandle(root->ioEvent);
+        CloseHandle(root->directory);
+        return;
+    }
+    libraryWatcher.rootCount++;
+    sfThread_launch(root->thread);
+    printf("Watching %s for library changes.\n", directoryPath);
+}
+
+void stopLibraryWatcher(void) {
+    if (!libraryWatcher.stopEvent) return;
+    SetEvent(libraryWatcher.stopEvent);
+    for (int i = 0; i < libraryWatcher.rootCount; i++) {
+        LibraryRoot* root = &libraryWatcher.roots[i];
+        sfThread_wait(root->thread);
+        sfThread_destroy(root->thread);
+        CloseHandle(root->ioEvent);
+        CloseHandle(root->directory);
+    }
+    libraryWatcher.rootCount = 0;
+    CloseHandle(libraryWatcher.stopEvent);
+    libraryWatcher.stopEvent = NULL;
+    sfMutex_destroy(libraryWatcher.lock);
+    libraryWatcher.lock = NULL;
+}
+
+// Brings the library in line with the directory contents after notifications were lost
+void rescanLibraryRoot(const char* directoryPath) {
+    Song* found = NULL; // Temporary list of what is on disk now
+    loadSongsFromDirectory(&found, directoryPath);
+    size_t rootLen = strlen(directoryPath);
+
+    // Indexed by path, so checking every library song stays linear in the library size
+    SongIndex onDisk = { false, NULL, 0, 0 };
+    size_t foundCount = 0;
+    for (Song* f = found; f; f = f->next) foundCount++;
+    songIndexReserve(&onDisk, foundCount);
+    for (Song* f = found; f; f = f->next) songIndexInsert(&onDisk, f);
+    bool indexed = onDisk.count == foundCount; // Out of memory: remove nothing rather than everything
+
+    Song* song = allSongsList;
+    while (song) {
+        Song* next = song->next;
+        if (indexed && strncmp(song->path, directoryPath, rootLen) == 0 && song->path[rootLen] == '\\' && !songIndexFindKey(&onDisk, song->key)) {
+            removeSongFromLibrary(song);
+        }
+        song = next;
+    }
+    songIndexClear(&onDisk);
+    while (found) {
+        Song* next = found->next;
+        if (!findSongByPath(found->path)) addLibrarySong(found->name, found->path);
+        freeSong(found);
+        found = next;
+    }
+    libraryWatcher.rescans++;
+}
+
+bool pathIsUnder(const char* path, const char* directoryPath) {
+    size_t len = strlen(directoryPath);
+    return strncmp(path, directoryPath, len) == 0 && path[len] == '\\';
+}
+
+// A file showed up where no song was known. If a song with the same file name has lost its
+// file, the file was moved here from another folder: the Song is relinked so playlists keep it.
+void addOrRelinkLibrarySong(const char* name, const char* path) {
+    Song* moved = songIndexFind(&songNameIndex, path);
+    if (moved && GetFileAttributesA(moved->path) == INVALID_FILE_ATTRIBUTES) {
+        printf("Library: moved %s -> %s\n", moved->path, path);
+        relinkLibrarySong(moved, name, path);
+    } else {
+        addLibrarySong(name, path);
+        printf("Library: added %s\n", path);
+    }
+}
+
+// A folder was renamed or moved within the root: relink every song under it
+void relinkLibraryFolder(const char* oldPath, const char* path) {
+    size_t oldLen = strlen(oldPath);
+    for (Song* song = allSongsList; song; song = song->next) {
+        if (!pathIsUnder(song->path, oldPath)) continue;
+        char newPath[MAX_PATH_LENGTH];
+        if (snprintf(newPath, sizeof(newPath), "%s%s", path, song->path + oldLen) >= (int)sizeof(newPath)) continue;
+        relinkLibrarySong(song, song->name, newPath);
+    }
+    printf("Library: moved folder %s -> %s\n", oldPath, path);
+}
+
+void applyLibraryChange(const LibraryChange* change) {
+    const char* rootPath = libraryWatcher.roots[change->root].path;
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s\\%s", rootPath, change->name);
+    const char* name = pathBaseName(change->name);
+    Song* song = findSongByPath(path);
+    DWORD attributes = GetFileAttributesA(path);
+    bool isFolder = attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+
+    switch (change->kind) {
+        case CHANGE_ADDED:
+            if (isFolder) { // Copied or moved in along with its files
+                Song* found = NULL;
+                loadSongsFromDirectory(&found, path);
+                while (found) {
+                    Song* next = found->next;
+                    if (!findSongByPath(found->path)) addOrRelinkLibrarySong(found->name, found->path);
+                    freeSong(found);
+                    found = next;
+                }
+            } else if (!song && hasOggExtension(name)) {
+                addOrRelinkLibrarySong(name, path);
+            } else if (hasTranscodableExtension(name)) {
+                transcodeSourceAdded(path, name);
+            }
+            break;
+        case CHANGE_REMOVED: // Applied after the rest of its batch, see applyLibraryChanges()
+            if (attributes != INVALID_FILE_ATTRIBUTES) { // Replaced: it is back by now
+                pcmCacheInvalidate(path);
+                if (song) queueFingerprint(path);
+            } else if (song) {
+                printf("Library: removed %s\n", path);
+                removeSongFromLibrary(song);
+            } else {
+                Song* under = allSongsList; // A whole folder went
+                while (under) {
+                    Song* next = under->next;
+                    if (pathIsUnder(under->path, path)) {
+                        printf("Library: removed %s\n", under->path);
+                        removeSongFromLibrary(under);
+                    }
+                    under = next;
+                }
+                transcodeSourceRemoved(path);
+            }
+            break;
+        case CHANGE_MODIFIED:
+            pcmCacheInvalidate(path); // Decoded audio is stale
+            if (song) queueFingerprint(path);
+            if (hasTranscodableExtension(name)) transcodeSourceAdded(path, name);
+            break;
+        case CHANGE_RENAMED: {
+            char oldPath[MAX_PATH_LENGTH];
+            snprintf(oldPath, sizeof(oldPath), "%s\\%s", rootPath, change->oldName);
+            Song* moved = findSongByPath(oldPath);
+            if (isFolder) {
+                relinkLibraryFolder(oldPath, path);
+            } else if (moved && hasOggExtension(name)) {
+                relinkLibrarySong(moved, name, path);
+                printf("Library: renamed %s -> %s\n", oldPath, path);
+            } else if (moved) {
+                removeSongFromLibrary(moved);
+            } else if (!song && hasOggExtension(name)) {
+                addOrRelinkLibrarySong(name, path);
+            }
+            if (!moved && !isFolder) transcodeSourceRenamed(oldPath, path, name);
+            break;
+        }
+    }
+}
+
+// Main loop: applies queued changes once the library has settled. Returns true if
+// anything was applied so the caller can refresh its lists.
+bool applyLibraryChanges(void) {
+    if (!libraryWatcher.lock) return false;
+    static LibraryChange batch[MAX_PENDING_CHANGES];
+    bool rescan[MAX_LIBRARY_ROOTS];
+    int count = 0;
+
+    sfMutex_lock(libraryWatcher.lock);
+    bool settled = perfMicros() - libraryWatcher.lastEventMicros > LIBRARY_SETTLE_MS * 1000LL;
+    if (settled) {
+        count = libraryWatcher.pendingCount;
+        memcpy(batch, libraryWatcher.pending, (size_t)count * sizeof(LibraryChange));
+        memcpy(rescan, libraryWatcher.rescanNeeded, sizeof(rescan));
+        memset(libraryWatcher.rescanNeeded, 0, sizeof(libraryWatcher.rescanNeeded));
+        libraryWatcher.pendingCount = 0;
+    }
+    sfMutex_unlock(libraryWatcher.lock);
+    if (!settled) return false;
+
+    bool anyRescan = false;
+    for (int i = 0; i < libraryWatcher.rootCount; i++) {
+        if (rescan[i]) {
+            printf("Library: change notifications lost, rescanning %s\n", libraryWatcher.roots[i].path);
+            rescanLibraryRoot(libraryWatcher.roots[i].path);
+            anyRescan = true;
+        }
+    }
+    // A move between folders arrives as a removal and an addition, in either order. Removals
+    // go last so the addition can still find the song by file name and relink it.
+    for (int i = 0; i < count; i++) {
+        if (!rescan[batch[i].root] && batch[i].kind != CHANGE_REMOVED) applyLibraryChange(&batch[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        if (!rescan[batch[i].root] && batch[i].kind == CHANGE_REMOVED) applyLibraryChange(&batch[i]);
+    }
+    if (count == 0 && !anyRescan) return false;
+
+    if (!current) current = allSongsList;
+    libraryWatcher.batchesApplied++;
+    libraryWatcher.changesApplied += count;
+    return true;
+}
+
+// -------------------------- Shared Library Snapshot --------------------------
+// Several player instances (one per zone or output) can share one library scan. The first
+// instance becomes the publisher: it scans music/ and playlists.txt as usual and writes the
+// result as an immutable snapshot into a named shared memory segment. Every later instance
+// attaches to that snapshot instead of scanning. Snapshots store offsets rather than pointers,
+// so each process can map them at any address. A small control segment names the current
+// snapshot version; the publisher writes a whole new segment after every library or playlist
+// change and swaps the version under a sequence lock, so readers never see half a snapshot.
+// Attached instances check the version every frame and apply new snapshots in place.
+#define LIBRARY_CONTROL_NAME "Local\\MusicPlayerLibrary"
+#define LIBRARY_SNAPSHOT_MAGIC 0x4C50534Du // "MSPL"
+#define LIBRARY_SNAPSHOT_FORMAT 1
+#define LIBRARY_ATTACH_WAIT_MS 5000 // How long to wait for a publisher that is still scanning
+#define LIBRARY_PUBLISHER_CHECK_MS 1000
+#define LIBRARY_PUBLISH_RETRY_MS 1000 // First retry after a failed publish; doubles up to the max
+#define LIBRARY_PUBLISH_RETRY_MAX_MS 60000
+
+typedef struct LibraryControl {
+    volatile LONG sequence; // Odd while the publisher updates the fields below
+    volatile LONG publisherPid; // 0 = nobody publishes
+    unsigned long long version; // Current snapshot, 0 = none published yet
+    unsigned int snapshotSize;
+} LibraryControl;
+
+typedef struct SnapshotHeader {
+    unsigned int magic;
+    unsigned int format;
+    unsigned long long version;
+    unsigned int totalSize;
+    unsigned int songCount;
+    unsigned int playlistCount;
+    unsigned int entryCount;
+    unsigned int songsOffset; // SnapshotSong[songCount], in library order
+    unsigned int playlistsOffset; // SnapshotPlaylist[playlistCount], in list order
+    unsigned int entriesOffset; // Song index of every playlist entry
+    unsigned int stringsOffset; // NUL-terminated names and paths
+    unsigned int stringsSize;
+} SnapshotHeader;
+
+typedef struct SnapshotSong {
+    unsigned int nameOffset; // Relative to stringsOffset
+    unsigned int pathOffset;
+} SnapshotSong;
+
+typedef struct SnapshotPlaylist {
+    unsigned int nameOffset;
+    unsigned int firstEntry;
+    unsigned int entryCount;
+} SnapshotPlaylist;
+
+typedef enum SharedLibraryRole {
+    SHARED_LIBRARY_OFF,
+    SHARED_LIBRARY_PUBLISHER,
+    SHARED_LIBRARY_ATTACHED
+} SharedLibraryRole;
+
+typedef struct SharedLibrary {
+    SharedLibraryRole role;
+    HANDLE control;
+    LibraryControl* controlView;
+    HANDLE snapshots[2]; // Publisher: current and previous segment stay alive for late readers
+    unsigned long long version; // Snapshot this process last published or applied
+    long long lastPublisherCheck;
+    long long publishRetryAt; // Publisher: when a failed publish is tried again, 0 = none pending
+    int publishRetryMs;
+    long long attachMicros;
+    long published;
+    long applied;
+} SharedLibrary;
+
+SharedLibrary sharedLibrary = {0};
+bool sharedLibraryEnabled = true;
+
+void librarySnapshotName(unsigned long long version, char* out, size_t size) {
+    snprintf(out, size, "%s.%llu", LIBRARY_CONTROL_NAME, version);
+}
+
+// Consistent copy of the control fields; false if the publisher kept them busy
+bool readLibraryControl(unsigned long long* version, unsigned int* size) {
+    LibraryControl* control = sharedLibrary.controlView;
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        LONG before = control->sequence;
+        MemoryBarrier();
+        unsigned long long v = control->version;
+        unsigned int s = control->snapshotSize;
+        MemoryBarrier();
+        if (!(before & 1) && control->sequence == before) {
+            *version = v;
+            *size = s;
+            return true;
+        }
+        Sleep(0);
+    }
+    return false;
+}
+
+bool libraryPublisherAlive(LONG pid) {
+    if (pid == 0) return false;
+    if ((DWORD)pid == GetCurrentProcessId()) return true;
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, (DWORD)pid);
+    if (!process) return false;
+    DWORD exitCode = 0;
+    bool alive = GetExitCodeProcess(process, &exitCode) && exitCode == STILL_ACTIVE;
+    CloseHandle(process);
+    return alive;
+}
+
+// Becomes the publisher if nobody (alive) is
+bool claimLibraryPublisher(void) {
+    LONG pid = sharedLibrary.controlView->publisherPid;
+    if (libraryPublisherAlive(pid)) return false;
+    if (InterlockedCompareExchange(&sharedLibrary.controlView->publisherPid, (LONG)GetCurrentProcessId(), pid) != pid) return false;
+    sharedLibrary.role = SHARED_LIBRARY_PUBLISHER;
+    sharedLibrary.version = 0;
+    return true;
+}
+
+typedef struct SnapshotSongRef {
+    const Song* song;
+    unsigned int index;
+} SnapshotSongRef;
+
+int compareSnapshotSongRefs(const void* a, const void* b) {
+    const Song* x = ((const SnapshotSongRef*)a)->song;
+    const Song* y = ((const SnapshotSongRef*)b)->song;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// A failed publish is retried later, less often each time, instead of on every frame
+void libraryPublishFailed(void) {
+    sharedLibrary.publishRetryMs = sharedLibrary.publishRetryMs ? sharedLibrary.publishRetryMs * 2 : LIBRARY_PUBLISH_RETRY_MS;
+    if (sharedLibrary.publishRetryMs > LIBRARY_PUBLISH_RETRY_MAX_MS) sharedLibrary.publishRetryMs = LIBRARY_PUBLISH_RETRY_MAX_MS;
+    sharedLibrary.publishRetryAt = perfMicros() + sharedLibrary.publishRetryMs * 1000LL;
+    printf("Retrying the library snapshot in %d s\n", sharedLibrary.publishRetryMs / 1000);
+}
+
+// Publisher: writes the library and playlists into a new segment and makes it current
+void publishLibrarySnapshot(void) {
+    if (sharedLibrary.role != SHARED_LIBRARY_PUBLISHER) return;
+    long long start = perfMicros();
+    unsigned int songCount = 0, playlistCount = 0, entryCount = 0;
+    size_t stringsSize = 0;
+    for (const Song* song = allSongsList; song; song = song->next) {
+        songCount++;
+        stringsSize += strlen(song->name) + strlen(song->path) + 2;
+    }
+    for (const Playlist* pl = playlists; pl; pl = pl->next) {
+        playlistCount++;
+        entryCount += (unsigned int)pl->length;
+        stringsSize += strlen(pl->name) + 1;
+    }
 
+    size_t songsOffset = sizeof(SnapshotHeader);
+    size_t playlistsOffset = songsOffset + (size_t)songCount * sizeof(SnapshotSong);
+    size_t entriesOffset = playlistsOffset + (size_t)playlistCount * sizeof(SnapshotPlaylist);
+    size_t stringsOffset = entriesOffset + (size_t)entryCount * sizeof(unsigned int);
+    size_t totalSize = stringsOffset + stringsSize;
+    if (totalSize > 0x7fffffff) {
+        printf("Library too large to share (%zu bytes)\n", totalSize);
+        libraryPublishFailed();
+        return;
+    }
 
-bool handleSelectPlaylistScreen(sfRenderWindow* window, sfEvent* event, sfFont* font, Playlist* allPlaylists) {
-    static bool uiInitialized = false;
+    // Playlists name songs by index; look indices up through a sorted pointer table
+    SnapshotSongRef* refs = (SnapshotSongRef*)malloc((songCount ? songCount : 1) * sizeof(SnapshotSongRef));
+    if (!refs) {
+        fprintf(stderr, "Memory allocation failed for library snapshot.\n");
+        libraryPublishFailed();
+        return;
+    }
+    unsigned int index = 0;
+    for (const Song* song = allSongsList; song; song = song->next, index++) {
+        refs[index].song = song;
+        refs[index].index = index;
+    }
+    qsort(refs, songCount, sizeof(SnapshotSongRef), compareSnapshotSongRefs);
+
+    unsigned long long version = sharedLibrary.controlView->version + 1;
+    char name[MAX_PATH_LENGTH];
+    librarySnapshotName(version, name, sizeof(name));
+    HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)totalSize, name);
+    unsigned char* base = mapping ? (unsigned char*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, totalSize) : NULL;
+    if (!base) {
+        printf("Could not create library snapshot %s (Error Code: %lu)\n", name, GetLastError());
+        if (mapping) CloseHandle(mapping);
+        free(refs);
+        libraryPublishFailed();
+        return;
+    }
 
-    if (!uiInitialized) {
-        // Cleanup existing elements if re-entering
-        if (selectPlTitle_s) { sfText_destroy(selectPlTitle_s); selectPlTitle_s = NULL; }
-        if (playSelectedBtn_s) { sfText_destroy(playSelectedBtn_s); playSelectedBtn_s = NULL; }
-        if (cancelSelectBtn_s) { sfText_destroy(cancelSelectBtn_s); cancelSelectBtn_s = NULL; }
-        for(int i = 0; i < MAX_VISIBLE_LIST_ITEMS; ++i) {
-            if (playlistText_s[i]) { sfText_destroy(playlistText_s[i]); playlistText_s[i] = NULL; }
-            if (playlistRect_s[i]) { sfRectangleShape_destroy(playlistRect_s[i]); playlistRect_s[i] = NULL; } // Destroy rectangles
+    SnapshotHeader* header = (SnapshotHeader*)base;
+    SnapshotSong* songs = (SnapshotSong*)(base + songsOffset);
+    SnapshotPlaylist* lists = (SnapshotPlaylist*)(base + playlistsOffset);
+    unsigned int* entries = (unsigned int*)(base + entriesOffset);
+    char* strings = (char*)(base + stringsOffset);
+    size_t used = 0;
+    index = 0;
+    for (const Song* song = allSongsList; song; song = song->next, index++) {
+        songs[index].nameOffset = (unsigned int)used;
+        used += (size_t)sprintf(strings + used, "%s", song->name) + 1;
+        songs[index].pathOffset = (unsigned int)used;
+        used += (size_t)sprintf(strings + used, "%s", song->path) + 1;
+    }
+    unsigned int entry = 0;
+    index = 0;
+    for (const Playlist* pl = playlists; pl; pl = pl->next, index++) {
+        lists[index].nameOffset = (unsigned int)used;
+        used += (size_t)sprintf(strings + used, "%s", pl->name) + 1;
+        lists[index].firstEntry = entry;
+        for (const PlaylistNode* node = pl->front; node; node = node->next) {
+            SnapshotSongRef key = { node->song, 0 };
+            SnapshotSongRef* found = (SnapshotSongRef*)bsearch(&key, refs, songCount, sizeof(SnapshotSongRef), compareSnapshotSongRefs);
+            if (found) entries[entry++] = found->index;
         }
+        lists[index].entryCount = entry - lists[index].firstEntry;
+    }
+    free(refs);
+
+    header->format = LIBRARY_SNAPSHOT_FORMAT;
+    header->version = version;
+    header->totalSize = (unsigned int)totalSize;
+    header->songCount = songCount;
+    header->playlistCount = playlistCount;
+    header->entryCount = entry;
+    header->songsOffset = (unsigned int)songsOffset;
+    header->playlistsOffset = (unsigned int)playlistsOffset;
+    header->entriesOffset = (unsigned int)entriesOffset;
+    header->stringsOffset = (unsigned int)stringsOffset;
+    header->stringsSize = (unsigned int)stringsSize;
+    MemoryBarrier();
+    header->magic = LIBRARY_SNAPSHOT_MAGIC; // Written last: a segment without it is incomplete
+    UnmapViewOfFile(base);
+
+    // Swap: readers retry while the sequence is odd or changed under them
+    LibraryControl* control = sharedLibrary.controlView;
+    InterlockedIncrement(&control->sequence);
+    control->version = version;
+    control->snapshotSize = (unsigned int)totalSize;
+    InterlockedIncrement(&control->sequence);
+
+    if (sharedLibrary.snapshots[1]) CloseHandle(sharedLibrary.snapshots[1]);
+    sharedLibrary.snapshots[1] = sharedLibrary.snapshots[0];
+    sharedLibrary.snapshots[0] = mapping;
+    sharedLibrary.version = version;
+    sharedLibrary.published++;
+    sharedLibrary.publishRetryAt = 0;
+    sharedLibrary.publishRetryMs = 0;
+    printf("Published library snapshot v%llu: %u songs, %u playlists, %zu bytes in %.2f ms\n",
+           version, songCount, playlistCount, totalSize, (perfMicros() - start) / 1000.0);
+}
 
-        selectPlTitle_s = createLabel(font, "Select Playlist to Play", 200, 20, 30);
-        if(selectPlTitle_s) sfText_setFillColor(selectPlTitle_s, sfBlue);
+// Checks that every offset and string of a mapped snapshot stays inside it
+bool validateLibrarySnapshot(const unsigned char* base, size_t size) {
+    if (size < sizeof(SnapshotHeader)) return false;
+    const SnapshotHeader* h = (const SnapshotHeader*)base;
+    if (h->magic != LIBRARY_SNAPSHOT_MAGIC || h->format != LIBRARY_SNAPSHOT_FORMAT || h->totalSize > size) return false;
+    if (h->songsOffset + (size_t)h->songCount * sizeof(SnapshotSong) > h->totalSize) return false;
+    if (h->playlistsOffset + (size_t)h->playlistCount * sizeof(SnapshotPlaylist) > h->totalSize) return false;
+    if (h->entriesOffset + (size_t)h->entryCount * sizeof(unsigned int) > h->totalSize) return false;
+    if ((size_t)h->stringsOffset + h->stringsSize > h->totalSize) return false;
+    const char* strings = (const char*)base + h->stringsOffset;
+    if (h->stringsSize > 0 && strings[h->stringsSize - 1] != '\0') return false; // Every string ends inside
+    const SnapshotSong* songs = (const SnapshotSong*)(base + h->songsOffset);
+    for (unsigned int i = 0; i < h->songCount; i++) {
+        if (songs[i].nameOffset >= h->stringsSize || songs[i].pathOffset >= h->stringsSize) return false;
+    }
+    const SnapshotPlaylist* lists = (const SnapshotPlaylist*)(base + h->playlistsOffset);
+    for (unsigned int i = 0; i < h->playlistCount; i++) {
+        if (lists[i].nameOffset >= h->stringsSize || lists[i].firstEntry + (size_t)lists[i].entryCount > h->entryCount) return false;
+    }
+    const unsigned int* entries = (const unsigned int*)(base + h->entriesOffset);
+    for (unsigned int i = 0; i < h->entryCount; i++) {
+        if (entries[i] >= h->songCount) return false;
+    }
+    return true;
+}
 
-        // Populate playlist names and create their rectangles
-        Playlist* tempPl = allPlaylists;
-        float yPos = 60;
-        int i = 0;
-        while(tempPl && i < MAX_VISIBLE_LIST_ITEMS) {
-            playlistText_s[i] = createLabel(font, tempPl->name, 50, yPos, 20);
-            if(playlistText_s[i]) {
-                sfText_setFillColor(playlistText_s[i], sfWhite); // Default color
+// Rebuilds the library and playlists from a validated snapshot. The first time the lists
+// are built directly; later snapshots are merged by path so Songs that stay keep their
+// identity (current song, queue, recent stack). Playlists created locally are kept.
+void applyLibrarySnapshot(const unsigned char* base, bool initial) {
+    const SnapshotHeader* h = (const SnapshotHeader*)base;
+    const SnapshotSong* songs = (const SnapshotSong*)(base + h->songsOffset);
+    const SnapshotPlaylist* lists = (const SnapshotPlaylist*)(base + h->playlistsOffset);
+    const unsigned int* entries = (const unsigned int*)(base + h->entriesOffset);
+    const char* strings = (const char*)base + h->stringsOffset;
+    Song** bySnapshotIndex = (Song**)calloc(h->songCount ? h->songCount : 1, sizeof(Song*));
+    if (!bySnapshotIndex) {
+        fprintf(stderr, "Memory allocation failed for library snapshot.\n");
+        return;
+    }
 
-                // Create rectangle for playlist name
-                playlistRect_s[i] = sfRectangleShape_create();
-                if (playlistRect_s[i]) {
-                    sfFloatRect textBounds = sfText_getGlobalBounds(playlistText_s[i]);
-                    // Add some padding to the rectangle
-                    sfRectangleShape_setSize(playlistRect_s[i], (sfVector2f){textBounds.width + 20, textBounds.height + 10});
-                    sfRectangleShape_setPosition(playlistRect_s[i], (sfVector2f){textBounds.left - 10, textBounds.top - 5});
-                    sfRectangleShape_setFillColor(playlistRect_s[i], sfColor_fromRGBA(0, 0, 0, 100)); // Semi-transparent black
-                    sfRectangleShape_setOutlineThickness(playlistRect_s[i], 1);
-                    sfRectangleShape_setOutlineColor(playlistRect_s[i], sfWhite);
+    if (initial) {
+        poolReserve(&songPool, songPool.liveObjects + (int)h->songCount);
+        Song* last = NULL;
+        for (unsigned int i = 0; i < h->songCount; i++) {
+            addSong(last ? &last : &allSongsList, strings + songs[i].nameOffset, strings + songs[i].pathOffset);
+            last = last ? last->next : allSongsList;
+            bySnapshotIndex[i] = last;
+        }
+    } else {
+        SnapshotSongRef* kept = (SnapshotSongRef*)malloc((h->songCount ? h->songCount : 1) * sizeof(SnapshotSongRef));
+        if (!kept) {
+            fprintf(stderr, "Memory allocation failed for library snapshot.\n");
+            free(bySnapshotIndex);
+            return;
+        }
+        unsigned int keptCount = 0;
+        for (unsigned int i = 0; i < h->songCount; i++) {
+            bySnapshotIndex[i] = findSongByPath(strings + songs[i].pathOffset);
+            if (bySnapshotIndex[i]) {
+                kept[keptCount].song = bySnapshotIndex[i];
+                kept[keptCount++].index = i;
+            }
+        }
+        qsort(kept, keptCount, sizeof(SnapshotSongRef), compareSnapshotSongRefs);
+        for (Song* song = allSongsList; song;) {
+            Song* next = song->next;
+            SnapshotSongRef key = { song, 0 };
+            if (!bsearch(&key, kept, keptCount, sizeof(SnapshotSongRef), compareSnapshotSongRefs)) removeSongFromLibrary(song);
+            song = next;
+        }
+        free(kept);
+        for (unsigned int i = 0; i < h->songCount; i++) {
+            if (bySnapshotIndex[i]) continue;
+            addLibrarySong(strings + songs[i].nameOffset, strings + songs[i].pathOffset);
+            bySnapshotIndex[i] = findSongByPath(strings + songs[i].pathOffset);
+        }
+
+        // Shared playlists are replaced wholesale
+        Playlist** link = &playlists;
+        while (*link) {
+            Playlist* pl = *link;
+            bool shared = false;
+            for (unsigned int i = 0; i < h->playlistCount && !shared; i++) shared = strcmp(pl->name, strings + lists[i].nameOffset) == 0;
+            if (shared) {
+                *link = pl->next;
+                destroyTemporaryPlaylist(pl);
+            } else {
+                link = &pl->next;
+            }
+        }
+    }
+
+    // createPlaylist() prepends, so build from the back to keep the publisher's order
+    for (unsigned int i = h->playlistCount; i-- > 0;) {
+        Playlist* pl = createPlaylist(strings + lists[i].nameOffset);
+        if (pl) pl->shared = true;
+        for (unsigned int e = 0; pl && e < lists[i].entryCount; e++) {
+            enqueueSong(pl, bySnapshotIndex[entries[lists[i].firstEntry + e]]);
+        }
+    }
+    free(bySnapshotIndex);
+    playlistsChanged = false;
+    sharedLibrary.version = h->version;
+    sharedLibrary.applied++;
+}
+
+// Maps the snapshot named by the control block and applies it. False if it is not there
+// (yet, or any more: the publisher just swapped or exited).
+bool loadCurrentLibrarySnapshot(bool initial) {
+    unsigned long long version;
+    unsigned int size;
+    if (!readLibraryControl(&version, &size) || version == 0) return false;
+    char name[MAX_PATH_LENGTH];
+    librarySnapshotName(version, name, sizeof(name));
+    HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+    if (!mapping) return false;
+    const unsigned char* base = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, size);
+    bool ok = base && validateLibrarySnapshot(base, size);
+    if (ok) applyLibrarySnapshot(base, initial);
+    else if (base) printf("Ignoring damaged library snapshot %s\n", name);
+    if (base) UnmapViewOfFile(base);
+    CloseHandle(mapping);
+    return ok;
+}
+
+// Startup: opens the control segment and either becomes the publisher (returns false, the
+// caller scans as usual and publishes) or attaches to the published library (returns true)
+bool attachLibrarySnapshot(void) {
+    if (!sharedLibraryEnabled) return false;
+    long long start = perfMicros();
+    sharedLibrary.control = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(LibraryControl), LIBRARY_CONTROL_NAME);
+    if (!sharedLibrary.control) return false;
+    sharedLibrary.controlView = (LibraryControl*)MapViewOfFile(sharedLibrary.control, FILE_MAP_WRITE, 0, 0, sizeof(LibraryControl));
+    if (!sharedLibrary.controlView) {
+        CloseHandle(sharedLibrary.control);
+        sharedLibrary.control = NULL;
+        return false;
+    }
+
+    for (long long waited = 0; waited < LIBRARY_ATTACH_WAIT_MS * 1000LL; waited = perfMicros() - start) {
+        if (claimLibraryPublisher()) {
+            printf("Publishing the shared library for other player instances\n");
+            return false;
+        }
+        if (loadCurrentLibrarySnapshot(true)) {
+            sharedLibrary.role = SHARED_LIBRARY_ATTACHED;
+            sharedLibrary.attachMicros = perfMicros() - start;
+            sharedLibrary.lastPublisherCheck = perfMicros();
+            printf("Attached to shared library v%llu in %lld us\n", sharedLibrary.version, sharedLibrary.attachMicros);
+            return true;
+        }
+        Sleep(10); // The publisher is still scanning or just swapped snapshots
+    }
+    printf("No shared library snapshot appeared, scanning locally\n");
+    return false;
+}
+
+// Attached instances cannot publish, so playlists created there are written to a handoff file
+// next to PLAYLISTS_FILE. The publisher loads and deletes these files, and the playlists come
+// back to every instance with its next snapshot. A file nobody picked up before its writer
+// exited is loaded by the next instance that publishes.
+#define PLAYLIST_HANDOFF_SUFFIX ".handoff"
+
+void playlistHandoffPath(char* out, size_t size) {
+    snprintf(out, size, "%s.%lu%s", PLAYLISTS_FILE, (unsigned long)GetCurrentProcessId(), PLAYLIST_HANDOFF_SUFFIX);
+}
+
+// Attached: rewrites this instance's handoff file with the playlists no snapshot carried yet
+void handOffPlaylists(void) {
+    if (sharedLibrary.role != SHARED_LIBRARY_ATTACHED) return;
+    char path[MAX_PATH_LENGTH], tempPath[MAX_PATH_LENGTH];
+    playlistHandoffPath(path, sizeof(path));
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    int count = 0;
+    for (const Playlist* pl = playlists; pl; pl = pl->next) count += !pl->shared;
+    playlistsChanged = false;
+    if (count == 0) {
+        DeleteFileA(path);
+        return;
+    }
+    FILE* fp = fopen(tempPath, "w");
+    bool ok = fp != NULL;
+    for (const Playlist* pl = playlists; ok && pl; pl = pl->next) {
+        if (!pl->shared) writePlaylist(fp, pl);
+    }
+    if (fp && fclose(fp) != 0) ok = false;
+    // Renamed into place, so the publisher never reads half a file
+    if (!ok || !MoveFileExA(tempPath, path, MOVEFILE_REPLACE_EXISTING)) {
+        printf("Could not hand %d playlist(s) to the publishing instance: %s\n", count, path);
+        DeleteFileA(tempPath);
+        return;
+    }
+    printf("Handed %d playlist(s) to the publishing instance\n", count);
+}
+
+// Publisher: loads every handoff file. A playlist that arrives again under the same name
+// replaces the one loaded earlier. Returns true if any playlist arrived.
+bool collectHandedOffPlaylists(void) {
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA(PLAYLISTS_FILE ".*" PLAYLIST_HANDOFF_SUFFIX, &data);
+    if (find == INVALID_HANDLE_VALUE) return false;
+    bool arrived = false;
+    do {
+        // Claimed under a name of its own first: a rewrite by the owner meanwhile waits for the next round
+        char claimed[MAX_PATH_LENGTH];
+        snprintf(claimed, sizeof(claimed), "%s.%lu.claimed", data.cFileName, (unsigned long)GetCurrentProcessId());
+        if (!MoveFileExA(data.cFileName, claimed, MOVEFILE_REPLACE_EXISTING)) continue;
+        Playlist* older = playlists;
+        loadPlaylistsFromFile(claimed, &playlists);
+        DeleteFileA(claimed);
+        if (playlists == older) continue;
+        Playlist* lastLoaded = playlists;
+        while (lastLoaded->next != older) lastLoaded = lastLoaded->next;
+        for (const Playlist* loaded = playlists; loaded != lastLoaded->next; loaded = loaded->next) {
+            Playlist** link = &lastLoaded->next;
+            while (*link) {
+                Playlist* pl = *link;
+                if (strcmp(pl->name, loaded->name) == 0) {
+                    *link = pl->next;
+                    destroyTemporaryPlaylist(pl);
+                } else {
+                    link = &pl->next;
                 }
             }
-            tempPl = tempPl->next;
-            yPos += 25;
-            i++;
         }
+        arrived = true;
+    } while (FindNextFileA(find, &data));
+    FindClose(find);
+    return arrived;
+}
+
+// Main loop (attached instances): applies a newer snapshot, or takes over publishing if the
+// publisher exited. Returns true if the library changed. The publisher retries a failed
+// publish and collects handed-off playlists here.
+bool syncLibrarySnapshot(const char* musicDirectory) {
+    if (sharedLibrary.role == SHARED_LIBRARY_PUBLISHER && sharedLibrary.publishRetryAt && perfMicros() >= sharedLibrary.publishRetryAt) {
+        publishLibrarySnapshot();
+    }
+    if (sharedLibrary.role == SHARED_LIBRARY_PUBLISHER &&
+        perfMicros() - sharedLibrary.lastPublisherCheck >= LIBRARY_PUBLISHER_CHECK_MS * 1000LL) {
+        sharedLibrary.lastPublisherCheck = perfMicros();
+        collectHandedOffPlaylists(); // createPlaylist() flags them for the next publish
+        return false;
+    }
+    if (sharedLibrary.role != SHARED_LIBRARY_ATTACHED) return false;
+    unsigned long long version;
+    unsigned int size;
+    if (readLibraryControl(&version, &size) && version != sharedLibrary.version && loadCurrentLibrarySnapshot(false)) {
+        printf("Library snapshot v%llu applied\n", sharedLibrary.version);
+        return true;
+    }
+    if (perfMicros() - sharedLibrary.lastPublisherCheck < LIBRARY_PUBLISHER_CHECK_MS * 1000LL) return false;
+    sharedLibrary.lastPublisherCheck = perfMicros();
+    if (!claimLibraryPublisher()) return false;
+    printf("Publishing instance exited, taking over the shared library\n");
+    watchLibraryRoot(musicDirectory);
+    loadTranscodeManifest(); // Conversions the previous publisher recorded
+    collectHandedOffPlaylists(); // Including this instance's own, which replace the local copies
+    publishLibrarySnapshot();
+    return false;
+}
+
+void closeSharedLibrary(void) {
+    if (!sharedLibrary.controlView) return;
+    if (sharedLibrary.role == SHARED_LIBRARY_PUBLISHER) {
+        // Hand over right away rather than after the liveness timeout
+        InterlockedCompareExchange(&sharedLibrary.controlView->publisherPid, 0, (LONG)GetCurrentProcessId());
+    }
+    for (int i = 0; i < 2; i++) {
+        if (sharedLibrary.snapshots[i]) CloseHandle(sharedLibrary.snapshots[i]);
+    }
+    UnmapViewOfFile(sharedLibrary.controlView);
+    CloseHandle(sharedLibrary.control);
+    memset(&sharedLibrary, 0, sizeof(sharedLibrary));
+}
+
+// -------------------------- HTTP Server --------------------------
+// --http-port=N serves the library to other devices: an index page, M3U/JSON listings of the
+// library and of every playlist, and the audio files themselves with range support, so
+// players can seek. One thread runs the whole server off an I/O completion port. File
+// bodies are sent straight out of mapped views of the file with the socket send buffer set
+// to zero, so Winsock transmits from those pages without copying them anywhere first; two
+// sends stay in flight per connection to keep the pipe full. The UI thread publishes an
+// immutable catalogue whenever the library or a playlist changes; responses hold a
+// reference to the catalogue they started with.
+#define HTTP_REQUEST_MAX 4096 // Request head limit; larger heads get 431
+#define HTTP_ACCEPTS_POSTED 16 // AcceptEx calls kept outstanding
+#define HTTP_MAX_CONNECTIONS 2048
+#define HTTP_SEND_CHUNK (256 * 1024) // Bytes per overlapped file send
+#define HTTP_IDLE_TIMEOUT_MS 30000 // Keep-alive connections silent this long are closed
+#define HTTP_KEY_IO 1 // Completion key of every socket
+#define HTTP_KEY_STOP 2 // Posted by stopHttpServer
+
+int httpPort = -1; // --http-port; -1 = off, 0 = any free port
+const char* httpBindAddress = "127.0.0.1"; // --http-bind (0.0.0.0 to reach other devices)
+
+typedef struct HttpBuffer {
+    char* data;
+    size_t length, capacity;
+    bool failed; // An append ran out of memory
+} HttpBuffer;
+
+void httpAppend(HttpBuffer* buffer, const char* format, ...) {
+    va_list args;
+    for (;;) {
+        size_t room = buffer->capacity - buffer->length;
+        va_start(args, format);
+        int written = buffer->data ? vsnprintf(buffer->data + buffer->length, room, format, args) : -1;
+        va_end(args);
+        if (written >= 0 && (size_t)written < room) {
+            buffer->length += written;
+            return;
+        }
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        while (written >= 0 && capacity - buffer->length <= (size_t)written) capacity *= 2;
+        char* grown = realloc(buffer->data, capacity);
+        if (!grown) {
+            buffer->failed = true;
+            return;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+}
+
+// Percent-encodes a library path into a URL path; backslashes become slashes
+void httpAppendUrl(HttpBuffer* buffer, const char* path) {
+    httpAppend(buffer, "/files/");
+    for (const unsigned char* c = (const unsigned char*)path; *c; c++) {
+        if (*c == '\\') httpAppend(buffer, "/");
+        else if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || strchr("-._~:/()", *c)) httpAppend(buffer, "%c", *c);
+        else httpAppend(buffer, "%%%02X", *c);
+    }
+}
+
+void httpAppendHtml(HttpBuffer* buffer, const char* text) {
+    for (; *text; text++) {
+        switch (*text) {
+            case '&': httpAppend(buffer, "&amp;"); break;
+            case '<': httpAppend(buffer, "&lt;"); break;
+            case '>': httpAppend(buffer, "&gt;"); break;
+            case '"': httpAppend(buffer, "&quot;"); break;
+            default: httpAppend(buffer, "%c", *text);
+        }
+    }
+}
+
+void httpAppendJson(HttpBuffer* buffer, const char* text) {
+    httpAppend(buffer, "\"");
+    for (const unsigned char* c = (const unsigned char*)text; *c; c++) {
+        if (*c == '"' || *c == '\\') httpAppend(buffer, "\\%c", *c);
+        else if (*c < 0x20) httpAppend(buffer, "\\u%04x", *c);
+        else httpAppend(buffer, "%c", *c);
+    }
+    httpAppend(buffer, "\"");
+}
+
+// Everything the server hands out, built on the UI thread and never modified afterwards
+typedef struct HttpCatalog {
+    volatile LONG refs;
+    HttpBuffer index; // "/"
+    HttpBuffer libraryM3u; // "/library.m3u8"
+    HttpBuffer libraryJson; // "/library.json"
+    int playlistCount;
+    HttpBuffer* playlistM3u; // "/playlists/<i>.m3u8"
+    int fileCount;
+    char** files; // Servable paths with '/' separators, sorted; "/files/<path>" serves one
+} HttpCatalog;
+
+void httpCatalogRelease(HttpCatalog* catalog) {
+    if (!catalog || InterlockedDecrement(&catalog->refs) > 0) return;
+    free(catalog->index.data);
+    free(catalog->libraryM3u.data);
+    free(catalog->libraryJson.data);
+    for (int i = 0; i < catalog->playlistCount; i++) free(catalog->playlistM3u[i].data);
+    free(catalog->playlistM3u);
+    for (int i = 0; i < catalog->fileCount; i++) free(catalog->files[i]);
+    free(catalog->files);
+    free(catalog);
+}
+
+int httpCompareFiles(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+void httpAppendM3uEntry(HttpBuffer* buffer, const Song* song) {
+    httpAppend(buffer, "#EXTINF:-1,%s\n", song->name);
+    httpAppendUrl(buffer, song->path);
+    httpAppend(buffer, "\n");
+}
+
+HttpCatalog* httpBuildCatalog(void) {
+    HttpCatalog* catalog = calloc(1, sizeof(HttpCatalog));
+    if (!catalog) return NULL;
+    catalog->refs = 1;
+    int songCount = 0;
+    for (Song* s = allSongsList; s; s = s->next) songCount++;
+    for (Playlist* pl = playlists; pl; pl = pl->next) catalog->playlistCount++;
+    catalog->files = calloc(songCount ? songCount : 1, sizeof(char*));
+    catalog->playlistM3u = calloc(catalog->playlistCount ? catalog->playlistCount : 1, sizeof(HttpBuffer));
+    bool failed = !catalog->files || !catalog->playlistM3u;
+
+    HttpBuffer* index = &catalog->index;
+    httpAppend(index, "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Music Player</title></head><body>\n");
+    httpAppend(index, "<h1>Library</h1>\n<p><a href=\"/library.m3u8\">library.m3u8</a> &middot; <a href=\"/library.json\">library.json</a></p>\n<ol>\n");
+    httpAppend(&catalog->libraryM3u, "#EXTM3U\n#PLAYLIST:Library\n");
+    httpAppend(&catalog->libraryJson, "[");
+    for (Song* s = allSongsList; s && !failed; s = s->next) {
+        httpAppend(index, "<li><a href=\"");
+        httpAppendUrl(index, s->path);
+        httpAppend(index, "\">");
+        httpAppendHtml(index, s->name);
+        httpAppend(index, "</a></li>\n");
+        httpAppendM3uEntry(&catalog->libraryM3u, s);
+        httpAppend(&catalog->libraryJson, "%s\n {\"name\": ", s == allSongsList ? "" : ",");
+        httpAppendJson(&catalog->libraryJson, s->name);
+        httpAppend(&catalog->libraryJson, ", \"url\": \"");
+        httpAppendUrl(&catalog->libraryJson, s->path);
+        httpAppend(&catalog->libraryJson, "\"}");
+
+        char* file = strdup(s->path);
+        if (!file) failed = true;
+        else {
+            for (char* c = file; *c; c++) if (*c == '\\') *c = '/';
+            catalog->files[catalog->fileCount++] = file;
+        }
+    }
+    httpAppend(&catalog->libraryJson, "\n]\n");
+    httpAppend(index, "</ol>\n<h1>Playlists</h1>\n<ul>\n");
+    int i = 0;
+    for (Playlist* pl = playlists; pl && !failed; pl = pl->next, i++) {
+        httpAppend(index, "<li><a href=\"/playlists/%d.m3u8\">", i);
+        httpAppendHtml(index, pl->name);
+        httpAppend(index, "</a> (%d)</li>\n", pl->length);
+        HttpBuffer* m3u = &catalog->playlistM3u[i];
+        httpAppend(m3u, "#EXTM3U\n#PLAYLIST:%s\n", pl->name);
+        for (const PlaylistNode* node = pl->front; node; node = node->next) httpAppendM3uEntry(m3u, node->song);
+        if (m3u->failed) failed = true;
+    }
+    httpAppend(index, "</ul>\n</body></html>\n");
+    if (index->failed || catalog->libraryM3u.failed || catalog->libraryJson.failed) failed = true;
+    if (failed) {
+        fprintf(stderr, "Out of memory building the HTTP catalogue.\n");
+        httpCatalogRelease(catalog);
+        return NULL;
+    }
+    qsort(catalog->files, catalog->fileCount, sizeof(char*), httpCompareFiles);
+    return catalog;
+}
+
+typedef enum HttpOp { HTTP_OP_ACCEPT, HTTP_OP_RECV, HTTP_OP_SEND } HttpOp;
+
+typedef struct HttpIo {
+    OVERLAPPED overlapped; // First member: completions hand back this address
+    HttpOp op;
+    struct HttpConnection* connection;
+    bool busy;
+    ULONG expected; // Bytes a send was asked to transmit
+    void* view; // Mapped file view a send reads from
+} HttpIo;
+
+typedef struct HttpConnection {
+    SOCKET socket;
+    HttpIo recvIo; // Also carries AcceptEx
+    HttpIo sendIo[2];
+    char request[HTTP_REQUEST_MAX];
+    int requestLength;
+    int requestHeadLength; // Bytes of the request being answered, 0 while reading one
+    long long lastActivity; // perfMicros of the last completion
+    // Response: head, then either a memory body or a byte range of a mapped file
+    char head[512];
+    int headLength;
+    bool headQueued;
+    const char* body;
+    long long bodyLength, bodyQueued;
+    HttpCatalog* catalog; // Keeps 'body' alive
+    HANDLE file, mapping;
+    long long fileOffset, fileEnd; // Next byte to queue, one past the last byte to send
+    bool keepAlive;
+    bool accepted; // Counted in openConnections
+    bool closing; // Socket closed; freed once 'pending' reaches zero
+    int pending; // Operations the completion port still owes us
+    struct HttpConnection* prev;
+    struct HttpConnection* next;
+} HttpConnection;
+
+ObjectPool httpConnectionPool = POOL_INIT("HttpConnection", HttpConnection);
+
+typedef struct HttpServer {
+    bool running;
+    bool stopping;
+    SOCKET listener;
+    HANDLE port;
+    sfThread* thread;
+    sfMutex* lock; // Guards 'catalog'
+    HttpCatalog* catalog;
+    unsigned short boundPort;
+    DWORD granularity; // File view offsets must be multiples of this
+    HttpConnection* connections; // Every allocated connection, accepting ones included
+    int connectionCount;
+    int acceptsPosted;
+    // Written by the server thread only; read for the F3 view
+    volatile LONG requests;
+    volatile LONG errors;
+    volatile LONG openConnections;
+    volatile LONG64 bytesSent;
+} HttpServer;
+
+HttpServer httpServer = {0};
+bool httpCatalogStale = false; // The library or a playlist changed since the catalogue was built
+
+void httpFreeResponse(HttpConnection* c) {
+    if (c->mapping) CloseHandle(c->mapping);
+    if (c->file && c->file != INVALID_HANDLE_VALUE) CloseHandle(c->file);
+    c->mapping = c->file = NULL;
+    httpCatalogRelease(c->catalog);
+    c->catalog = NULL;
+    c->body = NULL;
+    c->bodyLength = c->bodyQueued = 0;
+    c->fileOffset = c->fileEnd = 0;
+    c->headLength = 0;
+    c->headQueued = false;
+}
+
+HttpConnection* httpNewConnection(void) {
+    HttpConnection* c = poolAlloc(&httpConnectionPool);
+    if (!c) return NULL;
+    memset(c, 0, sizeof(*c));
+    c->socket = INVALID_SOCKET;
+    c->recvIo.connection = c;
+    for (int i = 0; i < 2; i++) {
+        c->sendIo[i].connection = c;
+        c->sendIo[i].op = HTTP_OP_SEND;
+    }
+    c->next = httpServer.connections;
+    if (c->next) c->next->prev = c;
+    httpServer.connections = c;
+    httpServer.connectionCount++;
+    return c;
+}
+
+void httpReleaseConnection(HttpConnection* c) {
+    httpFreeResponse(c);
+    if (c->prev) c->prev->next = c->next;
+    else httpServer.connections = c->next;
+    if (c->next) c->next->prev = c->prev;
+    httpServer.connectionCount--;
+    poolFree(&httpConnectionPool, c);
+}
+
+// Closes the socket; outstanding operations complete with errors, and the completion that
+// brings 'pending' to zero frees the connection
+void httpClose(HttpConnection* c) {
+    if (c->closing) return;
+    c->closing = true;
+    if (c->socket != INVALID_SOCKET) closesocket(c->socket);
+    c->socket = INVALID_SOCKET;
+    if (c->accepted) InterlockedDecrement(&httpServer.openConnections);
+}
+
+// httpClose for callers that do not touch 'c' afterwards
+void httpDrop(HttpConnection* c) {
+    httpClose(c);
+    if (c->pending == 0) httpReleaseConnection(c);
+}
+
+void httpPostAccept(void) {
+    HttpConnection* c = httpNewConnection();
+    if (!c) return;
+    c->socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (c->socket == INVALID_SOCKET) {
+        httpDrop(c);
+        return;
+    }
+    c->recvIo.op = HTTP_OP_ACCEPT;
+    DWORD received = 0;
+    DWORD addressLength = sizeof(struct sockaddr_in) + 16;
+    memset(&c->recvIo.overlapped, 0, sizeof(OVERLAPPED));
+    if (!AcceptEx(httpServer.listener, c->socket, c->request, 0, addressLength, addressLength, &received, &c->recvIo.overlapped) &&
+        WSAGetLastError() != ERROR_IO_PENDING) {
+        fprintf(stderr, "HTTP: AcceptEx failed (%d)\n", WSAGetLastError());
+        httpDrop(c);
+        return;
+    }
+    c->pending++;
+    httpServer.acceptsPosted++;
+}
+
+void httpPostRecv(HttpConnection* c) {
+    WSABUF buffer = { (ULONG)(HTTP_REQUEST_MAX - 1 - c->requestLength), c->request + c->requestLength }; // Room for a NUL
+    DWORD flags = 0;
+    c->recvIo.op = HTTP_OP_RECV;
+    memset(&c->recvIo.overlapped, 0, sizeof(OVERLAPPED));
+    if (WSARecv(c->socket, &buffer, 1, NULL, &flags, &c->recvIo.overlapped, NULL) == SOCKET_ERROR &&
+        WSAGetLastError() != WSA_IO_PENDING) {
+        httpClose(c);
+        return;
+    }
+    c->pending++;
+}
+
+bool httpPostSend(HttpConnection* c, HttpIo* io, WSABUF* buffers, DWORD count, void* view) {
+    io->expected = 0;
+    for (DWORD i = 0; i < count; i++) io->expected += buffers[i].len;
+    io->view = view;
+    memset(&io->overlapped, 0, sizeof(OVERLAPPED));
+    if (WSASend(c->socket, buffers, count, NULL, 0, &io->overlapped, NULL) == SOCKET_ERROR &&
+        WSAGetLastError() != WSA_IO_PENDING) {
+        if (view) UnmapViewOfFile(view);
+        io->view = NULL;
+        return false;
+    }
+    io->busy = true;
+    c->pending++;
+    return true;
+}
+
+// Queues the next piece of the response on every idle send slot
+void httpPump(HttpConnection* c) {
+    for (int s = 0; s < 2 && !c->closing; s++) {
+        HttpIo* io = &c->sendIo[s];
+        if (io->busy) continue;
+        if (!c->headQueued) {
+            // Memory bodies go out with the head in one send
+            WSABUF buffers[2] = { { (ULONG)c->headLength, c->head }, { (ULONG)c->bodyLength, (char*)c->body } };
+            DWORD count = c->body && c->bodyLength > 0 ? 2 : 1;
+            c->headQueued = true;
+            if (count == 2) c->bodyQueued = c->bodyLength;
+            if (!httpPostSend(c, io, buffers, count, NULL)) httpClose(c);
+        } else if (c->mapping && c->fileOffset < c->fileEnd) {
+            long long viewStart = c->fileOffset - c->fileOffset % httpServer.granularity;
+            long long length = c->fileEnd - c->fileOffset;
+            if (length > HTTP_SEND_CHUNK) length = HTTP_SEND_CHUNK;
+            SIZE_T viewLength = (SIZE_T)(c->fileOffset - viewStart + length);
+            char* view = MapViewOfFile(c->mapping, FILE_MAP_READ, (DWORD)(viewStart >> 32), (DWORD)viewStart, viewLength);
+            if (!view) {
+                httpClose(c);
+                return;
+            }
+            WSABUF buffer = { (ULONG)length, view + (c->fileOffset - viewStart) };
+            c->fileOffset += length;
+            if (!httpPostSend(c, io, &buffer, 1, view)) httpClose(c);
+        }
+    }
+}
+
+bool httpResponseDone(const HttpConnection* c) {
+    return c->headQueued && !c->sendIo[0].busy && !c->sendIo[1].busy &&
+           (!c->mapping || c->fileOffset >= c->fileEnd);
+}
+
+void httpStartResponse(HttpConnection* c, int status, const char* reason, const char* contentType, long long contentLength, const char* extraHeaders) {
+    c->headLength = snprintf(c->head, sizeof(c->head),
+                             "HTTP/1.1 %d %s\r\nServer: MusicPlayer\r\nContent-Type: %s\r\nContent-Length: %lld\r\n"
+                             "Accept-Ranges: bytes\r\n%sConnection: %s\r\n\r\n",
+                             status, reason, contentType, contentLength, extraHeaders ? extraHeaders : "",
+                             c->keepAlive ? "keep-alive" : "close");
+    if (c->headLength >= (int)sizeof(c->head)) c->headLength = sizeof(c->head) - 1;
+    c->headQueued = false;
+}
+
+void httpRespondText(HttpConnection* c, int status, const char* reason, const char* text, bool headOnly) {
+    httpStartResponse(c, status, reason, "text/plain; charset=utf-8", (long long)strlen(text), NULL);
+    c->body = headOnly ? NULL : text;
+    c->bodyLength = headOnly ? 0 : (long long)strlen(text);
+    if (status >= 400) InterlockedIncrement(&httpServer.errors);
+}
+
+// Value of header 'name' (case-insensitive) in a request head, copied into 'value'
+bool httpHeaderValue(const char* head, const char* name, char* value, size_t size) {
+    size_t nameLength = strlen(name);
+    const char* line = strstr(head, "\r\n");
+    while (line && line[2] != '\r' && line[2] != '\0') {
+        line += 2;
+        if (_strnicmp(line, name, nameLength) == 0 && line[nameLength] == ':') {
+            const char* start = line + nameLength + 1;
+            while (*start == ' ' || *start == '\t') start++;
+            const char* end = strstr(start, "\r\n");
+            size_t length = end ? (size_t)(end - start) : strlen(start);
+            while (length > 0 && (start[length - 1] == ' ' || start[length - 1] == '\t')) length--;
+            if (length >= size) length = size - 1;
+            memcpy(value, start, length);
+            value[length] = '\0';
+            return true;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return false;
+}
+
+// Single "bytes=" range against 'size': 1 = use [first, last], 0 = send everything (no range,
+// a multi-range or one we cannot parse), -1 = unsatisfiable
+int httpParseRange(const char* value, long long size, long long* first, long long* last) {
+    if (strncmp(value, "bytes=", 6) != 0 || strchr(value, ',')) return 0;
+    const char* spec = value + 6;
+    char* end;
+    if (*spec == '-') {
+        long long suffix = strtoll(spec + 1, &end, 10);
+        if (end == spec + 1 || *end) return 0;
+        if (suffix <= 0 || size == 0) return -1;
+        *first = suffix >= size ? 0 : size - suffix;
+        *last = size - 1;
+        return 1;
+    }
+    long long start = strtoll(spec, &end, 10);
+    if (end == spec || *end != '-' || start < 0) return 0;
+    spec = end + 1;
+    long long stop = size - 1;
+    if (*spec) {
+        stop = strtoll(spec, &end, 10);
+        if (*end || stop < start) return 0;
+        if (stop > size - 1) stop = size - 1;
+    }
+    if (start >= size) return -1;
+    *first = start;
+    *last = stop;
+    return 1;
+}
+
+const char* httpContentType(const char* path) {
+    const char* dot = strrchr(pathBaseName(path), '.');
+    if (!dot) return "application/octet-stream";
+    if (_stricmp(dot, ".ogg") == 0 || _stricmp(dot, ".opus") == 0) return "audio/ogg";
+    if (_stricmp(dot, ".wav") == 0) return "audio/wav";
+    if (_stricmp(dot, ".flac") == 0) return "audio/flac";
+    if (_stricmp(dot, ".mp3") == 0) return "audio/mpeg";
+    if (_stricmp(dot, ".aif") == 0 || _stricmp(dot, ".aiff") == 0) return "audio/aiff";
+    return "application/octet-stream";
+}
+
+// Decodes %XX escapes in place; false for malformed escapes or an encoded NUL
+bool httpDecodePath(char* path) {
+    char* dst = path;
+    for (const char* src = path; *src; src++) {
+        if (*src == '%') {
+            int hi = hexDigitValue(src[1]);
+            int lo = hi >= 0 ? hexDigitValue(src[2]) : -1;
+            if (lo < 0 || (hi == 0 && lo == 0)) return false;
+            *dst++ = (char)(hi * 16 + lo);
+            src += 2;
+        } else {
+            *dst++ = *src;
+        }
+    }
+    *dst = '\0';
+    return true;
+}
+
+void httpServeFile(HttpConnection* c, const char* path, const char* rangeHeader, bool headOnly) {
+    c->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                          OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    LARGE_INTEGER size;
+    if (c->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(c->file, &size)) {
+        httpRespondText(c, 404, "Not Found", "File is gone.\n", headOnly);
+        return;
+    }
+    long long first = 0, last = size.QuadPart - 1;
+    int range = rangeHeader ? httpParseRange(rangeHeader, size.QuadPart, &first, &last) : 0;
+    char extra[128];
+    if (range < 0) {
+        snprintf(extra, sizeof(extra), "Content-Range: bytes */%lld\r\n", size.QuadPart);
+        httpStartResponse(c, 416, "Range Not Satisfiable", "text/plain; charset=utf-8", 0, extra);
+        InterlockedIncrement(&httpServer.errors);
+        return;
+    }
+    if (range > 0) {
+        snprintf(extra, sizeof(extra), "Content-Range: bytes %lld-%lld/%lld\r\n", first, last, size.QuadPart);
+        httpStartResponse(c, 206, "Partial Content", httpContentType(path), last - first + 1, extra);
+    } else {
+        httpStartResponse(c, 200, "OK", httpContentType(path), size.QuadPart, NULL);
+    }
+    if (headOnly || size.QuadPart == 0) return;
+    c->mapping = CreateFileMappingA(c->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!c->mapping) {
+        fprintf(stderr, "HTTP: cannot map %s\n", path);
+        CloseHandle(c->file);
+        c->file = NULL;
+        httpRespondText(c, 500, "Internal Server Error", "Cannot read the file.\n", false);
+        return;
+    }
+    c->fileOffset = first;
+    c->fileEnd = last + 1;
+}
+
+// Parses the request in c->request (head complete, 'headLength' bytes) and sets up the response
+void httpHandleRequest(HttpConnection* c, int headLength) {
+    char* head = c->request;
+    char saved = head[headLength - 2];
+    head[headLength - 2] = '\0'; // Terminate after the last header line's CRLF
+    InterlockedIncrement(&httpServer.requests);
+
+    char method[8], target[1024], version[16];
+    bool parsed = sscanf(head, "%7s %1023s %15s", method, target, version) == 3 && strncmp(version, "HTTP/1.", 7) == 0;
+    char connection[32] = "";
+    httpHeaderValue(head, "Connection", connection, sizeof(connection));
+    c->keepAlive = parsed && (strcmp(version, "HTTP/1.1") == 0 ? _stricmp(connection, "close") != 0 : _stricmp(connection, "keep-alive") == 0);
+    bool headOnly = parsed && strcmp(method, "HEAD") == 0;
+
+    if (!parsed) {
+        c->keepAlive = false;
+        httpRespondText(c, 400, "Bad Request", "Bad request.\n", false);
+    } else if (strcmp(method, "GET") != 0 && !headOnly) {
+        c->keepAlive = false; // A request body would follow; we do not read it
+        httpRespondText(c, 405, "Method Not Allowed", "Only GET and HEAD are supported.\n", false);
+    } else {
+        char* query = strchr(target, '?');
+        if (query) *query = '\0';
+        char range[64];
+        bool hasRange = httpHeaderValue(head, "Range", range, sizeof(range));
+
+        sfMutex_lock(httpServer.lock);
+        c->catalog = httpServer.catalog;
+        if (c->catalog) InterlockedIncrement(&c->catalog->refs);
+        sfMutex_unlock(httpServer.lock);
+
+        const HttpBuffer* listing = NULL;
+        const char* type = "audio/x-mpegurl; charset=utf-8";
+        int playlistIndex;
+        char tail;
+        if (!c->catalog) {
+            httpRespondText(c, 503, "Service Unavailable", "Library not loaded yet.\n", headOnly);
+        } else if (strcmp(target, "/") == 0 || strcmp(target, "/index.html") == 0) {
+            listing = &c->catalog->index;
+            type = "text/html; charset=utf-8";
+        } else if (strcmp(target, "/library.m3u8") == 0) {
+            listing = &c->catalog->libraryM3u;
+        } else if (strcmp(target, "/library.json") == 0) {
+            listing = &c->catalog->libraryJson;
+            type = "application/json";
+        } else if (sscanf(target, "/playlists/%d.m3u%c", &playlistIndex, &tail) == 2 && tail == '8' &&
+                   playlistIndex >= 0 && playlistIndex < c->catalog->playlistCount) {
+            listing = &c->catalog->playlistM3u[playlistIndex];
+        } else if (strncmp(target, "/files/", 7) == 0 && httpDecodePath(target + 7)) {
+            char* key = target + 7;
+            if (bsearch(&key, c->catalog->files, c->catalog->fileCount, sizeof(char*), httpCompareFiles)) {
+                httpServeFile(c, key, hasRange ? range : NULL, headOnly);
+            } else {
+                httpRespondText(c, 404, "Not Found", "Not in the library.\n", headOnly);
+            }
+        } else {
+            httpRespondText(c, 404, "Not Found", "Not found.\n", headOnly);
+        }
+        if (listing) {
+            httpStartResponse(c, 200, "OK", type, (long long)listing->length, NULL);
+            c->body = headOnly ? NULL : listing->data;
+            c->bodyLength = headOnly ? 0 : (long long)listing->length;
+        }
+    }
+    head[headLength - 2] = saved;
+    c->requestHeadLength = headLength;
+}
+
+// Answers the next complete request in the buffer, or reads more of it
+void httpNextRequest(HttpConnection* c) {
+    c->request[c->requestLength] = '\0';
+    char* end = c->requestLength > 0 ? strstr(c->request, "\r\n\r\n") : NULL;
+    if (!end && c->requestLength >= HTTP_REQUEST_MAX - 1) {
+        c->keepAlive = false;
+        c->requestHeadLength = c->requestLength;
+        httpRespondText(c, 431, "Request Header Fields Too Large", "Request head too large.\n", false);
+    } else if (!end) {
+        httpPostRecv(c);
+        return;
+    } else {
+        httpHandleRequest(c, (int)(end + 4 - c->request));
+    }
+    httpPump(c); // Every response has at least its head to send; its completion continues
+}
+
+// One response went out completely: keep the connection for the next request or close it
+void httpFinishResponse(HttpConnection* c) {
+    httpFreeResponse(c);
+    if (!c->keepAlive) {
+        shutdown(c->socket, SD_SEND);
+        httpClose(c);
+        return;
+    }
+    // Pipelined requests already read sit after the one just answered
+    c->requestLength -= c->requestHeadLength;
+    memmove(c->request, c->request + c->requestHeadLength, c->requestLength);
+    c->requestHeadLength = 0;
+    httpNextRequest(c);
+}
+
+void httpOnAccept(HttpConnection* c, BOOL ok) {
+    httpServer.acceptsPosted--;
+    if (!ok || c->closing) {
+        httpClose(c);
+        return;
+    }
+    setsockopt(c->socket, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, (const char*)&httpServer.listener, sizeof(httpServer.listener));
+    int zero = 0;
+    setsockopt(c->socket, SOL_SOCKET, SO_SNDBUF, (const char*)&zero, sizeof(zero)); // Send from our pages
+    if (!CreateIoCompletionPort((HANDLE)c->socket, httpServer.port, HTTP_KEY_IO, 0)) {
+        httpClose(c);
+        return;
+    }
+    c->accepted = true;
+    InterlockedIncrement(&httpServer.openConnections);
+    httpPostRecv(c);
+}
+
+void httpOnCompletion(HttpIo* io, BOOL ok, DWORD bytes) {
+    HttpConnection* c = io->connection;
+    c->pending--;
+    c->lastActivity = perfMicros();
+
+    if (io->op == HTTP_OP_ACCEPT) {
+        httpOnAccept(c, ok);
+    } else if (io->op == HTTP_OP_RECV) {
+        if (!ok || bytes == 0 || c->closing) {
+            httpClose(c);
+        } else {
+            c->requestLength += bytes;
+            httpNextRequest(c);
+        }
+    } else {
+        io->busy = false;
+        if (io->view) UnmapViewOfFile(io->view);
+        io->view = NULL;
+        if (!ok || bytes != io->expected || c->closing) {
+            httpClose(c);
+        } else {
+            InterlockedExchangeAdd64(&httpServer.bytesSent, bytes);
+            httpPump(c);
+            if (!c->closing && httpResponseDone(c)) httpFinishResponse(c);
+        }
+    }
+    if (c->closing && c->pending == 0) httpReleaseConnection(c);
+}
+
+// Closes keep-alive connections that have been waiting for a request for too long
+void httpSweepIdle(void) {
+    long long cutoff = perfMicros() - HTTP_IDLE_TIMEOUT_MS * 1000LL;
+    HttpConnection* c = httpServer.connections;
+    while (c) {
+        HttpConnection* next = c->next;
+        if (!c->closing && c->recvIo.op == HTTP_OP_RECV && c->requestHeadLength == 0 && c->lastActivity < cutoff) {
+            httpDrop(c);
+        }
+        c = next;
+    }
+}
+
+// Keeps HTTP_ACCEPTS_POSTED accepts outstanding while there is room for more connections
+void httpRefillAccepts(void) {
+    while (!httpServer.stopping && httpServer.acceptsPosted < HTTP_ACCEPTS_POSTED &&
+           httpServer.connectionCount - httpServer.acceptsPosted < HTTP_MAX_CONNECTIONS) {
+        int posted = httpServer.acceptsPosted;
+        httpPostAccept();
+        if (httpServer.acceptsPosted == posted) break; // Out of sockets or memory; retry next time
+    }
+}
+
+void httpServerThread(void* userData) {
+    (void)userData;
+    long long lastSweep = perfMicros();
+    for (;;) {
+        httpRefillAccepts();
+        DWORD bytes = 0;
+        ULONG_PTR key = 0;
+        OVERLAPPED* overlapped = NULL;
+        BOOL ok = GetQueuedCompletionStatus(httpServer.port, &bytes, &key, &overlapped, 1000);
+        if (overlapped) {
+            httpOnCompletion((HttpIo*)overlapped, ok, bytes);
+        } else if (ok && key == HTTP_KEY_STOP && !httpServer.stopping) {
+            // Close everything, then keep draining until every cancelled operation came back
+            httpServer.stopping = true;
+            closesocket(httpServer.listener);
+            httpServer.listener = INVALID_SOCKET;
+            HttpConnection* c = httpServer.connections;
+            while (c) {
+                HttpConnection* next = c->next;
+                httpDrop(c);
+                c = next;
+            }
+        }
+        if (httpServer.stopping && httpServer.connectionCount == 0) break;
+        if (perfMicros() - lastSweep > 1000000) {
+            httpSweepIdle();
+            lastSweep = perfMicros();
+        }
+    }
+}
+
+// Rebuilds the catalogue from the library and playlists (UI thread)
+void httpPublishCatalog(void) {
+    httpCatalogStale = false;
+    if (!httpServer.running) return;
+    HttpCatalog* catalog = httpBuildCatalog();
+    if (!catalog) return;
+    sfMutex_lock(httpServer.lock);
+    HttpCatalog* old = httpServer.catalog;
+    httpServer.catalog = catalog;
+    sfMutex_unlock(httpServer.lock);
+    httpCatalogRelease(old);
+}
+
+bool startHttpServer(int port) {
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        fprintf(stderr, "HTTP: WSAStartup failed\n");
+        return false;
+    }
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    httpServer.granularity = info.dwAllocationGranularity;
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons((unsigned short)port);
+    if (inet_pton(AF_INET, httpBindAddress, &address.sin_addr) != 1) {
+        fprintf(stderr, "HTTP: bad bind address %s\n", httpBindAddress);
+        WSACleanup();
+        return false;
+    }
+    httpServer.listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    int addressLength = sizeof(address);
+    if (httpServer.listener == INVALID_SOCKET ||
+        bind(httpServer.listener, (struct sockaddr*)&address, sizeof(address)) == SOCKET_ERROR ||
+        listen(httpServer.listener, SOMAXCONN) == SOCKET_ERROR ||
+        getsockname(httpServer.listener, (struct sockaddr*)&address, &addressLength) == SOCKET_ERROR) {
+        fprintf(stderr, "HTTP: cannot listen on %s:%d (%d)\n", httpBindAddress, port, WSAGetLastError());
+        if (httpServer.listener != INVALID_SOCKET) closesocket(httpServer.listener);
+        WSACleanup();
+        return false;
+    }
+    httpServer.boundPort = ntohs(address.sin_port);
+    httpServer.port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    if (!httpServer.port || !CreateIoCompletionPort((HANDLE)httpServer.listener, httpServer.port, HTTP_KEY_IO, 0)) {
+        fprintf(stderr, "HTTP: cannot create the completion port\n");
+        closesocket(httpServer.listener);
+        if (httpServer.port) CloseHandle(httpServer.port);
+        WSACleanup();
+        return false;
+    }
+    httpServer.lock = sfMutex_create();
+    httpServer.running = true;
+    httpServer.stopping = false;
+    httpPublishCatalog();
+    httpServer.thread = sfThread_create(httpServerThread, NULL);
+    sfThread_launch(httpServer.thread);
+    printf("HTTP server on http://%s:%u/\n", httpBindAddress, httpServer.boundPort);
+    return true;
+}
+
+void stopHttpServer(void) {
+    if (!httpServer.running) return;
+    PostQueuedCompletionStatus(httpServer.port, 0, HTTP_KEY_STOP, NULL);
+    sfThread_wait(httpServer.thread);
+    sfThread_destroy(httpServer.thread);
+    CloseHandle(httpServer.port);
+    httpCatalogRelease(httpServer.catalog);
+    httpServer.catalog = NULL;
+    sfMutex_destroy(httpServer.lock);
+    poolDestroy(&httpConnectionPool);
+    WSACleanup();
+    httpServer.running = false;
+    printf("HTTP server stopped: %ld requests, %lld MB sent, %ld errors\n", (long)httpServer.requests,
+           (long long)httpServer.bytesSent >> 20, (long)httpServer.errors);
+}
+
+// -------------------------- HTTP Load Test --------------------------
+// --http-bench=N starts the server on a loopback port and points N client threads at it.
+// Each client reads /library.m3u8 once, then keeps requesting random files, half of them
+// as byte ranges, over one keep-alive connection until the time is up. Every body is
+// compared with the file on disk, so the run checks correctness as well as speed.
+#define HTTP_BENCH_MAX_CLIENTS 1024
+
+int httpBenchClients = 0; // --http-bench
+int httpBenchSeconds = 10; // --http-bench-seconds
+
+typedef struct HttpBenchClient {
+    unsigned int seed;
+    char** urls; // Parsed from /library.m3u8
+    int urlCount;
+    long long deadline; // perfMicros() at which to stop
+    long requests, errors;
+    long long bytes;
+    long long* firstByteMicros;
+    long long* totalMicros;
+    int samples, sampleCapacity;
+    char buffer[64 * 1024]; // Response bytes
+    char expected[64 * 1024]; // The same stretch of the file
+} HttpBenchClient;
+
+SOCKET httpBenchConnect(void) {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET) return s;
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(httpServer.boundPort);
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    if (connect(s, (struct sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+unsigned int httpBenchRandom(HttpBenchClient* client) {
+    client->seed ^= client->seed << 13;
+    client->seed ^= client->seed >> 17;
+    client->seed ^= client->seed << 5;
+    return client->seed;
+}
+
+// Sends one GET and reads the response. The body goes to 'body' (grown as needed) when
+// 'body' is not NULL, otherwise it is compared against 'file' from 'fileOffset' on.
+// Returns the status code, or -1 when the connection failed and has to be reopened.
+int httpBenchRequest(HttpBenchClient* client, SOCKET s, const char* url, const char* range, FILE* file, long long fileOffset,
+                     HttpBuffer* body, long long* contentLength, bool* keepAlive) {
+    char request[1400];
+    int requestLength = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: 127.0.0.1\r\n%s%s%s\r\n", url,
+                                 range ? "Range: " : "", range ? range : "", range ? "\r\n" : "");
+    long long start = perfMicros();
+    if (send(s, request, requestLength, 0) != requestLength) return -1;
+
+    char* buffer = client->buffer;
+    char* expected = client->expected;
+    int length = 0;
+    char* headEnd = NULL;
+    long long firstByte = 0;
+    while (!headEnd) {
+        int got = recv(s, buffer + length, (int)sizeof(client->buffer) - 1 - length, 0);
+        if (got <= 0) return -1;
+        if (!firstByte) firstByte = perfMicros();
+        length += got;
+        buffer[length] = '\0';
+        headEnd = strstr(buffer, "\r\n\r\n");
+        if (!headEnd && length >= (int)sizeof(client->buffer) - 1) return -1;
+    }
+    int status = 0;
+    if (sscanf(buffer, "HTTP/1.%*d %d", &status) != 1) return -1;
+    *headEnd = '\0';
+    char value[64];
+    *contentLength = httpHeaderValue(buffer, "Content-Length", value, sizeof(value)) ? strtoll(value, NULL, 10) : -1;
+    *keepAlive = !(httpHeaderValue(buffer, "Connection", value, sizeof(value)) && _stricmp(value, "close") == 0);
+    if (*contentLength < 0) return -1;
+
+    // Body bytes that arrived with the head, then the rest
+    char* data = headEnd + 4;
+    int dataLength = length - (int)(data - buffer);
+    long long remaining = *contentLength;
+    bool same = true;
+    if (file) _fseeki64(file, fileOffset, SEEK_SET); // fseek takes a 32-bit long on Windows
+    for (;;) {
+        if (dataLength > remaining) return -1; // We never pipeline, so nothing may follow the body
+        if (body) httpAppend(body, "%.*s", dataLength, data);
+        if (file && dataLength > 0 && same) {
+            same = fread(expected, 1, dataLength, file) == (size_t)dataLength && memcmp(expected, data, dataLength) == 0;
+        }
+        remaining -= dataLength;
+        client->bytes += dataLength;
+        if (remaining == 0) break;
+        dataLength = recv(s, buffer, (int)(remaining < (long long)sizeof(client->buffer) ? remaining : (long long)sizeof(client->buffer)), 0);
+        if (dataLength <= 0) return -1;
+        data = buffer;
+    }
+    long long end = perfMicros();
+    if (!same) {
+        fprintf(stderr, "HTTP bench: body of %s (%s) differs from the file\n", url, range ? range : "full");
+        client->errors++;
+    }
+    if (client->samples == client->sampleCapacity) {
+        int capacity = client->sampleCapacity ? client->sampleCapacity * 2 : 1024;
+        long long* first = realloc(client->firstByteMicros, capacity * sizeof(long long));
+        if (first) client->firstByteMicros = first;
+        long long* total = realloc(client->totalMicros, capacity * sizeof(long long));
+        if (total) client->totalMicros = total;
+        if (first && total) client->sampleCapacity = capacity;
+    }
+    if (client->samples < client->sampleCapacity) {
+        client->firstByteMicros[client->samples] = firstByte - start;
+        client->totalMicros[client->samples] = end - start;
+        client->samples++;
+    }
+    client->requests++;
+    return status;
+}
+
+void httpBenchClientThread(void* userData) {
+    HttpBenchClient* client = userData;
+    SOCKET s = INVALID_SOCKET;
+    while (perfMicros() < client->deadline) {
+        if (s == INVALID_SOCKET && (s = httpBenchConnect()) == INVALID_SOCKET) {
+            client->errors++;
+            Sleep(10);
+            continue;
+        }
+        const char* url = client->urls[httpBenchRandom(client) % client->urlCount];
+        char path[MAX_PATH_LENGTH];
+        snprintf(path, sizeof(path), "%s", url + 7); // Skip "/files/"
+        FILE* file = httpDecodePath(path) ? fopen(path, "rb") : NULL;
+        if (!file) {
+            client->errors++;
+            continue;
+        }
+        _fseeki64(file, 0, SEEK_END);
+        long long size = _ftelli64(file);
+
+        // Half the requests fetch a range, as a seeking player would
+        char range[64];
+        long long first = 0, last = size - 1;
+        unsigned int pick = httpBenchRandom(client);
+        bool ranged = size > 0 && (pick & 1);
+        if (ranged && (pick & 6) == 0) {
+            long long suffix = 1 + httpBenchRandom(client) % (size < 65536 ? size : 65536);
+            snprintf(range, sizeof(range), "bytes=-%lld", suffix);
+            first = size - suffix;
+        } else if (ranged) {
+            first = httpBenchRandom(client) % size;
+            last = first + httpBenchRandom(client) % 262144;
+            if (last > size - 1) last = size - 1;
+            snprintf(range, sizeof(range), "bytes=%lld-%lld", first, last);
+        }
+        long long contentLength;
+        bool keepAlive;
+        int status = httpBenchRequest(client, s, url, ranged ? range : NULL, file, first, NULL, &contentLength, &keepAlive);
+        fclose(file);
+        if (status < 0) {
+            client->errors++;
+            closesocket(s);
+            s = INVALID_SOCKET;
+            continue;
+        }
+        if (status != (ranged ? 206 : 200) || contentLength != last - first + 1) {
+            fprintf(stderr, "HTTP bench: %s (%s) answered %d with %lld bytes\n", url, ranged ? range : "full", status, contentLength);
+            client->errors++;
+        }
+        if (!keepAlive) {
+            closesocket(s);
+            s = INVALID_SOCKET;
+        }
+    }
+    if (s != INVALID_SOCKET) closesocket(s);
+}
 
-        playSelectedBtn_s = createLabel(font, "PLAY SELECTED", 200, 450, 24);
-        if(playSelectedBtn_s) sfText_setFillColor(playSelectedBtn_s, sfGreen);
-        cancelSelectBtn_s = createLabel(font, "CANCEL", 450, 450, 24);
-        if(cancelSelectBtn_s) sfText_setFillColor(cancelSelectBtn_s, sfRed);
-
-        selectedPlaylist_s = NULL;
-        playlistSelectedIndex_s = -1;
-        uiInitialized = true;
-        mouseWasPressed = false; // Reset mouse state for this screen
+// Reads /library.m3u8 and keeps its URL lines
+int httpBenchLoadUrls(HttpBenchClient* client, char*** urls) {
+    SOCKET s = httpBenchConnect();
+    if (s == INVALID_SOCKET) return -1;
+    HttpBuffer body = {0};
+    long long contentLength;
+    bool keepAlive;
+    int status = httpBenchRequest(client, s, "/library.m3u8", NULL, NULL, 0, &body, &contentLength, &keepAlive);
+    closesocket(s);
+    if (status != 200 || body.failed || !body.data) {
+        free(body.data);
+        return -1;
+    }
+    int count = 0;
+    *urls = NULL;
+    for (char* line = strtok(body.data, "\n"); line; line = strtok(NULL, "\n")) {
+        if (strncmp(line, "/files/", 7) != 0) continue;
+        char** grown = realloc(*urls, (count + 1) * sizeof(char*));
+        if (!grown) break;
+        *urls = grown;
+        (*urls)[count] = strdup(line);
+        if ((*urls)[count]) count++;
     }
+    free(body.data);
+    return count;
+}
 
-    if (event->type == sfEvtMouseButtonPressed) {
-        if (!mouseWasPressed) { // Only process click if mouse wasn't pressed in previous frame
-            sfVector2i mouse = sfMouse_getPositionRenderWindow(window);
-
-            // Check for clicks on playlist names
-            Playlist* currentListPtr = allPlaylists; // Use a fresh pointer for iteration
-            for (int i = 0; i < MAX_VISIBLE_LIST_ITEMS; ++i) {
-                if (!playlistText_s[i]) break;
-
-                // Use rectangle bounds for click detection for better hit area
-                sfFloatRect plRectBounds = sfRectangleShape_getGlobalBounds(playlistRect_s[i]);
-                if (sfFloatRect_contains(&plRectBounds, (float)mouse.x, (float)mouse.y)) {
-                    // Deselect previous visual
-                    if (playlistSelectedIndex_s != -1 && playlistRect_s[playlistSelectedIndex_s]) {
-                        sfRectangleShape_setOutlineColor(playlistRect_s[playlistSelectedIndex_s], sfWhite);
-                        sfRectangleShape_setFillColor(playlistRect_s[playlistSelectedIndex_s], sfColor_fromRGBA(0,0,0,100));
-                    }
+int httpBenchCompare(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
 
-                    // Select new visual
-                    playlistSelectedIndex_s = i;
-                    sfRectangleShape_setOutlineColor(playlistRect_s[i], sfCyan); // Highlight selected outline
-                    sfRectangleShape_setFillColor(playlistRect_s[i], sfColor_fromRGBA(0, 100, 100, 150)); // Darker cyan fill
+double httpBenchPercentile(const long long* sorted, long long count, double fraction) {
+    if (count == 0) return 0.0;
+    long long index = (long long)(fraction * (count - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
 
-                    // Find the actual playlist pointer based on its position in the list
-                    selectedPlaylist_s = currentListPtr;
-                    for(int j = 0; j < i; ++j) {
-                        if (selectedPlaylist_s) selectedPlaylist_s = selectedPlaylist_s->next;
-                    }
-                    mouseWasPressed = true; // Mark as processed
-                    break;
+int runHttpBenchmark(void) {
+    if (httpBenchClients > HTTP_BENCH_MAX_CLIENTS) httpBenchClients = HTTP_BENCH_MAX_CLIENTS;
+    httpBindAddress = "127.0.0.1";
+    if (!startHttpServer(0)) return 1;
+
+    HttpBenchClient* clients = calloc(httpBenchClients, sizeof(HttpBenchClient));
+    sfThread** threads = calloc(httpBenchClients, sizeof(sfThread*));
+    char** urls = NULL;
+    int urlCount = clients ? httpBenchLoadUrls(&clients[0], &urls) : -1;
+    if (!clients || !threads || urlCount <= 0) {
+        fprintf(stderr, "HTTP bench: %s\n", urlCount == 0 ? "the library is empty" : "could not read /library.m3u8");
+        free(clients);
+        free(threads);
+        stopHttpServer();
+        return 1;
+    }
+    printf("HTTP bench: %d clients, %d files, %d s\n", httpBenchClients, urlCount, httpBenchSeconds);
+
+    clients[0].requests = clients[0].samples = 0; // The listing fetch is not part of the run
+    clients[0].bytes = 0;
+    long long start = perfMicros();
+    for (int i = 0; i < httpBenchClients; i++) {
+        clients[i].seed = 2463534242u + i * 7919u;
+        clients[i].urls = urls;
+        clients[i].urlCount = urlCount;
+        clients[i].deadline = start + httpBenchSeconds * 1000000LL;
+        threads[i] = sfThread_create(httpBenchClientThread, &clients[i]);
+        sfThread_launch(threads[i]);
+    }
+    long requests = 0, errors = 0;
+    long long bytes = 0, samples = 0;
+    for (int i = 0; i < httpBenchClients; i++) {
+        sfThread_wait(threads[i]);
+        sfThread_destroy(threads[i]);
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+        samples += clients[i].samples;
+    }
+    double seconds = (perfMicros() - start) / 1e6;
+
+    long long* firstByte = malloc((samples ? samples : 1) * sizeof(long long));
+    long long* total = malloc((samples ? samples : 1) * sizeof(long long));
+    long long n = 0;
+    for (int i = 0; i < httpBenchClients && firstByte && total; i++) {
+        if (clients[i].samples == 0) continue;
+        memcpy(firstByte + n, clients[i].firstByteMicros, clients[i].samples * sizeof(long long));
+        memcpy(total + n, clients[i].totalMicros, clients[i].samples * sizeof(long long));
+        n += clients[i].samples;
+    }
+    if (firstByte && total) {
+        qsort(firstByte, n, sizeof(long long), httpBenchCompare);
+        qsort(total, n, sizeof(long long), httpBenchCompare);
+    }
+    printf("HTTP bench: %ld requests in %.1f s  %.0f req/s  %.1f MB/s  errors %ld\n", requests, seconds,
+           requests / seconds, bytes / seconds / (1024.0 * 1024.0), errors);
+    if (firstByte && total) {
+        printf("  first byte  p50 %.2f ms  p99 %.2f ms  p99.9 %.2f ms  max %.2f ms\n", httpBenchPercentile(firstByte, n, 0.50),
+               httpBenchPercentile(firstByte, n, 0.99), httpBenchPercentile(firstByte, n, 0.999), httpBenchPercentile(firstByte, n, 1.0));
+        printf("  response    p50 %.2f ms  p99 %.2f ms  p99.9 %.2f ms  max %.2f ms\n", httpBenchPercentile(total, n, 0.50),
+               httpBenchPercentile(total, n, 0.99), httpBenchPercentile(total, n, 0.999), httpBenchPercentile(total, n, 1.0));
+    }
+    free(firstByte);
+    free(total);
+    for (int i = 0; i < httpBenchClients; i++) {
+        free(clients[i].firstByteMicros);
+        free(clients[i].totalMicros);
+    }
+    for (int i = 0; i < urlCount; i++) free(urls[i]);
+    free(urls);
+    free(clients);
+    free(threads);
+    stopHttpServer();
+    return errors > 0 ? 1 : 0;
+}
+
+// -------------------------- Memory Accounting --------------------------
+// Bytes held by each part of the player, for the F3 view and --memory-bench, next to what
+// the OS reports for the process. Counts come from the structures themselves (block and
+// capacity sizes), so they include slack but not allocator headers; SFML objects are
+// estimated. The biggest single items are whole decoded tracks (players, the PCM cache and
+// analysis workers), so those are also listed on their own. --low-memory caps the big items:
+// with no decoded-track cache the main player streams tracks while the EQ is flat and arms
+// nothing ahead, background analysis is off, and read-ahead rings, worker threads, the cover
+// art atlas, button images and off-screen UI objects are smaller.
+#define LOW_MEMORY_PCM_CACHE_MB 0 // Nothing is kept decoded beyond what plays
+#define LOW_MEMORY_PREFETCH_WINDOW (256 * 1024)
+#define LOW_MEMORY_WORKERS 1 // Each analysis or conversion thread holds a whole decoded track
+#define MAX_UI_TEXTURES 16
+#define MUSIC_BUFFER_SECONDS 4 // sfMusic decodes a second at a time and keeps three such buffers queued
+
+typedef struct MemoryReport {
+    size_t library; // Songs and their strings, path indexes, library table, fingerprint index
+    size_t playlists; // Playlists, queue and recent stack nodes
+    size_t ui; // Layouts and the text objects on them
+    size_t textures; // Button and background images, font pages, cover art atlas
+    size_t audio; // Decoded tracks, read-ahead buffers, players, resampler tables
+    size_t audioDecoded; // Whole decoded tracks within 'audio' (PCM cache and what plays)
+    size_t background; // Queues and caches of the analysis, conversion, art and HTTP threads
+    size_t backgroundDecoded; // Tracks the analysis workers hold decoded, within 'background'
+    size_t workingSet; // From the OS
+    size_t peakWorkingSet;
+    size_t privateBytes;
+} MemoryReport;
+
+// Images loaded for buttons and the background, with the size of the file they came from
+typedef struct UiTexture {
+    sfTexture* texture;
+    unsigned int sourceWidth, sourceHeight;
+} UiTexture;
+
+UiTexture uiTextures[MAX_UI_TEXTURES];
+int uiTextureCount = 0;
+const unsigned int uiFontSizes[] = { 12, 16, 18, 20, 24, 28, 30 }; // Character sizes the screens use
+
+// Box filter over premultiplied alpha, so transparent edges do not darken
+sfImage* shrinkImage(const sfImage* image, unsigned int width, unsigned int height) {
+    sfVector2u size = sfImage_getSize(image);
+    const sfUint8* src = sfImage_getPixelsPtr(image);
+    sfUint8* pixels = (sfUint8*)malloc((size_t)width * height * 4);
+    if (!src || !pixels) {
+        free(pixels);
+        return NULL;
+    }
+    for (unsigned int y = 0; y < height; y++) {
+        unsigned int y0 = (unsigned int)((unsigned long long)y * size.y / height);
+        unsigned int y1 = (unsigned int)((unsigned long long)(y + 1) * size.y / height);
+        if (y1 <= y0) y1 = y0 + 1;
+        for (unsigned int x = 0; x < width; x++) {
+            unsigned int x0 = (unsigned int)((unsigned long long)x * size.x / width);
+            unsigned int x1 = (unsigned int)((unsigned long long)(x + 1) * size.x / width);
+            if (x1 <= x0) x1 = x0 + 1;
+            unsigned long long r = 0, g = 0, b = 0, a = 0, count = 0;
+            for (unsigned int sy = y0; sy < y1; sy++) {
+                const sfUint8* p = src + ((size_t)sy * size.x + x0) * 4;
+                for (unsigned int sx = x0; sx < x1; sx++, p += 4) {
+                    r += p[0] * p[3];
+                    g += p[1] * p[3];
+                    b += p[2] * p[3];
+                    a += p[3];
+                    count++;
                 }
-                if (currentListPtr) currentListPtr = currentListPtr->next;
             }
+            sfUint8* out = pixels + ((size_t)y * width + x) * 4;
+            out[0] = a ? (sfUint8)(r / a) : 0;
+            out[1] = a ? (sfUint8)(g / a) : 0;
+            out[2] = a ? (sfUint8)(b / a) : 0;
+            out[3] = (sfUint8)(a / count);
+        }
+    }
+    sfImage* small = sfImage_createFromPixels(width, height, pixels);
+    free(pixels);
+    return small;
+}
 
-            // Click on PLAY SELECTED button
-            if (playSelectedBtn_s) {
-                sfFloatRect playSelectedBtnBounds = sfText_getGlobalBounds(playSelectedBtn_s);
-                if (sfFloatRect_contains(&playSelectedBtnBounds, (float)mouse.x, (float)mouse.y)) {
-                    if (selectedPlaylist_s && selectedPlaylist_s->front) {
-                        // Cleanup previous currentPlaylist if exists (to avoid memory leaks if switching playlists)
-                        if (currentPlaylist) {
-                            PlaylistNode* node = currentPlaylist->front;
-                            while(node){
-                                PlaylistNode* next = node->next;
-                                free(node);
-                                node = next;
-                            }
-                            free(currentPlaylist);
-                            currentPlaylist = NULL;
-                        }
+// Loads a button or background image drawn at 'scale' of its size (0: stretched over the
+// window). In low-memory mode the pixels are first shrunk to what is shown, so the texture
+// holds no more than the screen needs; uiTextureScale() gives the sprite scale either way.
+sfTexture* loadUiTexture(const char* path, float scale) {
+    sfImage* image = sfImage_createFromFile(path);
+    if (!image) return NULL;
+    sfVector2u size = sfImage_getSize(image);
+    unsigned int width = size.x, height = size.y;
+    if (lowMemoryMode) {
+        width = scale > 0 ? (unsigned int)ceilf(size.x * scale) : (unsigned int)layoutWidth;
+        height = scale > 0 ? (unsigned int)ceilf(size.y * scale) : (unsigned int)layoutHeight;
+        if (width < 1) width = 1;
+        if (height < 1) height = 1;
+        if (width > size.x) width = size.x;
+        if (height > size.y) height = size.y;
+    }
+    sfTexture* texture = NULL;
+    if (width < size.x || height < size.y) {
+        sfImage* small = shrinkImage(image, width, height);
+        if (small) {
+            texture = sfTexture_createFromImage(small, NULL);
+            sfImage_destroy(small);
+        }
+    }
+    if (!texture) texture = sfTexture_createFromImage(image, NULL);
+    sfImage_destroy(image);
+    if (texture && uiTextureCount < MAX_UI_TEXTURES) {
+        uiTextures[uiTextureCount++] = (UiTexture){ texture, size.x, size.y };
+    }
+    return texture;
+}
 
-                        // Create a new temporary playlist (copy) to be the current playing queue
-                        currentPlaylist = createTemporaryPlaylist(selectedPlaylist_s->name);
-                        PlaylistNode* tempNode = selectedPlaylist_s->front;
-                        while(tempNode){
-                            enqueueSong(currentPlaylist, tempNode->song);
-                            tempNode = tempNode->next;
-                        }
+// Sprite scale that shows 'texture' at 'scale' of its original image size
+sfVector2f uiTextureScale(const sfTexture* texture, float scale) {
+    sfVector2u size = sfTexture_getSize(texture);
+    for (int i = 0; i < uiTextureCount; i++) {
+        if (uiTextures[i].texture == texture && size.x > 0 && size.y > 0) {
+            return (sfVector2f){ scale * uiTextures[i].sourceWidth / size.x, scale * uiTextures[i].sourceHeight / size.y };
+        }
+    }
+    return (sfVector2f){ scale, scale };
+}
 
-                        current = dequeueSong(currentPlaylist); // Get first song from the copy
-                        if (current) {
-                            playNewSong(globalSongLabel, globalFont, globalPlaySprite, pauseTexture, playTexture);
-                        } else {
-                            printf("Selected playlist is empty after copying.\n");
-                            currentPlaylist = NULL; // No songs, clear playlist
-                        }
-                        refreshQueueDisplay(globalFont, currentPlaylist); // Refresh main queue display
+size_t songIndexBytes(const SongIndex* index) {
+    return index->capacity * sizeof(SongIndexSlot);
+}
 
-                        uiInitialized = false;
-                        currentAppState = MAIN_PLAYER;
-                        mouseWasPressed = true; // Mark as processed
-                        return true;
-                    } else {
-                        printf("No playlist selected or selected playlist is empty.\n");
-                    }
-                }
-            }
+size_t textureBytes(const sfTexture* texture) {
+    if (!texture) return 0;
+    sfVector2u size = sfTexture_getSize(texture);
+    return (size_t)size.x * size.y * 4;
+}
 
-            // Click on CANCEL button
-            if (cancelSelectBtn_s) {
-                sfFloatRect cancelBtnBounds = sfText_getGlobalBounds(cancelSelectBtn_s);
-                if (sfFloatRect_contains(&cancelBtnBounds, (float)mouse.x, (float)mouse.y)) {
-                    printf("Playlist selection canceled.\n");
-                    uiInitialized = false;
-                    currentAppState = MAIN_PLAYER;
-                    mouseWasPressed = true; // Mark as processed
-                    return true;
-                }
-            }
+void collectMemoryReport(MemoryReport* report) {
+    memset(report, 0, sizeof(*report));
+    report->library = poolBytes(&songPool) + stringPoolBytes(&songStrings) + songIndexBytes(&songPathIndex) +
+                      songIndexBytes(&songNameIndex) + libraryTableBytes(&libraryTable) +
+                      (size_t)fingerprintIndex.capacity * (sizeof(FingerprintIndexEntry) + FINGERPRINT_SEGMENTS * sizeof(int));
+    report->playlists = poolBytes(&playlistPool) + poolBytes(&playlistNodePool) + poolBytes(&stackNodePool);
+    report->ui = layoutBytes(&mainLayout) + layoutBytes(&createLayout) + layoutBytes(&selectLayout);
+
+    for (int i = 0; i < uiTextureCount; i++) report->textures += textureBytes(uiTextures[i].texture);
+    if (globalFont) {
+        for (size_t i = 0; i < sizeof(uiFontSizes) / sizeof(uiFontSizes[0]); i++) {
+            report->textures += textureBytes(sfFont_getTexture(globalFont, uiFontSizes[i]));
         }
-    } else if (event->type == sfEvtMouseButtonReleased) {
-        mouseWasPressed = false; // Reset flag when mouse button is released
     }
+    report->textures += textureBytes(coverArt.atlas);
 
+    if (pcmCache.lock) {
+        sfMutex_lock(pcmCache.lock);
+        report->audioDecoded = pcmCache.usedBytes;
+        report->audio += pcmCache.usedBytes + (size_t)pcmCache.entryCount * sizeof(PcmCacheEntry);
+        sfMutex_unlock(pcmCache.lock);
+    }
+    if (player.music) report->audio += (size_t)MUSIC_BUFFER_SECONDS * player.sampleRate * player.channels * sizeof(sfInt16);
+    report->audio += (size_t)ioStats.ringBytes + (hintThread ? READAHEAD_CHUNK : 0);
+    report->audio += sizeof(Player) + (size_t)zoneCount * sizeof(Zone);
+    report->audio += resampleTableBytes();
+
+    if (fingerprinter.lock) {
+        sfMutex_lock(fingerprinter.lock);
+        report->background += (size_t)fingerprinter.jobCapacity * MAX_PATH_LENGTH +
+                              (size_t)(fingerprinter.resultCapacity + fingerprinter.spareCapacity + fingerprinter.cacheCapacity) * sizeof(FingerprintResult) +
+                              (size_t)fingerprinter.slotCapacity * sizeof(int);
+        sfMutex_unlock(fingerprinter.lock);
+    }
+    report->backgroundDecoded = (size_t)fingerprinter.decodedBytes;
+    report->background += report->backgroundDecoded;
+    if (transcoder.lock) {
+        sfMutex_lock(transcoder.lock);
+        report->background += (size_t)transcoder.jobCapacity * sizeof(TranscodeJob);
+        sfMutex_unlock(transcoder.lock);
+    }
+    report->background += (size_t)transcoder.manifestCapacity * sizeof(TranscodeEntry);
+    if (coverArt.lock) {
+        sfMutex_lock(coverArt.lock);
+        report->background += (size_t)coverArt.jobCapacity * MAX_PATH_LENGTH + (size_t)coverArt.resultCapacity * sizeof(ArtResult) +
+                              (size_t)coverArt.resultCount * (ART_IMAGE_BYTES / 3 * 4);
+        sfMutex_unlock(coverArt.lock);
+        report->background += (size_t)coverArt.entryCapacity * sizeof(ArtEntry) + (size_t)coverArt.entrySlotCapacity * sizeof(int);
+    }
+    if (httpServer.running) {
+        report->background += poolBytes(&httpConnectionPool);
+        sfMutex_lock(httpServer.lock);
+        const HttpCatalog* catalog = httpServer.catalog;
+        if (catalog) {
+            report->background += catalog->index.capacity + catalog->libraryM3u.capacity + catalog->libraryJson.capacity;
+            for (int i = 0; i < catalog->playlistCount; i++) report->background += catalog->playlistM3u[i].capacity;
+            for (int i = 0; i < catalog->fileCount; i++) report->background += strlen(catalog->files[i]) + 1 + sizeof(char*);
+        }
+        sfMutex_unlock(httpServer.lock);
+    }
 
-    sfRenderWindow_drawText(window, selectPlTitle_s, NULL);
-    for(int i = 0; i < MAX_VISIBLE_LIST_ITEMS; ++i) {
-        if(playlistRect_s[i]) sfRenderWindow_drawRectangleShape(window, playlistRect_s[i], NULL); // Draw rectangle first
-        if(playlistText_s[i]) sfRenderWindow_drawText(window, playlistText_s[i], NULL); // Then draw text
+    PROCESS_MEMORY_COUNTERS_EX counters;
+    memset(&counters, 0, sizeof(counters));
+    counters.cb = sizeof(counters);
+    if (GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters))) {
+        report->workingSet = counters.WorkingSetSize;
+        report->peakWorkingSet = counters.PeakWorkingSetSize;
+        report->privateBytes = counters.PrivateUsage;
     }
-    sfRenderWindow_drawText(window, playSelectedBtn_s, NULL);
-    sfRenderWindow_drawText(window, cancelSelectBtn_s, NULL);
+}
 
-    return false;
+double megabytes(size_t bytes) {
+    return bytes / (1024.0 * 1024.0);
 }
 
-// -------------------------- Directory Scanning (Windows Specific) --------------------------
-void loadSongsFromDirectory(Song** allSongsList, const char* directoryPath) {
-    WIN32_FIND_DATAA findFileData;
-    HANDLE hFind;
-    char searchPath[MAX_PATH_LENGTH];
-    char fullFilePath[MAX_PATH_LENGTH];
+// Two lines for the F3 view
+int formatMemoryReport(const MemoryReport* report, char* buffer, size_t size) {
+    int written = snprintf(buffer, size,
+                           "Memory        working set %.1f MB (peak %.1f)  private %.1f MB  low-memory %s\n"
+                           "              library %.2f  playlists %.2f  UI %.2f  textures %.2f  audio %.2f (%.2f decoded)  background %.2f (%.2f decoded) MB\n",
+                           megabytes(report->workingSet), megabytes(report->peakWorkingSet), megabytes(report->privateBytes),
+                           lowMemoryMode ? "on" : "off", megabytes(report->library), megabytes(report->playlists),
+                           megabytes(report->ui), megabytes(report->textures), megabytes(report->audio), megabytes(report->audioDecoded),
+                           megabytes(report->background), megabytes(report->backgroundDecoded));
+    return (written < 0) ? 0 : ((size_t)written >= size ? (int)size - 1 : written);
+}
 
-    snprintf(searchPath, sizeof(searchPath), "%s\\*.ogg", directoryPath);
+// Synthetic library of 'count' tracks and ten playlists: what loading it costs (--memory-bench)
+void runMemoryBenchmark(int count) {
+    MemoryReport before, after;
+    collectMemoryReport(&before);
+    long long start = perfMicros();
+    Song* last = allSongsList;
+    while (last && last->next) last = last->next;
+    unsigned int seed = 12345;
+    for (int i = 0; i < count; i++) {
+        seed = seed * 1103515245u + 12345u;
+        char name[MAX_SONG_NAME_LENGTH], path[MAX_PATH_LENGTH];
+        snprintf(name, sizeof(name), "Track %08x.ogg", seed * 2654435761u);
+        snprintf(path, sizeof(path), "music\\Artist %u\\Album %u\\%s", (seed >> 8) % (count / 40 + 1), (seed >> 4) % 12, name);
+        addSong(last ? &last : &allSongsList, name, path);
+        last = last ? last->next : allSongsList;
+        if (!last) return;
+    }
+    songIndexRebuild(allSongsList);
+    libraryTableRebuild(&libraryTable, allSongsList);
+    for (int p = 0; p < 10; p++) {
+        char name[32];
+        snprintf(name, sizeof(name), "Bench %d", p + 1);
+        Playlist* pl = createPlaylist(name);
+        int n = 0;
+        for (Song* song = allSongsList; pl && song && n < 100 * (p + 1); song = song->next, n++) {
+            if (n % (p + 1) == 0) enqueueSong(pl, song);
+        }
+    }
+    long long micros = perfMicros() - start;
+    collectMemoryReport(&after);
+
+    size_t strings = songStrings.liveBytes;
+    size_t fixedFields = (size_t)count * (MAX_SONG_NAME_LENGTH + MAX_PATH_LENGTH - 2 * sizeof(char*));
+    printf("Memory bench: %d tracks, 10 playlists loaded in %.1f ms%s\n", count, micros / 1000.0, lowMemoryMode ? " (low-memory mode)" : "");
+    printf("  library     %8.2f MB  (songs %.2f, names and paths %.2f, indexes %.2f, table %.2f)\n",
+           megabytes(after.library), megabytes(poolBytes(&songPool)), megabytes(stringPoolBytes(&songStrings)),
+           megabytes(songIndexBytes(&songPathIndex) + songIndexBytes(&songNameIndex)), megabytes(libraryTableBytes(&libraryTable)));
+    printf("  playlists   %8.2f MB\n", megabytes(after.playlists));
+    printf("  names and paths use %zu bytes per track; fixed %d + %d byte fields would add %.2f MB\n",
+           strings / count, MAX_SONG_NAME_LENGTH, MAX_PATH_LENGTH, fixedFields > strings ? megabytes(fixedFields - strings) : 0.0);
+    printf("  working set %+8.2f MB  (%.0f bytes per track), private %+.2f MB\n",
+           megabytes(after.workingSet) - megabytes(before.workingSet), ((double)after.workingSet - before.workingSet) / count,
+           megabytes(after.privateBytes) - megabytes(before.privateBytes));
+}
 
-    printf("Scanning directory: %s for .ogg files...\n", searchPath);
+// -------------------------- Debug Stats View --------------------------
+// Toggled with F3 on the main player screen; shows allocator counters so that
+// steady-state playback can be checked for heap activity
+bool debugStatsVisible = false;
+sfText* debugStatsText = NULL;
+
+void refreshDebugStatsDisplay(void) {
+    if (!debugStatsText) return;
+    char stats[8192];
+    int len = snprintf(stats, sizeof(stats), "[F3] Allocator stats\n");
+    len += formatPoolStats(&songPool, stats + len, sizeof(stats) - len);
+    len += formatStringPoolStats(&songStrings, stats + len, sizeof(stats) - len);
+    len += formatPoolStats(&playlistPool, stats + len, sizeof(stats) - len);
+    len += formatPoolStats(&playlistNodePool, stats + len, sizeof(stats) - len);
+    len += formatPoolStats(&stackNodePool, stats + len, sizeof(stats) - len);
+    if (httpServer.running) len += formatPoolStats(&httpConnectionPool, stats + len, sizeof(stats) - len);
+    MemoryReport memory;
+    collectMemoryReport(&memory);
+    len += formatMemoryReport(&memory, stats + len, sizeof(stats) - len);
+    len += snprintf(stats + len, sizeof(stats) - len,
+                    "Track I/O     read %lld KB  fetched %lld KB  playback stalls %ld (%.1f ms)  decode waits %ld (%.1f ms)  hints %ld\n",
+                    (long long)ioStats.bytesRead / 1024, (long long)ioStats.bytesFetched / 1024,
+                    (long)ioStats.stallEvents, ioStats.stallMicros / 1000.0, (long)ioStats.decodeWaits,
+                    ioStats.decodeWaitMicros / 1000.0, (long)ioStats.hintsIssued);
+    LONG lookups = pcmCache.hits + pcmCache.misses;
+    len += snprintf(stats + len, sizeof(stats) - len,
+                    "PCM cache     %d tracks  %zu/%zu MB  hit rate %.0f%% (%ld/%ld)  evictions %ld  prefetched %ld\n",
+                    pcmCache.entryCount, pcmCache.usedBytes >> 20, pcmCache.budgetBytes >> 20,
+                    lookups ? 100.0 * pcmCache.hits / lookups : 0.0, (long)pcmCache.hits, (long)lookups,
+                    (long)pcmCache.evictions, (long)pcmCache.prefetched);
+    len += snprintf(stats + len, sizeof(stats) - len, "Library watch %d roots  batches %ld  changes %ld  rescans %ld\n",
+                    libraryWatcher.rootCount, libraryWatcher.batchesApplied, libraryWatcher.changesApplied, libraryWatcher.rescans);
+    len += snprintf(stats + len, sizeof(stats) - len, "Library table %d rows (%d dead)  strings %u/%u/%u  full sorts %ld  patches %ld  last %s %.2f ms\n",
+                    libraryTable.rows, libraryTable.deadRows, libraryTable.titles.count, libraryTable.artists.count,
+                    libraryTable.albums.count, libraryTable.fullSorts, libraryTable.patches,
+                    librarySortNames[libraryTable.lastSortKey], libraryTable.lastSortMicros / 1000.0);
+    if (transcoder.lock) {
+        sfMutex_lock(transcoder.lock);
+        len += snprintf(stats + len, sizeof(stats) - len, "Transcode     %d/%d jobs  converted %ld  cached %ld  failed %ld  cancelled %ld  workers %d\n",
+                        transcoder.finished, transcoder.jobCount, transcoder.converted, transcoder.cached,
+                        transcoder.failed, transcoder.cancelled, transcoder.workerCount);
+        sfMutex_unlock(transcoder.lock);
+    }
+    if (fingerprinter.lock) {
+        sfMutex_lock(fingerprinter.lock);
+        len += snprintf(stats + len, sizeof(stats) - len, "Fingerprints  %d/%d queued  analysed %ld  cache hits %ld  failed %ld  duplicates %ld  workers %d\n",
+                        fingerprinter.nextJob, fingerprinter.jobCount, fingerprinter.analysed, fingerprinter.cacheHits,
+                        fingerprinter.failed, fingerprintIndex.duplicates, fingerprinter.workerCount);
+        sfMutex_unlock(fingerprinter.lock);
+    }
+    if (coverArt.lock) {
+        sfMutex_lock(coverArt.lock);
+        len += snprintf(stats + len, sizeof(stats) - len, "Cover art     %d tracks  decoded %ld  cache hits %ld  none %ld  failed %ld  uploads %ld  evictions %ld  pack %ld KB\n",
+                        coverArt.entryCount, coverArt.decoded, coverArt.cacheHits, coverArt.noArt, coverArt.failed,
+                        coverArt.uploads, coverArt.evictions, coverArt.cacheEnd / 1024);
+        sfMutex_unlock(coverArt.lock);
+    }
+    len += snprintf(stats + len, sizeof(stats) - len, "Auto-DJ       %s  indexed %d  picks %ld (avg %.0f us)\n",
+                    autoDjEnabled ? "on" : "off", autoDjIndexed, autoDjPicks,
+                    autoDjPicks ? (double)autoDjPickMicros / autoDjPicks : 0.0);
+    if (sharedLibrary.role != SHARED_LIBRARY_OFF) {
+        len += snprintf(stats + len, sizeof(stats) - len, "Shared lib    %s v%llu  published %ld  applied %ld  attach %lld us\n",
+                        sharedLibrary.role == SHARED_LIBRARY_PUBLISHER ? "publisher" : "attached", sharedLibrary.version,
+                        sharedLibrary.published, sharedLibrary.applied, sharedLibrary.attachMicros);
+    }
+    for (int i = 0; i < zoneCount; i++) {
+        const Zone* zone = &zones[i];
+        len += snprintf(stats + len, sizeof(stats) - len, "Zone %-2d       %-20.20s -> %-8.8s vol %3ld  tracks %ld  underruns %ld  late %.1f ms\n",
+                        i + 1, zone->current ? zone->current->name : "-", zoneSinkName(zone), (long)zone->volume,
+                        (long)zone->player.switches, (long)zone->underruns, zone->worstLateMicros / 1000.0);
+    }
+    if (httpServer.running) {
+        len += snprintf(stats + len, sizeof(stats) - len, "HTTP          port %u  connections %ld  requests %ld  sent %lld MB  errors %ld\n",
+                        httpServer.boundPort, (long)httpServer.openConnections, (long)httpServer.requests,
+                        (long long)httpServer.bytesSent >> 20, (long)httpServer.errors);
+    }
+    if (inputQueue.measured > 0) {
+        len += snprintf(stats + len, sizeof(stats) - len, "Input         events %ld  latency avg %.1f ms  p50 <%d ms  p99 <%d ms  worst %.1f ms\n",
+                        inputQueue.dispatched, inputQueue.totalMicros / 1000.0 / inputQueue.measured,
+                        inputLatencyPercentile(&inputQueue, 0.50), inputLatencyPercentile(&inputQueue, 0.99),
+                        inputQueue.worstMicros / 1000.0);
+    }
+    if (player.clock.readings > 0) len += formatClockStats(&player.clock, stats + len, sizeof(stats) - len);
+    len += snprintf(stats + len, sizeof(stats) - len, "DSP           load %.2f%%  bands %d  %u Hz\n",
+                    dspLoadPercent(&player.dsp), player.dsp.activeBands, player.dsp.sampleRate);
+    if (player.resampler.table) {
+        len += snprintf(stats + len, sizeof(stats) - len, "Resampler     %u -> %u Hz  %s (%d taps, %d phases)\n",
+                        player.sampleRate, player.outputRate, resampleTiers[player.resampler.table->quality].name,
+                        player.resampler.table->taps, player.resampler.table->phases);
+    }
+    sfText_setString(debugStatsText, stats);
+}
 
-    hFind = FindFirstFileA(searchPath, &findFileData);
-    if (hFind == INVALID_HANDLE_VALUE) {
-        printf("Error opening directory or no .ogg files found: %s (Error Code: %lu)\n", directoryPath, GetLastError());
-        return;
+// -------------------------- Offline Render --------------------------
+// --render=OUT.wav (or --render=null) plays the selected playlist, or the whole library, through
+// the same decode -> DSP -> next track path as the main player, but as fast as the CPU allows and
+// without opening a window or an audio device. Every track starts from a fresh DSP state, so the
+// same inputs and options always give the same bytes; the hash printed at the end makes two
+// renders easy to compare.
+const char* renderOutputPath = NULL; // NULL = normal interactive mode
+const char* renderPlaylistName = NULL; // NULL = every song in the library
+
+// The real-time factor covers the render loop (resampling, DSP and writing) only; decoding,
+// including any wait for the background look-ahead, is reported on its own.
+int runOfflineRender(void) {
+    RenderSink sink = {0};
+    sink.hash = 14695981039346656037ull;
+    bool nullSink = strcmp(renderOutputPath, "null") == 0;
+    bool ready = true;
+
+    // Walk either a playlist's queue or the library list, in play order
+    PlaylistNode* node = NULL;
+    Song* song = allSongsList;
+    if (renderPlaylistName) {
+        Playlist* pl = playlists;
+        while (pl && strcmp(pl->name, renderPlaylistName) != 0) pl = pl->next;
+        if (!pl) {
+            fprintf(stderr, "No playlist named '%s' to render.\n", renderPlaylistName);
+            ready = false;
+        }
+        node = pl ? pl->front : NULL;
+        song = node ? node->song : NULL;
     }
 
-    do {
-        if (strcmp(findFileData.cFileName, ".") == 0 || strcmp(findFileData.cFileName, "..") == 0) {
-            continue;
+    if (ready && !nullSink) {
+        sink.fp = fopen(renderOutputPath, "wb");
+        if (!sink.fp) {
+            fprintf(stderr, "Could not open render output: %s\n", renderOutputPath);
+            ready = false;
+        }
+    }
+    if (ready) printf("Rendering %s to %s\n", renderPlaylistName ? renderPlaylistName : "the library", nullSink ? "the null sink" : renderOutputPath);
+
+    int index = 0, rendered = 0, skipped = 0;
+    double totalAudioSeconds = 0.0, totalWallSeconds = 0.0, totalDecodeSeconds = 0.0;
+    bool writeFailed = false;
+    while (ready && song && !writeFailed) {
+        Song* next;
+        if (renderPlaylistName) {
+            node = node->next;
+            next = node ? node->song : NULL;
+        } else {
+            next = song->next;
+        }
+        index++;
+
+        long long decodeStart = perfMicros();
+        bool loaded = playerLoad(&player, song->path);
+        long long decodeMicros = perfMicros() - decodeStart;
+        totalDecodeSeconds += decodeMicros / 1000000.0;
+        prefetchUpcomingTrack(next); // Same look-ahead as playNewSong()
+
+        if (!loaded) {
+            printf("[%3d] %-40.40s skipped, could not decode\n", index, song->name);
+            skipped++;
+        } else if (sink.channels != 0 && (player.channels != sink.channels || player.outputRate != sink.sampleRate)) {
+            printf("[%3d] %-40.40s skipped, %u ch %u Hz does not match the output (%u ch %u Hz)\n",
+                   index, song->name, player.channels, player.outputRate, sink.channels, sink.sampleRate);
+            skipped++;
+        } else {
+            if (sink.channels == 0) {
+                sink.channels = player.channels;
+                sink.sampleRate = player.outputRate;
+                if (sink.fp && !writeWavHeader(&sink)) writeFailed = true;
+            }
+            LONG64 dspMicrosBefore = player.dsp.processMicros;
+            long long start = perfMicros();
+            sfSoundStreamChunk chunk;
+            while (!writeFailed && playerGetData(&chunk, &player)) {
+                if (!renderSinkWrite(&sink, chunk.samples, chunk.sampleCount)) writeFailed = true;
+            }
+            double wallSeconds = (perfMicros() - start) / 1000000.0;
+            double audioSeconds = (double)player.sampleCount / player.channels / player.sampleRate;
+            printf("[%3d] %-40.40s %7.1f s  decode %7.1f ms  dsp %6.1f ms  %8.1fx real time\n",
+                   index, song->name, audioSeconds, decodeMicros / 1000.0,
+                   (player.dsp.processMicros - dspMicrosBefore) / 1000.0,
+                   wallSeconds > 0.0 ? audioSeconds / wallSeconds : 0.0);
+            totalAudioSeconds += audioSeconds;
+            totalWallSeconds += wallSeconds;
+            rendered++;
         }
+        song = next;
+    }
+    playerUnload(&player);
 
-        if (!(findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
-            snprintf(fullFilePath, sizeof(fullFilePath), "%s\\%s", directoryPath, findFileData.cFileName);
-            addSong(allSongsList, findFileData.cFileName, fullFilePath);
-            printf("Found and added: %s\n", fullFilePath);
+    if (sink.fp) {
+        if (sink.channels == 0) { // Nothing rendered; still leave a valid (empty) file behind
+            sink.channels = 2;
+            sink.sampleRate = 44100;
         }
-    } while (FindNextFileA(hFind, &findFileData) != 0);
+        if (!writeFailed && !writeWavHeader(&sink)) writeFailed = true;
+        if (fclose(sink.fp) != 0) writeFailed = true;
+    }
+    if (writeFailed) fprintf(stderr, "Failed writing render output: %s\n", renderOutputPath);
+    if (!ready || writeFailed) return 1;
 
-    FindClose(hFind);
+    printf("Rendered %d tracks (%d skipped): %.1f s of audio in %.2f s, %.1fx real time (plus %.2f s decoding)\n",
+           rendered, skipped, totalAudioSeconds, totalWallSeconds,
+           totalWallSeconds > 0.0 ? totalAudioSeconds / totalWallSeconds : 0.0, totalDecodeSeconds);
+    printf("Output: %llu bytes, hash %016llx\n", (unsigned long long)sink.dataBytes, (unsigned long long)sink.hash);
+    return 0;
 }
 
-// -------------------------- Playlist Persistence --------------------------
+// -------------------------- Command Line --------------------------
+// Supported options:
+//   --source=file|mmap|readahead   How track files are read during playback
+//   --prefetch-kb=N                Read-ahead window / hint size in KB
+//   --pcm-cache-mb=N               Memory budget for decoded tracks (0 disables the cache)
+//   --import=FILE                  Import an M3U/M3U8/PLS/XSPF playlist at startup (repeatable)
+//   --export-dir=DIR               On exit, also write every playlist into DIR
+//   --export-format=m3u|pls|xspf   Format used by --export-dir (default m3u, written as .m3u8)
+//   --eq=g1,...,g10                Initial EQ band gains in dB (31 Hz .. 16 kHz)
+//   --preamp=dB                    Initial preamp gain
+//   --no-dsp                       Start with the DSP chain bypassed
+//   --render=OUT.wav|null          Render offline instead of opening the player window
+//   --render-playlist=NAME         Playlist rendered by --render (default: the whole library)
+//   --transcoder=PATH              ffmpeg compatible tool for formats SFML cannot decode
+//   --transcode-workers=N          Conversion threads (default: one per spare core)
+//   --output-rate=N                Rate every track is resampled to (0 = each track's own rate)
+//   --resample-quality=fast|medium|best
+//   --resample-bench               Print cost and accuracy of each resampler tier and exit
+//   --no-fingerprint               Skip the background analysis (duplicates, tempo, key)
+//   --analysis-workers=N           Analysis threads (default: one per spare core)
+//   --auto-dj                      Start with auto-DJ ordering on
+//   --no-shared-library            Neither publish nor attach to a shared library snapshot
+//   --zone=PLAYLIST|*              Add a playback zone playing PLAYLIST (or the library) on repeat
+//   --zone-out=device|null|FILE    Output of the last added zone (default: the audio device)
+//   --zone-volume=0..100           Volume of the last added zone
+//   --http-port=N                  Serve the library over HTTP on port N (0 = any free port)
+//   --http-bind=ADDR               Address the HTTP server listens on (default 127.0.0.1)
+//   --http-bench=N                 Load-test the HTTP server over loopback with N clients and exit
+//   --http-bench-seconds=N         Length of the --http-bench run (default 10)
+//   --library-bench=N              Time library sorts on N synthetic tracks and exit
+//   --no-cover-art                 Do not look for cover art
+//   --low-memory                   Small caches, buffers and textures, one worker per background task
+//   --memory-bench=N               Report the memory a synthetic library of N tracks takes and exit
+size_t pcmCacheBudgetMb = DEFAULT_PCM_CACHE_MB;
+#define MAX_IMPORT_FILES 8
+const char* importFiles[MAX_IMPORT_FILES];
+int importFileCount = 0;
+const char* exportDirectory = NULL;
+PlaylistFormat exportFormat = FORMAT_M3U;
+bool resampleBenchmark = false;
+int libraryBenchRows = 0;
+int memoryBenchRows = 0;
+
+void parseCommandLine(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strncmp(arg, "--source=", 9) == 0) {
+            const char* kind = arg + 9;
+            if (strcmp(kind, "file") == 0) trackSourceKind = SOURCE_FILE;
+            else if (strcmp(kind, "mmap") == 0) trackSourceKind = SOURCE_MMAP;
+            else if (strcmp(kind, "readahead") == 0) trackSourceKind = SOURCE_READAHEAD;
+            else printf("Unknown source kind '%s', keeping default.\n", kind);
+        } else if (strncmp(arg, "--prefetch-kb=", 14) == 0) {
+            long kb = strtol(arg + 14, NULL, 10);
+            if (kb >= 64) prefetchWindowBytes = (size_t)kb * 1024;
+            else printf("Prefetch window must be at least 64 KB, keeping %zu KB.\n", prefetchWindowBytes / 1024);
+        } else if (strncmp(arg, "--pcm-cache-mb=", 15) == 0) {
+            long mb = strtol(arg + 15, NULL, 10);
+            pcmCacheBudgetMb = mb < 0 ? 0 : (size_t)mb;
+        } else if (strncmp(arg, "--import=", 9) == 0) {
+            if (importFileCount < MAX_IMPORT_FILES) importFiles[importFileCount++] = arg + 9;
+            else printf("Too many --import options, ignoring %s\n", arg + 9);
+        } else if (strncmp(arg, "--export-dir=", 13) == 0) {
+            exportDirectory = arg + 13;
+        } else if (strncmp(arg, "--export-format=", 16) == 0) {
+            const char* format = arg + 16;
+            if (strcmp(format, "m3u") == 0 || strcmp(format, "m3u8") == 0) exportFormat = FORMAT_M3U;
+            else if (strcmp(format, "pls") == 0) exportFormat = FORMAT_PLS;
+            else if (strcmp(format, "xspf") == 0) exportFormat = FORMAT_XSPF;
+            else printf("Unknown export format '%s', keeping m3u.\n", format);
+        } else if (strncmp(arg, "--eq=", 5) == 0) {
+            parseEqGains(arg + 5, &player.dsp.params);
+        } else if (strncmp(arg, "--preamp=", 9) == 0) {
+            float preamp = strtof(arg + 9, NULL);
+            player.dsp.params.preampDb = preamp > EQ_MAX_GAIN_DB ? EQ_MAX_GAIN_DB : (preamp < -EQ_MAX_GAIN_DB ? -EQ_MAX_GAIN_DB : preamp);
+        } else if (strcmp(arg, "--no-dsp") == 0) {
+            player.dsp.params.enabled = false;
+        } else if (strncmp(arg, "--render=", 9) == 0) {
+            renderOutputPath = arg + 9;
+        } else if (strncmp(arg, "--render-playlist=", 18) == 0) {
+            renderPlaylistName = arg + 18;
+        } else if (strncmp(arg, "--transcoder=", 13) == 0) {
+            transcoderCommand = arg + 13;
+        } else if (strncmp(arg, "--transcode-workers=", 20) == 0) {
+            long workers = strtol(arg + 20, NULL, 10);
+            transcodeWorkerLimit = workers < 1 ? 1 : (workers > MAX_TRANSCODE_WORKERS ? MAX_TRANSCODE_WORKERS : (int)workers);
+        } else if (strncmp(arg, "--output-rate=", 14) == 0) {
+            long rate = strtol(arg + 14, NULL, 10);
+            if (rate == 0 || (rate >= 8000 && rate <= 192000)) outputSampleRate = (unsigned int)rate;
+            else printf("Output rate must be 0 or 8000..192000 Hz, keeping %u.\n", outputSampleRate);
+        } else if (strncmp(arg, "--resample-quality=", 19) == 0) {
+            const char* quality = arg + 19;
+            int q = 0;
+            while (q < RESAMPLE_QUALITY_COUNT && strcmp(quality, resampleTiers[q].name) != 0) q++;
+            if (q < RESAMPLE_QUALITY_COUNT) resampleQuality = (ResampleQuality)q;
+            else printf("Unknown resample quality '%s', keeping %s.\n", quality, resampleTiers[resampleQuality].name);
+        } else if (strcmp(arg, "--resample-bench") == 0) {
+            resampleBenchmark = true;
+        } else if (strcmp(arg, "--no-fingerprint") == 0) {
+            fingerprintingEnabled = false;
+        } else if (strncmp(arg, "--analysis-workers=", 19) == 0) {
+            long workers = strtol(arg + 19, NULL, 10);
+            analysisWorkerLimit = workers < 1 ? 1 : (workers > MAX_FINGERPRINT_WORKERS ? MAX_FINGERPRINT_WORKERS : (int)workers);
+        } else if (strcmp(arg, "--auto-dj") == 0) {
+            autoDjEnabled = true;
+        } else if (strcmp(arg, "--no-shared-library") == 0) {
+            sharedLibraryEnabled = false;
+        } else if (strncmp(arg, "--zone=", 7) == 0) {
+            addZone(arg + 7);
+        } else if (strncmp(arg, "--zone-out=", 11) == 0 && zoneCount > 0) {
+            const char* out = arg + 11;
+            Zone* zone = &zones[zoneCount - 1];
+            zone->sinkKind = strcmp(out, "device") == 0 ? ZONE_SINK_DEVICE : (strcmp(out, "null") == 0 ? ZONE_SINK_NULL : ZONE_SINK_FILE);
+            zone->sinkPath = out;
+        } else if (strncmp(arg, "--zone-volume=", 14) == 0 && zoneCount > 0) {
+            long volume = strtol(arg + 14, NULL, 10);
+            zones[zoneCount - 1].volume = volume < 0 ? 0 : (volume > 100 ? 100 : volume);
+        } else if (strncmp(arg, "--http-port=", 12) == 0) {
+            long port = strtol(arg + 12, NULL, 10);
+            if (port >= 0 && port <= 65535) httpPort = (int)port;
+            else printf("HTTP port must be 0..65535, server stays off.\n");
+        } else if (strncmp(arg, "--http-bind=", 12) == 0) {
+            httpBindAddress = arg + 12;
+        } else if (strncmp(arg, "--http-bench=", 13) == 0) {
+            long clients = strtol(arg + 13, NULL, 10);
+            httpBenchClients = clients < 1 ? 1 : (clients > HTTP_BENCH_MAX_CLIENTS ? HTTP_BENCH_MAX_CLIENTS : (int)clients);
+        } else if (strncmp(arg, "--http-bench-seconds=", 21) == 0) {
+            long seconds = strtol(arg + 21, NULL, 10);
+            httpBenchSeconds = seconds < 1 ? 1 : (int)seconds;
+        } else if (strcmp(arg, "--no-cover-art") == 0) {
+            coverArtEnabled = false;
+        } else if (strncmp(arg, "--library-bench=", 16) == 0) {
+            long rows = strtol(arg + 16, NULL, 10);
+            libraryBenchRows = rows < 1000 ? 1000 : (rows > 10000000 ? 10000000 : (int)rows);
+        } else if (strcmp(arg, "--low-memory") == 0) {
+            lowMemoryMode = true;
+        } else if (strncmp(arg, "--memory-bench=", 15) == 0) {
+            long rows = strtol(arg + 15, NULL, 10);
+            memoryBenchRows = rows < 1000 ? 1000 : (rows > 10000000 ? 10000000 : (int)rows);
+        } else {
+            printf("Ignoring unknown option: %s\n", arg);
+        }
+    }
+    if (lowMemoryMode) {
+        // Caps, so explicit smaller values still win
+        if (pcmCacheBudgetMb > LOW_MEMORY_PCM_CACHE_MB) pcmCacheBudgetMb = LOW_MEMORY_PCM_CACHE_MB;
+        if (prefetchWindowBytes > LOW_MEMORY_PREFETCH_WINDOW) prefetchWindowBytes = LOW_MEMORY_PREFETCH_WINDOW;
+        if (transcodeWorkerLimit == 0 || transcodeWorkerLimit > LOW_MEMORY_WORKERS) transcodeWorkerLimit = LOW_MEMORY_WORKERS;
+        if (analysisWorkerLimit == 0 || analysisWorkerLimit > LOW_MEMORY_WORKERS) analysisWorkerLimit = LOW_MEMORY_WORKERS;
+        fingerprintingEnabled = false; // Every analysed track is decoded whole
+    }
+}
 
-// Function to save all playlists to a file
-void savePlaylistsToFile(const char* filename, Playlist* allPlaylists) {
-    FILE* fp = fopen(filename, "w");
-    if (!fp) {
-        fprintf(stderr, "Error: Could not open playlist file for writing: %s\n", filename);
-        return;
+// -------------------------- Consistency Checks --------------------------
+// Structural invariants of the queues, the recent stack and the library. Each check returns a
+// description of the first broken invariant, or NULL. They walk whole structures, so the
+// player never calls them; the fuzz build below runs them after every operation.
+const char* checkPlaylistInvariants(const Playlist* pl) {
+    if (!pl) return NULL;
+    if (!pl->front != !pl->rear) return "front and rear disagree about an empty queue";
+    int count = 0;
+    const PlaylistNode* last = NULL;
+    for (const PlaylistNode* node = pl->front; node; node = node->next) {
+        if (++count > pl->length) return "more nodes than 'length' (or a cycle)";
+        if (!node->song) return "queued node without a song";
+        if (findSongByPath(node->song->path) == NULL) return "queued song is not in the library";
+        last = node;
     }
+    if (count != pl->length) return "'length' does not match the queued nodes";
+    if (last != pl->rear) return "'rear' is not the last node";
+    return NULL;
+}
 
-    Playlist* currentPl = allPlaylists;
-    while (currentPl) {
-        fprintf(fp, "#PLAYLIST_START:%s\n", currentPl->name);
-        PlaylistNode* currentNode = currentPl->front;
-        while (currentNode) {
-            fprintf(fp, "%s\n", currentNode->song->path); // Save full path
-            currentNode = currentNode->next;
-        }
-        fprintf(fp, "#PLAYLIST_END\n");
-        currentPl = currentPl->next;
+const char* checkRecentStackInvariants(void) {
+    int count = 0;
+    for (const StackNode* node = recentStack; node; node = node->next) {
+        if (++count > 5) return "recent stack holds more than 5 songs";
+        if (!node->song) return "recent entry without a song";
+        if (node->next && node->next->song == node->song) return "same song twice in a row on the recent stack";
+        if (findSongByPath(node->song->path) == NULL) return "recent song is not in the library";
     }
+    return NULL;
+}
 
-    fclose(fp);
-    printf("Playlists saved to %s\n", filename);
+const char* checkLibraryInvariants(void) {
+    size_t count = 0;
+    const Song* prev = NULL;
+    for (const Song* song = allSongsList; song; song = song->next) {
+        if (song->prev != prev) return "library 'prev' link does not match";
+        if ((long)++count > songPool.liveObjects) return "library is longer than the live songs (or has a cycle)";
+        if (songIndexFind(&songPathIndex, song->path) == NULL) return "song missing from the path index";
+        if (songIndexFind(&songNameIndex, song->path) == NULL) return "song missing from the file name index";
+        int row = song->libraryRow;
+        if (row < 0 || row >= libraryTable.rows || libraryTable.song[row] != song) return "song has no row in the library table";
+        prev = song;
+    }
+    if (songPathIndex.count != count || songNameIndex.count != count) return "index size does not match the library";
+    if ((size_t)(libraryTable.rows - libraryTable.deadRows) != count) return "library table has rows for removed songs";
+    if (current && findSongByPath(current->path) == NULL) return "'current' is not in the library";
+    return NULL;
 }
 
-// Helper to find a Song* by its path from the allSongsList
-Song* findSongByPath(const char* path) {
-    Song* temp = allSongsList; // Assuming allSongsList is globally accessible
-    while (temp) {
-        if (strcmp(temp->path, path) == 0) {
-            return temp;
-        }
-        temp = temp->next;
+// Every live pooled object must be reachable from the library, a queue or the recent stack
+const char* checkPoolAccounting(void) {
+    long songs = 0, lists = 0, nodes = 0, stackNodes = 0;
+    size_t stringBytes = 0;
+    for (const Song* song = allSongsList; song; song = song->next) {
+        songs++;
+        stringBytes += stringPoolSlotSize(strlen(song->name)) + stringPoolSlotSize(strlen(song->path)) +
+                       stringPoolSlotSize(strlen(song->key));
+    }
+    for (const Playlist* pl = playlists; pl; pl = pl->next, lists++) nodes += pl->length;
+    if (currentPlaylist) { lists++; nodes += currentPlaylist->length; }
+    for (int i = 0; i < zoneCount; i++) {
+        if (zones[i].queue) { lists++; nodes += zones[i].queue->length; }
     }
-    return NULL; // Song not found
+    for (const StackNode* node = recentStack; node; node = node->next) stackNodes++;
+    if (songs != songPool.liveObjects) return "live songs not in the library (leak) or freed songs still linked";
+    if (songStrings.liveStrings != 3 * songs || songStrings.liveBytes != stringBytes) return "song strings leaked or released twice";
+    if (lists != playlistPool.liveObjects) return "live playlists not reachable";
+    if (nodes != playlistNodePool.liveObjects) return "live queue nodes not reachable";
+    if (stackNodes != stackNodePool.liveObjects) return "live stack nodes not reachable";
+    return NULL;
 }
 
-// Function to load playlists from a file
-void loadPlaylistsFromFile(const char* filename, Playlist** allPlaylists) {
-    FILE* fp = fopen(filename, "r");
-    if (!fp) {
-        printf("No existing playlist file found: %s. Starting fresh.\n", filename);
-        return;
+const char* checkPlayerState(void) {
+    const char* problem = checkLibraryInvariants();
+    for (const Playlist* pl = playlists; pl && !problem; pl = pl->next) problem = checkPlaylistInvariants(pl);
+    if (!problem) problem = checkPlaylistInvariants(currentPlaylist);
+    if (!problem) problem = checkRecentStackInvariants();
+    if (!problem) problem = checkPoolAccounting();
+    return problem;
+}
+
+// -------------------------- Fuzzing --------------------------
+// Building with -DFUZZ_PLAYLIST_PARSER and clang's -fsanitize=fuzzer,address,undefined turns
+// this file into a libFuzzer target instead of the player (main() is left out). An input is
+// split at its first NUL byte. The text before it is parsed as playlists.txt, M3U, PLS or XSPF,
+// chosen by its first byte. The bytes after it drive a sequence of queue, stack and library
+// operations, with checkPlayerState() after each one. Everything is torn down at the end of
+// each input, so the pools' ASan poisoning also catches pointers kept across runs.
+#ifdef FUZZ_PLAYLIST_PARSER
+#define FUZZ_LIBRARY_SONGS 24
+
+void fuzzCheck(const char* step) {
+    const char* problem = checkPlayerState();
+    if (problem) {
+        fprintf(stderr, "Invariant broken after %s: %s\n", step, problem);
+        abort();
     }
+}
 
-    char line[MAX_PATH_LENGTH + 100]; // Buffer for reading lines
-    Playlist* currentLoadingPlaylist = NULL;
+// The parsers read FILE streams; hand them the input through a temporary file
+FILE* fuzzStream(const unsigned char* data, size_t size) {
+    FILE* fp = tmpfile();
+    if (!fp) return NULL;
+    if (size > 0 && fwrite(data, 1, size, fp) != size) {
+        fclose(fp);
+        return NULL;
+    }
+    rewind(fp);
+    return fp;
+}
 
-    while (fgets(line, sizeof(line), fp)) {
-        // Remove newline character if present
-        line[strcspn(line, "\n")] = 0;
+Song* fuzzPickSong(unsigned int pick) {
+    int count = 0;
+    for (Song* song = allSongsList; song; song = song->next) count++;
+    Song* song = allSongsList;
+    for (int i = count ? (int)(pick % count) : 0; song && i > 0; i--) song = song->next;
+    return song;
+}
 
-        if (strstr(line, "#PLAYLIST_START:") == line) { // Starts with #PLAYLIST_START:
-            char playlistName[MAX_PLAYLIST_NAME_LENGTH + 1];
-            sscanf(line, "#PLAYLIST_START:%[^\n]", playlistName); // Read name after prefix
-            currentLoadingPlaylist = createPlaylist(playlistName); // Creates and adds to global 'playlists' list
-            printf("Loading playlist: %s\n", playlistName);
-        } else if (strcmp(line, "#PLAYLIST_END") == 0) {
-            currentLoadingPlaylist = NULL; // End of current playlist
-        } else {
-            // This line is a song path
-            if (currentLoadingPlaylist) {
-                Song* foundSong = findSongByPath(line); // Find the Song* in your allSongsList
-                if (foundSong) {
-                    enqueueSong(currentLoadingPlaylist, foundSong);
-                    printf("  Added song: %s\n", foundSong->name);
-                } else {
-                    printf("  Warning: Song path not found in library, skipping: %s\n", line);
-                }
-            }
+Playlist* fuzzPickPlaylist(unsigned int pick) {
+    int count = 0;
+    for (Playlist* pl = playlists; pl; pl = pl->next) count++;
+    Playlist* pl = playlists;
+    for (int i = count ? (int)(pick % count) : 0; pl && i > 0; i--) pl = pl->next;
+    return pl;
+}
+
+// Property: a cached (possibly patched) order lists every live row once, in key order
+void fuzzCheckLibraryOrder(LibrarySortKey key) {
+    int count;
+    const int* rows = libraryTableOrder(&libraryTable, key, &count);
+    if (count != libraryTable.rows - libraryTable.deadRows) {
+        fprintf(stderr, "Library order by %s has %d rows\n", librarySortNames[key], count);
+        abort();
+    }
+    for (int i = 0; i < count; i++) {
+        if (!libraryTable.song[rows[i]] ||
+            (i > 0 && libraryRowKey(&libraryTable, key, rows[i - 1]) > libraryRowKey(&libraryTable, key, rows[i]))) {
+            fprintf(stderr, "Library order by %s is wrong at position %d\n", librarySortNames[key], i);
+            abort();
         }
     }
+}
+
+void fuzzFreePlaylists(void) {
+    while (playlists) {
+        Playlist* next = playlists->next;
+        destroyTemporaryPlaylist(playlists);
+        playlists = next;
+    }
+}
 
+// Property: saving and reloading gives the same playlists, in the same order, with the same songs
+void fuzzSaveLoadRoundTrip(void) {
+    FILE* fp = tmpfile();
+    if (!fp) return;
+    for (Playlist* pl = playlists; pl; pl = pl->next) {
+        fprintf(fp, "#PLAYLIST_START:%s\n", pl->name);
+        for (PlaylistNode* node = pl->front; node; node = node->next) fprintf(fp, "%s\n", node->song->path);
+        fprintf(fp, "#PLAYLIST_END\n");
+    }
+    rewind(fp);
+    Playlist* saved = playlists;
+    playlists = NULL;
+    loadPlaylistsFromStream(fp, "round trip", &playlists);
     fclose(fp);
-    printf("Playlists loaded from %s\n", filename);
+
+    Playlist* a = saved;
+    Playlist* b = playlists;
+    for (; a && b; a = a->next, b = b->next) {
+        if (strcmp(a->name, b->name) != 0 || a->length != b->length) break;
+        PlaylistNode* x = a->front;
+        PlaylistNode* y = b->front;
+        while (x && y && x->song == y->song) { x = x->next; y = y->next; }
+        if (x || y) break;
+    }
+    if (a || b) {
+        fprintf(stderr, "Playlists changed across a save / load round trip\n");
+        abort();
+    }
+    fuzzFreePlaylists();
+    playlists = saved;
 }
 
+int LLVMFuzzerTestOneInput(const unsigned char* data, size_t size) {
+    static bool quiet = false;
+    if (!quiet) { // The parsers report every playlist they load
+        freopen("NUL", "w", stdout);
+        quiet = true;
+    }
+    for (int i = 0; i < FUZZ_LIBRARY_SONGS; i++) {
+        char name[32], path[64];
+        snprintf(name, sizeof(name), "song%02d.ogg", i);
+        snprintf(path, sizeof(path), i % 3 ? "music\\%s" : "music\\album\\%s", name);
+        addLibrarySong(name, path);
+    }
+    current = allSongsList;
+
+    const unsigned char* text = data;
+    const unsigned char* split = (const unsigned char*)memchr(data, 0, size);
+    size_t textSize = split ? (size_t)(split - data) : size;
+    const unsigned char* ops = split ? split + 1 : data + size;
+    size_t opCount = split ? size - textSize - 1 : 0;
+
+    FILE* fp = fuzzStream(text, textSize);
+    if (fp) {
+        ImportReport report = {0};
+        Playlist* imported = textSize > 0 && text[0] != '#' ? createPlaylist("imported") : NULL;
+        if (!imported) {
+            loadPlaylistsFromStream(fp, "fuzz input", &playlists);
+        } else {
+            beginImportBatch(&importBatch, imported, &report, "music");
+            if (text[0] == '<') importXspf(fp, &importBatch);
+            else importLineFormat(fp, text[0] == '[' ? FORMAT_PLS : FORMAT_M3U, &importBatch);
+            flushImportBatch(&importBatch);
+        }
+        fclose(fp);
+    }
+    fuzzCheck("parsing");
+
+    int added = 0;
+    for (size_t i = 0; i + 1 < opCount; i += 2) {
+        unsigned int op = ops[i] % 15, arg = ops[i + 1];
+        Song* song = fuzzPickSong(arg);
+        Playlist* pl = fuzzPickPlaylist(arg >> 4);
+        char name[32], path[64];
+        switch (op) {
+            case 0: enqueueSong(pl, song); break;
+            case 1: dequeueSong(pl); break;
+            case 2: if (song) pushRecent(song); break;
+            case 3: popRecent(); break;
+            case 4: if (song) removeSongFromLibrary(song); break;
+            case 5:
+                snprintf(name, sizeof(name), "added%03d.ogg", added++);
+                snprintf(path, sizeof(path), "music\\new\\%s", name);
+                addLibrarySong(name, path);
+                break;
+            case 6:
+                snprintf(name, sizeof(name), "list %u", arg);
+                createPlaylist(name);
+                break;
+            case 7: // What the Select Playlist screen does when a playlist is played
+                destroyTemporaryPlaylist(currentPlaylist);
+                currentPlaylist = pl ? createTemporaryPlaylist(pl->name) : NULL;
+                for (PlaylistNode* node = pl ? pl->front : NULL; node; node = node->next) enqueueSong(currentPlaylist, node->song);
+                break;
+            case 8: current = dequeueSong(currentPlaylist); break;
+            case 9: releasePlaylistNodes(pl); break;
+            case 10:
+                if (!song) break;
+                snprintf(name, sizeof(name), "moved%03u.ogg", arg);
+                snprintf(path, sizeof(path), "music\\moved\\%s", name);
+                if (!findSongByPath(path)) relinkLibrarySong(song, name, path);
+                break;
+            case 11: fuzzSaveLoadRoundTrip(); break;
+            case 12: current = song; break;
+            case 13: // What playSong and the analysis pass do to a song
+                if (!song) break;
+                song->playCount += arg & 3;
+                song->durationMs = arg * 1000;
+                libraryTableRefresh(&libraryTable, song, false);
+                break;
+            case 14: fuzzCheckLibraryOrder((LibrarySortKey)(arg % SORT_KEY_COUNT)); break;
+        }
+        fuzzCheck("an operation");
+    }
+
+    // Tear down; nothing may stay live in the pools afterwards
+    fuzzFreePlaylists();
+    destroyTemporaryPlaylist(currentPlaylist);
+    currentPlaylist = NULL;
+    while (popRecent()) {}
+    while (allSongsList) removeSongFromLibrary(allSongsList);
+    current = NULL;
+    fuzzCheck("teardown");
+    songIndexClear(&songPathIndex);
+    songIndexClear(&songNameIndex);
+    libraryTableFree(&libraryTable);
+    return 0;
+}
+#endif
 
 // -------------------------- Main --------------------------
-int main() {
+#ifndef FUZZ_PLAYLIST_PARSER
+int main(int argc, char* argv[]) {
+    playerInit(&player);
+    parseCommandLine(argc, argv);
+    if (resampleBenchmark) {
+        runResamplerBenchmark();
+        freeResampleTables();
+        return 0;
+    }
+    if (libraryBenchRows > 0) {
+        runLibraryTableBenchmark(libraryBenchRows);
+        return 0;
+    }
+    if (memoryBenchRows > 0) {
+        runMemoryBenchmark(memoryBenchRows);
+        return 0;
+    }
+    dspPublish(&player.dsp);
+    startTrackHints();
+    pcmCacheStart(pcmCacheBudgetMb * 1024 * 1024);
+
+    // --- Load songs dynamically from 'music' directory ---
+    char musicDirectory[] = "music";
+    allSongsList = NULL;
+    bool attached = attachLibrarySnapshot(); // Another instance already scanned it
+    if (!attached) {
+        loadSongsFromDirectory(&allSongsList, musicDirectory);
+        loadTranscodeManifest();
+        scanTranscodeSources(&allSongsList, musicDirectory);
+    }
+    songIndexRebuild(allSongsList);
+    libraryTableRebuild(&libraryTable, allSongsList);
+    if (renderOutputPath) {
+        // Offline renders cover the whole library, so let pending conversions finish first
+        waitForTranscodes();
+        applyTranscodeResults();
+    }
+
+    if (allSongsList == NULL) {
+        printf("No .ogg songs found in the '%s' directory. Please add some music files.\n", musicDirectory);
+    } else {
+        current = allSongsList; // Set initial song for main player to the first found song
+    }
+
+    // --- Load Playlists from file AFTER songs are loaded ---
+    if (!attached) loadPlaylistsFromFile(PLAYLISTS_FILE, &playlists);
+    if (sharedLibrary.role == SHARED_LIBRARY_PUBLISHER) collectHandedOffPlaylists(); // Left by instances that exited
+    for (int i = 0; i < importFileCount; i++) {
+        importPlaylist(importFiles[i]);
+    }
+    publishLibrarySnapshot();
+
+    // Offline render and the HTTP load test need neither the window nor the audio device
+    if (renderOutputPath || httpBenchClients > 0) {
+        int result = renderOutputPath ? runOfflineRender() : runHttpBenchmark();
+        closeSharedLibrary();
+        stopTranscodeWorkers();
+        pcmCacheStop();
+        stopTrackHints();
+        freeResampleTables();
+        return result;
+    }
+
     sfVideoMode mode = {800, 500, 32};
     sfRenderWindow* window = sfRenderWindow_create(mode, "Music Player", sfResize | sfClose, NULL);
     if (!window) {
@@ -775,7 +11114,7 @@ int main() {
         return 1;
     }
 
-    sfTexture* bgTexture = sfTexture_createFromFile("bg.png", NULL);
+    sfTexture* bgTexture = loadUiTexture("bg.png", 0); // Stretched over the window
     if (!bgTexture) {
         fprintf(stderr, "Failed to load background image: bg.png\n");
         return 1;
@@ -793,26 +11132,28 @@ int main() {
     scale.y = (float)mode.height / bgSize.y;
     sfSprite_setScale(bgSprite, scale);
 
-    // --- Load songs dynamically from 'music' directory ---
-    char musicDirectory[] = "music";
-    allSongsList = NULL;
-    loadSongsFromDirectory(&allSongsList, musicDirectory);
-
-    if (allSongsList == NULL) {
-        printf("No .ogg songs found in the '%s' directory. Please add some music files.\n", musicDirectory);
-    } else {
-        current = allSongsList; // Set initial song for main player to the first found song
+    if (!attached) watchLibraryRoot(musicDirectory); // The publisher watches for everyone
+    startFingerprinting(allSongsList);
+    startCoverArt();
+    startZones();
+    if (httpPort >= 0) startHttpServer(httpPort);
+
+    // Reserve enough pooled nodes to copy the largest playlist into a play queue and to
+    // fill the recent stack, so switching playlists and auto-advance never reach malloc
+    int largestPlaylist = 0;
+    for (Playlist* pl = playlists; pl; pl = pl->next) {
+        if (pl->length > largestPlaylist) largestPlaylist = pl->length;
     }
-
-    // --- Load Playlists from file AFTER songs are loaded ---
-    loadPlaylistsFromFile(PLAYLISTS_FILE, &playlists);
-
+    poolReserve(&playlistNodePool, playlistNodePool.liveObjects + largestPlaylist);
+    poolReserve(&playlistPool, playlistPool.liveObjects + 1);
+    poolReserve(&stackNodePool, 6);
 
     // ---------- Music Control Sprites ----------
-    playTexture = sfTexture_createFromFile("play.png", NULL);
-    pauseTexture = sfTexture_createFromFile("pause.png", NULL);
-    sfTexture* nextTexture = sfTexture_createFromFile("next.png", NULL);
-    sfTexture* prevTexture = sfTexture_createFromFile("prev.jpg", NULL);
+    float control_scale = 0.15f; // Scaling for control buttons
+    playTexture = loadUiTexture("play.png", control_scale);
+    pauseTexture = loadUiTexture("pause.png", control_scale);
+    sfTexture* nextTexture = loadUiTexture("next.png", control_scale);
+    sfTexture* prevTexture = loadUiTexture("prev.jpg", control_scale);
 
     if (!playTexture || !pauseTexture || !nextTexture || !prevTexture) {
         fprintf(stderr, "Failed to load control button images.\n");
@@ -831,24 +11172,14 @@ int main() {
     sfSprite_setTexture(nextSprite, nextTexture, sfTrue);
     sfSprite_setTexture(prevSprite, prevTexture, sfTrue);
 
-    // Scaling for control buttons
-    float control_scale = 0.15f;
-    sfSprite_setScale(globalPlaySprite, (sfVector2f){control_scale, control_scale});
-    sfSprite_setScale(nextSprite, (sfVector2f){control_scale, control_scale});
-    sfSprite_setScale(prevSprite, (sfVector2f){control_scale, control_scale});
-
-    // Positioning for control buttons (more central)
-    sfVector2f playPos = {mode.width / 2.0f - sfSprite_getGlobalBounds(globalPlaySprite).width / 2.0f, 350};
-    sfVector2f prevPos = {playPos.x - sfSprite_getGlobalBounds(prevSprite).width - 20, 350};
-    sfVector2f nextPos = {playPos.x + sfSprite_getGlobalBounds(globalPlaySprite).width + 20, 350};
-
-    sfSprite_setPosition(globalPlaySprite, playPos);
-    sfSprite_setPosition(nextSprite, nextPos);
-    sfSprite_setPosition(prevSprite, prevPos);
+    sfSprite_setScale(globalPlaySprite, uiTextureScale(playTexture, control_scale));
+    sfSprite_setScale(nextSprite, uiTextureScale(nextTexture, control_scale));
+    sfSprite_setScale(prevSprite, uiTextureScale(prevTexture, control_scale));
 
     // ---------- Playlist Button Sprites ----------
-    sfTexture* createPlaylistTexture = sfTexture_createFromFile("create_playlist.png", NULL);
-    sfTexture* playPlaylistTexture = sfTexture_createFromFile("play_playlist.png", NULL);
+    float playlist_btn_scale = 0.20f; // Scaling for playlist buttons
+    sfTexture* createPlaylistTexture = loadUiTexture("create_playlist.png", playlist_btn_scale);
+    sfTexture* playPlaylistTexture = loadUiTexture("play_playlist.png", playlist_btn_scale);
 
     if (!createPlaylistTexture || !playPlaylistTexture) {
         fprintf(stderr, "Failed to load playlist button images.\n");
@@ -865,79 +11196,146 @@ int main() {
     sfSprite_setTexture(createPlaylistSprite, createPlaylistTexture, sfTrue);
     sfSprite_setTexture(playPlaylistSprite, playPlaylistTexture, sfTrue);
 
-    // Scaling for playlist buttons
-    float playlist_btn_scale = 0.20f;
-    sfSprite_setScale(createPlaylistSprite, (sfVector2f){playlist_btn_scale, playlist_btn_scale});
-    sfSprite_setScale(playPlaylistSprite, (sfVector2f){playlist_btn_scale, playlist_btn_scale});
-
-    // Positioning for playlist buttons
-    sfSprite_setPosition(createPlaylistSprite, (sfVector2f){210, 355});
-    sfSprite_setPosition(playPlaylistSprite, (sfVector2f){565, 355});
+    sfSprite_setScale(createPlaylistSprite, uiTextureScale(createPlaylistTexture, playlist_btn_scale));
+    sfSprite_setScale(playPlaylistSprite, uiTextureScale(playPlaylistTexture, playlist_btn_scale));
 
     // ---------- Labels (Main Player UI) ----------
-    globalSongLabel = createLabel(globalFont, "No Song Playing", 300, 200, 28); // Assign to global
-    sfText *recentHeading = createLabel(globalFont, "Recently Played:", 600, 30, 20);
-    sfText *queueHeading = createLabel(globalFont, "Current Playlist:", 50, 30, 20);
-    sfText *playlistNameLabel = createLabel(globalFont, "No Playlist Selected", 50, 70, 20);
+    globalSongLabel = createLabel(globalFont, "No Song Playing", 0, 0, 28); // Assign to global
+    sfText *positionLabel = createLabel(globalFont, "", 0, 0, 16);
+    char positionShown[32] = "";
+    sfText *recentHeading = createLabel(globalFont, "Recently Played:", 0, 0, 20);
+    sfText *queueHeading = createLabel(globalFont, "Current Playlist:", 0, 0, 20);
+    sfText *playlistNameLabel = createLabel(globalFont, "No Playlist Selected", 0, 0, 20);
 
     // Text labels below the new playlist sprites
-    sfText* tempText = createLabel(globalFont, "Create", 0,0,16);
-    float createLabelWidth = tempText ? sfText_getLocalBounds(tempText).width : 0;
-    if (tempText) sfText_destroy(tempText);
-    sfText *createPlaylistLabel = createLabel(globalFont, "Create", sfSprite_getPosition(createPlaylistSprite).x + (sfSprite_getGlobalBounds(createPlaylistSprite).width / 2) - createLabelWidth/2, sfSprite_getPosition(createPlaylistSprite).y + sfSprite_getGlobalBounds(createPlaylistSprite).height + 5, 16);
-
-    tempText = createLabel(globalFont, "Play List", 0,0,16);
-    float playLabelWidth = tempText ? sfText_getLocalBounds(tempText).width : 0;
-    if (tempText) sfText_destroy(tempText);
-    sfText *playPlaylistLabel = createLabel(globalFont, "Play List", sfSprite_getPosition(playPlaylistSprite).x + (sfSprite_getGlobalBounds(playPlaylistSprite).width / 2) - playLabelWidth/2, sfSprite_getPosition(playPlaylistSprite).y + sfSprite_getGlobalBounds(playPlaylistSprite).height + 5, 16);
-
+    sfText *createPlaylistLabel = createLabel(globalFont, "Create", 0, 0, 16);
+    sfText *playPlaylistLabel = createLabel(globalFont, "Play List", 0, 0, 16);
 
     // Initialize recent and queue display texts
     for (int i = 0; i < 5; i++) {
-        recentText[i] = createLabel(globalFont, "", 600, 60 + i * 25, 16);
-        queueText[i] = createLabel(globalFont, "", 400, 60 + i * 25, 16);
+        recentText[i] = createLabel(globalFont, "", 0, 0, 16);
+        queueText[i] = createLabel(globalFont, "", 0, 0, 16);
     }
 
+    eqOverlayText = createLabel(globalFont, "", 0, 0, 12);
+    if (eqOverlayText) sfText_setFillColor(eqOverlayText, sfCyan);
+
+    debugStatsText = createLabel(globalFont, "", 0, 0, 12);
+    if (debugStatsText) sfText_setFillColor(debugStatsText, sfYellow);
+
+    sfSprite* coverArtSprite = sfSprite_create(); // Art of the current song, from the atlas
+    prepareArtSprite(coverArtSprite, ART_LARGE, 150);
+    sfClock* debugStatsClock = sfClock_create(); // Throttles debug text rebuilds
+
+    // ---------- Main Player Layout ----------
+    // Controls keep to the bottom centre, the recent list to the right edge; at the
+    // default 800x500 everything lands where it always has
+    layoutReset(&mainLayout);
+    int playWidget = layoutAnchor(&mainLayout, WIDGET_SPRITE, globalPlaySprite, 0.5f, 0, 1, -150, 0.5f);
+    layoutSetAction(&mainLayout, playWidget, ACTION_PLAY);
+    layoutSetAction(&mainLayout, layoutAttach(&mainLayout, WIDGET_SPRITE, nextSprite, PLACE_RIGHT_OF, playWidget, 20, 0), ACTION_NEXT);
+    layoutSetAction(&mainLayout, layoutAttach(&mainLayout, WIDGET_SPRITE, prevSprite, PLACE_LEFT_OF, playWidget, 20, 0), ACTION_PREV);
+    int createWidget = layoutAnchor(&mainLayout, WIDGET_SPRITE, createPlaylistSprite, 0.5f, -190, 1, -145, 0);
+    int selectWidget = layoutAnchor(&mainLayout, WIDGET_SPRITE, playPlaylistSprite, 0.5f, 165, 1, -145, 0);
+    layoutSetAction(&mainLayout, createWidget, ACTION_OPEN_CREATE);
+    layoutSetAction(&mainLayout, selectWidget, ACTION_OPEN_SELECT);
+    layoutAnchor(&mainLayout, WIDGET_TEXT, globalSongLabel, 0.5f, -100, 0.4f, 0, 0);
+    layoutAnchor(&mainLayout, WIDGET_TEXT, positionLabel, 0.5f, -100, 0.4f, 40, 0);
+    layoutAnchor(&mainLayout, WIDGET_TEXT, recentHeading, 1, -200, 0, 30, 0);
+    layoutAnchor(&mainLayout, WIDGET_TEXT, queueHeading, 0, 50, 0, 30, 0);
+    layoutAttach(&mainLayout, WIDGET_TEXT, createPlaylistLabel, PLACE_BELOW, createWidget, 0, 5);
+    layoutAttach(&mainLayout, WIDGET_TEXT, playPlaylistLabel, PLACE_BELOW, selectWidget, 0, 5);
+    layoutAnchor(&mainLayout, WIDGET_TEXT, playlistNameLabel, 0, 50, 0, 70, 0);
+    for (int i = 0; i < 5; i++) {
+        layoutAnchor(&mainLayout, WIDGET_TEXT, recentText[i], 1, -200, 0, 60 + i * 25, 0);
+        layoutAnchor(&mainLayout, WIDGET_TEXT, queueText[i], 0.5f, 0, 0, 60 + i * 25, 0);
+    }
+    int eqWidget = layoutAnchor(&mainLayout, WIDGET_TEXT, eqOverlayText, 1, -200, 0, 200, 0);
+    int artWidget = layoutAnchor(&mainLayout, WIDGET_SPRITE, coverArtSprite, 0, 50, 0, 105, 0);
+    int debugWidget = layoutAnchor(&mainLayout, WIDGET_TEXT, debugStatsText, 0, 10, 0, 240, 0);
+
     // Main application loop
     while (sfRenderWindow_isOpen(window)) {
-        while (sfRenderWindow_pollEvent(window, &event)) {
+        // Queue everything pending, then hand each event to the screen active at its turn
+        inputPollWindow(&inputQueue, window);
+        InputEvent* input;
+        while ((input = inputNext(&inputQueue)) != NULL) {
+            event = input->event;
             if (event.type == sfEvtClosed) {
-                // Save playlists before closing!
-                savePlaylistsToFile(PLAYLISTS_FILE, playlists);
+                // Save playlists before closing! (the publishing instance owns the file)
+                if (sharedLibrary.role != SHARED_LIBRARY_ATTACHED) savePlaylistsToFile(PLAYLISTS_FILE, playlists);
+                if (playlistsChanged) handOffPlaylists();
+                char handoffPath[MAX_PATH_LENGTH];
+                playlistHandoffPath(handoffPath, sizeof(handoffPath));
+                if (sharedLibrary.role == SHARED_LIBRARY_ATTACHED && GetFileAttributesA(handoffPath) != INVALID_FILE_ATTRIBUTES) {
+                    printf("Playlists created here wait in %s until an instance publishing the library loads them\n", handoffPath);
+                }
+                if (exportDirectory) exportAllPlaylists(exportDirectory, exportFormat);
                 sfRenderWindow_close(window);
             }
 
+            if (event.type == sfEvtResized) {
+                // Show the scene at the new size instead of stretching the 800x500 one,
+                // and let every screen lay itself out again
+                sfFloatRect visible = {0, 0, (float)event.size.width, (float)event.size.height};
+                sfView* view = sfView_createFromRect(visible);
+                if (view) {
+                    sfRenderWindow_setView(window, view);
+                    sfView_destroy(view);
+                }
+                layoutResize(visible.width, visible.height);
+                sfSprite_setScale(bgSprite, (sfVector2f){visible.width / bgSize.x, visible.height / bgSize.y});
+            }
+
+            // Toggles ignore key auto-repeat; EQ adjustments keep it so a held key ramps
+            if (event.type == sfEvtKeyPressed && event.key.code == sfKeyF3 && !input->repeat) {
+                debugStatsVisible = !debugStatsVisible;
+                if (debugStatsVisible) refreshDebugStatsDisplay();
+            }
+            if (event.type == sfEvtKeyPressed && event.key.code == sfKeyF4 && !input->repeat) {
+                cancelTranscodes();
+            }
+            if (event.type == sfEvtKeyPressed && currentAppState == MAIN_PLAYER) {
+                if (event.key.code == sfKeyF6) {
+                    if (input->repeat) continue;
+                    autoDjEnabled = !autoDjEnabled;
+                    autoDjReset();
+                    autoDjFill();
+                    printf("Auto-DJ %s (%d analysed tracks)\n", autoDjEnabled ? "on" : "off", autoDjIndexed);
+                    refreshQueueDisplay(globalFont, currentPlaylist);
+                } else if (event.key.code == sfKeyF2) {
+                    if (input->repeat) continue;
+                    eqOverlayVisible = !eqOverlayVisible;
+                    if (eqOverlayVisible) refreshEqOverlay();
+                } else {
+                    handleEqKey(event.key.code);
+                }
+            }
+
             // Handle events based on current application state
             if (currentAppState == MAIN_PLAYER) {
-                // Mouse event handling for main player only checks if the mouse button was just pressed
-                if (event.type == sfEvtMouseButtonPressed && !mouseWasPressed) {
-                    sfVector2i mouse = sfMouse_getPositionRenderWindow(window);
-
-                    sfFloatRect playBounds = sfSprite_getGlobalBounds(globalPlaySprite);
-                    sfFloatRect nextBounds = sfSprite_getGlobalBounds(nextSprite);
-                    sfFloatRect prevBounds = sfSprite_getGlobalBounds(prevSprite);
-                    sfFloatRect createPlaylistBtnBounds = sfSprite_getGlobalBounds(createPlaylistSprite);
-                    sfFloatRect playPlaylistBtnBounds = sfSprite_getGlobalBounds(playPlaylistSprite);
+                if (event.type == sfEvtMouseButtonPressed) {
+                    sfVector2f mouse = sfRenderWindow_mapPixelToCoords(window, (sfVector2i){event.mouseButton.x, event.mouseButton.y}, NULL);
+                    int action = layoutHitTest(&mainLayout, mouse.x, mouse.y);
 
                     // --- Play Button Logic ---
-                    if (sfFloatRect_contains(&playBounds, (float)mouse.x, (float)mouse.y)) {
-                        if (!music || sfMusic_getStatus(music) == sfStopped) {
+                    if (action == ACTION_PLAY) {
+                        if (!playerHasTrack(&player) || playerGetStatus(&player) == sfStopped) {
                             playNewSong(globalSongLabel, globalFont, globalPlaySprite, pauseTexture, playTexture);
                         } else {
-                            sfSoundStatus status = sfMusic_getStatus(music);
+                            sfSoundStatus status = playerGetStatus(&player);
                             if (status == sfPlaying) {
-                                sfMusic_pause(music);
+                                playerPause(&player);
                                 sfSprite_setTexture(globalPlaySprite, playTexture, sfTrue); // Set to play icon when paused
                             } else {
-                                sfMusic_play(music);
+                                playerResume(&player);
                                 sfSprite_setTexture(globalPlaySprite, pauseTexture, sfTrue); // Set to pause icon when playing
                             }
                         }
-                        mouseWasPressed = true;
                     }
 
                     // --- Next / Prev (Playlist-aware) ---
-                    if (sfFloatRect_contains(&nextBounds, (float)mouse.x, (float)mouse.y)) {
+                    if (action == ACTION_NEXT) {
                         if (currentPlaylist) { // If a playlist is active
                             current = dequeueSong(currentPlaylist);
                             if (current) {
@@ -947,6 +11345,7 @@ int main() {
                                 printf("Playlist ended. Switching to main song list.\n");
                                 sfText_setString(globalSongLabel, "Playlist Ended");
                                 if (globalPlaySprite && playTexture) sfSprite_setTexture(globalPlaySprite, playTexture, sfTrue);
+                                destroyTemporaryPlaylist(currentPlaylist);
                                 currentPlaylist = NULL; // Playlist finished
                                 refreshQueueDisplay(globalFont, currentPlaylist); // Clear queue display
                                 // Optionally, auto-play first song from allSongsList here
@@ -955,21 +11354,20 @@ int main() {
                                     playNewSong(globalSongLabel, globalFont, globalPlaySprite, pauseTexture, playTexture);
                                 }
                             }
-                        } else if (current) { // No playlist, cycle through all songs
-                            current = current->next ? current->next : allSongsList;
+                        } else if (current) { // No playlist, cycle through all songs (or let auto-DJ pick)
+                            Song* pick = autoDjEnabled ? autoDjNext() : NULL;
+                            current = pick ? pick : (current->next ? current->next : allSongsList);
                             playNewSong(globalSongLabel, globalFont, globalPlaySprite, pauseTexture, playTexture);
                         }
-                        mouseWasPressed = true;
                     }
 
-                    if (sfFloatRect_contains(&prevBounds, (float)mouse.x, (float)mouse.y)) {
+                    if (action == ACTION_PREV) {
                         if (currentPlaylist) {
                             // Simplified for queue: just restart current song if within a playlist
                             // A full 'previous' in a queue requires re-enqueueing or a different list structure.
                             printf("Restarting current song in playlist (Prev button).\n");
                             if (current) { // Only restart if there's a song playing
-                                sfMusic_stop(music);
-                                sfMusic_play(music);
+                                playerRestart(&player);
                             }
                         } else if (current) { // No playlist, cycle through all songs
                             if (current->prev) {
@@ -983,108 +11381,158 @@ int main() {
                             }
                             playNewSong(globalSongLabel, globalFont, globalPlaySprite, pauseTexture, playTexture);
                         }
-                        mouseWasPressed = true;
                     }
 
                     // --- Playlist Buttons (Transition to other screens) ---
-                    if (sfFloatRect_contains(&createPlaylistBtnBounds, (float)mouse.x, (float)mouse.y)) {
+                    if (action == ACTION_OPEN_CREATE) {
                         currentAppState = CREATE_PLAYLIST_SCREEN;
-                        mouseWasPressed = true;
                     }
 
-                    if (sfFloatRect_contains(&playPlaylistBtnBounds, (float)mouse.x, (float)mouse.y)) {
+                    if (action == ACTION_OPEN_SELECT) {
                         currentAppState = SELECT_PLAYLIST_SCREEN;
-                        mouseWasPressed = true;
                     }
                 }
-                else if (event.type == sfEvtMouseButtonReleased) {
-                    mouseWasPressed = false; // Reset flag when mouse button is released
-                }
             } else if (currentAppState == CREATE_PLAYLIST_SCREEN) {
-                handleCreatePlaylistScreen(window, &event, globalFont, allSongsList, &playlists);
+                handleCreatePlaylistScreen(window, input, globalFont, allSongsList, &playlists);
             } else if (currentAppState == SELECT_PLAYLIST_SCREEN) {
-                handleSelectPlaylistScreen(window, &event, globalFont, playlists);
+                handleSelectPlaylistScreen(window, input, globalFont, playlists);
             }
         }
 
+        updateZones(); // Zones keep playing whatever screen is shown
+        updateLoadingSong(globalSongLabel, globalFont, globalPlaySprite, pauseTexture, playTexture);
+        applyCoverArtResults();
+
         // --- Drawing based on current application state ---
         sfRenderWindow_clear(window, sfBlack);
         sfRenderWindow_drawSprite(window, bgSprite, NULL);
 
         if (currentAppState == MAIN_PLAYER) {
-            // Auto-play next song if current one stops AND there's an active playlist
-            if (music && sfMusic_getStatus(music) == sfStopped) {
+            // Library edits are deferred while the playlist screens hold song indices
+            bool libraryChanged = applyLibraryChanges();
+            if (applyTranscodeResults()) libraryChanged = true;
+            if (libraryChanged || playlistsChanged) {
+                httpCatalogStale = true;
+                publishLibrarySnapshot(); // A failed publish is retried by syncLibrarySnapshot
+                handOffPlaylists();
+                playlistsChanged = false;
+            }
+            if (syncLibrarySnapshot(musicDirectory)) libraryChanged = httpCatalogStale = true;
+            if (httpCatalogStale) httpPublishCatalog();
+            applyFingerprintResults();
+            bool queueChanged = !currentPlaylist && autoDjFill();
+            if (libraryChanged || queueChanged) {
+                refreshQueueDisplay(globalFont, currentPlaylist);
+                refreshRecentDisplay(globalFont);
+            }
+
+            // Auto-play next song if current one ends AND there's an active playlist. When the
+            // callback already continued into the armed song, only the bookkeeping is left.
+            playerClockUpdate(&player);
+            updateArmedSong();
+            bool switched = player.stream && playerSwitchHeard(&player, &playerSwitchesSeen);
+            if (switched || playerTrackEnded(&player)) {
+                Song* armed = armedSong;
+                armedSong = NULL;
                 if (currentPlaylist && currentPlaylist->front) {
                     current = dequeueSong(currentPlaylist);
-                    if (current) {
+                    if (current && switched && current == armed) {
+                        songStarted(globalSongLabel, globalFont, globalPlaySprite, pauseTexture);
+                    } else if (current) {
                         playNewSong(globalSongLabel, globalFont, globalPlaySprite, pauseTexture, playTexture);
                     } else {
                         sfText_setString(globalSongLabel, "Playlist Ended");
                         if (globalPlaySprite && playTexture) sfSprite_setTexture(globalPlaySprite, playTexture, sfTrue);
 
                         // Clean up the temporary currentPlaylist when it's empty
-                        PlaylistNode* node = currentPlaylist->front;
-                        while(node){
-                            PlaylistNode* next = node->next;
-                            free(node);
-                            node = next;
-                        }
-                        free(currentPlaylist);
+                        destroyTemporaryPlaylist(currentPlaylist);
                         currentPlaylist = NULL;
 
                         refreshQueueDisplay(globalFont, currentPlaylist); // Clear queue display
                     }
                 } else { // Fallback to main song list auto-play if no playlist or playlist is empty (and current song ended)
                     if (allSongsList && current) { // Ensure current is not NULL before trying to find next
-                        current = current->next ? current->next : allSongsList; // Cycle back to start of all songs
-                        playNewSong(globalSongLabel, globalFont, globalPlaySprite, pauseTexture, playTexture);
+                        Song* pick = autoDjEnabled ? autoDjNext() : NULL;
+                        current = pick ? pick : (current->next ? current->next : allSongsList); // Cycle back to start of all songs
+                        if (switched && current == armed) songStarted(globalSongLabel, globalFont, globalPlaySprite, pauseTexture);
+                        else playNewSong(globalSongLabel, globalFont, globalPlaySprite, pauseTexture, playTexture);
                     } else {
+                        playerUnload(&player); // Nothing to continue with (not even what the callback moved on to)
                         sfText_setString(globalSongLabel, "No Songs Available");
                         if (globalPlaySprite && playTexture) sfSprite_setTexture(globalPlaySprite, playTexture, sfTrue);
                     }
                 }
             }
 
-            // Draw all main player UI elements
-            sfRenderWindow_drawSprite(window, globalPlaySprite, NULL);
-            sfRenderWindow_drawSprite(window, nextSprite, NULL);
-            sfRenderWindow_drawSprite(window, prevSprite, NULL);
-            sfRenderWindow_drawSprite(window, createPlaylistSprite, NULL);
-            sfRenderWindow_drawSprite(window, playPlaylistSprite, NULL);
-
-            sfRenderWindow_drawText(window, globalSongLabel, NULL);
-            sfRenderWindow_drawText(window, recentHeading, NULL);
-            sfRenderWindow_drawText(window, queueHeading, NULL);
-            sfRenderWindow_drawText(window, createPlaylistLabel, NULL);
-            sfRenderWindow_drawText(window, playPlaylistLabel, NULL);
+            // Position from the smoothed clock, so it moves evenly whatever the device reports
+            char positionText[32] = "";
+            if (playerHasTrack(&player)) {
+                long long position, length;
+                playerTrackPosition(&player, &position, &length);
+                snprintf(positionText, sizeof(positionText), "%lld:%02lld / %lld:%02lld", position / 60000000, position / 1000000 % 60,
+                         length / 60000000, length / 1000000 % 60);
+            }
+            if (strcmp(positionText, positionShown) != 0) {
+                strcpy(positionShown, positionText);
+                if (positionLabel) sfText_setString(positionLabel, positionText);
+            }
 
             // Update and display current playlist name
             if (currentPlaylist) {
                 sfText_setString(playlistNameLabel, currentPlaylist->name);
             } else {
-                sfText_setString(playlistNameLabel, "No Playlist Selected");
+                sfText_setString(playlistNameLabel, autoDjEnabled ? "Auto-DJ" : "No Playlist Selected");
             }
-            sfRenderWindow_drawText(window, playlistNameLabel, NULL);
-
 
-            for (int i = 0; i < 5; i++) {
-                sfRenderWindow_drawText(window, recentText[i], NULL);
-                sfRenderWindow_drawText(window, queueText[i], NULL);
+            // The next song's art is asked for now so it is in the atlas when the song starts
+            bool artShown = current && coverArtSprite && showCoverArt(coverArtSprite, current->path, ART_LARGE, 150);
+            layoutSetHidden(&mainLayout, artWidget, !artShown);
+            Song* upcoming = currentPlaylist && currentPlaylist->front ? currentPlaylist->front->song : (current ? current->next : NULL);
+            sfIntRect upcomingArt;
+            if (upcoming) coverArtRect(upcoming->path, ART_LARGE, &upcomingArt);
+
+            layoutSetHidden(&mainLayout, eqWidget, !eqOverlayVisible);
+            layoutSetHidden(&mainLayout, debugWidget, !debugStatsVisible);
+            if (debugStatsVisible && sfTime_asMilliseconds(sfClock_getElapsedTime(debugStatsClock)) > 250) {
+                refreshDebugStatsDisplay();
+                sfClock_restart(debugStatsClock);
             }
 
+            // Draw all main player UI elements
+            layoutDraw(window, &mainLayout);
+
         } else if (currentAppState == CREATE_PLAYLIST_SCREEN) {
-            handleCreatePlaylistScreen(window, &event, globalFont, allSongsList, &playlists);
+            drawCreatePlaylistScreen(window, globalFont, allSongsList);
         } else if (currentAppState == SELECT_PLAYLIST_SCREEN) {
-            handleSelectPlaylistScreen(window, &event, globalFont, playlists);
+            drawSelectPlaylistScreen(window, globalFont, playlists);
         }
 
         sfRenderWindow_display(window);
+        inputFrameShown(&inputQueue);
     }
 
     // --- Cleanup ---
-    if (music) { sfMusic_stop(music); sfMusic_destroy(music); }
+    stopHttpServer();
+    stopLibraryWatcher();
+    closeSharedLibrary();
+    stopTranscodeWorkers();
+    stopFingerprinting();
+    stopCoverArt();
+    freeAutoDjIndex();
+    stopZones();
+    if (player.clock.readings > 0) {
+        char clockStats[512];
+        formatClockStats(&player.clock, clockStats, sizeof(clockStats));
+        printf("Playback %s", clockStats);
+    }
+    playerDisarm(&player);
+    playerUnload(&player);
+    pcmCacheStop();
+    stopTrackHints();
+    freeResampleTables();
     if (globalFont) sfFont_destroy(globalFont);
     if (bgSprite) sfSprite_destroy(bgSprite);
+    if (coverArtSprite) sfSprite_destroy(coverArtSprite);
     if (bgTexture) sfTexture_destroy(bgTexture);
 
     if (globalPlaySprite) sfSprite_destroy(globalPlaySprite);
@@ -1102,6 +11550,7 @@ int main() {
 
     // Main player UI texts
     if (globalSongLabel) sfText_destroy(globalSongLabel);
+    if (positionLabel) sfText_destroy(positionLabel);
     if (recentHeading) sfText_destroy(recentHeading);
     if (queueHeading) sfText_destroy(queueHeading);
     if (createPlaylistLabel) sfText_destroy(createPlaylistLabel);
@@ -1113,6 +11562,13 @@ int main() {
         if (recentText[i]) sfText_destroy(recentText[i]);
         if (queueText[i]) sfText_destroy(queueText[i]);
     }
+    if (eqOverlayText) sfText_destroy(eqOverlayText);
+    if (debugStatsText) sfText_destroy(debugStatsText);
+    if (debugStatsClock) sfClock_destroy(debugStatsClock);
+    layoutFree(&mainLayout);
+    inputFree(&inputQueue);
+    layoutFree(&createLayout);
+    layoutFree(&selectLayout);
 
     // Cleanup for Create Playlist UI elements
     if (createPlTitle_s) sfText_destroy(createPlTitle_s);
@@ -1124,6 +11580,8 @@ int main() {
     if (createPlCancelBtn_s) sfText_destroy(createPlCancelBtn_s);
     for (int i = 0; i < MAX_SELECTABLE_SONGS; i++) {
         if (selectableSongTexts[i]) sfText_destroy(selectableSongTexts[i]);
+        if (selectableGroupTexts[i]) sfText_destroy(selectableGroupTexts[i]);
+        if (selectableArtSprites[i]) sfSprite_destroy(selectableArtSprites[i]);
     }
 
     // Cleanup for Select Playlist UI elements
@@ -1138,35 +11596,22 @@ int main() {
 
     if (window) sfRenderWindow_destroy(window);
 
-    // Clean up song linked list (allSongsList)
-    Song* tempSong;
-    while (allSongsList) {
-        tempSong = allSongsList;
-        allSongsList = allSongsList->next;
-        free(tempSong);
-    }
-
-    // Clean up playlists and their nodes
-    Playlist* currentPl = playlists;
-    while (currentPl) {
-        PlaylistNode* currentNode = currentPl->front;
-        while (currentNode) {
-            PlaylistNode* nextNode = currentNode->next;
-            free(currentNode);
-            currentNode = nextNode;
-        }
-        Playlist* nextPl = currentPl->next;
-        free(currentPl);
-        currentPl = nextPl;
-    }
-
-    // Clean up recent stack nodes
-    StackNode* currentStackNode = recentStack;
-    while (currentStackNode) {
-        StackNode* nextStackNode = currentStackNode->next;
-        free(currentStackNode);
-        currentStackNode = nextStackNode;
-    }
+    // Songs, playlists, queue nodes and recent stack nodes all live in the pools,
+    // so releasing the pool blocks frees everything in one pass per type
+    destroyTemporaryPlaylist(currentPlaylist);
+    currentPlaylist = NULL;
+    allSongsList = NULL;
+    playlists = NULL;
+    recentStack = NULL;
+    poolDestroy(&playlistNodePool);
+    poolDestroy(&playlistPool);
+    poolDestroy(&stackNodePool);
+    libraryTableFree(&libraryTable);
+    poolDestroy(&songPool);
+    stringPoolDestroy(&songStrings);
+    songIndexClear(&songPathIndex);
+    songIndexClear(&songNameIndex);
 
     return 0;
 }
+#endif